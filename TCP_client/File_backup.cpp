@@ -2,13 +2,381 @@
 #include <string>
 #include <winsock2.h>
 #include <ws2tcpip.h>
+#include <mswsock.h>
+#include <mstcpip.h>
 #include <chrono>
 #include <vector>
 #include <thread>
 #include <csignal>
 #include <fstream>
+#include <limits>
+#include <atomic>
+#include <cstring>
+#include <sstream>
+#include <iomanip>
+#include <unordered_map>
+#include <set>
+#include <memory>
+#include <algorithm>
+#include <random>
+#include <filesystem>
+#include <deque>
+#include <functional>
+#include <array>
+#include <mutex>
+#include <condition_variable>
+#include <iterator>
+
+// Hardware CRC-32C through SSE4.2, chosen at run time
+#if defined(_M_X64) || defined(__x86_64__)
+#define CRC32C_HARDWARE
+#include <nmmintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#endif
 
 #pragma comment(lib, "ws2_32.lib")
+#pragma comment(lib, "mswsock.lib")
+
+// SHA-256, for block matches and the digest of a delta upload
+class Sha256
+{
+public:
+    Sha256();
+
+    void update(const char *data, size_t size);
+
+    // Finish the digest as 32 raw bytes
+    std::string digest();
+
+    // Finish the digest as 64 lowercase hex characters
+    std::string hexDigest();
+
+private:
+    void processBlock(const uint8_t *block);
+
+    uint32_t state_[8];
+    uint8_t block_[64];
+    size_t blockSize_ = 0;
+    uint64_t totalSize_ = 0;
+};
+
+// Adaptive binary range coder in the style of LZMA: 11-bit probabilities that move toward each coded bit
+class RangeEncoder
+{
+public:
+    void encodeBit(uint16_t &probability, int bit);
+
+    // The low bitCount bits of value, most significant first, through a tree of probabilities
+    void encodeTree(uint16_t *probabilities, int bitCount, uint32_t value);
+
+    // Equiprobable bits, for the noisy low bits of numbers
+    void encodeDirect(uint64_t value, int bitCount);
+
+    std::string finish();
+
+private:
+    void shiftLow();
+
+    uint64_t low_ = 0;
+    uint32_t range_ = 0xFFFFFFFF;
+    uint8_t cache_ = 0;
+    uint64_t cacheSize_ = 1;
+    std::string out_;
+};
+
+class RangeDecoder
+{
+public:
+    RangeDecoder(const char *data, size_t size);
+
+    int decodeBit(uint16_t &probability);
+    uint32_t decodeTree(uint16_t *probabilities, int bitCount);
+    uint64_t decodeDirect(int bitCount);
+
+    // Input ran out before the block was decoded, so the block is corrupt
+    bool overrun() const { return overrun_; }
+
+private:
+    uint8_t nextByte();
+
+    const char *data_;
+    size_t size_;
+    size_t position_ = 0;
+    uint32_t range_ = 0xFFFFFFFF;
+    uint32_t code_ = 0;
+    bool overrun_ = false;
+};
+
+// G-code model: symbols are raw bytes or a word letter whose number follows; numbers are coded
+// as the change from the same letter's previous value, so slowly moving axes cost a few bits
+struct GcodeModel
+{
+    static const int symbolBits = 9;
+    static const int letterCount = 26;
+    // Symbols 0..255 are bytes, wordSymbol + letter is a letter followed by a number
+    static const uint32_t wordSymbol = 256;
+    static const uint32_t symbolCount = wordSymbol + letterCount;
+
+    GcodeModel();
+
+    // Symbol probabilities in the context of the previous symbol
+    std::vector<uint16_t> symbols;
+    // Per letter: decimal format, bit length of the zigzagged change
+    uint16_t decimals[letterCount][1 << 5];
+    uint16_t bitLengths[letterCount][1 << 7];
+    int64_t previousValue[letterCount] = {};
+    uint32_t previousDecimals[letterCount] = {};
+    uint32_t previousSymbol = '\n';
+};
+
+// Streaming G-code codec. The stream is a sequence of independent blocks, each
+// <uint32 raw size><uint32 payload size><range coded payload>, so a reader can decode any block alone
+class GcodeCodec
+{
+public:
+    // Blocks end at the last line break before this size
+    static const size_t blockSize = 1024 * 1024;
+
+    // Encode one block, header included
+    static std::string encodeBlock(const char *data, size_t size);
+
+    // Decode a block payload into exactly rawSize bytes; false if the payload is corrupt
+    static bool decodeBlock(const char *payload, size_t payloadSize, size_t rawSize, std::string &out);
+};
+
+// A size header of -1 asks the server for a delta upload against its latest version
+const int64_t deltaUploadRequest = -1;
+
+// A size header of -2 announces a G-code codec stream: the raw size follows, then codec blocks
+const int64_t compressedUploadRequest = -2;
+
+// A size header of -3 announces one byte range of a parallel upload: a RangeHeader follows,
+// then the range's bytes
+const int64_t rangeUploadRequest = -3;
+
+struct RangeHeader
+{
+    // Shared by every range of the file, so the server can put them together
+    uint64_t transferId;
+    int64_t fileSize;
+    int64_t offset;
+    int64_t length;
+    uint32_t rangeCount;
+    uint32_t rangeIndex;
+};
+
+// A size header of -4 starts or resumes an upload: a ResumeHeader follows, the server answers
+// with the 8-byte offset it holds durably, and the client sends the rest of the file
+const int64_t resumableUploadRequest = -4;
+
+struct ResumeHeader
+{
+    // Derived from the file, so retries and restarts of the client name the same transfer
+    uint64_t transferId;
+    int64_t fileSize;
+    // CRC-32C of the whole file; the server commits the version only if what it holds matches
+    uint32_t crc;
+    uint32_t reserved;
+};
+
+// A size header of -5 opens a session: manifests and any number of files follow as frames, interleaved by
+// stream ID, until the client closes the connection
+const int64_t sessionRequest = -5;
+
+// Session frame: <uint8 type><uint32 stream><uint32 payload length><payload>
+enum class FrameType : uint8_t
+{
+    // Payload is the int64 file size, optionally followed by the file name the server keeps
+    // the version under
+    FileBegin = 1,
+    FileData = 2,
+    // No payload; every announced byte must have been sent
+    FileEnd = 3,
+    // Server to client, payload is the response text of one file
+    Ack = 4,
+    // Payload is entries <uint16 name length><name><int64 size><int64 mtime><uint32 CRC-32C> of
+    // files the client could send; the stream field only pairs it with its answer
+    Manifest = 5,
+    // Server to client, answering a manifest frame: one byte per entry, 1 if the file is needed
+    Needed = 6
+};
+
+const size_t frameHeaderSize = 9;
+// Longest file name the server accepts for a version
+const size_t maxFileNameLength = 4096;
+// Payload of the data frames the client sends
+const uint32_t dataFrameSize = 64 * 1024;
+
+// A size header of -6 starts a chunk-acknowledged upload: a ChunkedHeader follows, then chunks of
+// <uint32 index><uint32 length><uint32 CRC-32C><payload>, retransmissions in any order. The server
+// answers each chunk with <uint32 index><uint8 ChunkStatus>, and "File received" after the last
+const int64_t chunkedUploadRequest = -6;
+
+struct ChunkedHeader
+{
+    int64_t fileSize;
+    // Every chunk but the last has this size
+    uint32_t chunkSize;
+    // Unacknowledged chunks the client keeps in flight
+    uint32_t window;
+};
+
+enum class ChunkStatus : uint8_t
+{
+    // Checksum matched and the chunk is flushed to disk
+    Stored = 0,
+    // Checksum mismatch; the client sends the chunk again
+    Retransmit = 1
+};
+
+// A size header of -7 offers a file before sending it: an OfferHeader follows and the server
+// answers with one OfferStatus byte. On Send the body follows as in a plain upload; on
+// AlreadyStored the upload is over
+const int64_t offeredUploadRequest = -7;
+
+// A size header of -8 keeps the connection open after each plain or offered upload, whose text
+// response then ends with '\n'
+const int64_t keepAliveRequest = -8;
+
+struct OfferHeader
+{
+    int64_t fileSize;
+    // CRC-32C of the whole file
+    uint32_t crc;
+    uint32_t reserved;
+};
+
+enum class OfferStatus : uint8_t
+{
+    Send = 0,
+    // The server's newest version already has this size and CRC-32C
+    AlreadyStored = 1
+};
+
+const uint32_t checkedChunkSize = 64 * 1024;
+const size_t chunkHeaderSize = 3 * sizeof(uint32_t);
+// Sends of one chunk before the upload is given up
+const int maxChunkAttempts = 8;
+
+// CRC-32C (Castagnoli) of data, continuing from crc; start with 0. Uses the SSE4.2 instruction
+// when the CPU has it, else a slicing-by-8 table
+static uint32_t crc32c(uint32_t crc, const char *data, size_t size);
+
+// Size of the chunks a read-and-send loop moves per call, tuned by hill climbing between fixed
+// bounds: every window of calls it measures bytes per second spent inside the calls, and keeps
+// doubling or halving the size while that improves, turning round when it does not. Small
+// chunks pay the per-call cost too often, large ones fall out of cache
+class ChunkSizer
+{
+public:
+    ChunkSizer(size_t minSize = 4 * 1024, size_t maxSize = 1024 * 1024);
+
+    // Bytes to move in the next call
+    size_t size() const { return size_; }
+    size_t maxSize() const { return maxSize_; }
+
+    // Account one call that moved bytes and took seconds
+    void record(size_t bytes, double seconds);
+
+    // Calls and bytes accounted since construction
+    uint64_t calls() const { return totalCalls_; }
+    uint64_t bytes() const { return totalBytes_; }
+
+private:
+    // Calls per measurement window
+    static const uint32_t windowCalls = 16;
+
+    size_t minSize_;
+    size_t maxSize_;
+    size_t size_;
+    // 1 while doubling, -1 while halving
+    int direction_ = 1;
+    // Bytes per second of the previous window, 0 before the first
+    double lastRate_ = 0;
+    uint32_t windowCallCount_ = 0;
+    uint64_t windowBytes_ = 0;
+    double windowSeconds_ = 0;
+    uint64_t totalCalls_ = 0;
+    uint64_t totalBytes_ = 0;
+};
+
+// Persistent record of the size, modification time and CRC-32C of files hashed before, so an
+// unchanged file is recognised without reading it again. One line per file in the cache file:
+// "<size> <mtime> <CRC-32C hex> <absolute path>"
+class ChangeCache
+{
+public:
+    explicit ChangeCache(const std::string &cachePath) : cachePath_(cachePath) {}
+
+    // Read the cache file; a missing or unreadable one is an empty cache
+    void load();
+
+    // Write the cache file if anything changed, replacing the old one with a rename
+    bool save();
+
+    // Size, modification time and CRC-32C of a file, hashing it only if its size or
+    // modification time differ from the cached ones
+    bool digest(const std::string &filePath, int64_t &size, int64_t &mtime, uint32_t &crc);
+
+private:
+    struct Entry
+    {
+        int64_t size;
+        int64_t mtime;
+        uint32_t crc;
+    };
+
+    std::string cachePath_;
+    std::unordered_map<std::string, Entry> entries_;
+    bool changed_ = false;
+};
+
+// Connections to the server opened ahead of the uploads that take them. Each starts with the
+// keep-alive request, carried in the SYN by TCP Fast Open where the system allows it, and TCP
+// keepalive probes it while idle; one the server or network dropped meanwhile is replaced
+class ConnectionPool
+{
+public:
+    ConnectionPool(const std::string &ipAddress, unsigned short port, size_t size = 2);
+    ~ConnectionPool();
+
+    // Open connections until size are idle
+    void warm();
+
+    // An idle connection that is still open, else a new one; reused tells which.
+    // INVALID_SOCKET if no connection could be opened
+    SOCKET acquire(bool &reused);
+
+    // Take back a connection whose last request completed, or close it when the pool is full
+    void release(SOCKET socket);
+
+    // Open a new keep-alive connection
+    SOCKET open();
+
+private:
+    // Socket with keepalive probes set
+    SOCKET newSocket();
+
+    // Connect sending the keep-alive request in the SYN; false when Fast Open is unavailable or
+    // the connect failed, and the caller then tries a plain connect on a new socket
+    bool connectFastOpen(SOCKET socket, const sockaddr_in &serverAddress);
+
+    // Whether an idle connection is still open: the server sends nothing unasked, so anything
+    // readable is its close or an error
+    static bool alive(SOCKET socket);
+
+    std::string ipAddress_;
+    unsigned short port_;
+    size_t size_;
+    std::deque<SOCKET> idle_;
+    // Cleared after the first failed Fast Open, so later connections skip straight to connect
+    bool fastOpen_ = true;
+    WSADATA wsaData_;
+};
 
 // TCPClient class to handle client-side TCP connection
 class TCPClient
@@ -24,18 +392,215 @@ public:
     bool connectToServer();
 
     // Sends .nc file to server and  waits for response
-    void sendFile(const std::string &filePath);
+    bool sendFile(const std::string &filePath);
+
+    // Sends only what changed since the server's latest version, rsync style, and waits for response
+    bool sendFileDelta(const std::string &filePath);
+
+    // Sends the file through the G-code codec and waits for response
+    bool sendFileCompressed(const std::string &filePath);
+
+    // Splits the file into byte ranges sent over streamCount connections at once, this one
+    // included, and waits for the server's single response
+    bool sendFileParallel(const std::string &filePath, size_t streamCount);
+
+    // Sends the file, reconnecting after a failure and continuing from the offset the server
+    // already holds, up to maxAttempts connections in all
+    bool sendFileResumable(const std::string &filePath, int maxAttempts = 5);
+
+    // Turns the connection into a session for sendFiles
+    bool openSession();
+
+    // Sends files over the open session, interleaving the data frames of up to interleave files
+    // at once, and waits for every ack; lastResponse() is the last ack, or the first error
+    bool sendFiles(const std::vector<std::string> &filePaths, size_t interleave = 1);
+
+    // Sends a manifest of every file under the directory over the open session, then streams the
+    // files the server does not have back to back, named by their path relative to the directory,
+    // and waits for every ack; filesSent counts those the server asked for
+    bool sendDirectory(const std::string &directoryPath, size_t &filesSent);
+
+    // sendDirectory for the named files of the directory only; names that are no longer regular
+    // files, such as deleted ones, are skipped
+    bool sendManifest(const std::string &directoryPath, const std::vector<std::string> &fileNames,
+                      size_t &filesSent);
+
+    // Sends the file as checksummed chunks, keeping up to window of them unacknowledged and
+    // resending those the server reports corrupt, and waits for response
+    bool sendFileChecked(const std::string &filePath, uint32_t window = 16);
+
+    // Response text of the last successful upload
+    const std::string &lastResponse() const { return lastResponse_; }
+
+    // Whether sendFile hands the body to the kernel with TransmitFile; on by default
+    void setZeroCopy(bool zeroCopy) { zeroCopy_ = zeroCopy; }
+
+    // Cache that sendFileOffered and manifests take file hashes from, or nullptr to hash every time
+    void setChangeCache(ChangeCache *cache) { changeCache_ = cache; }
+
+    // Bounds of the chunk size of the buffered send path; equal bounds fix it. 4 KB to 1 MB by default
+    void setChunkBounds(size_t minSize, size_t maxSize) { chunkSizer_ = ChunkSizer(minSize, maxSize); }
+
+    // Chunk sizing of the buffered send path, carried from one upload to the next
+    const ChunkSizer &chunkSizer() const { return chunkSizer_; }
+
+    // Pool that connectToServer takes connections from and closeConnection returns them to,
+    // or nullptr to connect afresh every time. Only sendFile and sendFileOffered leave a
+    // connection reusable
+    void setConnectionPool(ConnectionPool *pool) { pool_ = pool; }
+
+    // Offers the file's size and CRC-32C first and sends it only if the server's newest version
+    // differs, and waits for response; lastResponse() is "Already have it" for an unchanged file
+    bool sendFileOffered(const std::string &filePath);
 
     // Closes the connection
     void closeConnection();
 
 private:
+    // Outcome of a zero-copy send: Unavailable means nothing was sent and the buffered path can run
+    enum class ZeroCopySend
+    {
+        Sent,
+        Unavailable,
+        Failed
+    };
+
+    // Send the whole file with TransmitFile, then hash it through a read-only mapping
+    ZeroCopySend transmitFile(const std::string &filePath, int64_t fileSize, uint32_t &crc);
+
+    // Send the body of a plain upload, zero-copy when possible, and its CRC-32C as sent
+    bool sendBody(std::ifstream &file, const std::string &filePath, int64_t fileSize, uint32_t &crc);
+
+    // Size, modification time and CRC-32C of a file, through the change cache if there is one
+    bool fileDigest(const std::string &filePath, int64_t &size, int64_t &mtime, uint32_t &crc);
+
+    // After a failure on a connection from the pool, which the server may have dropped unnoticed,
+    // close it and open a new one, once per request; false for any other connection
+    bool replaceStaleConnection();
+
+    // Send or receive exactly size bytes
+    bool sendAll(const char *data, size_t size);
+    bool receiveAll(char *data, size_t size);
+
+    // Wait for the server's response to an upload
+    bool receiveResponse();
+
+    // Compare the CRC-32C of the bytes sent with the one the server reports having stored
+    bool verifyDigest(uint32_t crc);
+
+    // Send one range of a parallel upload, then read until the server closes; response is
+    // empty unless this range was the one that completed the file
+    bool sendRange(const std::string &filePath, const RangeHeader &range, std::string &response);
+
+    // One attempt of a resumable upload over the current connection
+    bool resumeUpload(std::ifstream &file, const ResumeHeader &header);
+
+    // Send a frame whose payload already follows the header space at the start of frame
+    bool sendFrame(char *frame, FrameType type, uint32_t stream, uint32_t payloadSize);
+
+    // sendFiles, giving each file the matching name of fileNames when there are any
+    bool streamFiles(const std::vector<std::string> &filePaths, const std::vector<std::string> &fileNames,
+                     size_t interleave);
+
     std::string ipAddress;
     unsigned short port;
     SOCKET connectSocket;
     WSADATA wsaData;
+    std::string lastResponse_;
+    // Stream ID of the last file begun on the session
+    uint32_t nextStream_ = 0;
+    bool zeroCopy_ = true;
+    ChangeCache *changeCache_ = nullptr;
+    ChunkSizer chunkSizer_;
+    ConnectionPool *pool_ = nullptr;
+    // Connection taken from the pool, not yet replaced, and fit to go back after this request
+    bool pooled_ = false;
+    bool replaceable_ = false;
+    bool reusable_ = false;
+};
+
+// Watches directory trees with ReadDirectoryChangesW. The system queues changes between waits,
+// so nothing is missed while an upload runs, and an idle watcher costs no CPU
+class DirectoryWatcher
+{
+public:
+    DirectoryWatcher() = default;
+    DirectoryWatcher(const DirectoryWatcher &) = delete;
+    DirectoryWatcher &operator=(const DirectoryWatcher &) = delete;
+    ~DirectoryWatcher();
+
+    // Start watching a directory and everything below it
+    bool add(const std::string &directoryPath);
+
+    const std::string &directory(size_t index) const { return watches_[index]->path; }
+    size_t size() const { return watches_.size(); }
+
+    // Wait up to timeoutMs for changes. changed gets the index of the directory and the path of
+    // each file written, created or renamed into place, relative to it; overflowed gets the
+    // index of a directory whose changes were too many to queue, so all of it must be checked
+    bool wait(DWORD timeoutMs, const std::function<void(size_t, const std::string &)> &changed,
+              const std::function<void(size_t)> &overflowed);
+
+private:
+    struct Watch
+    {
+        std::string path;
+        HANDLE handle;
+        OVERLAPPED overlapped;
+        // DWORD-aligned, as FILE_NOTIFY_INFORMATION records require
+        std::vector<DWORD> buffer;
+    };
+
+    // Queue the next read of a directory's changes
+    bool arm(Watch &watch);
+
+    std::vector<std::unique_ptr<Watch>> watches_;
 };
 
+// Backs up the directories continuously: everything that changed while the agent was not
+// running first, then each burst of saves shortly after it ends, until Ctrl+C
+void runWatchAgent(const std::string &ipAddress, unsigned short port, const std::vector<std::string> &directories,
+                   ChangeCache &cache);
+
+// Uploads the file from many concurrent clients and reports aggregate throughput
+void runThroughputBenchmark(const std::string &ipAddress, unsigned short port, const std::string &filePath,
+                            const std::vector<size_t> &clientCounts);
+
+// Compares the G-code codec with a generic LZ codec on a file: ratio and MB/s both ways
+void runCodecBenchmark(const std::string &filePath);
+
+// Uploads the file many times with a connection each, then over one session, and reports both
+void runSessionBenchmark(const std::string &ipAddress, unsigned short port, const std::string &filePath,
+                         size_t uploadCount);
+
+// Measures CRC-32C and SHA-256 throughput of one core in GB/s over a buffer of the given size
+void runHashBenchmark(size_t megabytes);
+
+// Uploads the file once per stream count with sendFileParallel and reports throughput
+void runParallelBenchmark(const std::string &ipAddress, unsigned short port, const std::string &filePath,
+                          const std::vector<size_t> &streamCounts);
+
+// Uploads the file uploadCount times with the buffered and then the zero-copy sendFile, and
+// reports throughput and client CPU time per GB of each
+void runSendBenchmark(const std::string &ipAddress, unsigned short port, const std::string &filePath,
+                      size_t uploadCount);
+
+// Uploads the file uploadCount times over the buffered send path at each of a sweep of fixed
+// chunk sizes and then with adaptive sizing, and reports throughput, CPU time and calls of each
+void runChunkBenchmark(const std::string &ipAddress, unsigned short port, const std::string &filePath,
+                       size_t uploadCount);
+
+// Offers the unchanged file uploadCount times, so each upload is one request and its one-byte
+// answer, then sends it as plain uploads, first connecting for each and then with a pre-warmed
+// connection pool; reports time to the first response byte, and to the whole response
+void runPoolBenchmark(const std::string &ipAddress, unsigned short port, const std::string &filePath,
+                      size_t uploadCount);
+
+// Starts clientCount plain uploads of the file together; each sends its size and first 64 KB,
+// then holds until all have, so the server has every upload open at once before any finishes
+void runStressTest(const std::string &ipAddress, unsigned short port, const std::string &filePath,
+                   size_t clientCount);
+
 // Signal handler to catch interrupt signals
 volatile sig_atomic_t interrupted = false;
 void signalHandler(int signum)
@@ -43,26 +608,179 @@ void signalHandler(int signum)
     interrupted = true;
 }
 
-int main()
+int main(int argc, char *argv[])
 {
+    std::string ipAddress = "127.0.0.1";
+    unsigned short port = 12345;
+    std::string filePath = "C:/Users/Ian/Desktop/5axis_cut.nc";
+    std::string mode = argc > 1 ? argv[1] : "";
+
+    // Hashes of files already seen, so unchanged files are neither read nor sent again
+    ChangeCache cache("C:/Users/Ian/Desktop/backup_client.cache");
+    cache.load();
+
+    // "bench [file]" measures server throughput instead of the interactive loop
+    if (mode == "bench")
+    {
+        runThroughputBenchmark(ipAddress, port, argc > 2 ? argv[2] : filePath, {1, 10, 100, 1000});
+        return 0;
+    }
+
+    // "stress [clients] [file]" opens that many uploads at once, 500 by default, like a shift
+    // change; the server's stats show its memory staying within budget meanwhile
+    if (mode == "stress")
+    {
+        runStressTest(ipAddress, port, argc > 3 ? argv[3] : filePath, argc > 2 ? std::stoul(argv[2]) : 500);
+        return 0;
+    }
+
+    // "codec-bench [file]" compares the G-code codec with generic LZ, offline
+    if (mode == "codec-bench")
+    {
+        runCodecBenchmark(argc > 2 ? argv[2] : filePath);
+        return 0;
+    }
+
+    // "parallel-bench [file]" sweeps the number of streams of a parallel upload
+    if (mode == "parallel-bench")
+    {
+        runParallelBenchmark(ipAddress, port, argc > 2 ? argv[2] : filePath, {1, 2, 4, 8, 16});
+        return 0;
+    }
+
+    // "hash-bench [MB]" measures the hashing kernels, offline
+    if (mode == "hash-bench")
+    {
+        runHashBenchmark(argc > 2 ? std::stoul(argv[2]) : 256);
+        return 0;
+    }
+
+    // "session-bench [file]" compares a connection per upload with one session for all
+    if (mode == "session-bench")
+    {
+        runSessionBenchmark(ipAddress, port, argc > 2 ? argv[2] : filePath, 100);
+        return 0;
+    }
+
+    // "send-bench [file] [server IP]" compares the buffered and zero-copy send paths
+    if (mode == "send-bench")
+    {
+        runSendBenchmark(argc > 3 ? argv[3] : ipAddress, port, argc > 2 ? argv[2] : filePath, 20);
+        return 0;
+    }
+
+    // "chunk-bench [file] [server IP]" sweeps the chunk size of the buffered send path
+    if (mode == "chunk-bench")
+    {
+        runChunkBenchmark(argc > 3 ? argv[3] : ipAddress, port, argc > 2 ? argv[2] : filePath, 20);
+        return 0;
+    }
+
+    // "pool-bench [file] [server IP]" compares time to first byte on new and pooled connections
+    if (mode == "pool-bench")
+    {
+        runPoolBenchmark(argc > 3 ? argv[3] : ipAddress, port, argc > 2 ? argv[2] : filePath, 200);
+        return 0;
+    }
+
+    // "batch <directory>" backs up every file under the directory once over one session, sending
+    // only those the server does not already have
+    if (mode == "batch" && argc > 2)
+    {
+        TCPClient client(ipAddress, port);
+        client.setChangeCache(&cache);
+        auto start = std::chrono::steady_clock::now();
+        size_t filesSent = 0;
+        bool sent = client.connectToServer() && client.openSession() && client.sendDirectory(argv[2], filesSent);
+        client.closeConnection();
+        cache.save();
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        if (sent)
+        {
+            std::cout << "Sent " << filesSent << " changed files in " << elapsed.count() << " s: "
+                      << client.lastResponse() << std::endl;
+        }
+        return sent ? 0 : 1;
+    }
+
+    // "watch <directory>..." runs as a backup agent for the directories until Ctrl+C
+    if (mode == "watch" && argc > 2)
+    {
+        std::signal(SIGINT, signalHandler);
+        runWatchAgent(ipAddress, port, std::vector<std::string>(argv + 2, argv + argc), cache);
+        return 0;
+    }
+
+    // "--parallel [N]" uploads over N connections, 4 by default
+    size_t streamCount = mode == "--parallel" && argc > 2 ? std::stoul(argv[2]) : 4;
+
     // Set up signal handler
     std::signal(SIGINT, signalHandler);
 
     // Create a TCPClient instance with IP address and port number
-    TCPClient client("127.0.0.1", 12345);
-    std::string filePath = "C:/Users/Ian/Desktop/5axis_cut.nc";
+    TCPClient client(ipAddress, port);
+    client.setChangeCache(&cache);
+
+    // Offered uploads, the default, take a connection opened while waiting for Enter, so the
+    // handshake is off the upload's path
+    ConnectionPool pool(ipAddress, port, 1);
+    if (mode.empty())
+    {
+        client.setConnectionPool(&pool);
+        pool.warm();
+    }
+
+    // "--session" keeps one connection open and sends every upload over it
+    bool sessionOpen = false;
 
     // Continuously send file until interrupted
     while (!interrupted)
     {   
+        if (mode == "--session")
+        {
+            if (!sessionOpen && client.connectToServer())
+            {
+                sessionOpen = client.openSession();
+                if (!sessionOpen)
+                {
+                    client.closeConnection();
+                }
+            }
+            if (sessionOpen && client.sendFiles({filePath}))
+            {
+                std::cout << client.lastResponse() << std::endl;
+            }
+            else if (sessionOpen)
+            {
+                // Start a new session for the next upload
+                client.closeConnection();
+                sessionOpen = false;
+            }
+        }
         // Connect to the server
-        if (client.connectToServer())
+        else if (client.connectToServer())
         {
-            // Send file to server and wait for response
-            client.sendFile(filePath);
+            // Send file to server and wait for response; by default it is offered first, so an
+            // unchanged file costs one round trip
+            // "--delta", "--compress", "--parallel", "--resume" and "--checked" pick the upload protocol
+            bool sent = mode == "--delta"      ? client.sendFileDelta(filePath)
+                        : mode == "--compress" ? client.sendFileCompressed(filePath)
+                        : mode == "--parallel" ? client.sendFileParallel(filePath, streamCount)
+                        : mode == "--resume"   ? client.sendFileResumable(filePath)
+                        : mode == "--checked"  ? client.sendFileChecked(filePath)
+                                               : client.sendFileOffered(filePath);
+            if (sent)
+            {
+                std::cout << client.lastResponse() << std::endl;
+                cache.save();
+            }
 
-            // Close the connection
+            // Close the connection, or return it to the pool and open another if it was not fit
             client.closeConnection();
+            if (mode.empty())
+            {
+                pool.warm();
+            }
         }
 
         std::cout << "Press Enter to send the file again or Ctrl+C to exit." << std::endl;
@@ -97,12 +815,23 @@ TCPClient::~TCPClient()
 // Connects to the server with the specified IP address and port number
 bool TCPClient::connectToServer()
 {
+    if (pool_)
+    {
+        // Idle in the pool or just opened, the server may close the connection before the request
+        // arrives: after an idle timeout, or while it hands its port to a new process
+        bool reused;
+        connectSocket = pool_->acquire(reused);
+        pooled_ = connectSocket != INVALID_SOCKET;
+        replaceable_ = pooled_;
+        reusable_ = false;
+        return pooled_;
+    }
+
     // Create a socket
     connectSocket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
     if (connectSocket == INVALID_SOCKET)
     {
         std::cerr << "Error creating socket: " << WSAGetLastError() << std::endl;
-        WSACleanup();
         return false;
     }
 
@@ -118,7 +847,6 @@ bool TCPClient::connectToServer()
     {
         std::cerr << "Error connecting to server: " << WSAGetLastError() << std::endl;
         closesocket(connectSocket);
-        WSACleanup();
         return false;
     }
 
@@ -126,82 +854,2819 @@ bool TCPClient::connectToServer()
 }
 
 // Sends the file to the server
-void TCPClient::sendFile(const std::string &filePath)
+bool TCPClient::sendFile(const std::string &filePath)
 {
     std::ifstream file(filePath, std::ios::binary);
     if (!file)
     {
         std::cerr << "Error opening file: " << filePath << std::endl;
-        return;
+        return false;
     }
 
-    const size_t bufferSize = 4096;
-    std::vector<char> buffer(bufferSize);
-    std::streamsize bytesRead;
-
-    auto sendAll = [&](const char *data, size_t len)
-    {
-        int totalSent = 0;
-        while (totalSent < len)
-        {
-            int bytesSent = send(connectSocket, data + totalSent, len - totalSent, 0);
-            if (bytesSent == SOCKET_ERROR)
-            {
-                return SOCKET_ERROR;
-            }
-            totalSent += bytesSent;
-        }
-        return totalSent;
-    };
+    bool sent = false;
+    uint32_t crc = 0;
 
     // Calculate file size
     file.seekg(0, std::ios::end);
     int64_t fileSize = file.tellg();
     file.seekg(0, std::ios::beg);
 
-    for (size_t i = 0; i < 1; i++)
+    // A second attempt only follows a failure on a stale pooled connection
+    for (size_t i = 0; i < 2; i++)
     {
+        crc = 0;
+
         // Send file size before sending file data
-        if (sendAll(reinterpret_cast<const char *>(&fileSize), sizeof(fileSize)) == SOCKET_ERROR)
+        if (!sendAll(reinterpret_cast<const char *>(&fileSize), sizeof(fileSize)))
         {
             std::cerr << "Error sending file size: " << WSAGetLastError() << std::endl;
-            break;
-        }
-
-        // Reset the file pointer to the beginning
-        file.seekg(0, std::ios::beg);
-
-        while ((bytesRead = file.readsome(buffer.data(), bufferSize)) > 0)
-        {
-            if (sendAll(buffer.data(), bytesRead) == SOCKET_ERROR)
-            {
-                std::cerr << "Error sending data: " << WSAGetLastError() << std::endl;
-                break;
-            }
         }
-
-        // Clear EOF flag
-        file.clear();
-
-        std::vector<char> response(1024);
-        int responseSize = recv(connectSocket, response.data(), response.size(), 0);
-        if (responseSize > 0)
+        else if (sendBody(file, filePath, fileSize, crc))
         {
-            std::string serverResponse(response.data(), responseSize);
-            std::cout << serverResponse << std::endl;
+            sent = receiveResponse() && verifyDigest(crc);
         }
-        else
+        if (sent || !replaceStaleConnection())
         {
-            std::cerr << "Error receiving response from server: " << WSAGetLastError() << std::endl;
             break;
         }
     }
 
     file.close(); // Close the file after the loop is finished
+    reusable_ = sent;
+    return sent;
 }
 
-// Closes the connection by closing the socket
-void TCPClient::closeConnection()
+bool TCPClient::sendFileOffered(const std::string &filePath)
 {
-    closesocket(connectSocket);
-}
\ No newline at end of file
+    int64_t fileSize, mtime;
+    uint32_t fileCrc;
+    std::ifstream file(filePath, std::ios::binary);
+    if (!file || !fileDigest(filePath, fileSize, mtime, fileCrc))
+    {
+        std::cerr << "Error opening file: " << filePath << std::endl;
+        return false;
+    }
+
+    // A stale pooled connection fails on the offer, before any of the body is sent
+    OfferHeader offer = {fileSize, fileCrc, 0};
+    char status;
+    while (!sendAll(reinterpret_cast<const char *>(&offeredUploadRequest), sizeof(offeredUploadRequest)) ||
+           !sendAll(reinterpret_cast<const char *>(&offer), sizeof(offer)) || !receiveAll(&status, sizeof(status)))
+    {
+        if (!replaceStaleConnection())
+        {
+            std::cerr << "Error offering file: " << WSAGetLastError() << std::endl;
+            return false;
+        }
+    }
+    if (static_cast<OfferStatus>(status) == OfferStatus::AlreadyStored)
+    {
+        lastResponse_ = "Already have it";
+        reusable_ = true;
+        return true;
+    }
+
+    // The digest check covers the bytes actually sent, in case the file changed since it was hashed
+    uint32_t crc = 0;
+    reusable_ = sendBody(file, filePath, fileSize, crc) && receiveResponse() && verifyDigest(crc);
+    return reusable_;
+}
+
+bool TCPClient::sendBody(std::ifstream &file, const std::string &filePath, int64_t fileSize, uint32_t &crc)
+{
+    ZeroCopySend zeroCopy = zeroCopy_ ? transmitFile(filePath, fileSize, crc) : ZeroCopySend::Unavailable;
+    if (zeroCopy != ZeroCopySend::Unavailable)
+    {
+        return zeroCopy == ZeroCopySend::Sent;
+    }
+
+    // Buffered fallback, through user memory in chunks sized by the chunk sizer. read() rather
+    // than readsome(), which may return nothing before the end of the file
+    std::vector<char> buffer(chunkSizer_.maxSize());
+    int64_t bytesSent = 0;
+
+    // Reset the file pointer to the beginning
+    file.clear();
+    file.seekg(0, std::ios::beg);
+
+    while (bytesSent < fileSize)
+    {
+        auto start = std::chrono::steady_clock::now();
+        size_t wanted = static_cast<size_t>(std::min<int64_t>(chunkSizer_.size(), fileSize - bytesSent));
+        file.read(buffer.data(), wanted);
+        size_t bytesRead = static_cast<size_t>(file.gcount());
+        if (bytesRead == 0)
+        {
+            std::cerr << "File ended after " << bytesSent << " of " << fileSize << " bytes: " << filePath
+                      << std::endl;
+            return false;
+        }
+
+        // Hash each buffer while it is still in cache from the read
+        crc = crc32c(crc, buffer.data(), bytesRead);
+        if (!sendAll(buffer.data(), bytesRead))
+        {
+            std::cerr << "Error sending data: " << WSAGetLastError() << std::endl;
+            return false;
+        }
+        bytesSent += bytesRead;
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        chunkSizer_.record(bytesRead, elapsed.count());
+    }
+
+    // Clear EOF flag
+    file.clear();
+    return true;
+}
+
+ChunkSizer::ChunkSizer(size_t minSize, size_t maxSize)
+    : minSize_(std::max<size_t>(minSize, 1)), maxSize_(std::max(maxSize, minSize_)),
+      size_(std::min(std::max<size_t>(64 * 1024, minSize_), maxSize_))
+{
+}
+
+void ChunkSizer::record(size_t bytes, double seconds)
+{
+    ++totalCalls_;
+    totalBytes_ += bytes;
+    ++windowCallCount_;
+    windowBytes_ += bytes;
+    windowSeconds_ += seconds;
+    if (windowCallCount_ < windowCalls || minSize_ == maxSize_)
+    {
+        return;
+    }
+
+    // A step that gained under 5% counts as none, so the size settles where the rate levels off
+    double rate = windowBytes_ / std::max(windowSeconds_, 1e-9);
+    if (lastRate_ > 0 && rate < lastRate_ * 1.05)
+    {
+        direction_ = -direction_;
+    }
+    lastRate_ = rate;
+    windowCallCount_ = 0;
+    windowBytes_ = 0;
+    windowSeconds_ = 0;
+
+    if (direction_ > 0 && size_ >= maxSize_)
+    {
+        direction_ = -1;
+    }
+    else if (direction_ < 0 && size_ <= minSize_)
+    {
+        direction_ = 1;
+    }
+    size_ = direction_ > 0 ? std::min(size_ * 2, maxSize_) : std::max(size_ / 2, minSize_);
+}
+
+// Size and CRC-32C of a whole file
+static bool hashFile(const std::string &filePath, int64_t &size, uint32_t &crc)
+{
+    std::ifstream file(filePath, std::ios::binary);
+    if (!file)
+    {
+        return false;
+    }
+    std::vector<char> buffer(dataFrameSize);
+    size = 0;
+    crc = 0;
+    while (file.read(buffer.data(), buffer.size()) || file.gcount() > 0)
+    {
+        crc = crc32c(crc, buffer.data(), static_cast<size_t>(file.gcount()));
+        size += file.gcount();
+    }
+    return !file.bad();
+}
+
+bool TCPClient::fileDigest(const std::string &filePath, int64_t &size, int64_t &mtime, uint32_t &crc)
+{
+    if (changeCache_)
+    {
+        return changeCache_->digest(filePath, size, mtime, crc);
+    }
+    std::error_code error;
+    mtime = std::filesystem::last_write_time(filePath, error).time_since_epoch().count();
+    return hashFile(filePath, size, crc);
+}
+
+void ChangeCache::load()
+{
+    std::ifstream file(cachePath_);
+    std::string line;
+    while (std::getline(file, line))
+    {
+        std::istringstream fields(line);
+        Entry entry;
+        std::string path;
+        fields >> entry.size >> entry.mtime >> std::hex >> entry.crc;
+        if (fields && fields.get() == ' ' && std::getline(fields, path) && !path.empty())
+        {
+            entries_[path] = entry;
+        }
+    }
+    changed_ = false;
+}
+
+bool ChangeCache::save()
+{
+    if (!changed_)
+    {
+        return true;
+    }
+
+    // Written beside the cache and renamed over it, so a crash leaves the old or the new cache
+    std::string temporaryPath = cachePath_ + ".tmp";
+    {
+        std::ofstream file(temporaryPath, std::ios::trunc);
+        for (const auto &entry : entries_)
+        {
+            file << entry.second.size << ' ' << entry.second.mtime << ' ' << std::hex << entry.second.crc << std::dec
+                 << ' ' << entry.first << '\n';
+        }
+        if (!file.flush())
+        {
+            std::cerr << "Error writing change cache: " << temporaryPath << std::endl;
+            return false;
+        }
+    }
+    std::error_code error;
+    std::filesystem::rename(temporaryPath, cachePath_, error);
+    if (error)
+    {
+        std::cerr << "Error writing change cache: " << cachePath_ << " (" << error.message() << ")" << std::endl;
+        return false;
+    }
+    changed_ = false;
+    return true;
+}
+
+bool ChangeCache::digest(const std::string &filePath, int64_t &size, int64_t &mtime, uint32_t &crc)
+{
+    std::error_code error;
+    std::string path = std::filesystem::absolute(filePath, error).generic_string();
+    auto modified = std::filesystem::last_write_time(filePath, error);
+    uint64_t fileSize = std::filesystem::file_size(filePath, error);
+    if (error)
+    {
+        return false;
+    }
+    mtime = modified.time_since_epoch().count();
+
+    auto cached = entries_.find(path);
+    if (cached != entries_.end() && cached->second.size == static_cast<int64_t>(fileSize) &&
+        cached->second.mtime == mtime)
+    {
+        size = cached->second.size;
+        crc = cached->second.crc;
+        return true;
+    }
+
+    if (!hashFile(filePath, size, crc))
+    {
+        return false;
+    }
+
+    // A file modified within the last two seconds could change again without its modification
+    // time moving on coarse file systems, so it is only cached once it has been still for longer
+    if (std::filesystem::file_time_type::clock::now() - modified > std::chrono::seconds(2))
+    {
+        entries_[path] = {size, mtime, crc};
+        changed_ = true;
+    }
+    return true;
+}
+
+// TransmitFile sends straight from the page cache, so the body is never copied into user memory.
+// The hash then reads the same cached pages through a mapping, while the server stores the file
+TCPClient::ZeroCopySend TCPClient::transmitFile(const std::string &filePath, int64_t fileSize, uint32_t &crc)
+{
+    // One TransmitFile call takes just under 2 GB; send a gigabyte per call to stay well clear
+    const int64_t maxTransmitBytes = 1ll << 30;
+
+    HANDLE file = CreateFileA(filePath.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+                              FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+    if (file == INVALID_HANDLE_VALUE)
+    {
+        return ZeroCopySend::Unavailable;
+    }
+
+    // An empty file cannot be mapped, and has nothing to hash
+    HANDLE mapping = fileSize > 0 ? CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr) : nullptr;
+    const char *view = mapping ? static_cast<const char *>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0)) : nullptr;
+    ZeroCopySend result = fileSize > 0 && !view ? ZeroCopySend::Unavailable : ZeroCopySend::Sent;
+
+    for (int64_t offset = 0; result == ZeroCopySend::Sent && offset < fileSize;)
+    {
+        DWORD take = static_cast<DWORD>(std::min(fileSize - offset, maxTransmitBytes));
+        LARGE_INTEGER position;
+        position.QuadPart = offset;
+        if (!SetFilePointerEx(file, position, nullptr, FILE_BEGIN) ||
+            !TransmitFile(connectSocket, file, take, 0, nullptr, nullptr, 0))
+        {
+            // Refused before anything went out, as on sockets TransmitFile does not support
+            int error = WSAGetLastError();
+            result = offset == 0 && error == WSAEOPNOTSUPP ? ZeroCopySend::Unavailable : ZeroCopySend::Failed;
+            if (result == ZeroCopySend::Failed)
+            {
+                std::cerr << "Error sending data: " << error << std::endl;
+            }
+            break;
+        }
+        offset += take;
+    }
+
+    if (result == ZeroCopySend::Sent && view)
+    {
+        crc = crc32c(0, view, static_cast<size_t>(fileSize));
+    }
+
+    if (view)
+    {
+        UnmapViewOfFile(view);
+    }
+    if (mapping)
+    {
+        CloseHandle(mapping);
+    }
+    CloseHandle(file);
+    return result;
+}
+
+bool TCPClient::sendAll(const char *data, size_t size)
+{
+    size_t totalSent = 0;
+    while (totalSent < size)
+    {
+        int bytesSent = send(connectSocket, data + totalSent, static_cast<int>(size - totalSent), 0);
+        if (bytesSent == SOCKET_ERROR)
+        {
+            return false;
+        }
+        totalSent += bytesSent;
+    }
+    return true;
+}
+
+bool TCPClient::receiveAll(char *data, size_t size)
+{
+    size_t totalReceived = 0;
+    while (totalReceived < size)
+    {
+        int bytesReceived = recv(connectSocket, data + totalReceived, static_cast<int>(size - totalReceived), 0);
+        if (bytesReceived <= 0)
+        {
+            return false;
+        }
+        totalReceived += bytesReceived;
+    }
+    return true;
+}
+
+bool TCPClient::receiveResponse()
+{
+    std::vector<char> response(1024);
+    int responseSize = recv(connectSocket, response.data(), response.size(), 0);
+    if (responseSize > 0)
+    {
+        lastResponse_.assign(response.data(), responseSize);
+
+        // On a keep-alive connection the response ends at its newline, or at the close of a
+        // request that does not keep the connection
+        while (pooled_ && lastResponse_.back() != '\n' && lastResponse_.size() < response.size() &&
+               (responseSize = recv(connectSocket, response.data(), response.size(), 0)) > 0)
+        {
+            lastResponse_.append(response.data(), responseSize);
+        }
+        if (pooled_ && lastResponse_.back() == '\n')
+        {
+            lastResponse_.pop_back();
+        }
+        return true;
+    }
+
+    std::cerr << "Error receiving response from server: " << WSAGetLastError() << std::endl;
+    return false;
+}
+
+// Servers that predate digests answer just "File received" and are trusted as before
+bool TCPClient::verifyDigest(uint32_t crc)
+{
+    const std::string label = "CRC-32C ";
+    size_t position = lastResponse_.find(label);
+    if (position == std::string::npos)
+    {
+        return true;
+    }
+
+    uint32_t stored = static_cast<uint32_t>(std::strtoul(lastResponse_.c_str() + position + label.size(), nullptr, 16));
+    if (stored != crc)
+    {
+        std::cerr << "Digest mismatch: sent CRC-32C " << std::hex << std::setw(8) << std::setfill('0') << crc
+                  << ", server stored " << std::setw(8) << stored << std::dec << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// Sends the file as literals and references to blocks of the server's latest version
+bool TCPClient::sendFileDelta(const std::string &filePath)
+{
+    std::ifstream file(filePath, std::ios::binary);
+    if (!file)
+    {
+        std::cerr << "Error opening file: " << filePath << std::endl;
+        return false;
+    }
+    std::vector<char> data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    file.close();
+
+    int64_t header[2] = {deltaUploadRequest, static_cast<int64_t>(data.size())};
+    if (!sendAll(reinterpret_cast<const char *>(header), sizeof(header)))
+    {
+        std::cerr << "Error sending file size: " << WSAGetLastError() << std::endl;
+        return false;
+    }
+
+    // Signatures: block size, block count, then a 4-byte weak and 16-byte strong checksum per block
+    uint32_t blockInfo[2];
+    if (!receiveAll(reinterpret_cast<char *>(blockInfo), sizeof(blockInfo)))
+    {
+        std::cerr << "Error receiving signatures: " << WSAGetLastError() << std::endl;
+        return false;
+    }
+    const size_t blockSize = blockInfo[0];
+    const uint32_t blockCount = blockInfo[1];
+    const size_t entrySize = sizeof(uint32_t) + 16;
+    std::vector<char> signatures(static_cast<size_t>(blockCount) * entrySize);
+    if (blockSize == 0 || !receiveAll(signatures.data(), signatures.size()))
+    {
+        std::cerr << "Error receiving signatures: " << WSAGetLastError() << std::endl;
+        return false;
+    }
+
+    std::unordered_map<uint32_t, std::vector<uint32_t>> blocksByWeak;
+    for (uint32_t i = 0; i < blockCount; ++i)
+    {
+        uint32_t weak;
+        std::memcpy(&weak, &signatures[i * entrySize], sizeof(weak));
+        blocksByWeak[weak].push_back(i);
+    }
+
+    // Instructions are batched and sent once 64 KB have accumulated
+    std::string out;
+    const size_t sendThreshold = 64 * 1024;
+    size_t literalStart = 0;
+    uint32_t runFirst = 0;
+    uint32_t runCount = 0;
+    uint64_t matchedBytes = 0;
+
+    auto flush = [&](bool force)
+    {
+        if (out.size() >= sendThreshold || (force && !out.empty()))
+        {
+            bool sent = sendAll(out.data(), out.size());
+            out.clear();
+            return sent;
+        }
+        return true;
+    };
+    auto emitRun = [&]()
+    {
+        if (runCount > 0)
+        {
+            out += 'B';
+            out.append(reinterpret_cast<const char *>(&runFirst), sizeof(runFirst));
+            out.append(reinterpret_cast<const char *>(&runCount), sizeof(runCount));
+            runCount = 0;
+        }
+        return flush(false);
+    };
+    auto emitLiteral = [&](size_t end)
+    {
+        while (literalStart < end)
+        {
+            uint32_t length = static_cast<uint32_t>(std::min<size_t>(end - literalStart, sendThreshold));
+            out += 'L';
+            out.append(reinterpret_cast<const char *>(&length), sizeof(length));
+            out.append(&data[literalStart], length);
+            literalStart += length;
+            if (!flush(false))
+            {
+                return false;
+            }
+        }
+        return true;
+    };
+
+    // rsync's rolling checksum over the window [pos, pos + blockSize)
+    uint32_t a = 0;
+    uint32_t b = 0;
+    auto resetWindow = [&](size_t pos)
+    {
+        a = 0;
+        b = 0;
+        for (size_t i = pos; i < pos + blockSize; ++i)
+        {
+            a += static_cast<uint8_t>(data[i]);
+            b += a;
+        }
+    };
+
+    bool ok = true;
+    size_t pos = 0;
+    if (blockCount > 0 && data.size() >= blockSize)
+    {
+        resetWindow(0);
+    }
+    while (ok && blockCount > 0 && pos + blockSize <= data.size())
+    {
+        uint32_t weak = (a & 0xffff) | (b << 16);
+        auto candidates = blocksByWeak.find(weak);
+        int64_t match = -1;
+        if (candidates != blocksByWeak.end())
+        {
+            Sha256 sha;
+            sha.update(&data[pos], blockSize);
+            std::string strong = sha.digest().substr(0, 16);
+            for (uint32_t index : candidates->second)
+            {
+                if (std::memcmp(&signatures[index * entrySize + sizeof(uint32_t)], strong.data(), 16) == 0)
+                {
+                    match = index;
+                    break;
+                }
+            }
+        }
+
+        if (match >= 0)
+        {
+            // Extend the current run of consecutive blocks, or start a new one after any literal
+            if (literalStart < pos || runCount == 0 || runFirst + runCount != match)
+            {
+                ok = emitRun() && emitLiteral(pos);
+                runFirst = static_cast<uint32_t>(match);
+            }
+            ++runCount;
+            matchedBytes += blockSize;
+            pos += blockSize;
+            literalStart = pos;
+            if (pos + blockSize <= data.size())
+            {
+                resetWindow(pos);
+            }
+            continue;
+        }
+
+        if (pos + blockSize == data.size())
+        {
+            break;
+        }
+        uint8_t leaving = static_cast<uint8_t>(data[pos]);
+        uint8_t entering = static_cast<uint8_t>(data[pos + blockSize]);
+        a = a - leaving + entering;
+        b = b - static_cast<uint32_t>(blockSize) * leaving + a;
+        ++pos;
+    }
+
+    // Whatever follows the last match, then the digest the server verifies the rebuilt file against
+    Sha256 sha;
+    sha.update(data.data(), data.size());
+    ok = ok && emitRun() && emitLiteral(data.size());
+    out += 'E';
+    out += sha.hexDigest();
+    if (!ok || !flush(true))
+    {
+        std::cerr << "Error sending data: " << WSAGetLastError() << std::endl;
+        return false;
+    }
+
+    std::cout << "Delta upload: " << matchedBytes << " of " << data.size() << " bytes matched the server's copy"
+              << std::endl;
+    return receiveResponse();
+}
+
+// Sends the file as G-code codec blocks, each cut at a line break
+bool TCPClient::sendFileCompressed(const std::string &filePath)
+{
+    std::ifstream file(filePath, std::ios::binary | std::ios::ate);
+    if (!file)
+    {
+        std::cerr << "Error opening file: " << filePath << std::endl;
+        return false;
+    }
+    int64_t header[2] = {compressedUploadRequest, static_cast<int64_t>(file.tellg())};
+    file.seekg(0, std::ios::beg);
+
+    if (!sendAll(reinterpret_cast<const char *>(header), sizeof(header)))
+    {
+        std::cerr << "Error sending file size: " << WSAGetLastError() << std::endl;
+        return false;
+    }
+
+    std::string pending;
+    std::vector<char> buffer(GcodeCodec::blockSize);
+    uint64_t compressedBytes = 0;
+    bool endOfFile = false;
+    while (!endOfFile || !pending.empty())
+    {
+        if (!endOfFile && pending.size() < GcodeCodec::blockSize)
+        {
+            file.read(buffer.data(), GcodeCodec::blockSize - pending.size());
+            pending.append(buffer.data(), static_cast<size_t>(file.gcount()));
+            endOfFile = file.eof() || !file;
+            continue;
+        }
+
+        // Keep a trailing partial line for the next block, so words are not split
+        size_t blockEnd = pending.size();
+        if (!endOfFile)
+        {
+            size_t lineEnd = pending.rfind('\n');
+            if (lineEnd != std::string::npos)
+            {
+                blockEnd = lineEnd + 1;
+            }
+        }
+
+        std::string block = GcodeCodec::encodeBlock(pending.data(), blockEnd);
+        pending.erase(0, blockEnd);
+        compressedBytes += block.size();
+        if (!sendAll(block.data(), block.size()))
+        {
+            std::cerr << "Error sending data: " << WSAGetLastError() << std::endl;
+            return false;
+        }
+    }
+
+    std::cout << "Compressed upload: " << header[1] << " bytes sent as " << compressedBytes << std::endl;
+    return receiveResponse();
+}
+
+// Sends range 0 over this connection and the other ranges over connections of their own
+bool TCPClient::sendFileParallel(const std::string &filePath, size_t streamCount)
+{
+    std::ifstream file(filePath, std::ios::binary | std::ios::ate);
+    if (!file)
+    {
+        std::cerr << "Error opening file: " << filePath << std::endl;
+        return false;
+    }
+    int64_t fileSize = file.tellg();
+    file.close();
+
+    // At least one byte per range, and a single empty range for an empty file
+    uint32_t rangeCount = static_cast<uint32_t>(
+        std::max<int64_t>(1, std::min<int64_t>(static_cast<int64_t>(streamCount), fileSize)));
+    std::random_device random;
+    uint64_t transferId = (static_cast<uint64_t>(random()) << 32) ^ random() ^
+                          static_cast<uint64_t>(std::chrono::steady_clock::now().time_since_epoch().count());
+
+    std::vector<RangeHeader> ranges(rangeCount);
+    for (uint32_t i = 0; i < rangeCount; ++i)
+    {
+        int64_t begin = fileSize * i / rangeCount;
+        int64_t end = fileSize * (i + 1) / rangeCount;
+        ranges[i] = {transferId, fileSize, begin, end - begin, rangeCount, i};
+    }
+
+    std::vector<std::string> responses(rangeCount);
+    std::vector<char> succeeded(rangeCount, 0);
+    std::vector<std::thread> threads;
+    for (uint32_t i = 1; i < rangeCount; ++i)
+    {
+        threads.emplace_back([&, i]()
+                             {
+            TCPClient stream(ipAddress, port);
+            if (stream.connectToServer())
+            {
+                succeeded[i] = stream.sendRange(filePath, ranges[i], responses[i]);
+                stream.closeConnection();
+            } });
+    }
+    succeeded[0] = sendRange(filePath, ranges[0], responses[0]);
+    for (auto &thread : threads)
+    {
+        thread.join();
+    }
+
+    // Exactly one stream carries the response, whichever range the server finished last
+    for (uint32_t i = 0; i < rangeCount; ++i)
+    {
+        if (succeeded[i] && !responses[i].empty())
+        {
+            lastResponse_ = responses[i];
+            return true;
+        }
+    }
+    std::cerr << "Error receiving response from server: no stream was acknowledged" << std::endl;
+    return false;
+}
+
+bool TCPClient::sendRange(const std::string &filePath, const RangeHeader &range, std::string &response)
+{
+    std::ifstream file(filePath, std::ios::binary);
+    if (!file)
+    {
+        std::cerr << "Error opening file: " << filePath << std::endl;
+        return false;
+    }
+    file.seekg(range.offset);
+
+    if (!sendAll(reinterpret_cast<const char *>(&rangeUploadRequest), sizeof(rangeUploadRequest)) ||
+        !sendAll(reinterpret_cast<const char *>(&range), sizeof(range)))
+    {
+        std::cerr << "Error sending range header: " << WSAGetLastError() << std::endl;
+        return false;
+    }
+
+    std::vector<char> buffer(64 * 1024);
+    int64_t remaining = range.length;
+    while (remaining > 0)
+    {
+        file.read(buffer.data(), std::min<int64_t>(remaining, buffer.size()));
+        std::streamsize bytesRead = file.gcount();
+        if (bytesRead <= 0)
+        {
+            std::cerr << "Error reading file: " << filePath << std::endl;
+            return false;
+        }
+        if (!sendAll(buffer.data(), bytesRead))
+        {
+            std::cerr << "Error sending data: " << WSAGetLastError() << std::endl;
+            return false;
+        }
+        remaining -= bytesRead;
+    }
+
+    // Nothing more on this stream; the server closes it once the range is on disk
+    shutdown(connectSocket, SD_SEND);
+    response.clear();
+    char reply[256];
+    int bytesReceived;
+    while ((bytesReceived = recv(connectSocket, reply, sizeof(reply), 0)) > 0)
+    {
+        response.append(reply, bytesReceived);
+    }
+    if (bytesReceived == SOCKET_ERROR)
+    {
+        std::cerr << "Error receiving response from server: " << WSAGetLastError() << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// The transfer ID hashes the path, size and modification time, so an edited file starts over
+bool TCPClient::sendFileResumable(const std::string &filePath, int maxAttempts)
+{
+    std::ifstream file(filePath, std::ios::binary);
+    std::error_code error;
+    auto modified = std::filesystem::last_write_time(filePath, error);
+    ResumeHeader header = {};
+    if (!file || error || !hashFile(filePath, header.fileSize, header.crc))
+    {
+        std::cerr << "Error opening file: " << filePath << std::endl;
+        return false;
+    }
+
+    Sha256 identity;
+    int64_t modifiedTicks = modified.time_since_epoch().count();
+    identity.update(filePath.data(), filePath.size());
+    identity.update(reinterpret_cast<const char *>(&header.fileSize), sizeof(header.fileSize));
+    identity.update(reinterpret_cast<const char *>(&modifiedTicks), sizeof(modifiedTicks));
+    std::memcpy(&header.transferId, identity.digest().data(), sizeof(header.transferId));
+
+    for (int attempt = 1; attempt <= maxAttempts; ++attempt)
+    {
+        if (attempt > 1)
+        {
+            // Back off 1, 2, 4... seconds, then reconnect and pick up where the server stopped
+            closeConnection();
+            std::this_thread::sleep_for(std::chrono::seconds(1 << std::min(attempt - 2, 4)));
+            std::cout << "Retrying upload, attempt " << attempt << " of " << maxAttempts << std::endl;
+            if (!connectToServer())
+            {
+                continue;
+            }
+        }
+        if (resumeUpload(file, header))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool TCPClient::resumeUpload(std::ifstream &file, const ResumeHeader &header)
+{
+    int64_t offset;
+    if (!sendAll(reinterpret_cast<const char *>(&resumableUploadRequest), sizeof(resumableUploadRequest)) ||
+        !sendAll(reinterpret_cast<const char *>(&header), sizeof(header)) ||
+        !receiveAll(reinterpret_cast<char *>(&offset), sizeof(offset)))
+    {
+        std::cerr << "Error negotiating resume offset: " << WSAGetLastError() << std::endl;
+        return false;
+    }
+    if (offset < 0 || offset > header.fileSize)
+    {
+        std::cerr << "Server reported an invalid resume offset: " << offset << std::endl;
+        return false;
+    }
+    if (offset > 0)
+    {
+        std::cout << "Resuming at byte " << offset << " of " << header.fileSize << std::endl;
+    }
+
+    file.clear();
+    file.seekg(offset);
+    std::vector<char> buffer(64 * 1024);
+    int64_t remaining = header.fileSize - offset;
+    while (remaining > 0)
+    {
+        file.read(buffer.data(), std::min<int64_t>(remaining, buffer.size()));
+        std::streamsize bytesRead = file.gcount();
+        if (bytesRead <= 0)
+        {
+            std::cerr << "Error reading file" << std::endl;
+            return false;
+        }
+        if (!sendAll(buffer.data(), bytesRead))
+        {
+            std::cerr << "Error sending data: " << WSAGetLastError() << std::endl;
+            return false;
+        }
+        remaining -= bytesRead;
+    }
+
+    return receiveResponse() && verifyDigest(header.crc);
+}
+
+bool TCPClient::openSession()
+{
+    if (!sendAll(reinterpret_cast<const char *>(&sessionRequest), sizeof(sessionRequest)))
+    {
+        std::cerr << "Error opening session: " << WSAGetLastError() << std::endl;
+        return false;
+    }
+    nextStream_ = 0;
+    return true;
+}
+
+bool TCPClient::sendFiles(const std::vector<std::string> &filePaths, size_t interleave)
+{
+    return streamFiles(filePaths, {}, interleave);
+}
+
+bool TCPClient::sendDirectory(const std::string &directoryPath, size_t &filesSent)
+{
+    std::vector<std::string> fileNames;
+    std::error_code error;
+    for (const auto &entry : std::filesystem::recursive_directory_iterator(directoryPath, error))
+    {
+        if (entry.is_regular_file())
+        {
+            fileNames.push_back(entry.path().lexically_relative(directoryPath).generic_string());
+        }
+    }
+    if (error)
+    {
+        std::cerr << "Error reading directory: " << directoryPath << " (" << error.message() << ")" << std::endl;
+        return false;
+    }
+    return sendManifest(directoryPath, fileNames, filesSent);
+}
+
+bool TCPClient::sendManifest(const std::string &directoryPath, const std::vector<std::string> &fileNames,
+                             size_t &filesSent)
+{
+    struct ManifestEntry
+    {
+        std::string path;
+        std::string name;
+        int64_t size;
+        int64_t mtime;
+        uint32_t crc;
+    };
+    std::vector<ManifestEntry> entries;
+    for (const std::string &name : fileNames)
+    {
+        std::filesystem::path path = std::filesystem::path(directoryPath) / name;
+        std::error_code error;
+        if (!std::filesystem::is_regular_file(path, error))
+        {
+            continue;
+        }
+        if (name.size() > maxFileNameLength)
+        {
+            std::cerr << "File name too long: " << name << std::endl;
+            return false;
+        }
+
+        int64_t size, mtime;
+        uint32_t crc;
+        if (!fileDigest(path.string(), size, mtime, crc))
+        {
+            std::cerr << "Error opening file: " << path.string() << std::endl;
+            return false;
+        }
+        entries.push_back({path.string(), name, size, mtime, crc});
+    }
+
+    // Every manifest frame goes out before the first answer is read, so the manifest costs one
+    // round trip however many files it lists
+    std::vector<char> frame(frameHeaderSize + dataFrameSize);
+    std::vector<size_t> frameStarts;
+    for (size_t next = 0; next < entries.size();)
+    {
+        frameStarts.push_back(next);
+        uint32_t payloadSize = 0;
+        while (next < entries.size())
+        {
+            const ManifestEntry &entry = entries[next];
+            uint16_t nameLength = static_cast<uint16_t>(entry.name.size());
+            size_t entrySize = sizeof(nameLength) + nameLength + sizeof(entry.size) + sizeof(entry.mtime) +
+                               sizeof(entry.crc);
+            if (payloadSize + entrySize > dataFrameSize)
+            {
+                break;
+            }
+            char *out = frame.data() + frameHeaderSize + payloadSize;
+            std::memcpy(out, &nameLength, sizeof(nameLength));
+            std::memcpy(out + sizeof(nameLength), entry.name.data(), nameLength);
+            out += sizeof(nameLength) + nameLength;
+            std::memcpy(out, &entry.size, sizeof(entry.size));
+            std::memcpy(out + sizeof(entry.size), &entry.mtime, sizeof(entry.mtime));
+            std::memcpy(out + sizeof(entry.size) + sizeof(entry.mtime), &entry.crc, sizeof(entry.crc));
+            payloadSize += static_cast<uint32_t>(entrySize);
+            ++next;
+        }
+        if (!sendFrame(frame.data(), FrameType::Manifest, static_cast<uint32_t>(frameStarts.size()), payloadSize))
+        {
+            return false;
+        }
+    }
+
+    // Answers come in the order of the manifest frames
+    std::vector<std::string> neededPaths, neededNames;
+    for (size_t i = 0; i < frameStarts.size(); ++i)
+    {
+        size_t first = frameStarts[i];
+        size_t count = (i + 1 < frameStarts.size() ? frameStarts[i + 1] : entries.size()) - first;
+        char header[frameHeaderSize];
+        uint32_t stream, length;
+        if (!receiveAll(header, sizeof(header)))
+        {
+            std::cerr << "Error receiving response from server: " << WSAGetLastError() << std::endl;
+            return false;
+        }
+        std::memcpy(&stream, header + 1, sizeof(stream));
+        std::memcpy(&length, header + 5, sizeof(length));
+        std::string needed(length, '\0');
+        if (static_cast<FrameType>(header[0]) != FrameType::Needed || stream != i + 1 || length != count ||
+            !receiveAll(&needed[0], length))
+        {
+            std::cerr << "Unexpected manifest answer from server" << std::endl;
+            return false;
+        }
+        for (size_t j = 0; j < count; ++j)
+        {
+            if (needed[j])
+            {
+                neededPaths.push_back(entries[first + j].path);
+                neededNames.push_back(entries[first + j].name);
+            }
+        }
+    }
+
+    filesSent = neededPaths.size();
+    if (neededPaths.empty())
+    {
+        lastResponse_ = "Nothing to send";
+        return true;
+    }
+    return streamFiles(neededPaths, neededNames, 1);
+}
+
+bool TCPClient::streamFiles(const std::vector<std::string> &filePaths, const std::vector<std::string> &fileNames,
+                            size_t interleave)
+{
+    struct Upload
+    {
+        std::ifstream file;
+        uint32_t stream;
+        int64_t remaining;
+    };
+    std::vector<Upload> active;
+    std::unordered_map<uint32_t, std::string> unacknowledged;
+    std::vector<char> frame(frameHeaderSize + dataFrameSize);
+    size_t next = 0;
+    interleave = std::max<size_t>(interleave, 1);
+
+    while (next < filePaths.size() || !active.empty())
+    {
+        // Keep up to interleave files in flight
+        while (active.size() < interleave && next < filePaths.size())
+        {
+            const std::string &filePath = filePaths[next++];
+            std::ifstream file(filePath, std::ios::binary | std::ios::ate);
+            if (!file)
+            {
+                std::cerr << "Error opening file: " << filePath << std::endl;
+                return false;
+            }
+            int64_t fileSize = file.tellg();
+            file.seekg(0, std::ios::beg);
+
+            uint32_t stream = ++nextStream_;
+            const std::string &fileName = fileNames.empty() ? std::string() : fileNames[next - 1];
+            std::memcpy(frame.data() + frameHeaderSize, &fileSize, sizeof(fileSize));
+            std::memcpy(frame.data() + frameHeaderSize + sizeof(fileSize), fileName.data(), fileName.size());
+            if (!sendFrame(frame.data(), FrameType::FileBegin, stream,
+                           static_cast<uint32_t>(sizeof(fileSize) + fileName.size())))
+            {
+                return false;
+            }
+            unacknowledged[stream] = filePath;
+            active.push_back({std::move(file), stream, fileSize});
+        }
+
+        // One data frame of each file in turn, and the end frame after its last byte
+        for (auto upload = active.begin(); upload != active.end();)
+        {
+            if (upload->remaining > 0)
+            {
+                upload->file.read(frame.data() + frameHeaderSize, std::min<int64_t>(upload->remaining, dataFrameSize));
+                uint32_t bytesRead = static_cast<uint32_t>(upload->file.gcount());
+                if (bytesRead == 0)
+                {
+                    std::cerr << "Error reading file: " << unacknowledged[upload->stream] << std::endl;
+                    return false;
+                }
+                if (!sendFrame(frame.data(), FrameType::FileData, upload->stream, bytesRead))
+                {
+                    return false;
+                }
+                upload->remaining -= bytesRead;
+            }
+            if (upload->remaining == 0)
+            {
+                if (!sendFrame(frame.data(), FrameType::FileEnd, upload->stream, 0))
+                {
+                    return false;
+                }
+                upload = active.erase(upload);
+            }
+            else
+            {
+                ++upload;
+            }
+        }
+    }
+
+    // Acks arrive in the order the files ended
+    std::string firstError;
+    while (!unacknowledged.empty())
+    {
+        char header[frameHeaderSize];
+        uint32_t stream, length;
+        if (!receiveAll(header, sizeof(header)))
+        {
+            std::cerr << "Error receiving response from server: " << WSAGetLastError() << std::endl;
+            return false;
+        }
+        std::memcpy(&stream, header + 1, sizeof(stream));
+        std::memcpy(&length, header + 5, sizeof(length));
+        auto upload = unacknowledged.find(stream);
+        if (static_cast<FrameType>(header[0]) != FrameType::Ack || length > 1024 || upload == unacknowledged.end())
+        {
+            std::cerr << "Unexpected frame from server" << std::endl;
+            return false;
+        }
+
+        std::string text(length, '\0');
+        if (!receiveAll(&text[0], length))
+        {
+            std::cerr << "Error receiving response from server: " << WSAGetLastError() << std::endl;
+            return false;
+        }
+        if (text != "File received" && firstError.empty())
+        {
+            firstError = upload->second + ": " + text;
+        }
+        lastResponse_ = text;
+        unacknowledged.erase(upload);
+    }
+    if (!firstError.empty())
+    {
+        lastResponse_ = firstError;
+    }
+    return true;
+}
+
+bool TCPClient::sendFileChecked(const std::string &filePath, uint32_t window)
+{
+    std::ifstream file(filePath, std::ios::binary | std::ios::ate);
+    if (!file)
+    {
+        std::cerr << "Error opening file: " << filePath << std::endl;
+        return false;
+    }
+    ChunkedHeader header = {static_cast<int64_t>(file.tellg()), checkedChunkSize, std::max<uint32_t>(window, 1)};
+    uint32_t chunkCount = static_cast<uint32_t>((header.fileSize + header.chunkSize - 1) / header.chunkSize);
+
+    if (!sendAll(reinterpret_cast<const char *>(&chunkedUploadRequest), sizeof(chunkedUploadRequest)) ||
+        !sendAll(reinterpret_cast<const char *>(&header), sizeof(header)))
+    {
+        std::cerr << "Error sending file size: " << WSAGetLastError() << std::endl;
+        return false;
+    }
+
+    std::vector<char> chunk(chunkHeaderSize + header.chunkSize);
+    std::deque<uint32_t> retransmits;
+    std::vector<int> attempts(chunkCount, 0);
+    std::vector<bool> stored(chunkCount, false);
+    uint32_t nextChunk = 0;
+    uint32_t inFlight = 0;
+    uint32_t storedCount = 0;
+    uint32_t retransmitted = 0;
+
+    while (storedCount < chunkCount)
+    {
+        // Fill the window, corrupt chunks first
+        while (inFlight < header.window && (!retransmits.empty() || nextChunk < chunkCount))
+        {
+            uint32_t index = nextChunk;
+            if (!retransmits.empty())
+            {
+                index = retransmits.front();
+                retransmits.pop_front();
+            }
+            else
+            {
+                ++nextChunk;
+            }
+
+            int64_t offset = static_cast<int64_t>(index) * header.chunkSize;
+            uint32_t length = static_cast<uint32_t>(std::min<int64_t>(header.chunkSize, header.fileSize - offset));
+            file.clear();
+            file.seekg(offset);
+            if (!file.read(chunk.data() + chunkHeaderSize, length))
+            {
+                std::cerr << "Error reading file: " << filePath << std::endl;
+                return false;
+            }
+            uint32_t crc = crc32c(0, chunk.data() + chunkHeaderSize, length);
+            std::memcpy(chunk.data(), &index, sizeof(index));
+            std::memcpy(chunk.data() + 4, &length, sizeof(length));
+            std::memcpy(chunk.data() + 8, &crc, sizeof(crc));
+            if (!sendAll(chunk.data(), chunkHeaderSize + length))
+            {
+                std::cerr << "Error sending data: " << WSAGetLastError() << std::endl;
+                return false;
+            }
+            ++attempts[index];
+            ++inFlight;
+        }
+
+        // The window is full or everything is out: wait for the next ack
+        char ack[sizeof(uint32_t) + 1];
+        uint32_t index;
+        if (!receiveAll(ack, sizeof(ack)))
+        {
+            std::cerr << "Error receiving chunk ack: " << WSAGetLastError() << std::endl;
+            return false;
+        }
+        std::memcpy(&index, ack, sizeof(index));
+        ChunkStatus status = static_cast<ChunkStatus>(ack[4]);
+        if (index >= chunkCount || stored[index] || inFlight == 0 ||
+            (status != ChunkStatus::Stored && status != ChunkStatus::Retransmit))
+        {
+            std::cerr << "Unexpected chunk ack from server" << std::endl;
+            return false;
+        }
+        --inFlight;
+
+        if (status == ChunkStatus::Stored)
+        {
+            stored[index] = true;
+            ++storedCount;
+        }
+        else if (attempts[index] >= maxChunkAttempts)
+        {
+            std::cerr << "Chunk " << index << " failed its checksum " << attempts[index] << " times, giving up"
+                      << std::endl;
+            return false;
+        }
+        else
+        {
+            retransmits.push_back(index);
+            ++retransmitted;
+        }
+    }
+
+    if (retransmitted > 0)
+    {
+        std::cout << "Resent " << retransmitted << " corrupt chunks of " << chunkCount << std::endl;
+    }
+    return receiveResponse();
+}
+
+bool TCPClient::sendFrame(char *frame, FrameType type, uint32_t stream, uint32_t payloadSize)
+{
+    frame[0] = static_cast<char>(type);
+    std::memcpy(frame + 1, &stream, sizeof(stream));
+    std::memcpy(frame + 5, &payloadSize, sizeof(payloadSize));
+    if (!sendAll(frame, frameHeaderSize + payloadSize))
+    {
+        std::cerr << "Error sending data: " << WSAGetLastError() << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// Closes the connection by closing the socket
+void TCPClient::closeConnection()
+{
+    if (pooled_ && reusable_)
+    {
+        pool_->release(connectSocket);
+    }
+    else
+    {
+        closesocket(connectSocket);
+    }
+    pooled_ = false;
+    reusable_ = false;
+}
+
+bool TCPClient::replaceStaleConnection()
+{
+    if (!pooled_ || !replaceable_)
+    {
+        return false;
+    }
+    closesocket(connectSocket);
+    replaceable_ = false;
+    connectSocket = pool_->open();
+    pooled_ = connectSocket != INVALID_SOCKET;
+    return pooled_;
+}
+
+ConnectionPool::ConnectionPool(const std::string &ipAddress, unsigned short port, size_t size)
+    : ipAddress_(ipAddress), port_(port), size_(size)
+{
+    int result = WSAStartup(MAKEWORD(2, 2), &wsaData_);
+    if (result != 0)
+    {
+        std::cerr << "WSAStartup failed: " << result << std::endl;
+        std::exit(1);
+    }
+}
+
+ConnectionPool::~ConnectionPool()
+{
+    for (SOCKET socket : idle_)
+    {
+        closesocket(socket);
+    }
+    WSACleanup();
+}
+
+void ConnectionPool::warm()
+{
+    // Connections the server closed meanwhile make room for new ones
+    idle_.erase(std::remove_if(idle_.begin(), idle_.end(),
+                               [](SOCKET socket)
+                               {
+                                   bool open = alive(socket);
+                                   if (!open)
+                                   {
+                                       closesocket(socket);
+                                   }
+                                   return !open;
+                               }),
+                idle_.end());
+    while (idle_.size() < size_)
+    {
+        SOCKET socket = open();
+        if (socket == INVALID_SOCKET)
+        {
+            break;
+        }
+        idle_.push_back(socket);
+    }
+}
+
+SOCKET ConnectionPool::acquire(bool &reused)
+{
+    while (!idle_.empty())
+    {
+        SOCKET socket = idle_.front();
+        idle_.pop_front();
+        if (alive(socket))
+        {
+            reused = true;
+            return socket;
+        }
+        closesocket(socket);
+    }
+    reused = false;
+    return open();
+}
+
+void ConnectionPool::release(SOCKET socket)
+{
+    if (idle_.size() < size_)
+    {
+        idle_.push_back(socket);
+    }
+    else
+    {
+        closesocket(socket);
+    }
+}
+
+SOCKET ConnectionPool::open()
+{
+    sockaddr_in serverAddress;
+    serverAddress.sin_family = AF_INET;
+    serverAddress.sin_port = htons(port_);
+    inet_pton(AF_INET, ipAddress_.c_str(), &serverAddress.sin_addr);
+
+    SOCKET connectSocket = newSocket();
+    if (connectSocket != INVALID_SOCKET && fastOpen_)
+    {
+        if (connectFastOpen(connectSocket, serverAddress))
+        {
+            return connectSocket;
+        }
+
+        // A socket bound for ConnectEx is not reused for connect
+        closesocket(connectSocket);
+        connectSocket = newSocket();
+    }
+    if (connectSocket == INVALID_SOCKET)
+    {
+        return INVALID_SOCKET;
+    }
+
+    if (connect(connectSocket, (SOCKADDR *)&serverAddress, sizeof(serverAddress)) == SOCKET_ERROR ||
+        send(connectSocket, reinterpret_cast<const char *>(&keepAliveRequest), sizeof(keepAliveRequest), 0) !=
+            sizeof(keepAliveRequest))
+    {
+        std::cerr << "Error connecting to server: " << WSAGetLastError() << std::endl;
+        closesocket(connectSocket);
+        return INVALID_SOCKET;
+    }
+    return connectSocket;
+}
+
+SOCKET ConnectionPool::newSocket()
+{
+    SOCKET connectSocket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (connectSocket == INVALID_SOCKET)
+    {
+        std::cerr << "Error creating socket: " << WSAGetLastError() << std::endl;
+        return INVALID_SOCKET;
+    }
+
+    // Probe after 30 s idle, then every 5 s, so idle connections stay open through NAT and
+    // firewall timeouts and a dead server shows up as an error before an upload is tried
+    tcp_keepalive keepalive = {1, 30 * 1000, 5 * 1000};
+    DWORD bytesReturned;
+    if (WSAIoctl(connectSocket, SIO_KEEPALIVE_VALS, &keepalive, sizeof(keepalive), nullptr, 0, &bytesReturned,
+                 nullptr, nullptr) == SOCKET_ERROR)
+    {
+        std::cerr << "Error enabling keepalive: " << WSAGetLastError() << std::endl;
+    }
+
+    // A request written in pieces would otherwise wait out the server's delayed ack of the
+    // previous response before its second piece leaves
+    BOOL noDelay = TRUE;
+    setsockopt(connectSocket, IPPROTO_TCP, TCP_NODELAY, reinterpret_cast<const char *>(&noDelay), sizeof(noDelay));
+    return connectSocket;
+}
+
+bool ConnectionPool::connectFastOpen(SOCKET socket, const sockaddr_in &serverAddress)
+{
+    // ConnectEx is an extension function, and the only connect that takes data for the SYN
+    GUID connectExId = WSAID_CONNECTEX;
+    LPFN_CONNECTEX connectEx = nullptr;
+    DWORD bytes;
+    DWORD fastOpen = 1;
+    sockaddr_in localAddress = {};
+    localAddress.sin_family = AF_INET;
+    if (WSAIoctl(socket, SIO_GET_EXTENSION_FUNCTION_POINTER, &connectExId, sizeof(connectExId), &connectEx,
+                 sizeof(connectEx), &bytes, nullptr, nullptr) == SOCKET_ERROR ||
+        setsockopt(socket, IPPROTO_TCP, TCP_FASTOPEN, reinterpret_cast<const char *>(&fastOpen), sizeof(fastOpen)) ==
+            SOCKET_ERROR ||
+        bind(socket, (SOCKADDR *)&localAddress, sizeof(localAddress)) == SOCKET_ERROR)
+    {
+        std::cerr << "TCP Fast Open unavailable, connecting normally: " << WSAGetLastError() << std::endl;
+        fastOpen_ = false;
+        return false;
+    }
+
+    // The first connection to a server only fetches its cookie; later ones send the request in the SYN
+    OVERLAPPED overlapped = {};
+    DWORD flags;
+    if ((!connectEx(socket, (SOCKADDR *)&serverAddress, sizeof(serverAddress),
+                    const_cast<int64_t *>(&keepAliveRequest), sizeof(keepAliveRequest), &bytes, &overlapped) &&
+         WSAGetLastError() != ERROR_IO_PENDING) ||
+        !WSAGetOverlappedResult(socket, &overlapped, &bytes, TRUE, &flags) || bytes != sizeof(keepAliveRequest))
+    {
+        return false;
+    }
+
+    // Lets shutdown and getpeername work on the socket as after connect
+    setsockopt(socket, SOL_SOCKET, SO_UPDATE_CONNECT_CONTEXT, nullptr, 0);
+    return true;
+}
+
+bool ConnectionPool::alive(SOCKET socket)
+{
+    WSAPOLLFD pollFd = {socket, POLLRDNORM, 0};
+    return WSAPoll(&pollFd, 1, 0) == 0;
+}
+
+// Starts every client at once so the server has all uploads in flight together
+void runThroughputBenchmark(const std::string &ipAddress, unsigned short port, const std::string &filePath,
+                            const std::vector<size_t> &clientCounts)
+{
+    std::ifstream file(filePath, std::ios::binary | std::ios::ate);
+    if (!file)
+    {
+        std::cerr << "Error opening file: " << filePath << std::endl;
+        return;
+    }
+    int64_t fileSize = file.tellg();
+    file.close();
+
+    std::cout << "clients, uploads ok, MB, seconds, MB/s" << std::endl;
+
+    for (size_t clientCount : clientCounts)
+    {
+        std::atomic<size_t> succeeded(0);
+        std::vector<std::thread> threads;
+        threads.reserve(clientCount);
+
+        auto start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < clientCount; ++i)
+        {
+            threads.emplace_back([&]()
+                                 {
+                TCPClient client(ipAddress, port);
+                if (client.connectToServer())
+                {
+                    if (client.sendFile(filePath))
+                    {
+                        ++succeeded;
+                    }
+                    client.closeConnection();
+                } });
+        }
+        for (auto &thread : threads)
+        {
+            thread.join();
+        }
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+        double megabytes = static_cast<double>(fileSize) * succeeded / (1024.0 * 1024.0);
+        std::cout << clientCount << ", " << succeeded << ", " << megabytes << ", " << elapsed.count() << ", "
+                  << megabytes / elapsed.count() << std::endl;
+    }
+}
+
+void runStressTest(const std::string &ipAddress, unsigned short port, const std::string &filePath,
+                   size_t clientCount)
+{
+    std::ifstream file(filePath, std::ios::binary);
+    if (!file)
+    {
+        std::cerr << "Error opening file: " << filePath << std::endl;
+        return;
+    }
+    std::vector<char> body((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    int64_t fileSize = static_cast<int64_t>(body.size());
+    size_t headSize = std::min<size_t>(body.size(), 64 * 1024);
+
+    WSADATA wsaData;
+    if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0)
+    {
+        return;
+    }
+    sockaddr_in serverAddress;
+    serverAddress.sin_family = AF_INET;
+    serverAddress.sin_port = htons(port);
+    inet_pton(AF_INET, ipAddress.c_str(), &serverAddress.sin_addr);
+
+    std::mutex mutex;
+    std::condition_variable allHeld;
+    size_t held = 0;
+    std::atomic<size_t> succeeded(0);
+    std::vector<std::thread> threads;
+    threads.reserve(clientCount);
+
+    auto sendAll = [](SOCKET socket, const char *data, size_t size)
+    {
+        while (size > 0)
+        {
+            int sent = send(socket, data, static_cast<int>(std::min<size_t>(size, 1 << 20)), 0);
+            if (sent == SOCKET_ERROR)
+            {
+                return false;
+            }
+            data += sent;
+            size -= sent;
+        }
+        return true;
+    };
+
+    std::cout << "clients, uploads ok, seconds" << std::endl;
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < clientCount; ++i)
+    {
+        threads.emplace_back([&]()
+                             {
+            SOCKET connectSocket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+            bool sent = connectSocket != INVALID_SOCKET &&
+                        connect(connectSocket, (SOCKADDR *)&serverAddress, sizeof(serverAddress)) != SOCKET_ERROR &&
+                        sendAll(connectSocket, reinterpret_cast<const char *>(&fileSize), sizeof(fileSize)) &&
+                        sendAll(connectSocket, body.data(), headSize);
+
+            // A client that failed still counts, so the others are not held for it; a server that
+            // admits none of them holds everyone until the timeout
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                ++held;
+                allHeld.notify_all();
+                allHeld.wait_for(lock, std::chrono::seconds(30), [&]() { return held == clientCount; });
+            }
+
+            char response[256];
+            int responseSize = 0;
+            if (sent && sendAll(connectSocket, body.data() + headSize, body.size() - headSize))
+            {
+                responseSize = recv(connectSocket, response, sizeof(response), 0);
+            }
+            if (responseSize > 0 && std::string(response, responseSize).rfind("File received", 0) == 0)
+            {
+                ++succeeded;
+            }
+            closesocket(connectSocket); });
+    }
+    for (auto &thread : threads)
+    {
+        thread.join();
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    std::cout << clientCount << ", " << succeeded << ", " << elapsed.count() << std::endl;
+    WSACleanup();
+}
+
+void runSessionBenchmark(const std::string &ipAddress, unsigned short port, const std::string &filePath,
+                         size_t uploadCount)
+{
+    std::ifstream file(filePath, std::ios::binary | std::ios::ate);
+    if (!file)
+    {
+        std::cerr << "Error opening file: " << filePath << std::endl;
+        return;
+    }
+    double megabytes = static_cast<double>(file.tellg()) * uploadCount / (1024.0 * 1024.0);
+    file.close();
+
+    std::cout << "mode, uploads, seconds, uploads/s, MB/s" << std::endl;
+    auto report = [&](const char *mode, std::chrono::steady_clock::time_point start)
+    {
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        std::cout << mode << ", " << uploadCount << ", " << elapsed.count() << ", " << uploadCount / elapsed.count()
+                  << ", " << megabytes / elapsed.count() << std::endl;
+    };
+
+    TCPClient client(ipAddress, port);
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < uploadCount; ++i)
+    {
+        if (!client.connectToServer())
+        {
+            return;
+        }
+        bool sent = client.sendFile(filePath);
+        client.closeConnection();
+        if (!sent)
+        {
+            return;
+        }
+    }
+    report("connection per file", start);
+
+    // The same uploads one after another over one session, then four at a time
+    std::vector<std::string> filePaths(uploadCount, filePath);
+    for (size_t interleave : {1, 4})
+    {
+        start = std::chrono::steady_clock::now();
+        if (!client.connectToServer())
+        {
+            return;
+        }
+        bool sent = client.openSession() && client.sendFiles(filePaths, interleave);
+        client.closeConnection();
+        if (!sent)
+        {
+            return;
+        }
+        report(interleave == 1 ? "session" : "session, 4 interleaved", start);
+    }
+}
+
+void runParallelBenchmark(const std::string &ipAddress, unsigned short port, const std::string &filePath,
+                          const std::vector<size_t> &streamCounts)
+{
+    std::ifstream file(filePath, std::ios::binary | std::ios::ate);
+    if (!file)
+    {
+        std::cerr << "Error opening file: " << filePath << std::endl;
+        return;
+    }
+    int64_t fileSize = file.tellg();
+    file.close();
+
+    std::cout << "streams, upload ok, MB, seconds, MB/s" << std::endl;
+
+    for (size_t streamCount : streamCounts)
+    {
+        TCPClient client(ipAddress, port);
+        bool succeeded = false;
+        auto start = std::chrono::steady_clock::now();
+        if (client.connectToServer())
+        {
+            succeeded = client.sendFileParallel(filePath, streamCount) && client.lastResponse() == "File received";
+            client.closeConnection();
+        }
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+        double megabytes = static_cast<double>(fileSize) / (1024.0 * 1024.0);
+        std::cout << streamCount << ", " << (succeeded ? "yes" : "no") << ", " << megabytes << ", "
+                  << elapsed.count() << ", " << megabytes / elapsed.count() << std::endl;
+    }
+}
+
+// Kernel plus user time of the whole process, in seconds
+static double cpuSeconds()
+{
+    FILETIME creationTime, exitTime, kernelTime, userTime;
+    GetProcessTimes(GetCurrentProcess(), &creationTime, &exitTime, &kernelTime, &userTime);
+    // FILETIME counts 100 ns units
+    auto toSeconds = [](const FILETIME &time)
+    { return ((static_cast<uint64_t>(time.dwHighDateTime) << 32) | time.dwLowDateTime) / 1e7; };
+    return toSeconds(kernelTime) + toSeconds(userTime);
+}
+
+void runSendBenchmark(const std::string &ipAddress, unsigned short port, const std::string &filePath,
+                      size_t uploadCount)
+{
+    std::ifstream file(filePath, std::ios::binary | std::ios::ate);
+    if (!file)
+    {
+        std::cerr << "Error opening file: " << filePath << std::endl;
+        return;
+    }
+    double megabytes = static_cast<double>(file.tellg()) * uploadCount / (1024.0 * 1024.0);
+    file.close();
+
+    std::cout << "path, uploads, MB, seconds, MB/s, CPU s per GB" << std::endl;
+    TCPClient client(ipAddress, port);
+    for (bool zeroCopy : {false, true})
+    {
+        client.setZeroCopy(zeroCopy);
+        double cpuStart = cpuSeconds();
+        auto start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < uploadCount; ++i)
+        {
+            if (!client.connectToServer())
+            {
+                return;
+            }
+            bool sent = client.sendFile(filePath);
+            client.closeConnection();
+            if (!sent)
+            {
+                return;
+            }
+        }
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        double cpu = cpuSeconds() - cpuStart;
+        std::cout << (zeroCopy ? "zero-copy" : "buffered") << ", " << uploadCount << ", " << megabytes << ", "
+                  << elapsed.count() << ", " << megabytes / elapsed.count() << ", " << cpu / (megabytes / 1024.0)
+                  << std::endl;
+    }
+}
+
+void runPoolBenchmark(const std::string &ipAddress, unsigned short port, const std::string &filePath,
+                      size_t uploadCount)
+{
+    // Store the file once, so every offer below is answered AlreadyStored
+    TCPClient client(ipAddress, port);
+    if (!client.connectToServer())
+    {
+        return;
+    }
+    bool stored = client.sendFile(filePath);
+    client.closeConnection();
+    if (!stored)
+    {
+        return;
+    }
+
+    std::cout << "connections, request, uploads, mean ms, p50 ms, p99 ms" << std::endl;
+    ConnectionPool pool(ipAddress, port, 1);
+    for (bool pooled : {false, true})
+    {
+        client.setConnectionPool(pooled ? &pool : nullptr);
+        for (bool offered : {true, false})
+        {
+            std::vector<double> milliseconds;
+            for (size_t i = 0; i < uploadCount; ++i)
+            {
+                // Timed from before the connect, which the pool has usually done already
+                auto start = std::chrono::steady_clock::now();
+                if (!client.connectToServer())
+                {
+                    return;
+                }
+                bool sent = offered ? client.sendFileOffered(filePath) : client.sendFile(filePath);
+                std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+                client.closeConnection();
+                if (!sent)
+                {
+                    return;
+                }
+                milliseconds.push_back(elapsed.count());
+
+                // Between uploads, as the interactive client does while waiting for Enter
+                if (pooled)
+                {
+                    pool.warm();
+                }
+            }
+
+            std::sort(milliseconds.begin(), milliseconds.end());
+            double mean = 0;
+            for (double value : milliseconds)
+            {
+                mean += value / milliseconds.size();
+            }
+            std::cout << (pooled ? "pooled" : "new") << ", " << (offered ? "offer (TTFB)" : "plain upload") << ", "
+                      << uploadCount << ", " << mean << ", " << milliseconds[milliseconds.size() / 2] << ", "
+                      << milliseconds[milliseconds.size() * 99 / 100] << std::endl;
+        }
+    }
+}
+
+void runChunkBenchmark(const std::string &ipAddress, unsigned short port, const std::string &filePath,
+                       size_t uploadCount)
+{
+    std::ifstream file(filePath, std::ios::binary | std::ios::ate);
+    if (!file)
+    {
+        std::cerr << "Error opening file: " << filePath << std::endl;
+        return;
+    }
+    double megabytes = static_cast<double>(file.tellg()) * uploadCount / (1024.0 * 1024.0);
+    file.close();
+
+    // Fixed sizes first, then the sizer over its default bounds; 0 stands for adaptive
+    const size_t chunkSizes[] = {4 * 1024, 16 * 1024, 64 * 1024, 256 * 1024, 1024 * 1024, 0};
+    std::cout << "chunk KB, uploads, MB, seconds, MB/s, CPU s per GB, calls per MB, final chunk KB" << std::endl;
+    for (size_t chunkSize : chunkSizes)
+    {
+        TCPClient client(ipAddress, port);
+        client.setZeroCopy(false);
+        if (chunkSize != 0)
+        {
+            client.setChunkBounds(chunkSize, chunkSize);
+        }
+        double cpuStart = cpuSeconds();
+        auto start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < uploadCount; ++i)
+        {
+            if (!client.connectToServer())
+            {
+                return;
+            }
+            bool sent = client.sendFile(filePath);
+            client.closeConnection();
+            if (!sent)
+            {
+                return;
+            }
+        }
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        double cpu = cpuSeconds() - cpuStart;
+        const ChunkSizer &sizer = client.chunkSizer();
+        std::cout << (chunkSize != 0 ? std::to_string(chunkSize / 1024) : std::string("adaptive")) << ", "
+                  << uploadCount << ", " << megabytes << ", " << elapsed.count() << ", "
+                  << megabytes / elapsed.count() << ", " << cpu / (megabytes / 1024.0) << ", "
+                  << sizer.calls() / megabytes << ", " << sizer.size() / 1024 << std::endl;
+    }
+}
+
+DirectoryWatcher::~DirectoryWatcher()
+{
+    for (auto &watch : watches_)
+    {
+        CancelIoEx(watch->handle, &watch->overlapped);
+        DWORD bytes;
+        GetOverlappedResult(watch->handle, &watch->overlapped, &bytes, TRUE);
+        CloseHandle(watch->overlapped.hEvent);
+        CloseHandle(watch->handle);
+    }
+}
+
+bool DirectoryWatcher::add(const std::string &directoryPath)
+{
+    auto watch = std::make_unique<Watch>();
+    watch->path = directoryPath;
+    watch->handle = CreateFileA(directoryPath.c_str(), FILE_LIST_DIRECTORY,
+                                FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING,
+                                FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OVERLAPPED, nullptr);
+    if (watch->handle == INVALID_HANDLE_VALUE)
+    {
+        std::cerr << "Error opening directory: " << directoryPath << " (" << GetLastError() << ")" << std::endl;
+        return false;
+    }
+    watch->overlapped = {};
+    watch->overlapped.hEvent = CreateEventA(nullptr, TRUE, FALSE, nullptr);
+    watch->buffer.resize(16 * 1024);
+    if (!arm(*watch))
+    {
+        CloseHandle(watch->overlapped.hEvent);
+        CloseHandle(watch->handle);
+        return false;
+    }
+    watches_.push_back(std::move(watch));
+    return true;
+}
+
+bool DirectoryWatcher::arm(Watch &watch)
+{
+    ResetEvent(watch.overlapped.hEvent);
+    if (!ReadDirectoryChangesW(watch.handle, watch.buffer.data(),
+                               static_cast<DWORD>(watch.buffer.size() * sizeof(DWORD)), TRUE,
+                               FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_SIZE | FILE_NOTIFY_CHANGE_LAST_WRITE,
+                               nullptr, &watch.overlapped, nullptr))
+    {
+        std::cerr << "Error watching directory: " << watch.path << " (" << GetLastError() << ")" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool DirectoryWatcher::wait(DWORD timeoutMs, const std::function<void(size_t, const std::string &)> &changed,
+                            const std::function<void(size_t)> &overflowed)
+{
+    std::vector<HANDLE> events;
+    for (auto &watch : watches_)
+    {
+        events.push_back(watch->overlapped.hEvent);
+    }
+    DWORD result = WaitForMultipleObjects(static_cast<DWORD>(events.size()), events.data(), FALSE, timeoutMs);
+    if (result == WAIT_TIMEOUT)
+    {
+        return true;
+    }
+    if (result >= WAIT_OBJECT_0 + events.size())
+    {
+        std::cerr << "Error waiting for directory changes: " << GetLastError() << std::endl;
+        return false;
+    }
+
+    // Every directory with changes ready, not just the first one signalled
+    for (size_t index = 0; index < watches_.size(); ++index)
+    {
+        Watch &watch = *watches_[index];
+        DWORD bytes = 0;
+        if (!GetOverlappedResult(watch.handle, &watch.overlapped, &bytes, FALSE))
+        {
+            if (GetLastError() == ERROR_IO_INCOMPLETE)
+            {
+                continue;
+            }
+            std::cerr << "Error reading directory changes: " << watch.path << " (" << GetLastError() << ")"
+                      << std::endl;
+            return false;
+        }
+
+        // An empty result means the changes overflowed the buffer and were dropped
+        if (bytes == 0)
+        {
+            overflowed(index);
+        }
+        const char *record = reinterpret_cast<const char *>(watch.buffer.data());
+        while (bytes > 0)
+        {
+            const FILE_NOTIFY_INFORMATION &information = *reinterpret_cast<const FILE_NOTIFY_INFORMATION *>(record);
+            if (information.Action == FILE_ACTION_ADDED || information.Action == FILE_ACTION_MODIFIED ||
+                information.Action == FILE_ACTION_RENAMED_NEW_NAME)
+            {
+                int wideLength = static_cast<int>(information.FileNameLength / sizeof(WCHAR));
+                int length = WideCharToMultiByte(CP_UTF8, 0, information.FileName, wideLength, nullptr, 0, nullptr,
+                                                 nullptr);
+                std::string name(length, '\0');
+                WideCharToMultiByte(CP_UTF8, 0, information.FileName, wideLength, &name[0], length, nullptr, nullptr);
+                std::replace(name.begin(), name.end(), '\\', '/');
+                changed(index, name);
+            }
+            if (information.NextEntryOffset == 0)
+            {
+                break;
+            }
+            record += information.NextEntryOffset;
+        }
+
+        if (!arm(watch))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+void runWatchAgent(const std::string &ipAddress, unsigned short port, const std::vector<std::string> &directories,
+                   ChangeCache &cache)
+{
+    // A burst of writes is over once the files have been quiet this long; a file written without
+    // pause is still sent this long after its first change
+    const auto quietPeriod = std::chrono::milliseconds(300);
+    const auto maxDelay = std::chrono::seconds(2);
+    const auto retryDelay = std::chrono::seconds(5);
+
+    DirectoryWatcher watcher;
+    for (const std::string &directory : directories)
+    {
+        if (!watcher.add(directory))
+        {
+            return;
+        }
+    }
+
+    // Changed names per directory, a set so repeated saves of a file coalesce into one upload.
+    // A directory whose events overflowed is sent whole
+    std::vector<std::set<std::string>> pending(watcher.size());
+    std::vector<bool> rescan(watcher.size(), true);
+    auto firstChange = std::chrono::steady_clock::now();
+    auto lastChange = firstChange - quietPeriod;
+    auto retryAt = firstChange;
+    bool anyPending = true;
+
+    TCPClient client(ipAddress, port);
+    client.setChangeCache(&cache);
+    while (!interrupted)
+    {
+        auto now = std::chrono::steady_clock::now();
+        auto due = std::max(std::min(lastChange + quietPeriod, firstChange + maxDelay), retryAt);
+        if (anyPending && now >= due)
+        {
+            // One session per burst; the manifest keeps files whose content the server has off the wire
+            size_t filesSent = 0, directoriesSent = 0;
+            if (client.connectToServer() && client.openSession())
+            {
+                for (size_t index = 0; index < watcher.size(); ++index)
+                {
+                    size_t sent = 0;
+                    std::vector<std::string> names(pending[index].begin(), pending[index].end());
+                    bool stored = rescan[index] ? client.sendDirectory(watcher.directory(index), sent)
+                                                : names.empty() || client.sendManifest(watcher.directory(index), names, sent);
+                    if (!stored)
+                    {
+                        break;
+                    }
+                    pending[index].clear();
+                    rescan[index] = false;
+                    filesSent += sent;
+                    ++directoriesSent;
+                }
+            }
+            client.closeConnection();
+            cache.save();
+
+            std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - lastChange;
+            if (directoriesSent == watcher.size())
+            {
+                anyPending = false;
+                if (filesSent > 0)
+                {
+                    std::cout << "Backed up " << filesSent << " files, " << elapsed.count()
+                              << " ms after the last change: " << client.lastResponse() << std::endl;
+                }
+            }
+            else
+            {
+                // Whatever was not stored stays pending; a file still locked by its editor is retried too
+                std::cerr << "Backup failed, retrying in " << retryDelay.count() << " s" << std::endl;
+                retryAt = std::chrono::steady_clock::now() + retryDelay;
+            }
+            continue;
+        }
+
+        // Sleep until the pending burst is due, or until the system reports a change
+        DWORD timeoutMs = 1000;
+        if (anyPending)
+        {
+            timeoutMs = static_cast<DWORD>(std::chrono::duration_cast<std::chrono::milliseconds>(due - now).count()) + 1;
+        }
+        bool watching = watcher.wait(
+            timeoutMs,
+            [&](size_t index, const std::string &name)
+            {
+                auto changedAt = std::chrono::steady_clock::now();
+                if (!anyPending)
+                {
+                    firstChange = changedAt;
+                    anyPending = true;
+                }
+                lastChange = changedAt;
+                pending[index].insert(name);
+            },
+            [&](size_t index)
+            {
+                rescan[index] = true;
+                lastChange = std::chrono::steady_clock::now();
+                if (!anyPending)
+                {
+                    firstChange = lastChange;
+                    anyPending = true;
+                }
+            });
+        if (!watching)
+        {
+            return;
+        }
+    }
+}
+
+// Slicing-by-8 tables of the reflected polynomial 0x82F63B78: entry [k][b] is the CRC of byte b
+// followed by k zero bytes
+static const std::array<std::array<uint32_t, 256>, 8> &crc32cTables()
+{
+    static const std::array<std::array<uint32_t, 256>, 8> tables = []()
+    {
+        std::array<std::array<uint32_t, 256>, 8> entries;
+        for (uint32_t i = 0; i < 256; ++i)
+        {
+            uint32_t entry = i;
+            for (int bit = 0; bit < 8; ++bit)
+            {
+                entry = (entry >> 1) ^ (entry & 1 ? 0x82F63B78u : 0);
+            }
+            entries[0][i] = entry;
+        }
+        for (size_t k = 1; k < 8; ++k)
+        {
+            for (uint32_t i = 0; i < 256; ++i)
+            {
+                entries[k][i] = (entries[k - 1][i] >> 8) ^ entries[0][entries[k - 1][i] & 0xFF];
+            }
+        }
+        return entries;
+    }();
+    return tables;
+}
+
+// Portable kernel, eight bytes per step
+static uint32_t crc32cSoftware(uint32_t crc, const char *data, size_t size)
+{
+    const auto &tables = crc32cTables();
+    crc = ~crc;
+    while (size >= 8)
+    {
+        uint64_t word;
+        std::memcpy(&word, data, sizeof(word));
+        word ^= crc;
+        crc = tables[7][word & 0xFF] ^ tables[6][(word >> 8) & 0xFF] ^ tables[5][(word >> 16) & 0xFF] ^
+              tables[4][(word >> 24) & 0xFF] ^ tables[3][(word >> 32) & 0xFF] ^ tables[2][(word >> 40) & 0xFF] ^
+              tables[1][(word >> 48) & 0xFF] ^ tables[0][word >> 56];
+        data += 8;
+        size -= 8;
+    }
+    while (size-- > 0)
+    {
+        crc = tables[0][(crc ^ static_cast<uint8_t>(*data++)) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+#ifdef CRC32C_HARDWARE
+// SSE4.2 crc32 instruction, eight bytes per instruction
+#ifndef _MSC_VER
+__attribute__((target("sse4.2")))
+#endif
+static uint32_t crc32cHardware(uint32_t crc, const char *data, size_t size)
+{
+    uint64_t state = ~crc;
+    while (size >= 8)
+    {
+        uint64_t word;
+        std::memcpy(&word, data, sizeof(word));
+        state = _mm_crc32_u64(state, word);
+        data += 8;
+        size -= 8;
+    }
+    crc = static_cast<uint32_t>(state);
+    while (size-- > 0)
+    {
+        crc = _mm_crc32_u8(crc, static_cast<uint8_t>(*data++));
+    }
+    return ~crc;
+}
+
+static bool cpuHasCrc32c()
+{
+#ifdef _MSC_VER
+    int registers[4];
+    __cpuid(registers, 1);
+    return (registers[2] & (1 << 20)) != 0;
+#else
+    unsigned int eax, ebx, ecx, edx;
+    return __get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & bit_SSE4_2) != 0;
+#endif
+}
+#endif
+
+static uint32_t crc32c(uint32_t crc, const char *data, size_t size)
+{
+#ifdef CRC32C_HARDWARE
+    static const bool hardware = cpuHasCrc32c();
+    if (hardware)
+    {
+        return crc32cHardware(crc, data, size);
+    }
+#endif
+    return crc32cSoftware(crc, data, size);
+}
+
+void runHashBenchmark(size_t megabytes)
+{
+    std::vector<char> data(megabytes << 20);
+    std::mt19937_64 random(1);
+    for (size_t i = 0; i + sizeof(uint64_t) <= data.size(); i += sizeof(uint64_t))
+    {
+        uint64_t word = random();
+        std::memcpy(&data[i], &word, sizeof(word));
+    }
+
+    std::cout << "kernel, GB/s, checksum" << std::endl;
+    auto measure = [&](const char *kernel, const std::function<uint32_t()> &hash)
+    {
+        // Best of three, so a page fault or a preempted run does not count
+        double best = 0;
+        uint32_t checksum = 0;
+        for (int run = 0; run < 3; ++run)
+        {
+            auto start = std::chrono::steady_clock::now();
+            checksum = hash();
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+            best = std::max(best, data.size() / elapsed.count() / 1e9);
+        }
+        std::cout << kernel << ", " << best << ", " << std::hex << checksum << std::dec << std::endl;
+    };
+
+#ifdef CRC32C_HARDWARE
+    if (cpuHasCrc32c())
+    {
+        measure("crc32c sse4.2", [&]() { return crc32cHardware(0, data.data(), data.size()); });
+    }
+#endif
+    measure("crc32c slicing-by-8", [&]() { return crc32cSoftware(0, data.data(), data.size()); });
+    measure("sha-256", [&]()
+            {
+        Sha256 sha;
+        sha.update(data.data(), data.size());
+        uint32_t prefix;
+        std::memcpy(&prefix, sha.digest().data(), sizeof(prefix));
+        return prefix; });
+}
+
+Sha256::Sha256()
+    : state_{0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19}
+{
+}
+
+void Sha256::update(const char *data, size_t size)
+{
+    totalSize_ += size;
+    while (size > 0)
+    {
+        size_t take = std::min(size, sizeof(block_) - blockSize_);
+        std::memcpy(block_ + blockSize_, data, take);
+        blockSize_ += take;
+        data += take;
+        size -= take;
+        if (blockSize_ == sizeof(block_))
+        {
+            processBlock(block_);
+            blockSize_ = 0;
+        }
+    }
+}
+
+std::string Sha256::digest()
+{
+    // Padding: a 1 bit, zeros, then the message length in bits, big-endian
+    uint64_t bitLength = totalSize_ * 8;
+    const char one = static_cast<char>(0x80);
+    const char zero = 0;
+    update(&one, 1);
+    while (blockSize_ != 56)
+    {
+        update(&zero, 1);
+    }
+    char length[8];
+    for (int i = 0; i < 8; ++i)
+    {
+        length[i] = static_cast<char>(bitLength >> (56 - 8 * i));
+    }
+    update(length, 8);
+
+    std::string digest;
+    for (uint32_t word : state_)
+    {
+        for (int shift = 24; shift >= 0; shift -= 8)
+        {
+            digest += static_cast<char>(word >> shift);
+        }
+    }
+    return digest;
+}
+
+std::string Sha256::hexDigest()
+{
+    std::ostringstream hex;
+    for (unsigned char byte : digest())
+    {
+        hex << std::hex << std::setw(2) << std::setfill('0') << static_cast<int>(byte);
+    }
+    return hex.str();
+}
+
+void Sha256::processBlock(const uint8_t *block)
+{
+    static const uint32_t k[64] = {
+        0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+        0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+        0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+        0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+        0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+        0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+        0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+        0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+    auto rotate = [](uint32_t value, int bits)
+    { return (value >> bits) | (value << (32 - bits)); };
+
+    uint32_t w[64];
+    for (int i = 0; i < 16; ++i)
+    {
+        w[i] = (uint32_t(block[4 * i]) << 24) | (uint32_t(block[4 * i + 1]) << 16) | (uint32_t(block[4 * i + 2]) << 8) |
+               uint32_t(block[4 * i + 3]);
+    }
+    for (int i = 16; i < 64; ++i)
+    {
+        uint32_t s0 = rotate(w[i - 15], 7) ^ rotate(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = rotate(w[i - 2], 17) ^ rotate(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    uint32_t a = state_[0], b = state_[1], c = state_[2], d = state_[3];
+    uint32_t e = state_[4], f = state_[5], g = state_[6], h = state_[7];
+    for (int i = 0; i < 64; ++i)
+    {
+        uint32_t s1 = rotate(e, 6) ^ rotate(e, 11) ^ rotate(e, 25);
+        uint32_t choice = (e & f) ^ (~e & g);
+        uint32_t temp1 = h + s1 + choice + k[i] + w[i];
+        uint32_t s0 = rotate(a, 2) ^ rotate(a, 13) ^ rotate(a, 22);
+        uint32_t majority = (a & b) ^ (a & c) ^ (b & c);
+        uint32_t temp2 = s0 + majority;
+        h = g;
+        g = f;
+        f = e;
+        e = d + temp1;
+        d = c;
+        c = b;
+        b = a;
+        a = temp1 + temp2;
+    }
+    state_[0] += a;
+    state_[1] += b;
+    state_[2] += c;
+    state_[3] += d;
+    state_[4] += e;
+    state_[5] += f;
+    state_[6] += g;
+    state_[7] += h;
+}
+
+// LZ4-style greedy LZ77, the generic baseline of the codec benchmark: a token with 4-bit literal
+// and match lengths (255-byte extensions), the literals, then a 16-bit match offset
+static std::string lzCompress(const char *data, size_t size)
+{
+    std::string out;
+    std::vector<int64_t> table(1 << 16, -1);
+    auto writeLength = [&](size_t length)
+    {
+        for (; length >= 255; length -= 255)
+        {
+            out += static_cast<char>(255);
+        }
+        out += static_cast<char>(length);
+    };
+
+    size_t anchor = 0;
+    size_t i = 0;
+    while (i + 4 <= size)
+    {
+        uint32_t sequence;
+        std::memcpy(&sequence, data + i, sizeof(sequence));
+        uint32_t hash = (sequence * 2654435761u) >> 16;
+        int64_t candidate = table[hash];
+        table[hash] = static_cast<int64_t>(i);
+        if (candidate < 0 || i - candidate > 65535 || std::memcmp(data + candidate, data + i, 4) != 0)
+        {
+            ++i;
+            continue;
+        }
+
+        size_t matchLength = 4;
+        while (i + matchLength < size && data[candidate + matchLength] == data[i + matchLength])
+        {
+            ++matchLength;
+        }
+        size_t literalLength = i - anchor;
+        size_t extraMatch = matchLength - 4;
+        out += static_cast<char>((std::min<size_t>(literalLength, 15) << 4) | std::min<size_t>(extraMatch, 15));
+        if (literalLength >= 15)
+        {
+            writeLength(literalLength - 15);
+        }
+        out.append(data + anchor, literalLength);
+        uint16_t offset = static_cast<uint16_t>(i - candidate);
+        out.append(reinterpret_cast<const char *>(&offset), sizeof(offset));
+        if (extraMatch >= 15)
+        {
+            writeLength(extraMatch - 15);
+        }
+        i += matchLength;
+        anchor = i;
+    }
+
+    // The last token carries only literals; the end of input marks it
+    size_t literalLength = size - anchor;
+    out += static_cast<char>(std::min<size_t>(literalLength, 15) << 4);
+    if (literalLength >= 15)
+    {
+        writeLength(literalLength - 15);
+    }
+    out.append(data + anchor, literalLength);
+    return out;
+}
+
+static std::string lzDecompress(const std::string &in)
+{
+    std::string out;
+    size_t position = 0;
+    auto readLength = [&](size_t length)
+    {
+        if (length == 15)
+        {
+            uint8_t extra;
+            do
+            {
+                extra = static_cast<uint8_t>(in[position++]);
+                length += extra;
+            } while (extra == 255);
+        }
+        return length;
+    };
+
+    while (position < in.size())
+    {
+        uint8_t token = static_cast<uint8_t>(in[position++]);
+        size_t literalLength = readLength(token >> 4);
+        out.append(in, position, literalLength);
+        position += literalLength;
+        if (position >= in.size())
+        {
+            break;
+        }
+
+        uint16_t offset;
+        std::memcpy(&offset, &in[position], sizeof(offset));
+        position += sizeof(offset);
+        size_t matchLength = readLength(token & 15) + 4;
+        size_t from = out.size() - offset;
+        for (size_t i = 0; i < matchLength; ++i)
+        {
+            out += out[from + i];
+        }
+    }
+    return out;
+}
+
+void runCodecBenchmark(const std::string &filePath)
+{
+    std::ifstream file(filePath, std::ios::binary);
+    if (!file)
+    {
+        std::cerr << "Error opening file: " << filePath << std::endl;
+        return;
+    }
+    std::string data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    double megabytes = data.size() / (1024.0 * 1024.0);
+
+    // Both codecs get the same 1 MB line-aligned blocks
+    std::vector<std::pair<size_t, size_t>> blocks;
+    for (size_t start = 0; start < data.size();)
+    {
+        size_t end = std::min(start + GcodeCodec::blockSize, data.size());
+        size_t lineEnd = data.rfind('\n', end - 1);
+        if (end < data.size() && lineEnd != std::string::npos && lineEnd >= start)
+        {
+            end = lineEnd + 1;
+        }
+        blocks.push_back({start, end - start});
+        start = end;
+    }
+
+    auto seconds = [](std::chrono::steady_clock::time_point start)
+    { return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count(); };
+
+    // G-code codec
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::string> encoded;
+    size_t gcodeBytes = 0;
+    for (const auto &block : blocks)
+    {
+        encoded.push_back(GcodeCodec::encodeBlock(data.data() + block.first, block.second));
+        gcodeBytes += encoded.back().size();
+    }
+    double gcodeEncode = seconds(start);
+
+    start = std::chrono::steady_clock::now();
+    std::string decoded;
+    bool gcodeOk = true;
+    for (size_t i = 0; i < blocks.size(); ++i)
+    {
+        const size_t headerSize = 2 * sizeof(uint32_t);
+        gcodeOk = gcodeOk && GcodeCodec::decodeBlock(encoded[i].data() + headerSize, encoded[i].size() - headerSize,
+                                                     blocks[i].second, decoded);
+    }
+    double gcodeDecode = seconds(start);
+    gcodeOk = gcodeOk && decoded == data;
+
+    // Generic LZ
+    start = std::chrono::steady_clock::now();
+    std::vector<std::string> compressed;
+    size_t lzBytes = 0;
+    for (const auto &block : blocks)
+    {
+        compressed.push_back(lzCompress(data.data() + block.first, block.second));
+        lzBytes += compressed.back().size();
+    }
+    double lzEncode = seconds(start);
+
+    start = std::chrono::steady_clock::now();
+    std::string decompressed;
+    for (const auto &block : compressed)
+    {
+        decompressed += lzDecompress(block);
+    }
+    double lzDecode = seconds(start);
+    bool lzOk = decompressed == data;
+
+    std::cout << filePath << ": " << data.size() << " bytes" << std::endl;
+    std::cout << "codec, ratio, compress MB/s, decompress MB/s, round trip" << std::endl;
+    std::cout << "gcode, " << static_cast<double>(data.size()) / gcodeBytes << ", " << megabytes / gcodeEncode << ", "
+              << megabytes / gcodeDecode << ", " << (gcodeOk ? "ok" : "MISMATCH") << std::endl;
+    std::cout << "lz, " << static_cast<double>(data.size()) / lzBytes << ", " << megabytes / lzEncode << ", "
+              << megabytes / lzDecode << ", " << (lzOk ? "ok" : "MISMATCH") << std::endl;
+}
+
+void RangeEncoder::encodeBit(uint16_t &probability, int bit)
+{
+    uint32_t bound = (range_ >> 11) * probability;
+    if (bit == 0)
+    {
+        range_ = bound;
+        probability += (2048 - probability) >> 5;
+    }
+    else
+    {
+        low_ += bound;
+        range_ -= bound;
+        probability -= probability >> 5;
+    }
+    while (range_ < (1u << 24))
+    {
+        range_ <<= 8;
+        shiftLow();
+    }
+}
+
+void RangeEncoder::encodeTree(uint16_t *probabilities, int bitCount, uint32_t value)
+{
+    uint32_t node = 1;
+    for (int i = bitCount - 1; i >= 0; --i)
+    {
+        int bit = (value >> i) & 1;
+        encodeBit(probabilities[node], bit);
+        node = (node << 1) | bit;
+    }
+}
+
+void RangeEncoder::encodeDirect(uint64_t value, int bitCount)
+{
+    for (int i = bitCount - 1; i >= 0; --i)
+    {
+        range_ >>= 1;
+        if ((value >> i) & 1)
+        {
+            low_ += range_;
+        }
+        while (range_ < (1u << 24))
+        {
+            range_ <<= 8;
+            shiftLow();
+        }
+    }
+}
+
+void RangeEncoder::shiftLow()
+{
+    // Hold back 0xFF bytes until it is known whether a carry will ripple into them
+    if (static_cast<uint32_t>(low_) < 0xFF000000u || (low_ >> 32) != 0)
+    {
+        uint8_t carry = static_cast<uint8_t>(low_ >> 32);
+        uint8_t pending = cache_;
+        do
+        {
+            out_ += static_cast<char>(pending + carry);
+            pending = 0xFF;
+        } while (--cacheSize_ != 0);
+        cache_ = static_cast<uint8_t>(low_ >> 24);
+    }
+    ++cacheSize_;
+    low_ = (low_ & 0x00FFFFFF) << 8;
+}
+
+std::string RangeEncoder::finish()
+{
+    for (int i = 0; i < 5; ++i)
+    {
+        shiftLow();
+    }
+    return std::move(out_);
+}
+
+RangeDecoder::RangeDecoder(const char *data, size_t size) : data_(data), size_(size)
+{
+    for (int i = 0; i < 5; ++i)
+    {
+        code_ = (code_ << 8) | nextByte();
+    }
+}
+
+uint8_t RangeDecoder::nextByte()
+{
+    if (position_ >= size_)
+    {
+        overrun_ = true;
+        return 0;
+    }
+    return static_cast<uint8_t>(data_[position_++]);
+}
+
+int RangeDecoder::decodeBit(uint16_t &probability)
+{
+    uint32_t bound = (range_ >> 11) * probability;
+    int bit;
+    if (code_ < bound)
+    {
+        range_ = bound;
+        probability += (2048 - probability) >> 5;
+        bit = 0;
+    }
+    else
+    {
+        code_ -= bound;
+        range_ -= bound;
+        probability -= probability >> 5;
+        bit = 1;
+    }
+    while (range_ < (1u << 24))
+    {
+        range_ <<= 8;
+        code_ = (code_ << 8) | nextByte();
+    }
+    return bit;
+}
+
+uint32_t RangeDecoder::decodeTree(uint16_t *probabilities, int bitCount)
+{
+    uint32_t node = 1;
+    for (int i = 0; i < bitCount; ++i)
+    {
+        node = (node << 1) | decodeBit(probabilities[node]);
+    }
+    return node - (1u << bitCount);
+}
+
+uint64_t RangeDecoder::decodeDirect(int bitCount)
+{
+    uint64_t value = 0;
+    for (int i = 0; i < bitCount; ++i)
+    {
+        range_ >>= 1;
+        int bit = code_ >= range_ ? 1 : 0;
+        if (bit)
+        {
+            code_ -= range_;
+        }
+        value = (value << 1) | bit;
+        while (range_ < (1u << 24))
+        {
+            range_ <<= 8;
+            code_ = (code_ << 8) | nextByte();
+        }
+    }
+    return value;
+}
+
+GcodeModel::GcodeModel() : symbols(static_cast<size_t>(symbolCount) << symbolBits, 1024)
+{
+    std::fill(&decimals[0][0], &decimals[0][0] + sizeof(decimals) / sizeof(uint16_t), 1024);
+    std::fill(&bitLengths[0][0], &bitLengths[0][0] + sizeof(bitLengths) / sizeof(uint16_t), 1024);
+}
+
+// Parse the number of a G-code word: [-]digits[.digits], at most 18 digits. Only forms that
+// render back to exactly the same text are accepted; anything else is coded byte by byte.
+// decimalsCode is 0 without a decimal point, else 1 + the number of fraction digits.
+static bool parseWordNumber(const char *text, size_t available, int64_t &value, uint32_t &decimalsCode,
+                            size_t &length)
+{
+    size_t i = 0;
+    bool negative = i < available && text[i] == '-';
+    if (negative)
+    {
+        ++i;
+    }
+
+    size_t integerStart = i;
+    uint64_t mantissa = 0;
+    while (i < available && text[i] >= '0' && text[i] <= '9')
+    {
+        mantissa = mantissa * 10 + (text[i++] - '0');
+    }
+    size_t integerDigits = i - integerStart;
+    if (integerDigits == 0 || (integerDigits > 1 && text[integerStart] == '0'))
+    {
+        return false;
+    }
+
+    size_t fractionDigits = 0;
+    bool hasPoint = i < available && text[i] == '.';
+    if (hasPoint)
+    {
+        ++i;
+        while (i < available && text[i] >= '0' && text[i] <= '9')
+        {
+            mantissa = mantissa * 10 + (text[i++] - '0');
+            ++fractionDigits;
+        }
+    }
+    if (integerDigits + fractionDigits > 18 || (negative && mantissa == 0))
+    {
+        return false;
+    }
+
+    value = negative ? -static_cast<int64_t>(mantissa) : static_cast<int64_t>(mantissa);
+    decimalsCode = hasPoint ? static_cast<uint32_t>(fractionDigits + 1) : 0;
+    length = i;
+    return true;
+}
+
+static void renderWordNumber(int64_t value, uint32_t decimalsCode, std::string &out)
+{
+    if (value < 0)
+    {
+        out += '-';
+    }
+    std::string digits = std::to_string(value < 0 ? -static_cast<uint64_t>(value) : static_cast<uint64_t>(value));
+    if (decimalsCode == 0)
+    {
+        out += digits;
+        return;
+    }
+
+    size_t fractionDigits = decimalsCode - 1;
+    if (digits.size() <= fractionDigits)
+    {
+        digits.insert(0, fractionDigits + 1 - digits.size(), '0');
+    }
+    out.append(digits, 0, digits.size() - fractionDigits);
+    out += '.';
+    out.append(digits, digits.size() - fractionDigits, fractionDigits);
+}
+
+std::string GcodeCodec::encodeBlock(const char *data, size_t size)
+{
+    auto model = std::make_unique<GcodeModel>();
+    RangeEncoder encoder;
+
+    size_t i = 0;
+    while (i < size)
+    {
+        char c = data[i];
+        int64_t value;
+        uint32_t decimalsCode;
+        size_t length;
+        uint32_t symbol = static_cast<uint8_t>(c);
+        bool isWord = c >= 'A' && c <= 'Z' && parseWordNumber(data + i + 1, size - i - 1, value, decimalsCode, length);
+        if (isWord)
+        {
+            symbol = GcodeModel::wordSymbol + (c - 'A');
+        }
+
+        encoder.encodeTree(&model->symbols[static_cast<size_t>(model->previousSymbol) << GcodeModel::symbolBits],
+                           GcodeModel::symbolBits, symbol);
+        model->previousSymbol = symbol;
+        if (!isWord)
+        {
+            ++i;
+            continue;
+        }
+
+        // Change from the letter's previous value when the format matches, else the value itself
+        int letter = c - 'A';
+        encoder.encodeTree(model->decimals[letter], 5, decimalsCode);
+        int64_t base = decimalsCode == model->previousDecimals[letter] ? model->previousValue[letter] : 0;
+        int64_t delta = value - base;
+        uint64_t zigzag = (static_cast<uint64_t>(delta) << 1) ^ static_cast<uint64_t>(delta >> 63);
+        int bitLength = 0;
+        while (bitLength < 64 && (zigzag >> bitLength) != 0)
+        {
+            ++bitLength;
+        }
+        encoder.encodeTree(model->bitLengths[letter], 7, bitLength);
+        if (bitLength > 1)
+        {
+            encoder.encodeDirect(zigzag, bitLength - 1);
+        }
+        model->previousValue[letter] = value;
+        model->previousDecimals[letter] = decimalsCode;
+        i += 1 + length;
+    }
+
+    std::string payload = encoder.finish();
+    uint32_t header[2] = {static_cast<uint32_t>(size), static_cast<uint32_t>(payload.size())};
+    return std::string(reinterpret_cast<const char *>(header), sizeof(header)) + payload;
+}
+
+bool GcodeCodec::decodeBlock(const char *payload, size_t payloadSize, size_t rawSize, std::string &out)
+{
+    auto model = std::make_unique<GcodeModel>();
+    RangeDecoder decoder(payload, payloadSize);
+    size_t end = out.size() + rawSize;
+
+    while (out.size() < end && !decoder.overrun())
+    {
+        uint32_t symbol = decoder.decodeTree(
+            &model->symbols[static_cast<size_t>(model->previousSymbol) << GcodeModel::symbolBits], GcodeModel::symbolBits);
+        model->previousSymbol = symbol;
+        if (symbol < GcodeModel::wordSymbol)
+        {
+            out += static_cast<char>(symbol);
+            continue;
+        }
+        if (symbol >= GcodeModel::symbolCount)
+        {
+            return false;
+        }
+
+        int letter = symbol - GcodeModel::wordSymbol;
+        uint32_t decimalsCode = decoder.decodeTree(model->decimals[letter], 5);
+        int bitLength = static_cast<int>(decoder.decodeTree(model->bitLengths[letter], 7));
+        if (bitLength > 64)
+        {
+            return false;
+        }
+        uint64_t zigzag = bitLength == 0 ? 0 : (1ULL << (bitLength - 1)) | (bitLength > 1 ? decoder.decodeDirect(bitLength - 1) : 0);
+        int64_t delta = static_cast<int64_t>(zigzag >> 1) ^ -static_cast<int64_t>(zigzag & 1);
+        int64_t base = decimalsCode == model->previousDecimals[letter] ? model->previousValue[letter] : 0;
+        int64_t value = base + delta;
+        model->previousValue[letter] = value;
+        model->previousDecimals[letter] = decimalsCode;
+
+        out += static_cast<char>('A' + letter);
+        renderWordNumber(value, decimalsCode, out);
+    }
+    return out.size() == end && !decoder.overrun();
+}
@@ -3,188 +3,8991 @@
 #include <ws2tcpip.h>
 #include <vector>
 #include <fstream>
+#include <memory>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <string>
+#include <cstring>
+#include <array>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <unordered_set>
+#include <unordered_map>
+#include <filesystem>
+#include <sstream>
+#include <iomanip>
+#include <cmath>
+#include <iterator>
+#include <functional>
+#include <cctype>
+
+// Hardware CRC-32C through SSE4.2, chosen at run time
+#if defined(_M_X64) || defined(__x86_64__)
+#define CRC32C_HARDWARE
+#include <nmmintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#endif
+
+#include <psapi.h>
 
 #pragma comment(lib, "ws2_32.lib")
+#pragma comment(lib, "psapi.lib")
+
+// Backup file written through a sliding view of a file mapping, so recv() copies straight
+// from the socket into the page cache without a user buffer or ofstream in between
+class MappedBackupFile
+{
+public:
+    MappedBackupFile() = default;
+    MappedBackupFile(const MappedBackupFile &) = delete;
+    MappedBackupFile &operator=(const MappedBackupFile &) = delete;
+    ~MappedBackupFile() { close(); }
+
+    // Create the file; the announced size bounds everything written, and the mapping grows
+    // toward it a step at a time as the views reach its end
+    bool open(const std::string &path, int64_t size);
+
+    // Span at the current offset, at most maxSize bytes and never past the mapped view
+    char *writableSpan(size_t maxSize, size_t &size);
+
+    // Advance past bytes received into the last span
+    void commit(size_t bytes) { offset_ += bytes; }
+
+    void close();
+
+private:
+    // Map the view that holds the current offset, first growing the mapping if it ends short of it
+    bool mapView();
+
+    HANDLE file_ = INVALID_HANDLE_VALUE;
+    HANDLE mapping_ = nullptr;
+    char *view_ = nullptr;
+    int64_t size_ = 0;
+    // Size of the mapping, which is also the file's
+    int64_t mappedSize_ = 0;
+    int64_t offset_ = 0;
+    int64_t viewOffset_ = 0;
+    size_t viewSize_ = 0;
+};
+
+// SHA-256, naming chunks in the deduplication store by content
+class Sha256
+{
+public:
+    Sha256();
+
+    void update(const char *data, size_t size);
+
+    // Finish the digest as 32 raw bytes
+    std::string digest();
+
+    // Finish the digest as 64 lowercase hex characters
+    std::string hexDigest();
+
+private:
+    void processBlock(const uint8_t *block);
+
+    uint32_t state_[8];
+    uint8_t block_[64];
+    size_t blockSize_ = 0;
+    uint64_t totalSize_ = 0;
+};
+
+// Destination of an upload body
+class BackupSink
+{
+public:
+    virtual ~BackupSink() = default;
+
+    virtual bool write(const char *data, size_t size) = 0;
+
+    // Complete the version; false if any of it failed to reach the disk
+    virtual bool finish() = 0;
+
+    // User memory the sink holds for bytes not yet written, charged to the memory budget
+    virtual size_t bufferBytes() const { return 0; }
+};
+
+// One plain file per version
+class FileBackupSink : public BackupSink
+{
+public:
+    // Append instead of truncating, to continue a resumed upload
+    bool open(const std::string &path, bool append = false);
+    bool write(const char *data, size_t size) override;
+    bool finish() override;
+
+private:
+    std::ofstream file_;
+};
+
+// Writes one byte range of a preallocated file through its own handle, so ranges of the
+// same transfer land in place in parallel
+class RangeSink : public BackupSink
+{
+public:
+    RangeSink() = default;
+    RangeSink(const RangeSink &) = delete;
+    RangeSink &operator=(const RangeSink &) = delete;
+    ~RangeSink() override;
+
+    bool open(const std::string &path, int64_t offset);
+    bool write(const char *data, size_t size) override;
+    bool finish() override;
+
+    // Move the next write, for chunks that arrive out of order
+    void seek(int64_t offset) { offset_ = offset; }
+
+    // Extend the file a step ahead of the writes up to size, for a sole writer of a file
+    // preallocated to allocated bytes
+    void growInSteps(int64_t allocated, int64_t size)
+    {
+        allocated_ = allocated;
+        fileSize_ = size;
+    }
+
+    // Make everything written so far durable
+    bool flush();
+
+private:
+    HANDLE file_ = INVALID_HANDLE_VALUE;
+    // Position of the next write
+    int64_t offset_ = 0;
+    // End of the file so far and the size it grows to; equal when it was preallocated in full
+    int64_t allocated_ = 0;
+    int64_t fileSize_ = 0;
+};
+
+// Backup file written around the page cache (FILE_FLAG_NO_BUFFERING, the O_DIRECT of Win32), so
+// ingest does not evict the versions being restored. The body is received straight into a
+// page-aligned staging buffer that goes to disk in whole aligned blocks
+class UnbufferedBackupSink : public BackupSink
+{
+public:
+    // Staging buffer size, a multiple of the alignment
+    static const size_t stagingSize = 1 << 20;
+    // Offset, size and address alignment of unbuffered I/O: the page size, a multiple of any sector size
+    static const size_t alignment = 4096;
+
+    UnbufferedBackupSink() = default;
+    UnbufferedBackupSink(const UnbufferedBackupSink &) = delete;
+    UnbufferedBackupSink &operator=(const UnbufferedBackupSink &) = delete;
+    ~UnbufferedBackupSink() override;
+
+    // Create the file, preallocated a step at a time up to the announced size
+    bool open(const std::string &path, int64_t fileSize);
+
+    // Free part of the staging buffer to receive into, then commit what was received
+    char *writableSpan(size_t &spanSize);
+    bool commit(size_t size);
+
+    bool write(const char *data, size_t size) override;
+
+    // Write the tail padded to the alignment, then trim the file back to its size
+    bool finish() override;
+
+    size_t bufferBytes() const override { return staging_ ? stagingSize : 0; }
+
+private:
+    bool writeStaged(size_t size);
+
+    HANDLE file_ = INVALID_HANDLE_VALUE;
+    char *staging_ = nullptr;
+    size_t staged_ = 0;
+    // File offset of the staging buffer
+    int64_t offset_ = 0;
+    // End of the file so far
+    int64_t allocated_ = 0;
+    int64_t fileSize_ = 0;
+};
+
+// Create or truncate a file at its final size, so writes land in place and never extend it
+static bool preallocateFile(const std::string &path, int64_t size);
+
+// Files written front to back are extended this far ahead of their writes rather than to the
+// announced size at once, so a header announcing more than ever arrives costs one step of disk
+static const int64_t allocationStep = 64ll << 20;
+
+// Move the end of an open file, extending or trimming it
+static bool setFileEnd(HANDLE file, int64_t size);
+
+// Flush a file's cached writes to the disk through a handle of its own, so writers need not
+// have kept theirs open
+static bool flushFile(const std::string &path);
+
+// CRC-32C (Castagnoli) of data, continuing from crc; start with 0. Uses the SSE4.2 instruction
+// when the CPU has it, else a slicing-by-8 table
+static uint32_t crc32c(uint32_t crc, const char *data, size_t size);
+
+// Response to an upload whose body hashed to crc; the catalog record keeps the CRC itself
+static std::string digestResponse(uint32_t crc);
+
+// Offset and CRC-32C of the durable prefix of a resumable upload, kept in "<transfer>.offset"
+// beside its "<transfer>.part". Read fails, meaning start over, when the record is missing or torn
+static bool readResumeCheckpoint(const std::string &transferPath, int64_t &offset, uint32_t &crc);
+static bool writeResumeCheckpoint(const std::string &transferPath, int64_t offset, uint32_t crc);
+
+// Delete the files of a version in whichever form it was stored, for expired versions and for
+// uploads that broke off before they were committed. Chunks of --dedup may be shared with other
+// versions, so only the recipe goes
+static void removeVersionFiles(const std::string &versionPath);
+
+// Wall-clock time in Unix milliseconds, for the timestamps of the version catalog
+static int64_t unixMilliseconds()
+{
+    return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch())
+        .count();
+}
+
+// Monotonic time in milliseconds, for the timeouts of the event loops
+static uint64_t steadyMilliseconds()
+{
+    return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+// Destination sink of a write-behind sink, shared with the disk thread while its buffers are queued
+struct WriteBehindTarget
+{
+    std::unique_ptr<BackupSink> sink;
+    // Some write failed; later buffers are dropped
+    std::atomic<bool> failed{false};
+    // The closing finish() ran on the disk thread, with the result in saved
+    std::atomic<bool> finished{false};
+    bool saved = false;
+    // Wake-up socket of the worker waiting for the finish
+    sockaddr_in wakeAddress = {};
+};
+
+// Dedicated disk thread behind the event loops. Sinks hand it filled buffers and go on receiving,
+// so a stalled disk fills this queue instead of blocking recv and closing the sender's window;
+// once it holds capacity bytes the workers stop reading the connections that feed it
+class WriteBehindQueue
+{
+public:
+    // Size of the buffers sinks fill before queueing them
+    static const size_t bufferSize = 256 * 1024;
+
+    explicit WriteBehindQueue(size_t capacityBytes) : capacity_(capacityBytes) {}
+    WriteBehindQueue(const WriteBehindQueue &) = delete;
+    WriteBehindQueue &operator=(const WriteBehindQueue &) = delete;
+    // Write out everything queued, then stop the thread
+    ~WriteBehindQueue();
+
+    bool start();
+
+    // Whether connections writing behind may be read
+    bool hasRoom() const { return queuedBytes_.load(std::memory_order_relaxed) < capacity_; }
+
+    // At capacity, wake the worker at wakeAddress once there is room again and return true;
+    // false if there is room already
+    bool wakeWhenRoom(const sockaddr_in &wakeAddress);
+
+    // Empty buffer of bufferSize capacity, recycled from written ones when possible
+    std::vector<char> takeBuffer();
+
+    // Queue a buffer for the target, and its finish() after it when finish is set
+    void push(const std::shared_ptr<WriteBehindTarget> &target, std::vector<char> data, bool finish);
+
+    // Block until the target's finish() has run
+    void waitFinished(const WriteBehindTarget &target);
+
+    // Close the target's sink after its queued buffers and delete the files of the version
+    void discard(const std::shared_ptr<WriteBehindTarget> &target, const std::string &versionPath);
+
+    // Bytes queued now and at most, disk time and time spent at capacity, for the stats report
+    size_t queuedBytes() const { return queuedBytes_.load(std::memory_order_relaxed); }
+    size_t peakBytes() const { return peakBytes_.load(std::memory_order_relaxed); }
+    double diskSeconds() const { return diskNanoseconds_.load(std::memory_order_relaxed) / 1e9; }
+    double stallSeconds() const;
+
+private:
+    struct Job
+    {
+        std::shared_ptr<WriteBehindTarget> target;
+        std::vector<char> data;
+        bool finish;
+        // Version whose files go once the sink is closed, for an upload that broke off
+        std::string discardPath;
+    };
+
+    void run();
+
+    // Send a wake-up datagram to a worker's poll
+    void wake(const sockaddr_in &wakeAddress);
+
+    size_t capacity_;
+    std::thread thread_;
+    std::mutex mutex_;
+    std::condition_variable jobReady_;
+    std::condition_variable jobDone_;
+    std::deque<Job> jobs_;
+    std::vector<std::vector<char>> freeBuffers_;
+    bool stopping_ = false;
+    SOCKET wakeSocket_ = INVALID_SOCKET;
+    // Workers holding connections back until the queue drops below capacity; guarded by mutex_
+    std::vector<sockaddr_in> roomWaiters_;
+
+    std::atomic<size_t> queuedBytes_{0};
+    std::atomic<size_t> peakBytes_{0};
+    std::atomic<uint64_t> diskNanoseconds_{0};
+    // Time at capacity so far, and since when the current stretch lasts; guarded by mutex_
+    uint64_t stallNanoseconds_ = 0;
+    bool full_ = false;
+    std::chrono::steady_clock::time_point fullSince_;
+};
+
+// Coalesces writes into buffers for the disk thread; write() never touches the disk
+class WriteBehindSink : public BackupSink
+{
+public:
+    // The disk thread wakes the worker at wakeAddress when the closing finish() has run
+    WriteBehindSink(WriteBehindQueue &queue, std::unique_ptr<BackupSink> sink, const sockaddr_in &wakeAddress);
+
+    bool write(const char *data, size_t size) override;
+
+    // Blocking finish, for callers that cannot wait in the event loop
+    bool finish() override;
+
+    // Queue the last buffer and the finish; finished() turns true once the disk thread ran them
+    void close();
+    bool finished() const { return target_->finished.load(std::memory_order_acquire); }
+
+    // Drop the version: the disk thread closes the sink and deletes its files after the buffers
+    // already queued
+    void discard(const std::string &versionPath);
+    bool saved() const { return target_->saved; }
+
+    // The queued buffers count against the queue's own limit, not here
+    size_t bufferBytes() const override { return buffer_.capacity(); }
+
+private:
+    WriteBehindQueue &queue_;
+    std::shared_ptr<WriteBehindTarget> target_;
+    std::vector<char> buffer_;
+    bool closed_ = false;
+};
+
+// Content-addressed chunk store shared by all workers; each unique chunk is written once.
+// Chunks are appended to container files, each record its 64 hex character hash, a uint32 size
+// and the bytes, so a batch of chunks costs one write instead of a file apiece
+class DedupStore
+{
+public:
+    // A container stops taking chunks once it reaches this size
+    static const uint64_t containerSize = 256ull << 20;
+    static const size_t recordHeaderSize = 64 + sizeof(uint32_t);
+
+    // Where a chunk is stored; container 0 is a file of its own named by the hash, as earlier
+    // versions of the store kept every chunk
+    struct Location
+    {
+        uint32_t container;
+        uint64_t offset;
+        uint32_t size;
+    };
+
+    explicit DedupStore(const std::string &folderPath) : chunkFolder_(folderPath + "chunks/") {}
+    DedupStore(const DedupStore &) = delete;
+    DedupStore &operator=(const DedupStore &) = delete;
+    ~DedupStore();
+
+    // Create the chunk folder and index the chunks already stored. Containers of earlier runs
+    // take no more appends
+    bool init();
+
+    bool contains(const std::string &hash);
+
+    // Append a batch of chunk records built by appendRecord; those another writer stored
+    // meanwhile are written again but indexed once
+    bool putChunks(const std::vector<char> &records);
+
+    // Make every chunk appended so far durable
+    bool sync();
+
+    bool locate(const std::string &hash, Location &location);
+
+    static void appendRecord(std::vector<char> &records, const std::string &hash, const char *data, size_t size);
+
+    std::string containerPath(uint32_t id) const { return chunkFolder_ + "container_" + std::to_string(id); }
+    std::string chunkPath(const std::string &hash) const { return chunkFolder_ + hash; }
+
+private:
+    // Index the records of a container up to its first torn one
+    void indexContainer(uint32_t id);
+
+    std::string chunkFolder_;
+    std::mutex mutex_;
+    std::unordered_map<std::string, Location> chunks_;
+    HANDLE container_ = INVALID_HANDLE_VALUE;
+    uint32_t containerId_ = 0;
+    uint32_t nextId_ = 1;
+    uint64_t containerEnd_ = 0;
+};
+
+// Splits a body into content-defined chunks with a gear rolling hash, so an edit only changes
+// the chunks around it; the version itself becomes a recipe listing its chunks
+class DedupSink : public BackupSink
+{
+public:
+    // 8 KB average chunks, bounded to 2..64 KB
+    static const size_t minChunkSize = 2 * 1024;
+    static const size_t maxChunkSize = 64 * 1024;
+
+    // New chunks are handed to the store in batches of about this many bytes
+    static const size_t batchSize = 1 << 20;
+
+    DedupSink(DedupStore &store, const std::string &recipePath) : store_(store), recipePath_(recipePath) {}
+
+    bool write(const char *data, size_t size) override;
+
+    // Store the last batch and make the chunks durable before the recipe names them
+    bool finish() override;
+    size_t bufferBytes() const override { return chunk_.capacity() + recipe_.capacity() + batch_.capacity(); }
+
+private:
+    // Hash the pending chunk, batch it unless it is stored already, and append it to the recipe
+    bool cutChunk();
+    bool storeBatch();
+
+    DedupStore &store_;
+    std::string recipePath_;
+    std::vector<char> chunk_;
+    uint64_t rollingHash_ = 0;
+    std::string recipe_;
+    // Records of new chunks not yet in the store, and their hashes, so a chunk repeated within
+    // the batch goes in once
+    std::vector<char> batch_;
+    std::unordered_set<std::string> batchHashes_;
+    uint64_t totalBytes_ = 0;
+    uint64_t newBytes_ = 0;
+    size_t chunkCount_ = 0;
+    bool failed_ = false;
+};
+
+// Stored version as the catalog knows it
+struct VersionRecord
+{
+    // Counts from 1 per machine and file
+    uint64_t version = 0;
+    // Global and never reused, naming the stored file backup_<sequence>.nc
+    uint64_t sequence = 0;
+    int64_t size = 0;
+    // CRC-32C of the content, for uploads that hash their body
+    bool hasCrc = false;
+    uint32_t crc = 0;
+    // Unix time in milliseconds when the upload started and when the version was committed
+    int64_t receivedAt = 0;
+    int64_t storedAt = 0;
+    // Segment and offset of the record of a version stored in a pack; segment 0 is a file of its own
+    uint32_t packSegment = 0;
+    uint64_t packOffset = 0;
+    // Index slot of the version, the same for the life of the catalog
+    uint32_t entry = 0;
+};
+
+// Fixed-size slot of the catalog index: one version, linked to the previous version of its key
+struct CatalogEntry
+{
+    // Bits of flags
+    static const uint32_t hasCrcFlag = 1;
+    static const uint32_t deletedFlag = 2;
+
+    uint64_t keyHash;
+    uint64_t sequence;
+    uint64_t version;
+    int64_t size;
+    int64_t receivedAt;
+    int64_t storedAt;
+    uint64_t packOffset;
+    uint32_t packSegment;
+    // Entry index of the previous version of the same key, or noEntry
+    uint32_t previous;
+    uint32_t crc;
+    uint32_t flags;
+};
+
+// Open-addressed slot keyed by the hash of (machine, file), pointing at its newest entry
+struct CatalogBucket
+{
+    uint64_t keyHash;
+    uint32_t latest;
+    uint32_t reserved;
+};
+
+// First bytes of the index file; the counts and log offset are those of the last checkpoint
+struct CatalogIndexHeader
+{
+    uint32_t magic;
+    uint32_t format;
+    uint64_t entryCapacity;
+    uint64_t bucketCount;
+    uint64_t entryCount;
+    uint64_t logOffset;
+    uint64_t nextSequence;
+    uint64_t reserved[2];
+};
+
+// Mapped "catalog.idx": the header, entryCapacity entries, then twice as many buckets
+class CatalogIndexFile
+{
+public:
+    CatalogIndexFile() = default;
+    CatalogIndexFile(const CatalogIndexFile &) = delete;
+    CatalogIndexFile &operator=(const CatalogIndexFile &) = delete;
+    ~CatalogIndexFile() { close(); }
+
+    // Map the existing file when entryCapacity is 0, else create an empty index of that capacity
+    bool open(const std::string &path, uint64_t entryCapacity);
+    void close();
+
+    // Write the dirty pages of the view and make them durable
+    bool flush();
+
+    // Slot of a key, or the empty slot where it would go
+    CatalogBucket &findBucket(uint64_t keyHash);
+
+    CatalogIndexHeader *header() { return header_; }
+    CatalogEntry *entries() { return entries_; }
+    const CatalogEntry *entries() const { return entries_; }
+    CatalogBucket *buckets() { return buckets_; }
+
+private:
+    HANDLE file_ = INVALID_HANDLE_VALUE;
+    HANDLE mapping_ = nullptr;
+    char *view_ = nullptr;
+    CatalogIndexHeader *header_ = nullptr;
+    CatalogEntry *entries_ = nullptr;
+    CatalogBucket *buckets_ = nullptr;
+};
+
+// Persistent catalog of every stored version, keyed by (machine, file, version). "catalog.log" is
+// the append-only source of truth, each record checksummed and flushed before the upload is
+// acknowledged; "catalog.idx" is a mapped hash index over it, so the latest version of a key is
+// one probe and its versions are a linked walk. The index is checkpointed now and then, and the
+// log records past the checkpoint are replayed when the server starts
+class VersionCatalog
+{
+public:
+    static const uint32_t noEntry = 0xFFFFFFFF;
+
+    explicit VersionCatalog(const std::string &folderPath)
+        : folderPath_(folderPath), logPath_(folderPath + "catalog.log"), indexPath_(folderPath + "catalog.idx") {}
+    VersionCatalog(const VersionCatalog &) = delete;
+    VersionCatalog &operator=(const VersionCatalog &) = delete;
+    // Checkpoint the index and close both files
+    ~VersionCatalog();
+
+    // Map the index, rebuilding it from the log if it is missing or damaged, and replay the log
+    // past its checkpoint; a torn record at the end of the log is cut off
+    bool open();
+
+    // Take the next global sequence number; numbers of uploads that never commit are skipped
+    uint64_t reserveSequence() { return nextSequence_.fetch_add(1); }
+
+    // Append a version and index it; fills in its version number and storedAt. It is durable on
+    // return unless durable is false, when a later sync() makes it so
+    bool commit(const std::string &machine, const std::string &file, VersionRecord &record, bool durable = true);
+
+    // Make every record appended so far durable
+    bool sync() { return flushLog(appendOffset_); }
+
+    // Newest version of a machine's file; false if it has none
+    bool latest(const std::string &machine, const std::string &file, VersionRecord &record);
+
+    // Versions of a machine's file that are not deleted, newest first, at most limit of them
+    std::vector<VersionRecord> list(const std::string &machine, const std::string &file, size_t limit);
+
+    // Delete every version of a machine's file but the newest keep, returning the versions deleted;
+    // the deletions are durable with the next sync()
+    std::vector<VersionRecord> expire(const std::string &machine, const std::string &file, size_t keep);
+
+    // Record that the compactor moved a packed version, durable with the next checkpoint; false if
+    // the version was deleted in the meantime
+    bool move(uint32_t entry, uint32_t packSegment, uint64_t packOffset);
+
+    // Call visit for every version in packs that is not deleted, a slice of the index at a time
+    void forEachPacked(const std::function<void(const VersionRecord &)> &visit);
+
+    // Make the index durable up to the current end of the log
+    bool checkpoint();
+
+    size_t versionCount();
+
+private:
+    // Types of log records, in the top byte of their size word
+    enum class RecordType : uint8_t
+    {
+        Version = 0,
+        Delete = 1,
+        Move = 2
+    };
+
+    static uint64_t keyHash(const std::string &machine, const std::string &file);
+    static CatalogEntry toEntry(uint64_t keyHash, const VersionRecord &record);
+    VersionRecord toRecord(uint32_t entry) const;
+
+    // Write a record at the end of the log; the caller indexes it
+    bool appendRecord(RecordType type, const std::string &payload);
+
+    // Apply a delete or move record to its entry; false if the entry does not exist
+    bool applyRecord(RecordType type, const char *payload, size_t size);
+
+    // Validate the mapped index against the log and drop what was indexed after its checkpoint
+    bool restoreCheckpoint(uint64_t logSize);
+
+    // Index the log records from offset on, truncating the log at the first torn record
+    bool replayLog(uint64_t offset, uint64_t logSize);
+
+    // Add an entry as the newest version of its key, growing the index first when it is full
+    bool insertEntry(const CatalogEntry &entry);
+
+    // Rewrite the index at twice the capacity and map it in place of the current one
+    bool growIndex();
+
+    // Flush the log and the entries of an index, then the header that claims them
+    bool writeCheckpoint(CatalogIndexFile &index);
+
+    // Flush the log through at least offset; concurrent commits share one flush
+    bool flushLog(uint64_t offset);
+
+    // Number one past the highest backup_N file in the folder, for a catalog started over old versions
+    uint64_t scanFolderSequence() const;
+
+    std::string folderPath_;
+    std::string logPath_;
+    std::string indexPath_;
+
+    // Guards the index and appends to the log
+    std::mutex mutex_;
+    HANDLE log_ = INVALID_HANDLE_VALUE;
+    // End of the indexed records; a commit writes its record here before indexing it
+    std::atomic<uint64_t> appendOffset_{0};
+    std::mutex flushMutex_;
+    uint64_t durableOffset_ = 0;
+    std::atomic<uint64_t> nextSequence_{1};
+
+    CatalogIndexFile index_;
+    // Entries and keys indexed so far, past the checkpoint too
+    uint64_t entryCount_ = 0;
+    uint64_t keyCount_ = 0;
+};
+
+// Catalog file name of uploads; the upload protocols do not carry file names, so every version
+// of a machine is a version of this one file
+const char *const defaultBackupName = "backup.nc";
+
+// Folder of the catalog and every stored version, and of the packs, chunks and resume files
+const char *const backupFolder = "C:/Users/Ian/Desktop/backup/";
+
+// Pack segment file of an ID, in the packs folder of the backup folder
+static std::string packSegmentPath(const std::string &folderPath, uint32_t id)
+{
+    return folderPath + "packs/pack_" + std::to_string(id) + ".seg";
+}
+
+// Append-only segment files ("packs") holding many versions each, so ingest is sequential writes
+// into a few large files instead of a new file, directory entry and metadata update per version.
+// A version is one record <uint32 magic><uint32 CRC-32C><uint64 sequence><int64 length><bytes>
+// whose segment and offset the catalog holds. Deleted versions leave garbage behind, which a
+// background compactor reclaims by copying the live records out of mostly dead segments
+class PackStore
+{
+public:
+    // A segment stops taking versions once it reaches this size
+    static const uint64_t segmentSize = 256ull << 20;
+    static const size_t recordHeaderSize = 24;
+    // "VPAK"; a record whose upload broke off keeps a zero header
+    static const uint32_t recordMagic = 0x4B415056;
+
+    // Segment that records are appended to, each writer into a region reserved for it
+    struct Segment
+    {
+        uint32_t id;
+        HANDLE file;
+        // End of the reserved regions, where the next record goes
+        uint64_t size;
+        // Writers still filling their regions; the handle closes once a sealed segment has none
+        size_t writers;
+        bool sealed;
+    };
+
+    PackStore(const std::string &folderPath, VersionCatalog &catalog)
+        : folderPath_(folderPath), packFolder_(folderPath + "packs/"), catalog_(catalog) {}
+    PackStore(const PackStore &) = delete;
+    PackStore &operator=(const PackStore &) = delete;
+    // Stop the compactor and close the segments
+    ~PackStore();
+
+    // Count the live bytes of the segments on disk from the catalog and start the compactor.
+    // Segments of earlier runs take no more appends
+    bool init();
+
+    // Reserve length bytes at the end of the active segment, sealing it and starting a new one
+    // when they do not fit; nullptr if no segment could be created
+    Segment *reserve(uint64_t length, uint64_t &offset);
+
+    // A writer is done with its region
+    void release(Segment *segment);
+
+    // Where a finished sink put a version, held until the catalog has committed it. A segment
+    // with versions waiting here is not compacted, since the catalog does not know them yet
+    void storeLocation(uint64_t sequence, uint32_t segment, uint64_t offset, int64_t length);
+    bool takeLocation(uint64_t sequence, uint32_t &segment, uint64_t &offset);
+    void settleLocation(uint64_t sequence, bool committed);
+
+    // Count the record of a deleted version as garbage
+    void releaseVersion(const VersionRecord &record);
+
+    std::string segmentPath(uint32_t id) const;
+
+private:
+    struct SegmentUsage
+    {
+        uint64_t totalBytes = 0;
+        uint64_t liveBytes = 0;
+        // Versions stored but not yet committed
+        size_t pending = 0;
+        // Closed for good, so the segment may be compacted
+        bool sealed = false;
+    };
+
+    struct PendingLocation
+    {
+        uint32_t segment;
+        uint64_t offset;
+        int64_t length;
+    };
+
+    // Close a sealed segment that no writer holds any more; called with the mutex held
+    void closeIfDone(Segment *segment);
+
+    // Compact the sealed segments that are more than half garbage, until the store stops
+    void compactLoop();
+
+    // Copy the live records of a segment to the active one, point the catalog at the copies and
+    // remove the segment
+    bool compact(uint32_t id);
+
+    std::string folderPath_;
+    std::string packFolder_;
+    VersionCatalog &catalog_;
+
+    std::mutex mutex_;
+    std::vector<std::unique_ptr<Segment>> open_;
+    Segment *active_ = nullptr;
+    uint32_t nextId_ = 1;
+    std::unordered_map<uint32_t, SegmentUsage> usage_;
+    std::unordered_map<uint64_t, PendingLocation> locations_;
+
+    std::thread compactor_;
+    std::condition_variable wake_;
+    bool stopping_ = false;
+};
+
+// Writes a version into the region of a pack segment reserved for its record
+class PackSink : public BackupSink
+{
+public:
+    PackSink(PackStore &store, uint64_t sequence) : store_(store), sequence_(sequence) {}
+    PackSink(const PackSink &) = delete;
+    PackSink &operator=(const PackSink &) = delete;
+    // An unfinished record is left behind as garbage
+    ~PackSink() override;
+
+    // Reserve the record of a version of the given size
+    bool open(int64_t fileSize);
+    bool write(const char *data, size_t size) override;
+
+    // Write the record header and hand the location to the store
+    bool finish() override;
+    size_t bufferBytes() const override { return buffer_.capacity(); }
+
+    // Coalesce small receives into large positioned writes
+    static const size_t bufferSize = 1 << 20;
+
+private:
+
+    bool flushBuffer();
+
+    PackStore &store_;
+    uint64_t sequence_;
+    PackStore::Segment *segment_ = nullptr;
+    uint64_t recordOffset_ = 0;
+    // Where the buffered bytes go
+    uint64_t writeOffset_ = 0;
+    int64_t reserved_ = 0;
+    int64_t length_ = 0;
+    uint32_t crc_ = 0;
+    std::vector<char> buffer_;
+};
+
+// Adaptive binary range decoder in the style of LZMA, for the G-code codec of the client
+class RangeDecoder
+{
+public:
+    RangeDecoder(const char *data, size_t size);
+
+    int decodeBit(uint16_t &probability);
+    uint32_t decodeTree(uint16_t *probabilities, int bitCount);
+    uint64_t decodeDirect(int bitCount);
+
+    // Input ran out before the block was decoded, so the block is corrupt
+    bool overrun() const { return overrun_; }
+
+private:
+    uint8_t nextByte();
+
+    const char *data_;
+    size_t size_;
+    size_t position_ = 0;
+    uint32_t range_ = 0xFFFFFFFF;
+    uint32_t code_ = 0;
+    bool overrun_ = false;
+};
+
+// G-code model: symbols are raw bytes or a word letter whose number follows; numbers are coded
+// as the change from the same letter's previous value, so slowly moving axes cost a few bits
+struct GcodeModel
+{
+    static const int symbolBits = 9;
+    static const int letterCount = 26;
+    // Symbols 0..255 are bytes, wordSymbol + letter is a letter followed by a number
+    static const uint32_t wordSymbol = 256;
+    static const uint32_t symbolCount = wordSymbol + letterCount;
+
+    GcodeModel();
+
+    // Symbol probabilities in the context of the previous symbol
+    std::vector<uint16_t> symbols;
+    // Per letter: decimal format, bit length of the zigzagged change
+    uint16_t decimals[letterCount][1 << 5];
+    uint16_t bitLengths[letterCount][1 << 7];
+    int64_t previousValue[letterCount] = {};
+    uint32_t previousDecimals[letterCount] = {};
+    uint32_t previousSymbol = '\n';
+};
+
+// Decoder of the client's streaming G-code codec. The stream is a sequence of independent blocks,
+// each <uint32 raw size><uint32 payload size><range coded payload>
+class GcodeCodec
+{
+public:
+    static const size_t headerSize = 2 * sizeof(uint32_t);
+    // Largest block the client produces
+    static const size_t blockSize = 1024 * 1024;
+
+    // Decode a block payload, appending exactly rawSize bytes; false if the payload is corrupt
+    static bool decodeBlock(const char *payload, size_t payloadSize, size_t rawSize, std::string &out);
+};
+
+// Checks a codec stream block by block as it arrives and stores it unchanged, as the at-rest format,
+// or decoded when the storage keeps raw bytes
+class CompressedUpload
+{
+public:
+    CompressedUpload(BackupSink &sink, int64_t rawSize, bool storeDecoded)
+        : sink_(sink), rawSize_(rawSize), storeDecoded_(storeDecoded) {}
+
+    // Consume stream bytes; false on a corrupt or empty block, a size overrun or a failed write.
+    // Empty blocks would let a client hold the upload open while sending nothing of the file
+    bool feed(const char *data, size_t size);
+
+    // Every announced raw byte arrived in valid blocks
+    bool finished() const { return rawReceived_ == rawSize_; }
+
+private:
+    BackupSink &sink_;
+    int64_t rawSize_;
+    bool storeDecoded_;
+    int64_t rawReceived_ = 0;
+    // Block being assembled, header included
+    std::string block_;
+    std::string decoded_;
+};
+
+// A size header of -1 asks for a delta upload against the latest version: the real size
+// follows, the server answers with block signatures, and the client sends instructions
+const int64_t deltaUploadRequest = -1;
+
+// A size header of -2 announces a G-code codec stream: the raw size follows, then codec blocks
+const int64_t compressedUploadRequest = -2;
+
+// A size header of -3 announces one byte range of a parallel upload: a RangeHeader follows,
+// then the range's bytes
+const int64_t rangeUploadRequest = -3;
+
+struct RangeHeader
+{
+    // Chosen by the client, shared by every range of the file
+    uint64_t transferId;
+    int64_t fileSize;
+    int64_t offset;
+    int64_t length;
+    uint32_t rangeCount;
+    uint32_t rangeIndex;
+};
+
+// Random-access reader over a stored version, either a plain file or a dedup recipe
+class VersionReader
+{
+public:
+    // Open the version stored for a path returned by TCPServer::nextBackupPath(): a plain file,
+    // a ".gcz" codec stream or a ".recipe"
+    bool open(const std::string &versionPath, DedupStore *store);
+
+    // Open the version held by the pack record at an offset of a segment
+    bool openPacked(const std::string &segmentPath, uint64_t recordOffset);
+
+    int64_t size() const { return size_; }
+
+    bool read(int64_t offset, char *data, size_t size);
+
+private:
+    struct Chunk
+    {
+        int64_t offset;
+        size_t size;
+        // File holding the chunk, and where in it
+        std::string path;
+        uint64_t fileOffset;
+    };
+
+    // Block of a ".gcz" version: raw range and where its payload sits in the file
+    struct CodecBlock
+    {
+        int64_t offset;
+        size_t size;
+        int64_t payloadOffset;
+        size_t payloadSize;
+    };
+
+    bool openCompressed(const std::string &path);
+    bool readCompressed(int64_t offset, char *data, size_t size);
+
+    std::ifstream file_;
+    // Where the bytes of a plain or packed version start in file_
+    int64_t baseOffset_ = 0;
+    bool isRecipe_ = false;
+    bool isCompressed_ = false;
+    std::vector<Chunk> chunks_;
+    std::vector<CodecBlock> blocks_;
+    int64_t size_ = 0;
+    // Last chunk or codec block read, since delta copies walk the version in order
+    const Chunk *cachedChunk_ = nullptr;
+    std::vector<char> cachedData_;
+    std::ifstream chunkFile_;
+    std::string chunkFilePath_;
+    const CodecBlock *cachedBlock_ = nullptr;
+    std::string cachedBlockData_;
+};
+
+// Rebuilds a version from the delta instruction stream of a client:
+// 'L' <uint32 length> <bytes>    literal data
+// 'B' <uint32 first> <uint32 n>  n consecutive blocks of the previous version
+// 'E' <64 hex chars>             end, with the SHA-256 of the whole new version
+class DeltaDecoder
+{
+public:
+    DeltaDecoder(std::unique_ptr<VersionReader> base, uint32_t blockSize, uint32_t blockCount, BackupSink &sink,
+                 int64_t fileSize)
+        : base_(std::move(base)), blockSize_(blockSize), blockCount_(blockCount), sink_(sink), fileSize_(fileSize) {}
+
+    // Consume instruction bytes; false on malformed input, a failed write or a digest mismatch
+    bool feed(const char *data, size_t size);
+
+    // The end record arrived and the rebuilt version matched its digest
+    bool finished() const { return finished_; }
+
+private:
+    bool output(const char *data, size_t size);
+    bool copyBlocks(uint32_t first, uint32_t count);
+
+    std::unique_ptr<VersionReader> base_;
+    uint32_t blockSize_;
+    uint32_t blockCount_;
+    BackupSink &sink_;
+    int64_t fileSize_;
+    int64_t written_ = 0;
+    Sha256 sha_;
+
+    // Record header being assembled, and the literal bytes still to come
+    std::string header_;
+    uint32_t literalRemaining_ = 0;
+    bool finished_ = false;
+};
+
+// Block size of the signatures of a version of the given size
+static uint32_t chooseBlockSize(int64_t fileSize);
+
+// Signature stream header: block size and block count
+static std::string encodeSignatureHeader(uint32_t blockSize, uint32_t blockCount);
+
+// Signatures of a stored version, computed on first use and cached in "<version>.sig"
+static bool loadSignatures(const std::string &versionPath, VersionReader &base, std::string &signatures);
+
+// Base of a delta upload and its signatures, looked up by the signature thread while the
+// connection waits; done is set once both are filled in, the base left empty when there is none
+struct SignatureJob
+{
+    std::string machine;
+    // Wake-up socket of the waiting connection's worker
+    sockaddr_in wakeAddress;
+    std::unique_ptr<VersionReader> base;
+    std::string signatures;
+    std::atomic<bool> done{false};
+};
+
+// Finished version waiting on the commit thread for its catalog record
+struct CommitJob
+{
+    std::string machine;
+    std::string versionPath;
+    std::string file;
+    int64_t size = 0;
+    int64_t receivedAt = 0;
+    bool hasCrc = false;
+    uint32_t crc = 0;
+    // Wake-up socket of the waiting connection's worker, or for an IOCP worker, the packet posted
+    // to its completion port instead
+    sockaddr_in wakeAddress = {};
+    HANDLE completionPort = nullptr;
+    ULONG_PTR completionKey = 0;
+    OVERLAPPED *completion = nullptr;
+    // Set once the record is durable or the commit failed; the files of a failed version are deleted
+    std::atomic<bool> done{false};
+    bool committed = false;
+};
+
+// File being uploaded as byte ranges over several connections, possibly on different workers.
+// Guarded by TCPServer's transfer mutex
+struct ParallelTransfer
+{
+    uint64_t id;
+    std::string versionPath;
+    int64_t fileSize;
+    uint32_t rangeCount;
+    // Connections that announced a range, and ranges that are complete or failed
+    uint32_t rangesJoined = 0;
+    uint32_t rangesEnded = 0;
+    bool failed = false;
+    // Offset and length of every range stored, to check they cover the file exactly
+    std::vector<std::pair<int64_t, int64_t>> storedRanges;
+    int64_t startedAt = 0;
+    // Steady milliseconds since which no connection holds a range of the transfer
+    uint64_t idleSince = 0;
+};
+
+// Outcome of a parallel transfer once a range ends
+enum class TransferStatus
+{
+    // Other ranges are still arriving
+    Pending,
+    // Every range is on disk; this connection carries the single ack
+    Stored,
+    // Every range ended but at least one failed, or they did not cover the file
+    Failed
+};
+
+// A size header of -4 starts or resumes an upload: a ResumeHeader follows, the server answers
+// with the 8-byte offset it holds durably, and the client sends the rest of the file
+const int64_t resumableUploadRequest = -4;
+
+struct ResumeHeader
+{
+    // Chosen by the client and stable across its retries of the same file; the server keeps
+    // the transfers of each machine apart
+    uint64_t transferId;
+    int64_t fileSize;
+    // CRC-32C of the whole file, checked against everything received before the version is committed
+    uint32_t crc;
+    uint32_t reserved;
+};
+
+// A resumable upload flushes its partial file and records the offset at least this often
+const int64_t resumeCheckpointBytes = 64ll << 20;
+
+// A size header of -5 opens a session: manifests and any number of files follow as frames, interleaved by
+// stream ID, until the client closes the connection
+const int64_t sessionRequest = -5;
+
+// Session frame: <uint8 type><uint32 stream><uint32 payload length><payload>
+enum class FrameType : uint8_t
+{
+    // Payload is the int64 file size, optionally followed by the file name the catalog keeps
+    // the version under
+    FileBegin = 1,
+    FileData = 2,
+    // No payload; every announced byte must have arrived
+    FileEnd = 3,
+    // Server to client, payload is the response text of one file
+    Ack = 4,
+    // Payload is entries <uint16 name length><name><int64 size><int64 mtime><uint32 CRC-32C> of
+    // files the client could send; the stream field only pairs it with its answer
+    Manifest = 5,
+    // Server to client, answering a manifest frame: one byte per entry, 1 if the file is needed
+    Needed = 6
+};
+
+const size_t frameHeaderSize = 9;
+const uint32_t maxFramePayload = 1 << 20;
+// Longest file name a session may give a version
+const size_t maxFileNameLength = 4096;
+// Files a session may have open at once
+const size_t maxSessionStreams = 64;
+
+// One file of a session, between its begin and end frames
+struct SessionStream
+{
+    std::unique_ptr<BackupSink> sink;
+    // The sink, when it writes behind; its file then ends on the disk thread
+    WriteBehindSink *writeBehind = nullptr;
+    // FileEnd arrived; the disk thread writes the last buffers, then the commit thread records the
+    // version, and the stream is acked once both are done
+    bool draining = false;
+    std::shared_ptr<CommitJob> commit;
+    std::string versionPath;
+    // Catalog file name of the version
+    std::string fileName;
+    // CRC-32C of the bytes received, so a later manifest can tell the file is unchanged
+    uint32_t crc = 0;
+    int64_t fileSize = 0;
+    int64_t bytesReceived = 0;
+    int64_t startedAt = 0;
+};
+
+// Frame parser state and open files of a session
+struct Session
+{
+    char header[frameHeaderSize];
+    size_t headerReceived = 0;
+
+    // Frame being read, and its payload bytes still to come
+    FrameType type = FrameType::FileData;
+    uint32_t stream = 0;
+    uint32_t payloadRemaining = 0;
+    // Payload of a begin frame, which is handled once complete
+    std::string control;
+
+    std::unordered_map<uint32_t, SessionStream> streams;
+    size_t drainingStreams = 0;
+    size_t filesStored = 0;
+
+    // A file's begin frame waits while the memory budget is exhausted; the bytes read past its
+    // header are kept, and handled in order once the budget has room
+    bool beginHeld = false;
+    std::string held;
+};
+
+// A size header of -6 starts a chunk-acknowledged upload: a ChunkedHeader follows, then chunks of
+// <uint32 index><uint32 length><uint32 CRC-32C><payload>, retransmissions in any order. The server
+// answers each chunk with <uint32 index><uint8 ChunkStatus>, and "File received" after the last
+const int64_t chunkedUploadRequest = -6;
+
+struct ChunkedHeader
+{
+    int64_t fileSize;
+    // Every chunk but the last has this size
+    uint32_t chunkSize;
+    // Unacknowledged chunks the client keeps in flight
+    uint32_t window;
+};
+
+enum class ChunkStatus : uint8_t
+{
+    // Checksum matched and the chunk is flushed to disk
+    Stored = 0,
+    // Checksum mismatch; the client sends the chunk again
+    Retransmit = 1
+};
+
+// A size header of -7 offers a file before sending it: an OfferHeader follows and the server
+// answers with one OfferStatus byte. On Send the client follows with the body as in a plain
+// upload; on AlreadyStored the upload is over
+const int64_t offeredUploadRequest = -7;
+
+// A size header of -8 keeps the connection open for further requests: after each plain or
+// offered upload the server reads the next size header instead of closing, and ends the text
+// response with '\n' since the close no longer marks its end. The other requests close as before
+const int64_t keepAliveRequest = -8;
+
+struct OfferHeader
+{
+    int64_t fileSize;
+    // CRC-32C of the whole file
+    uint32_t crc;
+    uint32_t reserved;
+};
+
+enum class OfferStatus : uint8_t
+{
+    Send = 0,
+    // The newest version of the machine already has this size and CRC-32C
+    AlreadyStored = 1
+};
+
+// Server side of a chunk-acknowledged upload: verifies each chunk while writing it in place and
+// acks the good ones in batches, each batch behind one flush of the file
+class ChunkedUpload
+{
+public:
+    ChunkedUpload(const ChunkedHeader &header, std::unique_ptr<RangeSink> file);
+
+    // Consume chunk bytes, appending acks to send; false on a protocol or storage error
+    bool feed(const char *data, size_t size, std::string &acks);
+
+    // Every chunk is stored and acknowledged
+    bool finished() const { return storedCount_ == chunkCount_ && pending_.empty(); }
+
+    // Close the file
+    bool finish() { return file_->finish(); }
+
+    static const size_t chunkHeaderSize = 3 * sizeof(uint32_t);
+
+private:
+    // Flush the file and ack the chunks written since the last flush
+    bool flushAcks(std::string &acks);
+    static void appendAck(std::string &acks, uint32_t index, ChunkStatus status);
+
+    ChunkedHeader header_;
+    uint32_t chunkCount_;
+    std::unique_ptr<RangeSink> file_;
+
+    // Chunk being received
+    char chunkHeader_[chunkHeaderSize];
+    size_t chunkHeaderReceived_ = 0;
+    uint32_t index_ = 0;
+    uint32_t remaining_ = 0;
+    uint32_t expectedCrc_ = 0;
+    uint32_t crc_ = 0;
+
+    // Chunks written with a good checksum, and those among them not yet flushed and acked
+    std::vector<bool> stored_;
+    uint32_t storedCount_ = 0;
+    std::vector<uint32_t> pending_;
+};
+
+// Receive size of a connection, tuned between the --chunk-min and --chunk-max bounds. Each
+// window of receives is timed from the recv to the end of its storage, and the size keeps
+// doubling or halving while bytes per busy second rise, turning round when they stop rising
+class ChunkSizer
+{
+public:
+    ChunkSizer(size_t minSize = 4 * 1024, size_t maxSize = 1024 * 1024);
+
+    // Bytes to ask the next receive for
+    size_t size() const { return size_; }
+
+    // Account one receive of bytes that kept the worker busy for seconds
+    void record(size_t bytes, double seconds);
+
+private:
+    // Receives per measurement window
+    static const uint32_t windowCalls = 16;
+
+    size_t minSize_;
+    size_t maxSize_;
+    size_t size_;
+    // 1 while doubling, -1 while halving
+    int direction_ = 1;
+    // Bytes per second of the previous window, 0 before the first
+    double lastRate_ = 0;
+    uint32_t windowCallCount_ = 0;
+    uint64_t windowBytes_ = 0;
+    double windowSeconds_ = 0;
+};
+
+struct Connection;
+
+// Entry of a connection in its worker's timer wheel; it leaves the wheel when destroyed
+struct TimerNode
+{
+    TimerNode() = default;
+    TimerNode(const TimerNode &) = delete;
+    TimerNode &operator=(const TimerNode &) = delete;
+    ~TimerNode() { unlink(); }
+
+    bool linked() const { return next != nullptr; }
+    void unlink()
+    {
+        if (next)
+        {
+            prev->next = next;
+            next->prev = prev;
+            prev = next = nullptr;
+        }
+    }
+
+    TimerNode *prev = nullptr;
+    TimerNode *next = nullptr;
+    // Tick the timer is due at
+    uint64_t expiry = 0;
+    Connection *connection = nullptr;
+};
+
+// Hierarchical timing wheel: four levels of 64 slots, 100 ms per slot on the first and 64 times
+// coarser on each next one, reaching 19 days. Scheduling and cancelling unlink and link a list
+// node; a coarser slot is spread over the finer levels when time reaches it. Timers fire within
+// a tick after they are due, never before, except past the 19 days, which fire at the edge
+class TimerWheel
+{
+public:
+    static const uint64_t tickMilliseconds = 100;
+
+    explicit TimerWheel(uint64_t nowMilliseconds);
+    TimerWheel(const TimerWheel &) = delete;
+    TimerWheel &operator=(const TimerWheel &) = delete;
+
+    // Schedule the node, moving it if it is already scheduled
+    void schedule(TimerNode &node, uint64_t dueMilliseconds);
+
+    // Advance to now and collect the connections of the timers that came due, unlinked
+    void advance(uint64_t nowMilliseconds, std::vector<Connection *> &due);
+
+    // Milliseconds the event loop may wait before the wheel has timers due, -1 if it has none
+    int pollTimeout(uint64_t nowMilliseconds) const;
+
+private:
+    static const int levelCount = 4;
+    static const int slotBits = 6;
+    static const uint64_t slotCount = 1 << slotBits;
+
+    // Link the node into the slot of its expiry, relative to the current tick
+    void insert(TimerNode &node);
+    bool empty() const;
+
+    // Circular list sentinel of every slot
+    TimerNode slots_[levelCount][slotCount];
+    // Last tick whose timers were collected
+    uint64_t currentTick_;
+};
+
+// State of one client upload: 8-byte size header, file body, then the response
+struct Connection
+{
+    enum class State
+    {
+        ReadingSize,
+        ReadingBody,
+        ReadingRequestSize,
+        ReadingRangeHeader,
+        ReadingResumeHeader,
+        ReadingChunkedHeader,
+        ReadingOfferHeader,
+        ReadingChunks,
+        // Delta upload waiting for the signature thread to read its base
+        WaitingSignatures,
+        SendingSignatures,
+        SendingOffset,
+        ReadingDelta,
+        ReadingCompressed,
+        ReadingSession,
+        // Upload complete, waiting for the disk thread to write it out
+        Draining,
+        // Version stored, waiting for the commit thread to record it in the catalog
+        Committing,
+        SendingResponse,
+        // Response sent on a keep-alive connection, which the poll loop renews for the next request
+        KeptAlive,
+        Closed
+    };
+
+    explicit Connection(SOCKET socket) : socket(socket) {}
+
+    // Waiting for the socket to take queued bytes rather than to deliver them
+    bool sending() const
+    {
+        return state == State::SendingSignatures || state == State::SendingOffset || state == State::SendingResponse;
+    }
+
+    // Kept alive and idle in the client's pool, before the first byte of its next request
+    bool betweenRequests() const { return keepAlive && state == State::ReadingSize && sizeBytesReceived == 0; }
+
+    SOCKET socket;
+    State state = State::ReadingSize;
+
+    // Client address and connection time, recorded in the catalog with every version stored
+    std::string machine;
+    int64_t startedAt = unixMilliseconds();
+
+    // Size header, filled in as many recv calls as it takes; a negative first header is
+    // a request code, followed by the real size
+    int64_t fileSize = 0;
+    size_t sizeBytesReceived = 0;
+    int64_t request = 0;
+
+    // Body progress and destination, the mapped file in zero-copy mode
+    int64_t bytesReceived = 0;
+    // CRC-32C of a plain upload, updated as each recv lands
+    bool hashBody = false;
+    uint32_t bodyCrc = 0;
+    std::unique_ptr<BackupSink> sink;
+    // The sink, when it writes behind
+    WriteBehindSink *writeBehind = nullptr;
+    // The sink, when it receives into aligned buffers for unbuffered writes
+    UnbufferedBackupSink *unbuffered = nullptr;
+    MappedBackupFile mappedFile;
+    bool zeroCopy = false;
+    std::string versionPath;
+    // Catalog commit of the finished version while Committing
+    std::shared_ptr<CommitJob> commitJob;
+
+    // Rebuilds the version in delta mode, or checks the codec stream of a compressed upload
+    std::unique_ptr<DeltaDecoder> delta;
+    std::shared_ptr<SignatureJob> signatureJob;
+    std::unique_ptr<CompressedUpload> compressed;
+
+    // Range header and transfer of a parallel upload; the body is the range
+    RangeHeader range = {};
+    std::shared_ptr<ParallelTransfer> transfer;
+
+    // Resumable upload: the body goes to a partial file named after the machine and transfer ID,
+    // which this connection holds until it completes or drops
+    ResumeHeader resume = {};
+    bool resuming = false;
+    std::string resumePath;
+    // The sink writing the partial file, and the byte count at which it next records a checkpoint
+    RangeSink *partial = nullptr;
+    int64_t checkpointAt = 0;
+
+    // Session mode; acks queue up in response while frames keep being read
+    std::unique_ptr<Session> session;
+
+    // Chunk-acknowledged upload, whose acks also go out while chunks are read
+    ChunkedHeader chunkedHeader = {};
+    std::unique_ptr<ChunkedUpload> chunked;
+
+    // Offered upload, answered from the catalog before any of the body is sent
+    OfferHeader offer = {};
+
+    // Size of the receives into the worker's buffer
+    ChunkSizer chunkSizer;
+
+    // Keep-alive connection, and whether the request in progress leaves it open once answered
+    bool keepAlive = false;
+    bool reusable = false;
+
+    // Admitted by the memory budget and charged this much, or left unread until it has room
+    bool admitted = false;
+    bool awaitingAdmission = false;
+    size_t charged = 0;
+
+    // Timeouts, in the worker's steady milliseconds: the wheel entry, the start of the request
+    // whose header is awaited, the last byte moved either way, and the current window of the
+    // minimum rate with the bytes received in it. The server's own stalls set stalledByServer,
+    // and the time they took is not held against the client
+    TimerNode timer;
+    uint64_t requestStartedAt = 0;
+    uint64_t lastProgressAt = 0;
+    uint64_t rateWindowStart = 0;
+    uint64_t rateWindowBytes = 0;
+    bool stalledByServer = false;
+
+    // Signatures or response still to be sent
+    std::string response;
+    size_t responseSent = 0;
+};
+
+// Command line settings of the server
+struct ServerOptions
+{
+    std::string ip = "127.0.0.1";
+    int port = 12345;
+    // Number of event loop threads, one per core by default
+    size_t workerCount = std::thread::hardware_concurrency();
+    // Use the I/O completion port backend instead of WSAPoll
+    bool useIocp = false;
+    // Receive WSAPoll upload bodies directly into a mapping of the backup file
+    bool zeroCopy = false;
+    // Store WSAPoll upload bodies as deduplicated chunks plus a recipe per version
+    bool dedup = false;
+    // Queue WSAPoll upload bodies for a disk thread, holding up to this many MB; 0 writes inline
+    size_t writeBehindMegabytes = 0;
+    // Write plain WSAPoll uploads preallocated and around the page cache
+    bool unbuffered = false;
+    // Append WSAPoll upload bodies to pack segments instead of a file per version
+    bool packed = false;
+    // Versions kept per machine, older ones are deleted; 0 keeps all
+    size_t keepVersions = 0;
+    // Bounds of the adaptive receive size of WSAPoll connections, in KB
+    size_t chunkMinKilobytes = 4;
+    size_t chunkMaxKilobytes = 1024;
+    // Memory for WSAPoll requests in all and per client machine, in MB, and requests in flight;
+    // 0 leaves a limit off
+    size_t memoryBudgetMegabytes = 512;
+    size_t clientBudgetMegabytes = 128;
+    size_t maxUploads = 0;
+    // WSAPoll clients are dropped when a request header takes this many seconds, when nothing
+    // moves either way for this many, or when a body arrives slower than this many bytes per
+    // second over a rate window; 0 leaves a limit off
+    size_t headerTimeoutSeconds = 10;
+    size_t idleTimeoutSeconds = 300;
+    size_t minRateBytes = 1024;
+    // Largest file a request may announce, in GB; the header is checked before anything is
+    // created or reserved for it. 0 leaves the limit off
+    size_t maxFileGigabytes = 256;
+    // Take the listening socket over from the server running on the port, which drains its
+    // uploads and exits, instead of binding a new one
+    bool takeover = false;
+};
+
+// I/O counters of one worker, written by that worker only and read by the stats report
+struct IoStats
+{
+    // Socket and file calls issued, including polls and completion dequeues
+    std::atomic<uint64_t> ioCalls{0};
+    std::atomic<uint64_t> bytesReceived{0};
+
+    void count(uint64_t calls, uint64_t bytes = 0)
+    {
+        ioCalls.fetch_add(calls, std::memory_order_relaxed);
+        bytesReceived.fetch_add(bytes, std::memory_order_relaxed);
+    }
+};
+
+// Memory the WSAPoll workers hold for requests, against a global budget, a budget per client
+// machine and a cap on requests in flight. A connection is admitted when its request arrives and
+// charged for its buffers until the request ends; until then it is not read, so TCP flow control
+// holds the client back rather than the server buffering for it
+class MemoryBudget
+{
+public:
+    // Limits in bytes and requests; 0 leaves a limit off
+    MemoryBudget(size_t totalBytes, size_t clientBytes, size_t maxUploads)
+        : totalBytes_(totalBytes), clientBytes_(clientBytes), maxUploads_(maxUploads) {}
+    MemoryBudget(const MemoryBudget &) = delete;
+    MemoryBudget &operator=(const MemoryBudget &) = delete;
+    ~MemoryBudget();
+
+    // Create the socket that wakes waiting workers
+    bool start();
+
+    // Admit a request of a machine charged bytes, if every limit has room. A request alone on the
+    // server, or alone from its machine, is admitted regardless, so one larger than a budget runs
+    bool admit(const std::string &machine, size_t bytes);
+
+    // Move an admitted request's charge, as its buffers grow or shrink
+    void recharge(const std::string &machine, size_t from, size_t to);
+
+    // End an admitted request and free its charge
+    void release(const std::string &machine, size_t bytes);
+
+    // Whether the charges, which may grow past admission, are over the global budget
+    bool exhausted() const { return totalBytes_ > 0 && chargedBytes_.load(std::memory_order_relaxed) > totalBytes_; }
+
+    // Hold an admitted request, a session about to begin another file, while the budget is
+    // exhausted; false if every other admitted request is held already, so one always goes on
+    // to finish and free memory
+    bool hold();
+    // Whether a held request still has to wait, and the end of its hold
+    bool keepHolding();
+    void unhold();
+
+    // Wake the worker at wakeAddress the next time a charge drops, a request ends or a hold ends,
+    // for a request waiting for admission or a session held at a file's begin. Ask before checking
+    // the budget, so room made in between still wakes the poll
+    void wakeWhenFreed(const sockaddr_in &wakeAddress);
+
+    size_t chargedBytes() const { return chargedBytes_.load(std::memory_order_relaxed); }
+    size_t peakBytes() const { return peakBytes_.load(std::memory_order_relaxed); }
+    size_t totalBytes() const { return totalBytes_; }
+    size_t maxUploads() const { return maxUploads_; }
+    size_t uploads() const { return uploads_.load(std::memory_order_relaxed); }
+
+    // Requests that had to wait for admission
+    void countDeferral() { deferrals_.fetch_add(1, std::memory_order_relaxed); }
+    uint64_t deferrals() const { return deferrals_.load(std::memory_order_relaxed); }
+
+private:
+    struct Client
+    {
+        size_t bytes = 0;
+        size_t uploads = 0;
+    };
+
+    // Apply a change of the global charge and track its peak; called under the mutex
+    void charge(size_t from, size_t to);
+
+    // Send a wake-up datagram to each worker taken from freedWaiters_; called without the mutex
+    void wake(const std::vector<sockaddr_in> &waiters);
+
+    size_t totalBytes_;
+    size_t clientBytes_;
+    size_t maxUploads_;
+    std::mutex mutex_;
+    std::unordered_map<std::string, Client> clients_;
+    // Admitted requests on hold; guarded by mutex_
+    size_t held_ = 0;
+    SOCKET wakeSocket_ = INVALID_SOCKET;
+    // Workers holding requests back until memory is freed; guarded by mutex_
+    std::vector<sockaddr_in> freedWaiters_;
+    // Written under the mutex, read without it by the poll loops and the stats report
+    std::atomic<size_t> chargedBytes_{0};
+    std::atomic<size_t> peakBytes_{0};
+    std::atomic<size_t> uploads_{0};
+    std::atomic<uint64_t> deferrals_{0};
+};
+
+class TCPServer;
+
+// Thread that opens the bases of delta uploads and reads their signatures, computing them on
+// first use, so a large base never holds up an event loop. A finished job wakes its worker
+// through the worker's wake-up socket, which outlives any worker that has exited
+class SignatureQueue
+{
+public:
+    explicit SignatureQueue(TCPServer &server) : server_(server) {}
+    SignatureQueue(const SignatureQueue &) = delete;
+    SignatureQueue &operator=(const SignatureQueue &) = delete;
+    // Finish the queued jobs, then stop the thread
+    ~SignatureQueue();
+
+    bool start();
+    void push(const std::shared_ptr<SignatureJob> &job);
+
+private:
+    void run();
+
+    TCPServer &server_;
+    SOCKET wakeSocket_ = INVALID_SOCKET;
+    std::thread thread_;
+    std::mutex mutex_;
+    std::condition_variable jobReady_;
+    std::deque<std::shared_ptr<SignatureJob>> jobs_;
+    bool stopping_ = false;
+};
+
+// Thread that commits finished versions, so no event loop waits for a flush. A round takes every
+// job queued, flushes the data of each version, appends their records to the catalog and then
+// flushes the log once for all of them, and wakes the workers waiting
+class CommitQueue
+{
+public:
+    // Threads a round's data flushes are spread over
+    static const size_t flushThreads = 4;
+
+    explicit CommitQueue(TCPServer &server) : server_(server) {}
+    CommitQueue(const CommitQueue &) = delete;
+    CommitQueue &operator=(const CommitQueue &) = delete;
+    // Commit the queued jobs, then stop the thread
+    ~CommitQueue();
+
+    bool start();
+    void push(const std::shared_ptr<CommitJob> &job);
+
+    // Rounds run and versions committed in them, for the stats report
+    uint64_t rounds() const { return rounds_.load(std::memory_order_relaxed); }
+    uint64_t versions() const { return versions_.load(std::memory_order_relaxed); }
+
+private:
+    void run();
+
+    TCPServer &server_;
+    SOCKET wakeSocket_ = INVALID_SOCKET;
+    std::thread thread_;
+    std::mutex mutex_;
+    std::condition_variable jobReady_;
+    std::deque<std::shared_ptr<CommitJob>> jobs_;
+    bool stopping_ = false;
+    std::atomic<uint64_t> rounds_{0};
+    std::atomic<uint64_t> versions_{0};
+};
+
+// One event loop pinned to a core, serving the connections run()'s accept thread hands it through
+// adopt()
+class Worker
+{
+public:
+    Worker(TCPServer &server, size_t index)
+        : server_(server), index_(index), now_(steadyMilliseconds()), timers_(now_) {}
+    ~Worker();
+
+    // Create the wake-up socket; must succeed before run() or adopt()
+    bool init();
+
+    // Poll this worker's uploads until an error stops the loop, or until a draining server has
+    // none left
+    void run();
+
+    // Hand an accepted socket to this worker; safe to call from the accepting thread
+    bool adopt(SOCKET clientSocket);
+
+    // End the worker's current poll, from any thread
+    void wake();
+
+    IoStats stats;
+
+private:
+    // Start serving the sockets handed over by adopt()
+    void adoptConnections();
+
+    // Advance a connection's state machine with whatever the socket has ready
+    void handleReadable(Connection &connection);
+    void handleWritable(Connection &connection);
+
+    // Open the next backup_N.nc for an upload whose size header is complete
+    bool openBackupFile(Connection &connection, bool allowZeroCopy);
+
+    // Buffered destination of a version of a known size: chunks plus recipe with --dedup, a pack
+    // record with --packed, else the plain file, behind the disk thread with --write-behind
+    std::unique_ptr<BackupSink> openVersionSink(const std::string &path, int64_t fileSize);
+
+    // Store a compressed upload as "backup_N.nc.gcz", the codec stream unchanged, or decoded
+    // into the chunk or pack store
+    bool startCompressedUpload(Connection &connection);
+
+    // Join the parallel transfer named by the range header and open the range for writing
+    bool startRangeUpload(Connection &connection);
+
+    // Open the partial file of a resumable upload and queue the offset it already holds
+    bool startResumableUpload(Connection &connection);
+
+    // Flush the partial file, then record how much of it is durable
+    bool checkpointResume(Connection &connection);
+
+    // Answer an offer, opening the backup file first when the body is wanted
+    bool startOfferedUpload(Connection &connection);
+
+    // Preallocate the next backup_N.nc for a chunk-acknowledged upload
+    bool startChunkedUpload(Connection &connection);
+
+    // Close the file and commit it, then queue "File received" behind the last acks
+    void finishChunkedUpload(Connection &connection);
+
+    // Open the version a delta upload rebuilds and queue the lookup of its base
+    bool startDeltaUpload(Connection &connection);
+
+    // Start the decoder and send the signatures, once the signature thread has them
+    void sendSignatures(Connection &connection);
+
+    // Close the file and hand the version to the commit thread, or queue the error for the client
+    void finishUpload(Connection &connection);
+
+    // Queue the commit of a finished version; the commit thread wakes this worker once it has run
+    std::shared_ptr<CommitJob> queueCommit(const std::string &machine, const std::string &versionPath, int64_t size,
+                                           int64_t receivedAt, bool hasCrc = false, uint32_t crc = 0,
+                                           const std::string &file = defaultBackupName);
+
+    // Reply to a Committing connection whose commit has run
+    void finishCommit(Connection &connection);
+    void replyToUpload(Connection &connection, bool saved);
+    void replyToChunked(Connection &connection, bool saved);
+
+    // Close the range; only the range that completes the transfer gets a response
+    void finishRange(Connection &connection);
+
+    // Parse session frames and write their files; false on a protocol or storage error
+    bool handleSessionData(Connection &connection, const char *data, size_t size);
+    // Handle the bytes a session held at a file's begin
+    void resumeSession(Connection &connection);
+    bool handleFrame(Connection &connection);
+
+    // Hand an ended session file to the commit thread, or ack the error and delete its files
+    void commitStream(Connection &connection, uint32_t id, bool written);
+    void ackStream(Connection &connection, uint32_t id, bool saved);
+
+    // Move on the ended session files whose disk writes or commit have run
+    void finishDrainedStreams(Connection &connection);
+
+    // Answer a manifest with the entries whose content the catalog does not have yet
+    bool answerManifest(Connection &connection);
+
+    // Append a frame to the connection's pending output
+    void queueFrame(Connection &connection, FrameType type, uint32_t stream, const std::string &payload);
+
+    // Close the client socket and mark the connection for removal, deleting the files of an
+    // upload it had not committed
+    void closeConnection(Connection &connection);
+
+    // Close the sink of a version that will not be committed and delete its files, behind the
+    // buffers still queued when it writes behind
+    void abandonVersion(std::unique_ptr<BackupSink> sink, const std::string &versionPath);
+
+    // Fresh state on the socket of a kept-alive connection, for its next request
+    std::unique_ptr<Connection> renewConnection(Connection &connection);
+
+    // Admit the connection's request under the memory budget; false leaves it unread for now
+    bool admit(Connection &connection);
+
+    // Bring the connection's charge in line with the buffers it holds now
+    void chargeMemory(Connection &connection);
+
+    // User memory held by a connection: its state, pending response, sinks and session streams
+    size_t footprint(const Connection &connection) const;
+
+    // Start the timeouts of a new or renewed connection
+    void startTimeouts(Connection &connection);
+
+    // Close a connection whose timer fired past a limit, or reschedule it for its next deadline;
+    // activity only moves the timestamps, so most timers find the deadline has moved on
+    void checkTimeouts(Connection &connection);
+
+    TCPServer &server_;
+    // Position among the workers, also the core it is pinned to
+    size_t index_;
+    // Uploads currently in flight on this worker
+    std::vector<std::unique_ptr<Connection>> connections_;
+    // Receive buffer shared by all connections of the loop
+    std::vector<char> buffer_;
+    // Time at the start of the current round, for the timestamps of the timeouts
+    uint64_t now_;
+    TimerWheel timers_;
+    // Connections whose timers fired this round
+    std::vector<Connection *> dueConnections_;
+    // Loopback datagram socket polled in slot 0; a datagram sent to its own address wakes the
+    // poll, at most one pending at a time
+    SOCKET wakeSocket_ = INVALID_SOCKET;
+    sockaddr_in wakeAddress_;
+    std::atomic<bool> wakePending_{false};
+    // Sockets accepted for this worker and not yet picked up
+    std::mutex adoptedMutex_;
+    std::vector<SOCKET> adopted_;
+};
+
+// Upload on the completion port backend: the socket and file carry overlapped operations
+struct IocpConnection;
+
+// Overlapped operation; the OVERLAPPED comes first so completions cast back to the operation
+struct IocpOperation
+{
+    enum class Type
+    {
+        Receive,
+        Write,
+        Send,
+        // Posted by the commit thread once the version is recorded, or failed to be
+        Commit
+    };
+
+    OVERLAPPED overlapped;
+    Type type;
+    IocpConnection *connection;
+    // Buffer of a file write
+    size_t bufferIndex;
+};
+
+struct IocpConnection : Connection
+{
+    explicit IocpConnection(SOCKET socket) : Connection(socket) {}
+
+    HANDLE file = INVALID_HANDLE_VALUE;
+
+    // Two receive buffers: the next recv lands in one while the other is written to disk
+    std::vector<char> buffers[2];
+    bool bufferWriting[2] = {false, false};
+    size_t receiveBuffer = 0;
+
+    // Body bytes handed to WriteFile, and the bytes that have completed
+    int64_t bytesQueued = 0;
+    int64_t bytesWritten = 0;
+
+    IocpOperation receiveOperation;
+    IocpOperation writeOperations[2];
+    IocpOperation sendOperation;
+    IocpOperation commitOperation;
+    bool receivePending = false;
+    bool sendPending = false;
+    int pendingOperations = 0;
+    // Socket closed, waiting for the cancelled operations to complete
+    bool closing = false;
+};
+
+// Completion-driven event loop: overlapped WSARecv feeds overlapped WriteFile through
+// double buffers, and completions are drained in batches with GetQueuedCompletionStatusEx
+class IocpWorker
+{
+public:
+    IocpWorker(TCPServer &server, size_t index) : server_(server), index_(index) {}
+    ~IocpWorker();
+
+    // Create the completion port; must succeed before run() or adopt()
+    bool init();
+
+    // Dequeue and dispatch completions until an error stops the loop, or until a draining server
+    // has no connections left
+    void run();
+
+    // Hand an accepted socket to this worker; safe to call from the accepting thread
+    bool adopt(SOCKET clientSocket);
+
+    // End the worker's current wait, from any thread
+    void wake();
+
+    IoStats stats;
+
+private:
+    // Start using a connection handed over by adopt()
+    void startConnection(IocpConnection *connection);
+
+    void onReceived(IocpConnection &connection, bool succeeded, DWORD bytes);
+    void onWritten(IocpConnection &connection, IocpOperation &operation, bool succeeded, DWORD bytes);
+    void onSent(IocpConnection &connection, bool succeeded, DWORD bytes);
+    void onCommitted(IocpConnection &connection);
+
+    // Act on a complete size or offer header
+    void onHeader(IocpConnection &connection);
+    // Open the version file for a body of connection.fileSize bytes; false if it cannot be stored
+    bool startBody(IocpConnection &connection);
+
+    // Post the next receive if the upload needs more data and a buffer is free
+    void postReceive(IocpConnection &connection);
+    void postWrite(IocpConnection &connection, size_t bufferIndex, DWORD bytes);
+    void postSend(IocpConnection &connection);
+
+    // Hand the version to the commit thread once every body byte is on disk and an offer's answer
+    // is out; its completion packet sends the response
+    void finishUploadIfDone(IocpConnection &connection);
+    void replyToUpload(IocpConnection &connection, bool saved);
+
+    // Wait for the next request of a kept-alive connection
+    void reuseConnection(IocpConnection &connection);
+
+    // Close the socket and file; the connection is freed when its last operation completes
+    void closeConnection(IocpConnection &connection);
+    void releaseIfIdle(IocpConnection &connection);
+
+    TCPServer &server_;
+    size_t index_;
+    HANDLE completionPort_ = nullptr;
+    std::vector<std::unique_ptr<IocpConnection>> connections_;
+};
+
+// TCPServer class that encapsulates the server logic
+class TCPServer
+{
+public:
+    // Constructor taking the command line settings as parameter
+    explicit TCPServer(const ServerOptions &options)
+        : ip_(options.ip), port_(options.port), workerCount_(std::max<size_t>(options.workerCount, 1)),
+          useIocp_(options.useIocp), zeroCopy_(options.zeroCopy), dedup_(options.dedup),
+          writeBehindMegabytes_(options.writeBehindMegabytes), unbuffered_(options.unbuffered),
+          packed_(options.packed), keepVersions_(options.keepVersions),
+          chunkMin_(options.chunkMinKilobytes * 1024), chunkMax_(options.chunkMaxKilobytes * 1024),
+          memoryBudget_(options.memoryBudgetMegabytes << 20, options.clientBudgetMegabytes << 20, options.maxUploads),
+          headerTimeout_(options.headerTimeoutSeconds * 1000), idleTimeout_(options.idleTimeoutSeconds * 1000),
+          minRate_(options.minRateBytes), maxFileSize_(static_cast<int64_t>(options.maxFileGigabytes) << 30),
+          takeover_(options.takeover) {}
+
+    // Initialize the server
+    bool init();
+
+    // Start listening for connections and run one worker per core until they stop
+    void run();
+
+    // Listening socket for incoming connections; only run()'s thread accepts on it, handing each
+    // connection round-robin to a worker's adopt()
+    SOCKET listenSocket() const { return listenSocket_; }
+
+    // Whether the listening socket went to a newer process and the last connection was handed to
+    // a worker; workers then finish their uploads and return
+    bool draining() const { return draining_; }
+
+    // Reserve the path of the next backup file, under a sequence number never used before
+    std::string nextBackupPath();
+
+    // Whether upload bodies are received into mapped backup files
+    bool zeroCopy() const { return zeroCopy_; }
+
+    // Whether plain upload bodies are written around the page cache
+    bool unbuffered() const { return unbuffered_; }
+
+    // Bounds of the receive size a connection's chunk sizer picks from
+    size_t chunkMin() const { return chunkMin_; }
+    size_t chunkMax() const { return chunkMax_; }
+
+    // Budget the WSAPoll workers admit requests under
+    MemoryBudget &memoryBudget() { return memoryBudget_; }
+
+    // Limits of slow and idle clients, in milliseconds and bytes per second; 0 is off
+    uint64_t headerTimeout() const { return headerTimeout_; }
+    uint64_t idleTimeout() const { return idleTimeout_; }
+    uint64_t minRate() const { return minRate_; }
+
+    // A size announced by a request header is one a file may have
+    bool acceptableFileSize(int64_t size) const
+    {
+        return size >= 0 && (maxFileSize_ == 0 || size <= maxFileSize_);
+    }
+
+    // Charge of a request on admission: the connection, plus the buffer of the sink a plain
+    // upload gets under the storage options
+    size_t uploadReserve() const;
+    // Buffer of the sink a file gets under the storage options, charged to each open session file
+    // until the sink holds one
+    size_t sinkReserve() const;
+
+    // Chunk store of deduplicated versions, or nullptr when versions are plain files
+    DedupStore *dedupStore() { return dedupStore_.get(); }
+
+    // Thread reading the bases of delta uploads
+    SignatureQueue &signatureQueue() { return *signatureQueue_; }
+
+    // Thread committing the versions the workers finish
+    CommitQueue &commitQueue() { return *commitQueue_; }
+
+    // Disk thread of --write-behind, or nullptr when sinks write inline
+    WriteBehindQueue *writeBehindQueue() { return writeBehindQueue_.get(); }
+
+    // Pack segments of --packed, or nullptr when versions are files of their own
+    PackStore *packStore() { return packStore_.get(); }
+
+    // Open a machine's newest stored version, the base of its delta uploads, and return the path
+    // its signatures are kept under; empty if there is none
+    std::string openLatestVersion(const std::string &machine, VersionReader &reader);
+
+    // Whether the newest version of a machine's file has this size and CRC-32C
+    bool hasVersion(const std::string &machine, const std::string &file, int64_t size, uint32_t crc);
+
+    // The steps of the commit thread recording a completely stored version in the catalog as the
+    // newest of a machine's file; the client may only be told once the record is durable. Flush the version's data, then append its record and the deletions of
+    // what falls out of --keep, which are durable once syncCatalog() returns true. The record goes
+    // after the data, so a record that survives a crash never points at bytes that did not; the
+    // expired files go only after the sync, so no surviving record points at a removed file
+    bool flushVersion(const CommitJob &job);
+    bool appendVersion(const CommitJob &job, std::vector<VersionRecord> &expired);
+    bool syncCatalog();
+    void removeExpired(const std::vector<VersionRecord> &expired);
+
+    // Register a range of a parallel upload, creating and preallocating the file for the
+    // first range of a transfer; nullptr if the header does not fit the transfer
+    std::shared_ptr<ParallelTransfer> joinTransfer(const RangeHeader &range);
+
+    // Record the end of a range, successful or not; the file of a failed transfer is deleted
+    TransferStatus endRange(ParallelTransfer &transfer, const RangeHeader &range, bool stored);
+
+    // Drop the transfers that no range connection has held for the idle timeout, and their files
+    void expireTransfers();
+
+    // Files of a resumable upload, without extension; they survive disconnects and server restarts
+    std::string resumePath(const std::string &machine, uint64_t transferId) const;
+
+    // Reserve a resumable transfer for one connection at a time; false if another holds it
+    bool claimResume(const std::string &resumePath);
+    void releaseResume(const std::string &resumePath);
+
+private:
+    // Accept connections for the workers, round-robin, so one connection wakes one thread
+    template <typename WorkerType>
+    void acceptForWorkers(std::vector<std::unique_ptr<WorkerType>> &workers);
+
+    // Create the listening socket and bind it to the address and port
+    bool bindListener();
+
+    // Receive the listening socket from the running server; it signals on drainPipe_ once it has
+    // stored its last upload and closed the catalog
+    bool takeOverListener();
+
+    // Open the catalog and the stores the options ask for
+    bool openStores();
+
+    // A connection accepted while the running server drains, and when
+    struct QueuedConnection
+    {
+        SOCKET socket;
+        uint64_t acceptedAt;
+    };
+
+    // After a takeover, accept connections into a queue until the running server has drained, then
+    // open the stores; false if they cannot be opened. The queue stops at its limit, leaving later
+    // connections in the listen backlog, and loses those past the header timeout once it drains
+    bool acceptWhileDraining(std::vector<QueuedConnection> &queued);
+
+    // Hand an accepted socket to the next worker, round-robin
+    template <typename WorkerType>
+    void handToWorker(std::vector<std::unique_ptr<WorkerType>> &workers, SOCKET clientSocket);
+
+    // Hand the listening socket to the first process that asks for it with --takeover, then set
+    // draining; runs on its own thread, blocked on the pipe
+    void serveTakeover();
+
+    // Print received bytes, I/O calls per MB and process CPU time per GB when they changed
+    void reportStats(const std::vector<const IoStats *> &stats);
+
+    // Stored file of a catalog sequence number
+    std::string backupPath(uint64_t sequence) const;
+
+    // IP address of the server
+    std::string ip_;
+    // Port number of the server
+    int port_;
+    // Number of event loop threads
+    size_t workerCount_;
+    // Completion port backend selected
+    bool useIocp_;
+    // Mapped-file receive selected
+    bool zeroCopy_;
+    // Deduplicating storage selected, and its chunk store
+    bool dedup_;
+    std::unique_ptr<DedupStore> dedupStore_;
+    // Write-behind selected, and its disk thread
+    size_t writeBehindMegabytes_;
+    std::unique_ptr<WriteBehindQueue> writeBehindQueue_;
+    std::unique_ptr<SignatureQueue> signatureQueue_;
+    bool unbuffered_;
+    bool packed_;
+    size_t keepVersions_;
+    size_t chunkMin_;
+    size_t chunkMax_;
+    MemoryBudget memoryBudget_;
+    uint64_t headerTimeout_;
+    uint64_t idleTimeout_;
+    uint64_t minRate_;
+    int64_t maxFileSize_;
+    bool takeover_;
+    // Set once the listening socket is handed over, then once accepting stopped, and the pipe to
+    // tell the new process when the catalog is free; the thread waiting for the request stops at
+    // shutdown
+    std::atomic<bool> handedOver_{false};
+    std::atomic<bool> draining_{false};
+    std::atomic<bool> stopping_{false};
+    HANDLE takeoverPipe_ = INVALID_HANDLE_VALUE;
+    // This process's end of the pipe after a takeover, until the running server has drained
+    HANDLE drainPipe_ = INVALID_HANDLE_VALUE;
+    std::thread takeoverThread_;
+    std::atomic<bool> takeoverFinished_{false};
+    // Worker threads still running
+    std::atomic<size_t> runningWorkers_{0};
+    // Round-robin position of the accept loop
+    size_t nextWorker_ = 0;
+    // Bytes reported by the last stats line
+    uint64_t reportedBytes_ = 0;
+    // Listening socket for incoming connections
+    SOCKET listenSocket_;
+    // Every stored version, and the source of backup file numbers
+    std::unique_ptr<VersionCatalog> catalog_;
+    // Declared after the catalog, since its compactor updates the catalog until it stops
+    std::unique_ptr<PackStore> packStore_;
+    // Declared after the stores, since it commits into them until it stops
+    std::unique_ptr<CommitQueue> commitQueue_;
+    // Parallel uploads with ranges still to come, by transfer ID
+    std::mutex transfersMutex_;
+    std::unordered_map<uint64_t, std::shared_ptr<ParallelTransfer>> transfers_;
+    // Resumable transfers with a connection attached
+    std::unordered_set<std::string> activeResumes_;
+};
+
+// Pipe a server started with --takeover asks the running one on its port for the listening socket
+static std::string takeoverPipeName(int port)
+{
+    return "\\\\.\\pipe\\file_backup_" + std::to_string(port);
+}
+
+// Read or write exactly this many bytes of a pipe
+static bool readPipe(HANDLE pipe, void *data, DWORD size)
+{
+    char *bytes = static_cast<char *>(data);
+    while (size > 0)
+    {
+        DWORD bytesRead = 0;
+        if (!ReadFile(pipe, bytes, size, &bytesRead, nullptr) || bytesRead == 0)
+        {
+            return false;
+        }
+        bytes += bytesRead;
+        size -= bytesRead;
+    }
+    return true;
+}
+
+static bool writePipe(HANDLE pipe, const void *data, DWORD size)
+{
+    const char *bytes = static_cast<const char *>(data);
+    while (size > 0)
+    {
+        DWORD bytesWritten = 0;
+        if (!WriteFile(pipe, bytes, size, &bytesWritten, nullptr))
+        {
+            return false;
+        }
+        bytes += bytesWritten;
+        size -= bytesWritten;
+    }
+    return true;
+}
+
+// Put a socket into non-blocking mode
+static bool setNonBlocking(SOCKET socket)
+{
+    u_long mode = 1;
+    return ioctlsocket(socket, FIONBIO, &mode) != SOCKET_ERROR;
+}
+
+// Address of a connected client, which names its machine in the version catalog
+static std::string peerAddress(SOCKET socket)
+{
+    sockaddr_in address;
+    int addressSize = sizeof(address);
+    char text[INET_ADDRSTRLEN] = "unknown";
+    if (getpeername(socket, (SOCKADDR *)&address, &addressSize) != SOCKET_ERROR)
+    {
+        inet_ntop(AF_INET, &address.sin_addr, text, sizeof(text));
+    }
+    return text;
+}
+
+// Catalog sequence of a path from TCPServer::nextBackupPath(), which ends in "backup_<sequence>.nc"
+static uint64_t sequenceOfPath(const std::string &versionPath)
+{
+    return std::stoull(versionPath.substr(versionPath.rfind("backup_") + 7));
+}
+
+// Keep an event loop and its connections' cache lines on one core
+static void pinToCore(size_t index)
+{
+    const size_t maskBits = sizeof(DWORD_PTR) * 8;
+    if (index < maskBits && index < std::thread::hardware_concurrency())
+    {
+        SetThreadAffinityMask(GetCurrentThread(), static_cast<DWORD_PTR>(1) << index);
+    }
+}
+
+// Writes a file of the given size with ofstream and unbuffered, and reports MB/s and page cache growth
+void runStorageBenchmark(size_t megabytes);
+
+// Prints the versions the catalog holds for a machine's file, newest first
+bool listVersions(const std::string &machine, const std::string &file);
+
+int main(int argc, char *argv[])
+{
+    // "storage-bench [MB]" compares the two ways to write a version, without serving
+    if (argc > 1 && std::string(argv[1]) == "storage-bench")
+    {
+        runStorageBenchmark(argc > 2 ? std::stoul(argv[2]) : 1024);
+        return 0;
+    }
+
+    // "versions <machine> [file]" reads the catalog of a stopped server
+    if (argc > 2 && std::string(argv[1]) == "versions")
+    {
+        return listVersions(argv[2], argc > 3 ? argv[3] : defaultBackupName) ? 0 : 1;
+    }
+
+    // Set IP address and port number, plus "--workers N", "--iocp", "--zero-copy", "--dedup",
+    // "--write-behind [MB]", "--unbuffered", "--packed", "--keep N", "--chunk-min KB", "--chunk-max KB",
+    // "--memory-budget MB", "--client-budget MB", "--max-uploads N", "--header-timeout S",
+    // "--idle-timeout S", "--min-rate B", "--max-file-size GB" and "--takeover"
+    ServerOptions options;
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+        if (arg == "--workers" && i + 1 < argc)
+        {
+            options.workerCount = std::stoul(argv[++i]);
+        }
+        else if (arg == "--iocp")
+        {
+            options.useIocp = true;
+        }
+        else if (arg == "--zero-copy")
+        {
+            options.zeroCopy = true;
+        }
+        else if (arg == "--dedup")
+        {
+            options.dedup = true;
+        }
+        else if (arg == "--unbuffered")
+        {
+            options.unbuffered = true;
+        }
+        else if (arg == "--packed")
+        {
+            options.packed = true;
+        }
+        else if (arg == "--keep" && i + 1 < argc)
+        {
+            options.keepVersions = std::stoul(argv[++i]);
+        }
+        else if (arg == "--chunk-min" && i + 1 < argc)
+        {
+            options.chunkMinKilobytes = std::stoul(argv[++i]);
+        }
+        else if (arg == "--chunk-max" && i + 1 < argc)
+        {
+            options.chunkMaxKilobytes = std::stoul(argv[++i]);
+        }
+        else if (arg == "--memory-budget" && i + 1 < argc)
+        {
+            options.memoryBudgetMegabytes = std::stoul(argv[++i]);
+        }
+        else if (arg == "--client-budget" && i + 1 < argc)
+        {
+            options.clientBudgetMegabytes = std::stoul(argv[++i]);
+        }
+        else if (arg == "--max-uploads" && i + 1 < argc)
+        {
+            options.maxUploads = std::stoul(argv[++i]);
+        }
+        else if (arg == "--header-timeout" && i + 1 < argc)
+        {
+            options.headerTimeoutSeconds = std::stoul(argv[++i]);
+        }
+        else if (arg == "--idle-timeout" && i + 1 < argc)
+        {
+            options.idleTimeoutSeconds = std::stoul(argv[++i]);
+        }
+        else if (arg == "--min-rate" && i + 1 < argc)
+        {
+            options.minRateBytes = std::stoul(argv[++i]);
+        }
+        else if (arg == "--max-file-size" && i + 1 < argc)
+        {
+            options.maxFileGigabytes = std::stoul(argv[++i]);
+        }
+        else if (arg == "--takeover")
+        {
+            options.takeover = true;
+        }
+        else if (arg == "--write-behind")
+        {
+            // Optional queue size in MB
+            options.writeBehindMegabytes = i + 1 < argc && std::isdigit(static_cast<unsigned char>(argv[i + 1][0])) ? std::stoul(argv[++i]) : 64;
+        }
+        else
+        {
+            std::cerr << "Unknown option: " << arg << std::endl;
+            return 1;
+        }
+    }
+
+    // Chunking needs the bytes in user memory, which the other two paths avoid
+    if (options.dedup && (options.useIocp || options.zeroCopy))
+    {
+        std::cerr << "--dedup cannot be combined with --iocp or --zero-copy." << std::endl;
+        return 1;
+    }
+
+    // Those two already keep the disk off the receive path
+    if (options.writeBehindMegabytes > 0 && (options.useIocp || options.zeroCopy))
+    {
+        std::cerr << "--write-behind cannot be combined with --iocp or --zero-copy." << std::endl;
+        return 1;
+    }
+
+    // Unbuffered writes replace the other storage paths of a plain upload
+    if (options.unbuffered &&
+        (options.useIocp || options.zeroCopy || options.dedup || options.writeBehindMegabytes > 0))
+    {
+        std::cerr << "--unbuffered cannot be combined with --iocp, --zero-copy, --dedup or --write-behind."
+                  << std::endl;
+        return 1;
+    }
+
+    // Packs take the buffered sink path, which those three bypass or replace
+    if (options.packed && (options.useIocp || options.zeroCopy || options.dedup || options.unbuffered))
+    {
+        std::cerr << "--packed cannot be combined with --iocp, --zero-copy, --dedup or --unbuffered." << std::endl;
+        return 1;
+    }
+
+    // recv takes an int length; equal bounds fix the receive size
+    if (options.chunkMinKilobytes == 0 || options.chunkMinKilobytes > options.chunkMaxKilobytes ||
+        options.chunkMaxKilobytes > 1024 * 1024)
+    {
+        std::cerr << "--chunk-min and --chunk-max need 1 <= min <= max <= 1048576 KB." << std::endl;
+        return 1;
+    }
+
+    // Create a TCPServer instance
+    TCPServer server(options);
+
+    // Initialize the server
+    if (server.init())
+    {
+        // Run the server
+        server.run();
+    }
+    else
+    {
+        std::cerr << "Failed to initialize the server." << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
+
+bool TCPServer::init()
+{
+    WSADATA wsaData;
+    // Initialize Winsock
+    int result = WSAStartup(MAKEWORD(2, 2), &wsaData);
+    if (result != 0)
+    {
+        std::cerr << "WSAStartup failed: " << result << std::endl;
+        return false;
+    }
+
+    // The running server keeps accepting until this process holds the socket, and this process
+    // accepts from then on, queuing connections while the other drains, so none are refused
+    // during a restart
+    if (takeover_)
+    {
+        if (!takeOverListener())
+        {
+            WSACleanup();
+            return false;
+        }
+    }
+    else if (!bindListener())
+    {
+        WSACleanup();
+        return false;
+    }
+
+    if (!memoryBudget_.start())
+    {
+        closesocket(listenSocket_);
+        WSACleanup();
+        return false;
+    }
+
+    // After a takeover the stores are the running server's until it drains; run() opens them then
+    if (!takeover_ && !openStores())
+    {
+        closesocket(listenSocket_);
+        WSACleanup();
+        return false;
+    }
+
+    // accept() must never block the event loop
+    if (!setNonBlocking(listenSocket_))
+    {
+        std::cerr << "Error setting non-blocking mode: " << WSAGetLastError() << std::endl;
+        closesocket(listenSocket_);
+        WSACleanup();
+        return false;
+    }
+
+    return true;
+}
+
+bool TCPServer::openStores()
+{
+    // Version numbers continue where the last run stopped
+    catalog_ = std::make_unique<VersionCatalog>(backupFolder);
+    if (!catalog_->open())
+    {
+        return false;
+    }
+
+    if (packed_)
+    {
+        packStore_ = std::make_unique<PackStore>(backupFolder, *catalog_);
+        if (!packStore_->init())
+        {
+            return false;
+        }
+    }
+
+    if (writeBehindMegabytes_ > 0)
+    {
+        writeBehindQueue_ = std::make_unique<WriteBehindQueue>(writeBehindMegabytes_ << 20);
+        if (!writeBehindQueue_->start())
+        {
+            return false;
+        }
+    }
+
+    signatureQueue_ = std::make_unique<SignatureQueue>(*this);
+    commitQueue_ = std::make_unique<CommitQueue>(*this);
+    if (!signatureQueue_->start() || !commitQueue_->start())
+    {
+        return false;
+    }
+
+    if (dedup_)
+    {
+        dedupStore_ = std::make_unique<DedupStore>(backupFolder);
+        if (!dedupStore_->init())
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool TCPServer::bindListener()
+{
+    // Create a socket
+    listenSocket_ = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (listenSocket_ == INVALID_SOCKET)
+    {
+        std::cerr << "Error creating socket: " << WSAGetLastError() << std::endl;
+        return false;
+    }
+
+    // Set up server address and bind the socket
+    sockaddr_in serverAddress;
+    serverAddress.sin_family = AF_INET;
+    serverAddress.sin_port = htons(port_);
+    inet_pton(AF_INET, ip_.c_str(), &serverAddress.sin_addr.s_addr);
+
+    // Accept data in the SYN from clients that reconnect with TCP Fast Open; the handshake just
+    // takes the usual round trip where the system does not support it
+    DWORD fastOpen = 1;
+    if (setsockopt(listenSocket_, IPPROTO_TCP, TCP_FASTOPEN, reinterpret_cast<const char *>(&fastOpen),
+                   sizeof(fastOpen)) == SOCKET_ERROR)
+    {
+        std::cerr << "TCP Fast Open unavailable: " << WSAGetLastError() << std::endl;
+    }
+
+    int result = bind(listenSocket_, (SOCKADDR *)&serverAddress, sizeof(serverAddress));
+    if (result == SOCKET_ERROR)
+    {
+        std::cerr << "Error binding socket: " << WSAGetLastError() << std::endl;
+        closesocket(listenSocket_);
+        return false;
+    }
+    return true;
+}
+
+bool TCPServer::takeOverListener()
+{
+    std::string pipeName = takeoverPipeName(port_);
+    HANDLE pipe = CreateFileA(pipeName.c_str(), GENERIC_READ | GENERIC_WRITE, 0, nullptr, OPEN_EXISTING, 0, nullptr);
+    if (pipe == INVALID_HANDLE_VALUE)
+    {
+        std::cerr << "No server to take over on port " << port_ << ": " << GetLastError() << std::endl;
+        return false;
+    }
+
+    // The running server duplicates the socket into this process by its ID, and keeps its own
+    // handle until the duplicate is confirmed open
+    DWORD processId = GetCurrentProcessId();
+    WSAPROTOCOL_INFOA protocolInfo;
+    if (!writePipe(pipe, &processId, sizeof(processId)) || !readPipe(pipe, &protocolInfo, sizeof(protocolInfo)))
+    {
+        std::cerr << "Error receiving the listening socket: " << GetLastError() << std::endl;
+        CloseHandle(pipe);
+        return false;
+    }
+    listenSocket_ = WSASocketA(FROM_PROTOCOL_INFO, FROM_PROTOCOL_INFO, FROM_PROTOCOL_INFO, &protocolInfo, 0,
+                               WSA_FLAG_OVERLAPPED);
+    if (listenSocket_ == INVALID_SOCKET)
+    {
+        std::cerr << "Error opening the listening socket: " << WSAGetLastError() << std::endl;
+        CloseHandle(pipe);
+        return false;
+    }
+    char confirmed = 1;
+    if (!writePipe(pipe, &confirmed, sizeof(confirmed)))
+    {
+        std::cerr << "Error confirming the listening socket: " << GetLastError() << std::endl;
+        closesocket(listenSocket_);
+        CloseHandle(pipe);
+        return false;
+    }
+
+    std::cout << "Took over the listening socket, accepting while the running server drains..." << std::endl;
+    drainPipe_ = pipe;
+    return true;
+}
+
+// Connections queued during a takeover when --max-uploads leaves the number open
+static const size_t takeoverQueueLimit = 1024;
+
+bool TCPServer::acceptWhileDraining(std::vector<QueuedConnection> &queued)
+{
+    // The catalog is the old server's until it signals, or until its end of the pipe closes
+    std::atomic<bool> drained{false};
+    std::thread waiter([this, &drained]()
+                       {
+                           char signal = 0;
+                           if (!readPipe(drainPipe_, &signal, sizeof(signal)))
+                           {
+                               std::cerr << "The running server exited without draining" << std::endl;
+                           }
+                           drained = true;
+                       });
+
+    // The accepted connections send their requests into their socket buffers meanwhile; once the
+    // queue is full the rest wait in the listen backlog, unaccepted, as they would for a busy server
+    size_t limit = memoryBudget_.maxUploads() > 0 ? memoryBudget_.maxUploads() : takeoverQueueLimit;
+    while (!drained)
+    {
+        if (queued.size() >= limit)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            continue;
+        }
+        WSAPOLLFD pollFd = {listenSocket_, POLLRDNORM, 0};
+        if (WSAPoll(&pollFd, 1, 10) <= 0)
+        {
+            continue;
+        }
+        SOCKET clientSocket = INVALID_SOCKET;
+        while (queued.size() < limit && (clientSocket = accept(listenSocket_, nullptr, nullptr)) != INVALID_SOCKET)
+        {
+            std::cout << "Client connected!" << std::endl;
+            queued.push_back({clientSocket, steadyMilliseconds()});
+        }
+        if (clientSocket == INVALID_SOCKET && WSAGetLastError() != WSAEWOULDBLOCK)
+        {
+            std::cerr << "Error accepting connection: " << WSAGetLastError() << std::endl;
+        }
+    }
+    waiter.join();
+    CloseHandle(drainPipe_);
+    drainPipe_ = INVALID_HANDLE_VALUE;
+
+    // A worker's header timeout starts when it adopts a connection, so one that already waited
+    // longer than that here is dropped now rather than given the whole timeout again
+    if (headerTimeout_ > 0)
+    {
+        uint64_t now = steadyMilliseconds();
+        size_t kept = 0;
+        for (const QueuedConnection &connection : queued)
+        {
+            if (now >= connection.acceptedAt + headerTimeout_)
+            {
+                closesocket(connection.socket);
+                continue;
+            }
+            queued[kept++] = connection;
+        }
+        if (kept < queued.size())
+        {
+            std::cerr << "Header timeout, dropping " << queued.size() - kept << " queued connections" << std::endl;
+            queued.resize(kept);
+        }
+    }
+
+    std::cout << "Running server drained, " << queued.size() << " connections waiting" << std::endl;
+    return openStores();
+}
+
+void TCPServer::serveTakeover()
+{
+    std::string pipeName = takeoverPipeName(port_);
+    while (!stopping_)
+    {
+        HANDLE pipe = CreateNamedPipeA(pipeName.c_str(), PIPE_ACCESS_DUPLEX,
+                                       PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_WAIT | PIPE_REJECT_REMOTE_CLIENTS, 1,
+                                       4096, 4096, 0, nullptr);
+        if (pipe == INVALID_HANDLE_VALUE)
+        {
+            std::cerr << "Error creating the takeover pipe: " << GetLastError() << std::endl;
+            break;
+        }
+
+        // run() connects once itself to stop the wait at shutdown
+        DWORD processId = 0;
+        bool connected = ConnectNamedPipe(pipe, nullptr) || GetLastError() == ERROR_PIPE_CONNECTED;
+        if (connected && !stopping_ && readPipe(pipe, &processId, sizeof(processId)))
+        {
+            WSAPROTOCOL_INFOA protocolInfo;
+            char confirmed = 0;
+            if (WSADuplicateSocketA(listenSocket_, processId, &protocolInfo) == 0 &&
+                writePipe(pipe, &protocolInfo, sizeof(protocolInfo)) && readPipe(pipe, &confirmed, sizeof(confirmed)))
+            {
+                std::cout << "Listening socket handed to process " << processId << ", draining uploads" << std::endl;
+                takeoverPipe_ = pipe;
+                handedOver_ = true;
+                break;
+            }
+            std::cerr << "Error handing over the listening socket: " << WSAGetLastError() << std::endl;
+        }
+        DisconnectNamedPipe(pipe);
+        CloseHandle(pipe);
+    }
+    takeoverFinished_ = true;
+}
+
+void TCPServer::run()
+{
+    // Listen for incoming connections
+    int result = listen(listenSocket_, SOMAXCONN);
+    if (result == SOCKET_ERROR)
+    {
+        std::cerr << "Error listening on socket: " << WSAGetLastError() << std::endl;
+        closesocket(listenSocket_);
+        WSACleanup();
+        return;
+    }
+
+    std::cout << "Server is listening for connections on " << workerCount_ << (useIocp_ ? " IOCP" : "")
+              << " workers..." << std::endl;
+
+    // After a takeover the workers start once the stores are open; the connections made meanwhile
+    // wait for them, accepted
+    std::vector<QueuedConnection> queued;
+    if (takeover_ && !acceptWhileDraining(queued))
+    {
+        for (const QueuedConnection &connection : queued)
+        {
+            closesocket(connection.socket);
+        }
+        closesocket(listenSocket_);
+        WSACleanup();
+        return;
+    }
+
+    takeoverThread_ = std::thread([this]()
+                                  { serveTakeover(); });
+
+    std::vector<std::unique_ptr<Worker>> pollWorkers;
+    std::vector<std::unique_ptr<IocpWorker>> iocpWorkers;
+    std::vector<const IoStats *> stats;
+    std::vector<std::thread> threads;
+    runningWorkers_ = workerCount_;
+
+    for (size_t i = 0; i < workerCount_; ++i)
+    {
+        if (useIocp_)
+        {
+            iocpWorkers.push_back(std::make_unique<IocpWorker>(*this, i));
+            IocpWorker *worker = iocpWorkers.back().get();
+            if (!worker->init())
+            {
+                iocpWorkers.pop_back();
+                --runningWorkers_;
+                continue;
+            }
+            stats.push_back(&worker->stats);
+            threads.emplace_back([this, worker]()
+                                 { worker->run(); --runningWorkers_; });
+        }
+        else
+        {
+            pollWorkers.push_back(std::make_unique<Worker>(*this, i));
+            Worker *worker = pollWorkers.back().get();
+            if (!worker->init())
+            {
+                pollWorkers.pop_back();
+                --runningWorkers_;
+                continue;
+            }
+            stats.push_back(&worker->stats);
+            threads.emplace_back([this, worker]()
+                                 { worker->run(); --runningWorkers_; });
+        }
+    }
+
+    // With no worker started there is no one to hand them to; run() then shuts down below
+    if (runningWorkers_ == 0)
+    {
+        for (const QueuedConnection &connection : queued)
+        {
+            closesocket(connection.socket);
+        }
+        queued.clear();
+    }
+    for (const QueuedConnection &connection : queued)
+    {
+        if (useIocp_)
+        {
+            handToWorker(iocpWorkers, connection.socket);
+        }
+        else
+        {
+            handToWorker(pollWorkers, connection.socket);
+        }
+    }
+
+    auto lastReport = std::chrono::steady_clock::now();
+    while (runningWorkers_ > 0)
+    {
+        // After a handover no accept follows; the workers are told to finish what they hold
+        if (handedOver_ && !draining_)
+        {
+            draining_ = true;
+            for (auto &worker : pollWorkers)
+            {
+                worker->wake();
+            }
+            for (auto &worker : iocpWorkers)
+            {
+                worker->wake();
+            }
+        }
+
+        // Only this thread waits on the listening socket, so a connection wakes one worker
+        if (draining_)
+        {
+            std::this_thread::sleep_for(std::chrono::seconds(1));
+        }
+        else if (useIocp_)
+        {
+            acceptForWorkers(iocpWorkers);
+        }
+        else
+        {
+            acceptForWorkers(pollWorkers);
+        }
+
+        // At least once a second: accepting waits that long at most
+        expireTransfers();
+
+        if (std::chrono::steady_clock::now() - lastReport >= std::chrono::seconds(10))
+        {
+            reportStats(stats);
+            // Bounds how much of the log the next start has to replay
+            catalog_->checkpoint();
+            lastReport = std::chrono::steady_clock::now();
+        }
+    }
+
+    for (auto &thread : threads)
+    {
+        thread.join();
+    }
+    catalog_->checkpoint();
+
+    // Stop waiting for a takeover, unless one happened
+    stopping_ = true;
+    while (!takeoverFinished_)
+    {
+        HANDLE wake = CreateFileA(takeoverPipeName(port_).c_str(), GENERIC_READ | GENERIC_WRITE, 0, nullptr,
+                                  OPEN_EXISTING, 0, nullptr);
+        if (wake != INVALID_HANDLE_VALUE)
+        {
+            CloseHandle(wake);
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    takeoverThread_.join();
+
+    // The new process opens the catalog and stores once they are closed here
+    if (draining_)
+    {
+        signatureQueue_.reset();
+        commitQueue_.reset();
+        packStore_.reset();
+        writeBehindQueue_.reset();
+        dedupStore_.reset();
+        catalog_.reset();
+        char drained = 1;
+        writePipe(takeoverPipe_, &drained, sizeof(drained));
+        CloseHandle(takeoverPipe_);
+        std::cout << "Uploads drained, exiting" << std::endl;
+    }
+
+    // Close the listening socket and clean up
+    closesocket(listenSocket_);
+    WSACleanup();
+}
+
+template <typename WorkerType>
+void TCPServer::acceptForWorkers(std::vector<std::unique_ptr<WorkerType>> &workers)
+{
+    // Wake up at least once a second so stats keep being reported
+    WSAPOLLFD pollFd = {listenSocket_, POLLRDNORM, 0};
+    if (WSAPoll(&pollFd, 1, 1000) <= 0)
+    {
+        return;
+    }
+
+    while (true)
+    {
+        SOCKET clientSocket = accept(listenSocket_, nullptr, nullptr);
+        if (clientSocket == INVALID_SOCKET)
+        {
+            int error = WSAGetLastError();
+            if (error != WSAEWOULDBLOCK)
+            {
+                std::cerr << "Error accepting connection: " << error << std::endl;
+            }
+            return;
+        }
+
+        std::cout << "Client connected!" << std::endl;
+        handToWorker(workers, clientSocket);
+    }
+}
+
+template <typename WorkerType>
+void TCPServer::handToWorker(std::vector<std::unique_ptr<WorkerType>> &workers, SOCKET clientSocket)
+{
+    // Round-robin over the workers; the socket travels through a completion port or the adopted
+    // list of a polling worker
+    if (!workers[nextWorker_++ % workers.size()]->adopt(clientSocket))
+    {
+        closesocket(clientSocket);
+    }
+}
+
+void TCPServer::reportStats(const std::vector<const IoStats *> &stats)
+{
+    uint64_t ioCalls = 0;
+    uint64_t bytes = 0;
+    for (const IoStats *workerStats : stats)
+    {
+        ioCalls += workerStats->ioCalls.load(std::memory_order_relaxed);
+        bytes += workerStats->bytesReceived.load(std::memory_order_relaxed);
+    }
+    if (bytes == reportedBytes_)
+    {
+        return;
+    }
+    reportedBytes_ = bytes;
+
+    // Kernel plus user time of the whole process, in 100 ns units
+    FILETIME creationTime, exitTime, kernelTime, userTime;
+    GetProcessTimes(GetCurrentProcess(), &creationTime, &exitTime, &kernelTime, &userTime);
+    auto toSeconds = [](const FILETIME &time)
+    { return ((static_cast<uint64_t>(time.dwHighDateTime) << 32) | time.dwLowDateTime) / 1e7; };
+    double cpuSeconds = toSeconds(kernelTime) + toSeconds(userTime);
+
+    double megabytes = bytes / (1024.0 * 1024.0);
+    std::cout << "Received " << megabytes << " MB in " << ioCalls << " I/O calls (" << ioCalls / megabytes
+              << " per MB), CPU " << cpuSeconds / (megabytes / 1024.0) << " s per GB" << std::endl;
+
+    // Mapped views of zero-copy uploads are file pages the system can trim, so they are not charged
+    PROCESS_MEMORY_COUNTERS memory = {};
+    GetProcessMemoryInfo(GetCurrentProcess(), &memory, sizeof(memory));
+    std::cout << "Memory charged " << memoryBudget_.chargedBytes() / (1024.0 * 1024.0) << " MB (peak "
+              << memoryBudget_.peakBytes() / (1024.0 * 1024.0) << " MB) of " << (memoryBudget_.totalBytes() >> 20)
+              << " MB, " << memoryBudget_.uploads() << " requests admitted, " << memoryBudget_.deferrals()
+              << " deferred; working set " << memory.WorkingSetSize / (1024.0 * 1024.0) << " MB (peak "
+              << memory.PeakWorkingSetSize / (1024.0 * 1024.0) << " MB)" << std::endl;
+
+    if (writeBehindQueue_)
+    {
+        std::cout << "Write-behind queue " << writeBehindQueue_->queuedBytes() / (1024.0 * 1024.0) << " MB (peak "
+                  << writeBehindQueue_->peakBytes() / (1024.0 * 1024.0) << " MB), disk "
+                  << writeBehindQueue_->diskSeconds() << " s, receive stalled " << writeBehindQueue_->stallSeconds()
+                  << " s" << std::endl;
+    }
+    if (commitQueue_ && commitQueue_->rounds() > 0)
+    {
+        std::cout << "Committed " << commitQueue_->versions() << " versions in " << commitQueue_->rounds()
+                  << " catalog flushes" << std::endl;
+    }
+}
+
+std::string TCPServer::openLatestVersion(const std::string &machine, VersionReader &reader)
+{
+    VersionRecord record;
+    if (!catalog_->latest(machine, defaultBackupName, record))
+    {
+        return "";
+    }
+
+    // Signatures of a packed version still live in a file named after its sequence. A server run
+    // without --packed has no pack store, but still reads the segments an earlier run wrote
+    std::string path = backupPath(record.sequence);
+    std::string segmentPath;
+    if (record.packSegment != 0)
+    {
+        segmentPath = packStore_ ? packStore_->segmentPath(record.packSegment)
+                                 : packSegmentPath(backupFolder, record.packSegment);
+    }
+    bool opened = record.packSegment != 0 ? reader.openPacked(segmentPath, record.packOffset)
+                                          : reader.open(path, dedupStore_.get());
+    return opened ? path : "";
+}
+
+SignatureQueue::~SignatureQueue()
+{
+    if (thread_.joinable())
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopping_ = true;
+        }
+        jobReady_.notify_one();
+        thread_.join();
+    }
+    if (wakeSocket_ != INVALID_SOCKET)
+    {
+        closesocket(wakeSocket_);
+    }
+}
+
+bool SignatureQueue::start()
+{
+    wakeSocket_ = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (wakeSocket_ == INVALID_SOCKET)
+    {
+        std::cerr << "Error creating signature thread socket: " << WSAGetLastError() << std::endl;
+        return false;
+    }
+    thread_ = std::thread(&SignatureQueue::run, this);
+    return true;
+}
+
+void SignatureQueue::push(const std::shared_ptr<SignatureJob> &job)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        jobs_.push_back(job);
+    }
+    jobReady_.notify_one();
+}
+
+void SignatureQueue::run()
+{
+    while (true)
+    {
+        std::shared_ptr<SignatureJob> job;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            jobReady_.wait(lock, [this]() { return stopping_ || !jobs_.empty(); });
+            if (jobs_.empty())
+            {
+                return;
+            }
+            job = std::move(jobs_.front());
+            jobs_.pop_front();
+        }
+
+        // The connection dropped its job when it closed
+        if (job.use_count() == 1)
+        {
+            continue;
+        }
+
+        auto base = std::make_unique<VersionReader>();
+        std::string basePath = server_.openLatestVersion(job->machine, *base);
+        if (!basePath.empty() && loadSignatures(basePath, *base, job->signatures))
+        {
+            job->base = std::move(base);
+        }
+        job->done.store(true, std::memory_order_release);
+
+        char signal = 0;
+        sendto(wakeSocket_, &signal, sizeof(signal), 0, reinterpret_cast<const SOCKADDR *>(&job->wakeAddress),
+               sizeof(job->wakeAddress));
+    }
+}
+
+CommitQueue::~CommitQueue()
+{
+    if (thread_.joinable())
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopping_ = true;
+        }
+        jobReady_.notify_one();
+        thread_.join();
+    }
+    if (wakeSocket_ != INVALID_SOCKET)
+    {
+        closesocket(wakeSocket_);
+    }
+}
+
+bool CommitQueue::start()
+{
+    wakeSocket_ = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (wakeSocket_ == INVALID_SOCKET)
+    {
+        std::cerr << "Error creating commit thread socket: " << WSAGetLastError() << std::endl;
+        return false;
+    }
+    thread_ = std::thread(&CommitQueue::run, this);
+    return true;
+}
+
+void CommitQueue::push(const std::shared_ptr<CommitJob> &job)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        jobs_.push_back(job);
+    }
+    jobReady_.notify_one();
+}
+
+void CommitQueue::run()
+{
+    while (true)
+    {
+        // Versions finished while the last round flushed make up the next one
+        std::deque<std::shared_ptr<CommitJob>> round;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            jobReady_.wait(lock, [this]() { return stopping_ || !jobs_.empty(); });
+            if (jobs_.empty())
+            {
+                return;
+            }
+            round.swap(jobs_);
+        }
+
+        // The data flushes of a round are independent, so they are spread over a few threads; the
+        // records are then appended in order. A job is committed even if its connection has gone,
+        // since the version is complete
+        std::vector<uint8_t> appended(round.size());
+        size_t threadCount = round.size() < flushThreads ? round.size() : flushThreads;
+        auto flushEvery = [this, &round, &appended, threadCount](size_t first)
+        {
+            for (size_t i = first; i < round.size(); i += threadCount)
+            {
+                appended[i] = server_.flushVersion(*round[i]);
+            }
+        };
+        std::vector<std::thread> flushers;
+        for (size_t first = 1; first < threadCount; ++first)
+        {
+            flushers.emplace_back(flushEvery, first);
+        }
+        flushEvery(0);
+        for (std::thread &flusher : flushers)
+        {
+            flusher.join();
+        }
+        // One catalog flush makes the round's records and deletions durable; only then do the
+        // expired versions' files go
+        std::vector<VersionRecord> expired;
+        for (size_t i = 0; i < round.size(); ++i)
+        {
+            appended[i] = appended[i] && server_.appendVersion(*round[i], expired);
+        }
+        bool durable = server_.syncCatalog();
+        if (durable)
+        {
+            server_.removeExpired(expired);
+        }
+        rounds_.fetch_add(1, std::memory_order_relaxed);
+        versions_.fetch_add(round.size(), std::memory_order_relaxed);
+
+        for (size_t i = 0; i < round.size(); ++i)
+        {
+            CommitJob &job = *round[i];
+            job.committed = appended[i] && durable;
+            if (!job.committed)
+            {
+                removeVersionFiles(job.versionPath);
+            }
+            job.done.store(true, std::memory_order_release);
+
+            if (job.completionPort)
+            {
+                PostQueuedCompletionStatus(job.completionPort, 0, job.completionKey, job.completion);
+                continue;
+            }
+            char signal = 0;
+            sendto(wakeSocket_, &signal, sizeof(signal), 0, reinterpret_cast<const SOCKADDR *>(&job.wakeAddress),
+                   sizeof(job.wakeAddress));
+        }
+    }
+}
+
+bool TCPServer::hasVersion(const std::string &machine, const std::string &file, int64_t size, uint32_t crc)
+{
+    VersionRecord record;
+    return catalog_->latest(machine, file, record) && record.size == size && record.hasCrc && record.crc == crc;
+}
+
+bool TCPServer::flushVersion(const CommitJob &job)
+{
+    uint32_t segment;
+    uint64_t offset;
+    if (packStore_ && packStore_->takeLocation(sequenceOfPath(job.versionPath), segment, offset))
+    {
+        return flushFile(packStore_->segmentPath(segment));
+    }
+    bool flushed = true;
+    for (const char *suffix : {"", ".gcz", ".recipe"})
+    {
+        std::error_code error;
+        if (std::filesystem::exists(job.versionPath + suffix, error))
+        {
+            flushed = flushFile(job.versionPath + suffix) && flushed;
+        }
+    }
+    return flushed;
+}
+
+bool TCPServer::syncCatalog()
+{
+    return catalog_->sync();
+}
+
+bool TCPServer::appendVersion(const CommitJob &job, std::vector<VersionRecord> &expired)
+{
+    VersionRecord record;
+    record.sequence = sequenceOfPath(job.versionPath);
+    record.size = job.size;
+    record.hasCrc = job.hasCrc;
+    record.crc = job.crc;
+    record.receivedAt = job.receivedAt;
+    bool packed = packStore_ && packStore_->takeLocation(record.sequence, record.packSegment, record.packOffset);
+    bool committed = catalog_->commit(job.machine, job.file, record, false);
+    if (packed)
+    {
+        packStore_->settleLocation(record.sequence, committed);
+    }
+    if (!committed)
+    {
+        std::cerr << "Error recording version in catalog: " << job.versionPath << std::endl;
+        return false;
+    }
+    std::cout << "Stored version " << record.version << " of " << job.machine << " " << job.file << " as "
+              << job.versionPath << std::endl;
+
+    if (keepVersions_ > 0)
+    {
+        std::vector<VersionRecord> deleted = catalog_->expire(job.machine, job.file, keepVersions_);
+        expired.insert(expired.end(), deleted.begin(), deleted.end());
+    }
+    return true;
+}
+
+void TCPServer::removeExpired(const std::vector<VersionRecord> &expired)
+{
+    for (const VersionRecord &record : expired)
+    {
+        removeVersionFiles(backupPath(record.sequence));
+        if (record.packSegment != 0 && packStore_)
+        {
+            packStore_->releaseVersion(record);
+        }
+    }
+}
+
+std::shared_ptr<ParallelTransfer> TCPServer::joinTransfer(const RangeHeader &range)
+{
+    if (!acceptableFileSize(range.fileSize) || range.offset < 0 || range.length < 0 || range.offset > range.fileSize ||
+        range.length > range.fileSize - range.offset || range.rangeCount == 0)
+    {
+        return nullptr;
+    }
+
+    std::shared_ptr<ParallelTransfer> transfer;
+    {
+        std::lock_guard<std::mutex> lock(transfersMutex_);
+        auto found = transfers_.find(range.transferId);
+        if (found != transfers_.end())
+        {
+            transfer = found->second;
+        }
+    }
+
+    // The first range creates the file, preallocated without holding up the other workers'
+    // ranges; of two first ranges racing, the one registered first wins and the other's file goes
+    std::string createdPath;
+    if (!transfer)
+    {
+        // Ranges arrive out of order, so they are stored as a plain file even with --dedup
+        createdPath = nextBackupPath();
+        if (!preallocateFile(createdPath, range.fileSize))
+        {
+            removeVersionFiles(createdPath);
+            return nullptr;
+        }
+    }
+
+    std::unique_lock<std::mutex> lock(transfersMutex_);
+    std::shared_ptr<ParallelTransfer> &registered = transfers_[range.transferId];
+    if (!registered)
+    {
+        registered = std::make_shared<ParallelTransfer>();
+        registered->id = range.transferId;
+        registered->versionPath = createdPath;
+        registered->fileSize = range.fileSize;
+        registered->rangeCount = range.rangeCount;
+        registered->startedAt = unixMilliseconds();
+        createdPath.clear();
+    }
+    transfer = registered;
+    bool fits = transfer->fileSize == range.fileSize && transfer->rangeCount == range.rangeCount &&
+                transfer->rangesJoined < transfer->rangeCount;
+    if (fits)
+    {
+        ++transfer->rangesJoined;
+    }
+    lock.unlock();
+
+    if (!createdPath.empty())
+    {
+        removeVersionFiles(createdPath);
+    }
+    return fits ? transfer : nullptr;
+}
+
+TransferStatus TCPServer::endRange(ParallelTransfer &transfer, const RangeHeader &range, bool stored)
+{
+    TransferStatus status = TransferStatus::Failed;
+    {
+        std::lock_guard<std::mutex> lock(transfersMutex_);
+        ++transfer.rangesEnded;
+        if (stored)
+        {
+            transfer.storedRanges.emplace_back(range.offset, range.length);
+        }
+        else
+        {
+            transfer.failed = true;
+        }
+
+        // A transfer whose remaining ranges never connect is expired once idle for long enough
+        if (transfer.rangesEnded < transfer.rangeCount)
+        {
+            if (transfer.rangesEnded == transfer.rangesJoined)
+            {
+                transfer.idleSince = steadyMilliseconds();
+            }
+            return TransferStatus::Pending;
+        }
+        transfers_.erase(transfer.id);
+
+        // The ranges must tile the file with no gap or overlap
+        std::sort(transfer.storedRanges.begin(), transfer.storedRanges.end());
+        int64_t covered = 0;
+        for (const auto &stored : transfer.storedRanges)
+        {
+            if (stored.first != covered)
+            {
+                break;
+            }
+            covered += stored.second;
+        }
+        if (!transfer.failed && covered == transfer.fileSize)
+        {
+            status = TransferStatus::Stored;
+        }
+    }
+
+    // Every range has ended, so no handle writes to the file any more
+    if (status == TransferStatus::Failed)
+    {
+        removeVersionFiles(transfer.versionPath);
+    }
+    return status;
+}
+
+void TCPServer::expireTransfers()
+{
+    if (idleTimeout_ == 0)
+    {
+        return;
+    }
+
+    std::vector<std::string> expired;
+    {
+        std::lock_guard<std::mutex> lock(transfersMutex_);
+        uint64_t now = steadyMilliseconds();
+        for (auto transfer = transfers_.begin(); transfer != transfers_.end();)
+        {
+            // Ranges still connected are under the timeouts of their own connections
+            const ParallelTransfer &candidate = *transfer->second;
+            if (candidate.rangesEnded == candidate.rangesJoined && now >= candidate.idleSince + idleTimeout_)
+            {
+                std::cerr << "Parallel transfer " << candidate.id << " expired with " << candidate.rangesEnded << " of "
+                          << candidate.rangeCount << " ranges" << std::endl;
+                expired.push_back(candidate.versionPath);
+                transfer = transfers_.erase(transfer);
+            }
+            else
+            {
+                ++transfer;
+            }
+        }
+    }
+    for (const std::string &path : expired)
+    {
+        removeVersionFiles(path);
+    }
+}
+
+std::string TCPServer::resumePath(const std::string &machine, uint64_t transferId) const
+{
+    std::ostringstream name;
+    name << backupFolder << "resume_" << machine << "_" << std::hex << std::setw(16)
+         << std::setfill('0') << transferId;
+    return name.str();
+}
+
+bool TCPServer::claimResume(const std::string &resumePath)
+{
+    std::lock_guard<std::mutex> lock(transfersMutex_);
+    return activeResumes_.insert(resumePath).second;
+}
+
+void TCPServer::releaseResume(const std::string &resumePath)
+{
+    std::lock_guard<std::mutex> lock(transfersMutex_);
+    activeResumes_.erase(resumePath);
+}
+
+std::string TCPServer::nextBackupPath()
+{
+    return backupPath(catalog_->reserveSequence());
+}
+
+std::string TCPServer::backupPath(uint64_t sequence) const
+{
+    std::string fileName = "backup_" + std::to_string(sequence) + ".nc";
+    return backupFolder + fileName;
+}
+
+size_t TCPServer::uploadReserve() const
+{
+    // The connection with the buffer of its ofstream, and the response or signatures it queues
+    size_t reserve = 16 * 1024;
+    if (packed_)
+    {
+        reserve += PackSink::bufferSize;
+    }
+    else if (unbuffered_)
+    {
+        reserve += UnbufferedBackupSink::stagingSize;
+    }
+    else if (writeBehindMegabytes_ > 0)
+    {
+        reserve += WriteBehindQueue::bufferSize;
+    }
+    else if (dedup_)
+    {
+        reserve += DedupSink::maxChunkSize + DedupSink::batchSize;
+    }
+    return reserve;
+}
+
+size_t TCPServer::sinkReserve() const
+{
+    // As openVersionSink picks them: writing behind, only the worker's buffer counts
+    if (writeBehindMegabytes_ > 0)
+    {
+        return WriteBehindQueue::bufferSize;
+    }
+    if (dedup_)
+    {
+        return DedupSink::maxChunkSize + DedupSink::batchSize;
+    }
+    return packed_ ? PackSink::bufferSize : 0;
+}
+
+void Worker::run()
+{
+    pinToCore(index_);
+
+    // Large enough for the biggest receive any connection's chunk sizer may ask for
+    buffer_.resize(server_.chunkMax());
+
+    std::vector<WSAPOLLFD> pollFds;
+
+    while (true)
+    {
+        // Slot 0 is the wake-up socket, slot i + 1 is connections_[i]
+        pollFds.clear();
+        pollFds.push_back({wakeSocket_, POLLRDNORM, 0});
+        WriteBehindQueue *writeBehind = server_.writeBehindQueue();
+        bool diskFull = writeBehind && !writeBehind->hasRoom() && writeBehind->wakeWhenRoom(wakeAddress_);
+        // Set when a held session may go on already, so the poll does not wait
+        bool memoryFreed = false;
+        for (const auto &connection : connections_)
+        {
+            short events = connection->sending() ? POLLWRNORM : POLLRDNORM;
+            if (!connection->sending() && connection->responseSent < connection->response.size())
+            {
+                events |= POLLWRNORM;
+            }
+
+            // Nothing is read while the signature thread looks up the base, or the commit thread
+            // records the version; either wakes the poll
+            if (connection->state == Connection::State::WaitingSignatures ||
+                connection->state == Connection::State::Committing)
+            {
+                events &= ~POLLRDNORM;
+                connection->stalledByServer = true;
+            }
+
+            // Backpressure: leave the data in the socket while the disk thread catches up. It wakes
+            // the poll when the queue has room again, and when it has finished a file
+            bool feedsDisk = connection->writeBehind || connection->session;
+            if (connection->state == Connection::State::Draining || (feedsDisk && diskFull))
+            {
+                events &= ~POLLRDNORM;
+                connection->stalledByServer = true;
+            }
+
+            // Likewise while the memory budget has no room for a waiting request, or for another
+            // file of a session; admitted requests read on, so they can finish. A session holding a
+            // file's begin reads nothing new until the held bytes are handled. The budget wakes the
+            // poll when another connection frees memory
+            bool beginHeld = connection->session && connection->session->beginHeld;
+            if (connection->awaitingAdmission || beginHeld)
+            {
+                server_.memoryBudget().wakeWhenFreed(wakeAddress_);
+            }
+            if ((connection->awaitingAdmission && !admit(*connection)) || beginHeld)
+            {
+                events &= ~POLLRDNORM;
+                connection->stalledByServer = true;
+                memoryFreed = memoryFreed || (beginHeld && !server_.memoryBudget().keepHolding());
+            }
+            pollFds.push_back({connection->socket, events, 0});
+        }
+
+        // Sleep until the next timer is due, or while draining for a second at most, to close idle
+        // pooled connections
+        int timeout = timers_.pollTimeout(steadyMilliseconds());
+        if (server_.draining())
+        {
+            timeout = timeout < 0 ? 1000 : std::min(timeout, 1000);
+        }
+        if (memoryFreed)
+        {
+            timeout = 0;
+        }
+        int result = WSAPoll(pollFds.data(), static_cast<ULONG>(pollFds.size()), timeout);
+        stats.count(1);
+        now_ = steadyMilliseconds();
+        if (result == SOCKET_ERROR)
+        {
+            std::cerr << "Error polling sockets: " << WSAGetLastError() << std::endl;
+            break;
+        }
+
+        // Read the wake-ups before looking at the jobs and queues they stand for, so one sent after
+        // a connection was looked at below leaves the socket readable for the next poll
+        if (pollFds[0].revents & POLLRDNORM)
+        {
+            // Clear the flag first, so a wake sent while reading is not lost
+            wakePending_ = false;
+            char signal;
+            while (recv(wakeSocket_, &signal, sizeof(signal), 0) > 0)
+            {
+            }
+        }
+
+        // Connections accepted below are appended past the polled range and wait for the next round
+        size_t polledCount = connections_.size();
+        for (size_t i = 0; i < polledCount; ++i)
+        {
+            Connection &connection = *connections_[i];
+            short revents = pollFds[i + 1].revents;
+
+            if (revents & (POLLERR | POLLNVAL))
+            {
+                std::cerr << "Connection error, dropping client" << std::endl;
+                closeConnection(connection);
+            }
+            else if (connection.state == Connection::State::Draining)
+            {
+                if (connection.writeBehind->finished())
+                {
+                    finishUpload(connection);
+                }
+            }
+            else if (connection.state == Connection::State::WaitingSignatures)
+            {
+                if (connection.signatureJob->done.load(std::memory_order_acquire))
+                {
+                    sendSignatures(connection);
+                }
+            }
+            else if (connection.state == Connection::State::Committing)
+            {
+                if (connection.commitJob->done.load(std::memory_order_acquire))
+                {
+                    finishCommit(connection);
+                }
+            }
+            else
+            {
+                // A hang-up is reported through recv returning 0
+                if (revents & (POLLRDNORM | POLLHUP))
+                {
+                    if (connection.sending())
+                    {
+                        closeConnection(connection);
+                    }
+                    else if (!admit(connection))
+                    {
+                        connection.awaitingAdmission = true;
+                        server_.memoryBudget().countDeferral();
+                    }
+                    else
+                    {
+                        handleReadable(connection);
+                    }
+                }
+                // Sessions and chunked uploads read data and send acks in the same round
+                if ((revents & POLLWRNORM) && connection.state != Connection::State::Closed)
+                {
+                    handleWritable(connection);
+                }
+            }
+
+            // A session held at a file's begin goes on once the budget has room, or once nothing
+            // else is left to free it
+            if (connection.state != Connection::State::Closed && connection.session &&
+                connection.session->beginHeld && !server_.memoryBudget().keepHolding())
+            {
+                resumeSession(connection);
+            }
+
+            // Session files whose end the disk thread has written are acked as soon as it wakes the poll
+            if (connection.state != Connection::State::Closed && connection.session &&
+                connection.session->drainingStreams > 0)
+            {
+                finishDrainedStreams(connection);
+                if (connection.responseSent < connection.response.size())
+                {
+                    handleWritable(connection);
+                }
+            }
+            chargeMemory(connection);
+        }
+
+        // Checked first: every socket adopted before draining began is picked up below
+        bool draining = server_.draining();
+        adoptConnections();
+
+        dueConnections_.clear();
+        timers_.advance(now_, dueConnections_);
+        for (Connection *connection : dueConnections_)
+        {
+            checkTimeouts(*connection);
+        }
+
+        // A draining worker leaves the next requests of pooled connections to the new process: it
+        // closes them after their response, or after a second without one, so a request already
+        // under way when the listening socket went is still served here. The client's pool
+        // replaces a closed connection and retries on the new process
+        const uint64_t drainIdleMilliseconds = 1000;
+        for (auto &connection : connections_)
+        {
+            if (connection->state == Connection::State::KeptAlive && !draining)
+            {
+                connection = renewConnection(*connection);
+            }
+            else if (draining && (connection->state == Connection::State::KeptAlive ||
+                                  (connection->betweenRequests() &&
+                                   now_ - connection->lastProgressAt >= drainIdleMilliseconds)))
+            {
+                closeConnection(*connection);
+            }
+        }
+        connections_.erase(std::remove_if(connections_.begin(), connections_.end(),
+                                          [](const std::unique_ptr<Connection> &connection)
+                                          { return connection->state == Connection::State::Closed; }),
+                           connections_.end());
+
+        if (draining && connections_.empty())
+        {
+            break;
+        }
+    }
+
+    for (auto &connection : connections_)
+    {
+        closeConnection(*connection);
+    }
+}
+
+Worker::~Worker()
+{
+    if (wakeSocket_ != INVALID_SOCKET)
+    {
+        closesocket(wakeSocket_);
+    }
+    for (SOCKET clientSocket : adopted_)
+    {
+        closesocket(clientSocket);
+    }
+}
+
+bool Worker::init()
+{
+    sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_port = 0;
+    inet_pton(AF_INET, "127.0.0.1", &address.sin_addr);
+    int addressSize = sizeof(wakeAddress_);
+
+    wakeSocket_ = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (wakeSocket_ == INVALID_SOCKET || bind(wakeSocket_, (SOCKADDR *)&address, sizeof(address)) == SOCKET_ERROR ||
+        getsockname(wakeSocket_, (SOCKADDR *)&wakeAddress_, &addressSize) == SOCKET_ERROR ||
+        !setNonBlocking(wakeSocket_))
+    {
+        std::cerr << "Error creating wake-up socket: " << WSAGetLastError() << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool Worker::adopt(SOCKET clientSocket)
+{
+    {
+        std::lock_guard<std::mutex> lock(adoptedMutex_);
+        adopted_.push_back(clientSocket);
+    }
+    wake();
+    return true;
+}
+
+void Worker::wake()
+{
+    if (!wakePending_.exchange(true))
+    {
+        char signal = 0;
+        sendto(wakeSocket_, &signal, sizeof(signal), 0, (const SOCKADDR *)&wakeAddress_, sizeof(wakeAddress_));
+    }
+}
+
+void Worker::adoptConnections()
+{
+    std::vector<SOCKET> adopted;
+    {
+        std::lock_guard<std::mutex> lock(adoptedMutex_);
+        adopted.swap(adopted_);
+    }
+
+    for (SOCKET clientSocket : adopted)
+    {
+        if (!setNonBlocking(clientSocket))
+        {
+            std::cerr << "Error setting non-blocking mode: " << WSAGetLastError() << std::endl;
+            closesocket(clientSocket);
+            continue;
+        }
+        connections_.push_back(std::make_unique<Connection>(clientSocket));
+        connections_.back()->machine = peerAddress(clientSocket);
+        connections_.back()->chunkSizer = ChunkSizer(server_.chunkMin(), server_.chunkMax());
+        startTimeouts(*connections_.back());
+    }
+}
+
+bool Worker::admit(Connection &connection)
+{
+    if (!connection.admitted)
+    {
+        size_t reserve = server_.uploadReserve();
+        if (!server_.memoryBudget().admit(connection.machine, reserve))
+        {
+            return false;
+        }
+        connection.admitted = true;
+        connection.awaitingAdmission = false;
+        connection.charged = reserve;
+    }
+    return true;
+}
+
+void Worker::chargeMemory(Connection &connection)
+{
+    if (!connection.admitted || connection.state == Connection::State::Closed ||
+        connection.state == Connection::State::KeptAlive)
+    {
+        return;
+    }
+
+    // The reserve stays charged for the whole request, as its sink may not be open yet
+    size_t charge = std::max(server_.uploadReserve(), footprint(connection));
+    if (charge != connection.charged)
+    {
+        server_.memoryBudget().recharge(connection.machine, connection.charged, charge);
+        connection.charged = charge;
+    }
+}
+
+size_t Worker::footprint(const Connection &connection) const
+{
+    size_t bytes = sizeof(Connection) + connection.response.capacity();
+    if (connection.sink)
+    {
+        bytes += connection.sink->bufferBytes();
+    }
+    if (connection.session)
+    {
+        bytes += sizeof(Session) + connection.session->control.capacity() + connection.session->held.capacity();
+        // A file not yet ending is charged its sink's buffer before the sink has one
+        size_t reserve = server_.sinkReserve();
+        for (const auto &entry : connection.session->streams)
+        {
+            size_t buffer = entry.second.sink ? entry.second.sink->bufferBytes() : 0;
+            bytes += sizeof(SessionStream) + (entry.second.draining ? buffer : std::max(buffer, reserve));
+        }
+    }
+    return bytes;
+}
+
+std::unique_ptr<Connection> Worker::renewConnection(Connection &connection)
+{
+    // The upload's resources were released when it finished; only the socket carries over, and
+    // the connection is charged again once its next request arrives
+    if (connection.admitted)
+    {
+        server_.memoryBudget().release(connection.machine, connection.charged);
+    }
+    auto renewed = std::make_unique<Connection>(connection.socket);
+    renewed->machine = connection.machine;
+    renewed->chunkSizer = connection.chunkSizer;
+    renewed->keepAlive = true;
+    startTimeouts(*renewed);
+    return renewed;
+}
+
+void Worker::startTimeouts(Connection &connection)
+{
+    connection.timer.connection = &connection;
+    connection.requestStartedAt = connection.lastProgressAt = connection.rateWindowStart = now_;
+    checkTimeouts(connection);
+}
+
+void Worker::checkTimeouts(Connection &connection)
+{
+    if (connection.state == Connection::State::Closed || connection.state == Connection::State::KeptAlive)
+    {
+        return;
+    }
+
+    // Waits of the server's own making restart the clocks: disk or memory backpressure, a request
+    // not yet admitted, or an upload draining to disk
+    if (connection.stalledByServer || connection.awaitingAdmission || connection.state == Connection::State::Draining)
+    {
+        connection.requestStartedAt = connection.lastProgressAt = connection.rateWindowStart = now_;
+        connection.rateWindowBytes = 0;
+        connection.stalledByServer = false;
+    }
+
+    const uint64_t rateWindow = 30 * 1000;
+    bool readingHeader = connection.state == Connection::State::ReadingSize ||
+                         connection.state == Connection::State::ReadingRequestSize ||
+                         connection.state == Connection::State::ReadingRangeHeader ||
+                         connection.state == Connection::State::ReadingResumeHeader ||
+                         connection.state == Connection::State::ReadingChunkedHeader ||
+                         connection.state == Connection::State::ReadingOfferHeader;
+    // A kept-alive connection idles in the client's pool until the first byte of its next request
+    bool pooled = connection.betweenRequests();
+    // Bodies owe the minimum rate; sessions only while a file is open
+    bool receivingBody = connection.state == Connection::State::ReadingBody ||
+                         connection.state == Connection::State::ReadingChunks ||
+                         connection.state == Connection::State::ReadingDelta ||
+                         connection.state == Connection::State::ReadingCompressed ||
+                         (connection.state == Connection::State::ReadingSession && !connection.session->streams.empty());
+
+    uint64_t headerTimeout = server_.headerTimeout();
+    uint64_t idleTimeout = server_.idleTimeout();
+    uint64_t minRate = server_.minRate();
+    uint64_t next = UINT64_MAX;
+
+    if (readingHeader && !pooled && headerTimeout > 0)
+    {
+        if (now_ >= connection.requestStartedAt + headerTimeout)
+        {
+            std::cerr << "Header timeout, dropping client " << connection.machine << std::endl;
+            closeConnection(connection);
+            return;
+        }
+        next = std::min(next, connection.requestStartedAt + headerTimeout);
+    }
+
+    if (idleTimeout > 0)
+    {
+        if (now_ >= connection.lastProgressAt + idleTimeout)
+        {
+            std::cerr << "Idle timeout, dropping client " << connection.machine << std::endl;
+            closeConnection(connection);
+            return;
+        }
+        next = std::min(next, connection.lastProgressAt + idleTimeout);
+    }
+
+    if (receivingBody && minRate > 0)
+    {
+        if (now_ >= connection.rateWindowStart + rateWindow)
+        {
+            uint64_t elapsed = now_ - connection.rateWindowStart;
+            if (connection.rateWindowBytes * 1000 < minRate * elapsed)
+            {
+                std::cerr << "Transfer below " << minRate << " B/s, dropping client " << connection.machine
+                          << std::endl;
+                closeConnection(connection);
+                return;
+            }
+            connection.rateWindowStart = now_;
+            connection.rateWindowBytes = 0;
+        }
+        next = std::min(next, connection.rateWindowStart + rateWindow);
+    }
+    else
+    {
+        // The window of a body starts with the body
+        connection.rateWindowStart = now_;
+        connection.rateWindowBytes = 0;
+    }
+
+    if (next != UINT64_MAX)
+    {
+        timers_.schedule(connection.timer, next);
+    }
+    else
+    {
+        connection.timer.unlink();
+    }
+}
+
+void Worker::handleReadable(Connection &connection)
+{
+    // A hang-up still polls readable; a session holding a file's begin reads once its held bytes are handled
+    if (connection.session && connection.session->beginHeld)
+    {
+        return;
+    }
+
+    char *destination;
+    int wanted;
+    bool readingHeader = connection.state == Connection::State::ReadingSize ||
+                         connection.state == Connection::State::ReadingRequestSize ||
+                         connection.state == Connection::State::ReadingRangeHeader ||
+                         connection.state == Connection::State::ReadingResumeHeader ||
+                         connection.state == Connection::State::ReadingChunkedHeader ||
+                         connection.state == Connection::State::ReadingOfferHeader;
+
+    // Read file size, then at most the remaining body, so bytes past the upload stay in the socket
+    if (connection.state == Connection::State::ReadingRangeHeader)
+    {
+        destination = reinterpret_cast<char *>(&connection.range) + connection.sizeBytesReceived;
+        wanted = static_cast<int>(sizeof(connection.range) - connection.sizeBytesReceived);
+    }
+    else if (connection.state == Connection::State::ReadingResumeHeader)
+    {
+        destination = reinterpret_cast<char *>(&connection.resume) + connection.sizeBytesReceived;
+        wanted = static_cast<int>(sizeof(connection.resume) - connection.sizeBytesReceived);
+    }
+    else if (connection.state == Connection::State::ReadingChunkedHeader)
+    {
+        destination = reinterpret_cast<char *>(&connection.chunkedHeader) + connection.sizeBytesReceived;
+        wanted = static_cast<int>(sizeof(connection.chunkedHeader) - connection.sizeBytesReceived);
+    }
+    else if (connection.state == Connection::State::ReadingOfferHeader)
+    {
+        destination = reinterpret_cast<char *>(&connection.offer) + connection.sizeBytesReceived;
+        wanted = static_cast<int>(sizeof(connection.offer) - connection.sizeBytesReceived);
+    }
+    else if (readingHeader)
+    {
+        destination = reinterpret_cast<char *>(&connection.fileSize) + connection.sizeBytesReceived;
+        wanted = static_cast<int>(sizeof(connection.fileSize) - connection.sizeBytesReceived);
+    }
+    else if (connection.state == Connection::State::ReadingDelta ||
+             connection.state == Connection::State::ReadingCompressed ||
+             connection.state == Connection::State::ReadingSession ||
+             connection.state == Connection::State::ReadingChunks)
+    {
+        // These streams end by their own framing, not by the announced size
+        destination = buffer_.data();
+        wanted = static_cast<int>(connection.chunkSizer.size());
+    }
+    else if (connection.zeroCopy)
+    {
+        size_t spanSize;
+        destination = connection.mappedFile.writableSpan(connection.fileSize - connection.bytesReceived, spanSize);
+        wanted = static_cast<int>(std::min<size_t>(spanSize, 1 << 20));
+        if (!destination)
+        {
+            closeConnection(connection);
+            return;
+        }
+    }
+    else if (connection.unbuffered)
+    {
+        size_t spanSize;
+        destination = connection.unbuffered->writableSpan(spanSize);
+        wanted = static_cast<int>(std::min<int64_t>(spanSize, connection.fileSize - connection.bytesReceived));
+    }
+    else
+    {
+        destination = buffer_.data();
+        wanted = static_cast<int>(
+            std::min<int64_t>(connection.chunkSizer.size(), connection.fileSize - connection.bytesReceived));
+    }
+
+    // Receives into the buffer are timed through their storage, whichever way this call returns
+    struct ChunkTimer
+    {
+        ChunkSizer *sizer;
+        size_t bytes = 0;
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+        ~ChunkTimer()
+        {
+            if (sizer && bytes > 0)
+            {
+                std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+                sizer->record(bytes, elapsed.count());
+            }
+        }
+    } chunkTimer{destination == buffer_.data() ? &connection.chunkSizer : nullptr};
+
+    int bytesRead = recv(connection.socket, destination, wanted, 0);
+    chunkTimer.bytes = bytesRead > 0 ? bytesRead : 0;
+    stats.count(1, bytesRead > 0 ? bytesRead : 0);
+    if (bytesRead == 0)
+    {
+        if (connection.session)
+        {
+            std::cout << "Session closed after " << connection.session->filesStored << " files" << std::endl;
+        }
+        else
+        {
+            std::cerr << "Client disconnected" << std::endl;
+        }
+        closeConnection(connection);
+        return;
+    }
+    if (bytesRead == SOCKET_ERROR)
+    {
+        int error = WSAGetLastError();
+        if (error != WSAEWOULDBLOCK)
+        {
+            std::cerr << "Error receiving file data: " << error << std::endl;
+            closeConnection(connection);
+        }
+        return;
+    }
+
+    // A pooled connection's next request has its header timeout from its first byte
+    if (connection.keepAlive && connection.state == Connection::State::ReadingSize && connection.sizeBytesReceived == 0)
+    {
+        connection.requestStartedAt = now_;
+    }
+    connection.lastProgressAt = now_;
+    connection.rateWindowBytes += bytesRead;
+
+    if (readingHeader)
+    {
+        connection.sizeBytesReceived += bytesRead;
+        size_t headerSize = connection.state == Connection::State::ReadingRangeHeader     ? sizeof(connection.range)
+                            : connection.state == Connection::State::ReadingResumeHeader  ? sizeof(connection.resume)
+                            : connection.state == Connection::State::ReadingChunkedHeader ? sizeof(connection.chunkedHeader)
+                            : connection.state == Connection::State::ReadingOfferHeader   ? sizeof(connection.offer)
+                                                                                           : sizeof(connection.fileSize);
+        if (connection.sizeBytesReceived < headerSize)
+        {
+            return;
+        }
+
+        if (connection.state == Connection::State::ReadingSize && connection.fileSize == keepAliveRequest)
+        {
+            // The connection may idle in the client's pool; it is admitted again for its request
+            server_.memoryBudget().release(connection.machine, connection.charged);
+            connection.admitted = false;
+            connection.charged = 0;
+            connection.keepAlive = true;
+            connection.sizeBytesReceived = 0;
+            return;
+        }
+        // A kept-alive connection may have idled in the client's pool; time versions from the request
+        if (connection.state == Connection::State::ReadingSize && connection.keepAlive)
+        {
+            connection.startedAt = unixMilliseconds();
+        }
+        if (connection.state == Connection::State::ReadingSize && connection.fileSize == chunkedUploadRequest)
+        {
+            connection.state = Connection::State::ReadingChunkedHeader;
+            connection.sizeBytesReceived = 0;
+            return;
+        }
+        if (connection.state == Connection::State::ReadingChunkedHeader)
+        {
+            if (!startChunkedUpload(connection))
+            {
+                std::cerr << "Error starting chunked upload" << std::endl;
+                closeConnection(connection);
+            }
+            return;
+        }
+        if (connection.state == Connection::State::ReadingSize && connection.fileSize == offeredUploadRequest)
+        {
+            connection.state = Connection::State::ReadingOfferHeader;
+            connection.sizeBytesReceived = 0;
+            return;
+        }
+        if (connection.state == Connection::State::ReadingOfferHeader)
+        {
+            if (!startOfferedUpload(connection))
+            {
+                std::cerr << "Error starting offered upload" << std::endl;
+                closeConnection(connection);
+            }
+            return;
+        }
+        if (connection.state == Connection::State::ReadingSize && connection.fileSize == sessionRequest)
+        {
+            connection.session = std::make_unique<Session>();
+            connection.state = Connection::State::ReadingSession;
+            return;
+        }
+        if (connection.state == Connection::State::ReadingSize && connection.fileSize == resumableUploadRequest)
+        {
+            connection.state = Connection::State::ReadingResumeHeader;
+            connection.sizeBytesReceived = 0;
+            return;
+        }
+        if (connection.state == Connection::State::ReadingResumeHeader)
+        {
+            if (!startResumableUpload(connection))
+            {
+                std::cerr << "Error starting resumable upload" << std::endl;
+                closeConnection(connection);
+            }
+            return;
+        }
+
+        if (connection.state == Connection::State::ReadingSize && connection.fileSize == rangeUploadRequest)
+        {
+            connection.state = Connection::State::ReadingRangeHeader;
+            connection.sizeBytesReceived = 0;
+            return;
+        }
+        if (connection.state == Connection::State::ReadingRangeHeader)
+        {
+            if (!startRangeUpload(connection))
+            {
+                std::cerr << "Error starting range upload" << std::endl;
+                closeConnection(connection);
+            }
+            return;
+        }
+
+        if (connection.state == Connection::State::ReadingSize &&
+            (connection.fileSize == deltaUploadRequest || connection.fileSize == compressedUploadRequest))
+        {
+            // The real size of the new version follows
+            connection.request = connection.fileSize;
+            connection.state = Connection::State::ReadingRequestSize;
+            connection.sizeBytesReceived = 0;
+            return;
+        }
+        if (connection.state == Connection::State::ReadingRequestSize)
+        {
+            bool started = server_.acceptableFileSize(connection.fileSize) &&
+                           (connection.request == deltaUploadRequest ? startDeltaUpload(connection)
+                                                                     : startCompressedUpload(connection));
+            if (!started)
+            {
+                std::cerr << "Error starting upload" << std::endl;
+                closeConnection(connection);
+            }
+            return;
+        }
+
+        if (!server_.acceptableFileSize(connection.fileSize) || !openBackupFile(connection, true))
+        {
+            std::cerr << "Error receiving file size" << std::endl;
+            closeConnection(connection);
+            return;
+        }
+        connection.hashBody = true;
+        connection.state = Connection::State::ReadingBody;
+    }
+    else if (connection.state == Connection::State::ReadingDelta)
+    {
+        if (!connection.delta->feed(buffer_.data(), bytesRead))
+        {
+            std::cerr << "Error rebuilding delta upload" << std::endl;
+            closeConnection(connection);
+            return;
+        }
+        if (connection.delta->finished())
+        {
+            finishUpload(connection);
+        }
+        return;
+    }
+    else if (connection.state == Connection::State::ReadingChunks)
+    {
+        if (!connection.chunked->feed(buffer_.data(), bytesRead, connection.response))
+        {
+            closeConnection(connection);
+            return;
+        }
+        if (connection.chunked->finished())
+        {
+            finishChunkedUpload(connection);
+        }
+        else if (connection.responseSent < connection.response.size())
+        {
+            handleWritable(connection);
+        }
+        return;
+    }
+    else if (connection.state == Connection::State::ReadingSession)
+    {
+        if (!handleSessionData(connection, buffer_.data(), bytesRead))
+        {
+            closeConnection(connection);
+            return;
+        }
+
+        // Acks of files that just ended usually go out right away; otherwise the poll loop finishes them
+        if (connection.responseSent < connection.response.size())
+        {
+            handleWritable(connection);
+        }
+        return;
+    }
+    else if (connection.state == Connection::State::ReadingCompressed)
+    {
+        if (!connection.compressed->feed(buffer_.data(), bytesRead))
+        {
+            std::cerr << "Error receiving compressed upload" << std::endl;
+            closeConnection(connection);
+            return;
+        }
+        if (connection.compressed->finished())
+        {
+            finishUpload(connection);
+        }
+        return;
+    }
+    else if (connection.zeroCopy)
+    {
+        // The bytes are already in the file, and still in cache for the hash
+        connection.bodyCrc = crc32c(connection.bodyCrc, destination, bytesRead);
+        connection.mappedFile.commit(bytesRead);
+        connection.bytesReceived += bytesRead;
+    }
+    else if (connection.unbuffered)
+    {
+        // Received in place like the mapping, but the disk write bypasses the cache
+        connection.bodyCrc = crc32c(connection.bodyCrc, destination, bytesRead);
+        if (!connection.unbuffered->commit(bytesRead))
+        {
+            closeConnection(connection);
+            return;
+        }
+        connection.bytesReceived += bytesRead;
+    }
+    else
+    {
+        if (connection.hashBody)
+        {
+            connection.bodyCrc = crc32c(connection.bodyCrc, buffer_.data(), bytesRead);
+        }
+        if (!connection.sink->write(buffer_.data(), bytesRead))
+        {
+            std::cerr << "Error writing file" << std::endl;
+            closeConnection(connection);
+            return;
+        }
+        stats.count(1);
+        connection.bytesReceived += bytesRead;
+        if (connection.partial && connection.bytesReceived >= connection.checkpointAt &&
+            connection.bytesReceived < connection.fileSize && !checkpointResume(connection))
+        {
+            closeConnection(connection);
+            return;
+        }
+    }
+
+    if (connection.bytesReceived == connection.fileSize)
+    {
+        finishUpload(connection);
+    }
+}
+
+void Worker::handleWritable(Connection &connection)
+{
+    int bytesSent = send(connection.socket, connection.response.data() + connection.responseSent,
+                         static_cast<int>(connection.response.size() - connection.responseSent), 0);
+    stats.count(1);
+    if (bytesSent == SOCKET_ERROR)
+    {
+        int error = WSAGetLastError();
+        if (error != WSAEWOULDBLOCK)
+        {
+            std::cerr << "Error sending response: " << error << std::endl;
+            closeConnection(connection);
+        }
+        return;
+    }
+
+    connection.lastProgressAt = now_;
+    connection.responseSent += bytesSent;
+    if (connection.responseSent < connection.response.size())
+    {
+        return;
+    }
+
+    if (connection.state == Connection::State::SendingSignatures)
+    {
+        // Signatures are out, the client now streams its instructions
+        connection.response.clear();
+        connection.responseSent = 0;
+        connection.state = Connection::State::ReadingDelta;
+        return;
+    }
+    if (connection.state == Connection::State::ReadingSession ||
+        connection.state == Connection::State::ReadingChunks)
+    {
+        // Acks are out; more data is on its way
+        connection.response.clear();
+        connection.responseSent = 0;
+        return;
+    }
+    if (connection.state == Connection::State::SendingOffset)
+    {
+        // The client continues from the offset, or sends an offered body from the start; a
+        // previous attempt may already have sent it all
+        connection.response.clear();
+        connection.responseSent = 0;
+        connection.state = Connection::State::ReadingBody;
+        if (connection.bytesReceived == connection.fileSize)
+        {
+            finishUpload(connection);
+        }
+        return;
+    }
+
+    // One file per connection, as before, unless the client keeps it alive
+    if (connection.reusable)
+    {
+        connection.state = Connection::State::KeptAlive;
+        return;
+    }
+    closeConnection(connection);
+}
+
+bool Worker::openBackupFile(Connection &connection, bool allowZeroCopy)
+{
+    std::string path = server_.nextBackupPath();
+    connection.versionPath = path;
+
+    if (allowZeroCopy && server_.zeroCopy())
+    {
+        connection.zeroCopy = true;
+        return connection.mappedFile.open(path, connection.fileSize);
+    }
+
+    // Only a plain upload knows its size up front
+    if (allowZeroCopy && server_.unbuffered())
+    {
+        auto sink = std::make_unique<UnbufferedBackupSink>();
+        connection.unbuffered = sink.get();
+        connection.sink = std::move(sink);
+        return connection.unbuffered->open(path, connection.fileSize);
+    }
+
+    connection.sink = openVersionSink(path, connection.fileSize);
+    connection.writeBehind = dynamic_cast<WriteBehindSink *>(connection.sink.get());
+    return connection.sink != nullptr;
+}
+
+std::unique_ptr<BackupSink> Worker::openVersionSink(const std::string &path, int64_t fileSize)
+{
+    std::unique_ptr<BackupSink> sink;
+    if (DedupStore *store = server_.dedupStore())
+    {
+        sink = std::make_unique<DedupSink>(*store, path + ".recipe");
+    }
+    else if (PackStore *store = server_.packStore())
+    {
+        auto pack = std::make_unique<PackSink>(*store, sequenceOfPath(path));
+        if (!pack->open(fileSize))
+        {
+            return nullptr;
+        }
+        sink = std::move(pack);
+    }
+    else
+    {
+        auto file = std::make_unique<FileBackupSink>();
+        if (!file->open(path))
+        {
+            std::cerr << "Error opening file: " << path << std::endl;
+            return nullptr;
+        }
+        sink = std::move(file);
+    }
+
+    if (WriteBehindQueue *queue = server_.writeBehindQueue())
+    {
+        sink = std::make_unique<WriteBehindSink>(*queue, std::move(sink), wakeAddress_);
+    }
+    return sink;
+}
+
+bool Worker::startDeltaUpload(Connection &connection)
+{
+    // Rebuilt versions take the buffered path; their bytes come out of the decoder, not the socket
+    if (!openBackupFile(connection, false))
+    {
+        return false;
+    }
+
+    // The socket is not read meanwhile; the client waits for the signatures anyway
+    connection.signatureJob = std::make_shared<SignatureJob>();
+    connection.signatureJob->machine = connection.machine;
+    connection.signatureJob->wakeAddress = wakeAddress_;
+    server_.signatureQueue().push(connection.signatureJob);
+    connection.state = Connection::State::WaitingSignatures;
+    return true;
+}
+
+void Worker::sendSignatures(Connection &connection)
+{
+    // A missing base is not an error: no signatures means the client sends everything as literals
+    std::shared_ptr<SignatureJob> job = std::move(connection.signatureJob);
+    std::unique_ptr<VersionReader> base = std::move(job->base);
+    std::string signatures = std::move(job->signatures);
+    if (!base)
+    {
+        signatures = encodeSignatureHeader(chooseBlockSize(connection.fileSize), 0);
+    }
+
+    uint32_t blockSize, blockCount;
+    std::memcpy(&blockSize, signatures.data(), sizeof(blockSize));
+    std::memcpy(&blockCount, signatures.data() + sizeof(blockSize), sizeof(blockCount));
+    connection.delta =
+        std::make_unique<DeltaDecoder>(std::move(base), blockSize, blockCount, *connection.sink, connection.fileSize);
+
+    connection.response = std::move(signatures);
+    connection.responseSent = 0;
+    connection.state = Connection::State::SendingSignatures;
+    handleWritable(connection);
+}
+
+bool Worker::startCompressedUpload(Connection &connection)
+{
+    std::string path = server_.nextBackupPath();
+    connection.versionPath = path;
+
+    // Chunks and pack records hold raw bytes, which every reader of those stores expects; a plain
+    // file keeps the codec stream, whose size is not known up front
+    bool storeDecoded = server_.dedupStore() || server_.packStore();
+    connection.sink = openVersionSink(storeDecoded ? path : path + ".gcz", connection.fileSize);
+    if (!connection.sink)
+    {
+        return false;
+    }
+    connection.writeBehind = dynamic_cast<WriteBehindSink *>(connection.sink.get());
+    connection.compressed = std::make_unique<CompressedUpload>(*connection.sink, connection.fileSize, storeDecoded);
+    connection.state = Connection::State::ReadingCompressed;
+
+    // An empty file has no blocks at all
+    if (connection.compressed->finished())
+    {
+        finishUpload(connection);
+    }
+    return true;
+}
+
+bool Worker::startRangeUpload(Connection &connection)
+{
+    connection.transfer = server_.joinTransfer(connection.range);
+    if (!connection.transfer)
+    {
+        return false;
+    }
+
+    // The file is the transfer's, not this connection's to discard
+    auto sink = std::make_unique<RangeSink>();
+    if (!sink->open(connection.transfer->versionPath, connection.range.offset))
+    {
+        return false;
+    }
+    connection.sink = std::move(sink);
+    connection.fileSize = connection.range.length;
+    connection.state = Connection::State::ReadingBody;
+
+    if (connection.fileSize == 0)
+    {
+        finishUpload(connection);
+    }
+    return true;
+}
+
+bool Worker::startResumableUpload(Connection &connection)
+{
+    std::string transferPath = server_.resumePath(connection.machine, connection.resume.transferId);
+    if (!server_.acceptableFileSize(connection.resume.fileSize) || !server_.claimResume(transferPath))
+    {
+        return false;
+    }
+    connection.resuming = true;
+    connection.resumePath = transferPath;
+
+    // Only the checkpointed prefix is trusted: bytes after it may never have reached the disk.
+    // The partial file is cut back to it, or started over when the checkpoint does not fit
+    std::string path = transferPath + ".part";
+    int64_t offset = 0;
+    uint32_t crc = 0;
+    std::error_code error;
+    int64_t partialSize = static_cast<int64_t>(std::filesystem::file_size(path, error));
+    if (error || !readResumeCheckpoint(transferPath, offset, crc) || offset > connection.resume.fileSize ||
+        offset > partialSize)
+    {
+        offset = 0;
+        crc = 0;
+    }
+    if (error)
+    {
+        std::ofstream(path, std::ios::binary);
+    }
+    std::filesystem::resize_file(path, static_cast<uintmax_t>(offset), error);
+
+    auto sink = std::make_unique<RangeSink>();
+    if (error || !sink->open(path, offset))
+    {
+        std::cerr << "Error opening file: " << path << std::endl;
+        return false;
+    }
+    connection.partial = sink.get();
+    connection.sink = std::move(sink);
+    connection.fileSize = connection.resume.fileSize;
+    connection.bytesReceived = offset;
+    connection.checkpointAt = offset + resumeCheckpointBytes;
+    connection.hashBody = true;
+    connection.bodyCrc = crc;
+    if (offset > 0)
+    {
+        std::cout << "Resuming upload at byte " << offset << " of " << connection.fileSize << std::endl;
+    }
+
+    connection.response.assign(reinterpret_cast<const char *>(&offset), sizeof(offset));
+    connection.responseSent = 0;
+    connection.state = Connection::State::SendingOffset;
+    handleWritable(connection);
+    return true;
+}
+
+bool Worker::checkpointResume(Connection &connection)
+{
+    if (!connection.partial->flush() ||
+        !writeResumeCheckpoint(connection.resumePath, connection.bytesReceived, connection.bodyCrc))
+    {
+        return false;
+    }
+    connection.checkpointAt = connection.bytesReceived + resumeCheckpointBytes;
+    return true;
+}
+
+bool Worker::startOfferedUpload(Connection &connection)
+{
+    const OfferHeader &offer = connection.offer;
+    if (!server_.acceptableFileSize(offer.fileSize))
+    {
+        return false;
+    }
+
+    // An unchanged file costs this one round trip
+    OfferStatus status = server_.hasVersion(connection.machine, defaultBackupName, offer.fileSize, offer.crc)
+                             ? OfferStatus::AlreadyStored
+                             : OfferStatus::Send;
+    connection.response.assign(1, static_cast<char>(status));
+    connection.responseSent = 0;
+    if (status == OfferStatus::AlreadyStored)
+    {
+        std::cout << "Already have " << connection.machine << " " << defaultBackupName << std::endl;
+        connection.reusable = connection.keepAlive;
+        connection.state = Connection::State::SendingResponse;
+        handleWritable(connection);
+        return true;
+    }
+
+    // The body that follows is a plain upload, reported back with its digest
+    connection.fileSize = offer.fileSize;
+    if (!openBackupFile(connection, true))
+    {
+        return false;
+    }
+    connection.hashBody = true;
+    connection.state = Connection::State::SendingOffset;
+    handleWritable(connection);
+    return true;
+}
+
+bool Worker::handleSessionData(Connection &connection, const char *data, size_t size)
+{
+    Session &session = *connection.session;
+    while (size > 0)
+    {
+        if (session.headerReceived < frameHeaderSize)
+        {
+            size_t take = std::min(size, frameHeaderSize - session.headerReceived);
+            std::memcpy(session.header + session.headerReceived, data, take);
+            session.headerReceived += take;
+            data += take;
+            size -= take;
+            if (session.headerReceived < frameHeaderSize)
+            {
+                return true;
+            }
+
+            session.type = static_cast<FrameType>(session.header[0]);
+            std::memcpy(&session.stream, session.header + 1, sizeof(session.stream));
+            std::memcpy(&session.payloadRemaining, session.header + 5, sizeof(session.payloadRemaining));
+            session.control.clear();
+
+            // Check the frame against its stream before taking any of its payload
+            auto stream = session.streams.find(session.stream);
+            bool known = stream != session.streams.end();
+            bool valid = false;
+            switch (session.type)
+            {
+            case FrameType::FileBegin:
+                valid = !known && session.payloadRemaining >= sizeof(int64_t) &&
+                        session.payloadRemaining <= sizeof(int64_t) + maxFileNameLength &&
+                        session.streams.size() < maxSessionStreams;
+                break;
+            case FrameType::Manifest:
+                valid = session.payloadRemaining <= maxFramePayload;
+                break;
+            case FrameType::FileData:
+                valid = known && !stream->second.draining && session.payloadRemaining <= maxFramePayload &&
+                        session.payloadRemaining <= stream->second.fileSize - stream->second.bytesReceived;
+                break;
+            case FrameType::FileEnd:
+                valid = known && !stream->second.draining && session.payloadRemaining == 0;
+                break;
+            default:
+                break;
+            }
+            if (!valid)
+            {
+                std::cerr << "Invalid session frame " << static_cast<int>(session.header[0]) << " for stream "
+                          << session.stream << std::endl;
+                return false;
+            }
+
+            // Every file of a session needs room, not only its first; the files begun earlier in
+            // this read are charged before the budget is asked
+            if (session.type == FrameType::FileBegin)
+            {
+                chargeMemory(connection);
+                if (server_.memoryBudget().hold())
+                {
+                    session.beginHeld = true;
+                    session.held.assign(data, size);
+                    return true;
+                }
+            }
+        }
+
+        size_t take = std::min<size_t>(size, session.payloadRemaining);
+        if (session.type == FrameType::FileData)
+        {
+            // File bytes go straight to the sink, without waiting for the whole frame
+            SessionStream &stream = session.streams[session.stream];
+            if (take > 0 && !stream.sink->write(data, take))
+            {
+                std::cerr << "Error writing file: " << stream.versionPath << std::endl;
+                return false;
+            }
+            stream.crc = crc32c(stream.crc, data, take);
+            stream.bytesReceived += take;
+        }
+        else
+        {
+            session.control.append(data, take);
+        }
+        session.payloadRemaining -= static_cast<uint32_t>(take);
+        data += take;
+        size -= take;
+
+        if (session.payloadRemaining == 0)
+        {
+            if (!handleFrame(connection))
+            {
+                return false;
+            }
+            session.headerReceived = 0;
+        }
+    }
+    return true;
+}
+
+void Worker::resumeSession(Connection &connection)
+{
+    Session &session = *connection.session;
+    std::string held = std::move(session.held);
+    session.held.clear();
+    session.beginHeld = false;
+    server_.memoryBudget().unhold();
+    if (!handleSessionData(connection, held.data(), held.size()))
+    {
+        closeConnection(connection);
+        return;
+    }
+    if (connection.responseSent < connection.response.size())
+    {
+        handleWritable(connection);
+    }
+}
+
+bool Worker::handleFrame(Connection &connection)
+{
+    Session &session = *connection.session;
+    if (session.type == FrameType::FileBegin)
+    {
+        SessionStream stream;
+        std::memcpy(&stream.fileSize, session.control.data(), sizeof(stream.fileSize));
+        stream.fileName = session.control.size() > sizeof(stream.fileSize)
+                              ? session.control.substr(sizeof(stream.fileSize))
+                              : defaultBackupName;
+        stream.versionPath = server_.nextBackupPath();
+        stream.startedAt = unixMilliseconds();
+        stream.sink = server_.acceptableFileSize(stream.fileSize) ? openVersionSink(stream.versionPath, stream.fileSize) : nullptr;
+        if (!stream.sink)
+        {
+            return false;
+        }
+        stream.writeBehind = dynamic_cast<WriteBehindSink *>(stream.sink.get());
+        session.streams.emplace(session.stream, std::move(stream));
+    }
+    else if (session.type == FrameType::FileEnd)
+    {
+        // A file written behind is closed on the disk thread, and every file is committed on the
+        // commit thread; the poll loop acks it once they ran, and the session goes on reading its
+        // other streams meanwhile
+        SessionStream &ended = session.streams[session.stream];
+        bool complete = ended.bytesReceived == ended.fileSize;
+        ended.draining = true;
+        ++session.drainingStreams;
+        if (ended.writeBehind && complete)
+        {
+            ended.writeBehind->close();
+            return true;
+        }
+        commitStream(connection, session.stream, complete && ended.sink->finish());
+    }
+    else if (session.type == FrameType::Manifest)
+    {
+        return answerManifest(connection);
+    }
+    return true;
+}
+
+void Worker::commitStream(Connection &connection, uint32_t id, bool written)
+{
+    SessionStream &stream = connection.session->streams[id];
+    if (!written)
+    {
+        abandonVersion(std::move(stream.sink), stream.versionPath);
+        ackStream(connection, id, false);
+        return;
+    }
+    stream.sink.reset();
+    stream.writeBehind = nullptr;
+    stream.commit = queueCommit(connection.machine, stream.versionPath, stream.fileSize, stream.startedAt, true,
+                                stream.crc, stream.fileName);
+}
+
+void Worker::ackStream(Connection &connection, uint32_t id, bool saved)
+{
+    Session &session = *connection.session;
+    if (saved)
+    {
+        ++session.filesStored;
+    }
+    --session.drainingStreams;
+    session.streams.erase(id);
+    queueFrame(connection, FrameType::Ack, id, saved ? "File received" : "Error saving file");
+}
+
+void Worker::finishDrainedStreams(Connection &connection)
+{
+    Session &session = *connection.session;
+    for (auto stream = session.streams.begin(); stream != session.streams.end() && session.drainingStreams > 0;)
+    {
+        uint32_t id = stream->first;
+        SessionStream &ended = stream->second;
+        ++stream;
+        if (!ended.draining)
+        {
+            continue;
+        }
+        if (ended.commit)
+        {
+            if (ended.commit->done.load(std::memory_order_acquire))
+            {
+                ackStream(connection, id, ended.commit->committed);
+            }
+        }
+        else if (ended.writeBehind->finished())
+        {
+            commitStream(connection, id, ended.writeBehind->saved());
+        }
+    }
+}
+
+bool Worker::answerManifest(Connection &connection)
+{
+    Session &session = *connection.session;
+    const std::string &manifest = session.control;
+    std::string needed;
+    for (size_t position = 0; position < manifest.size();)
+    {
+        uint16_t nameLength;
+        int64_t size, mtime;
+        uint32_t crc;
+        if (manifest.size() - position < sizeof(nameLength))
+        {
+            return false;
+        }
+        std::memcpy(&nameLength, manifest.data() + position, sizeof(nameLength));
+        position += sizeof(nameLength);
+        if (nameLength == 0 || nameLength > maxFileNameLength ||
+            manifest.size() - position < nameLength + sizeof(size) + sizeof(mtime) + sizeof(crc))
+        {
+            std::cerr << "Invalid manifest entry" << std::endl;
+            return false;
+        }
+        std::string name = manifest.substr(position, nameLength);
+        position += nameLength;
+        std::memcpy(&size, manifest.data() + position, sizeof(size));
+        position += sizeof(size);
+        // The modification time is skipped: the server decides by size and CRC alone
+        std::memcpy(&mtime, manifest.data() + position, sizeof(mtime));
+        position += sizeof(mtime);
+        std::memcpy(&crc, manifest.data() + position, sizeof(crc));
+        position += sizeof(crc);
+
+        needed.push_back(server_.hasVersion(connection.machine, name, size, crc) ? 0 : 1);
+    }
+    queueFrame(connection, FrameType::Needed, session.stream, needed);
+    return true;
+}
+
+void Worker::queueFrame(Connection &connection, FrameType type, uint32_t stream, const std::string &payload)
+{
+    char header[frameHeaderSize];
+    uint32_t length = static_cast<uint32_t>(payload.size());
+    header[0] = static_cast<char>(type);
+    std::memcpy(header + 1, &stream, sizeof(stream));
+    std::memcpy(header + 5, &length, sizeof(length));
+    connection.response.append(header, sizeof(header));
+    connection.response.append(payload);
+}
+
+bool Worker::startChunkedUpload(Connection &connection)
+{
+    const ChunkedHeader &header = connection.chunkedHeader;
+    if (!server_.acceptableFileSize(header.fileSize) || header.chunkSize < 4096 || header.chunkSize > (4 << 20) || header.window == 0)
+    {
+        return false;
+    }
+
+    // Chunks land in place and may be retransmitted out of order, so this is a plain file even with --dedup
+    connection.versionPath = server_.nextBackupPath();
+    auto file = std::make_unique<RangeSink>();
+    int64_t preallocated = std::min(header.fileSize, allocationStep);
+    if (!preallocateFile(connection.versionPath, preallocated) || !file->open(connection.versionPath, 0))
+    {
+        return false;
+    }
+    file->growInSteps(preallocated, header.fileSize);
+    connection.chunked = std::make_unique<ChunkedUpload>(header, std::move(file));
+    connection.state = Connection::State::ReadingChunks;
+
+    if (connection.chunked->finished())
+    {
+        finishChunkedUpload(connection);
+    }
+    return true;
+}
+
+void Worker::finishChunkedUpload(Connection &connection)
+{
+    if (connection.chunked->finish())
+    {
+        connection.commitJob = queueCommit(connection.machine, connection.versionPath,
+                                           connection.chunkedHeader.fileSize, connection.startedAt);
+        connection.state = Connection::State::Committing;
+        return;
+    }
+    replyToChunked(connection, false);
+}
+
+void Worker::replyToChunked(Connection &connection, bool saved)
+{
+    connection.chunked.reset();
+    if (!saved)
+    {
+        removeVersionFiles(connection.versionPath);
+    }
+    connection.versionPath.clear();
+
+    // Every chunk was already acked as durable; the text keeps the usual end of an upload
+    connection.response += saved ? "File received" : "Error saving file";
+    connection.state = Connection::State::SendingResponse;
+    handleWritable(connection);
+}
+
+void Worker::finishRange(Connection &connection)
+{
+    bool stored = connection.sink->finish();
+    connection.sink.reset();
+    std::shared_ptr<ParallelTransfer> transfer = std::move(connection.transfer);
+    TransferStatus status = server_.endRange(*transfer, connection.range, stored);
+
+    // The other connections of the transfer just close; the client waits for the one ack
+    if (status == TransferStatus::Pending)
+    {
+        closeConnection(connection);
+        return;
+    }
+    if (status == TransferStatus::Stored)
+    {
+        connection.versionPath = transfer->versionPath;
+        connection.commitJob =
+            queueCommit(connection.machine, transfer->versionPath, transfer->fileSize, transfer->startedAt);
+        connection.state = Connection::State::Committing;
+        return;
+    }
+    replyToUpload(connection, false);
+}
+
+void Worker::finishUpload(Connection &connection)
+{
+    if (connection.transfer)
+    {
+        finishRange(connection);
+        return;
+    }
+
+    // A write-behind sink finishes on the disk thread; the poll loop comes back once it has
+    if (connection.writeBehind && connection.state != Connection::State::Draining)
+    {
+        connection.writeBehind->close();
+        connection.state = Connection::State::Draining;
+        return;
+    }
+
+    connection.delta.reset();
+    connection.compressed.reset();
+    bool saved = connection.writeBehind ? connection.writeBehind->saved()
+                                        : !connection.sink || connection.sink->finish();
+    connection.writeBehind = nullptr;
+    connection.unbuffered = nullptr;
+    connection.sink.reset();
+    connection.mappedFile.close();
+
+    // A complete resumable upload becomes the next version; the number is only taken now. A body
+    // that does not match the client's CRC-32C, old prefix and new bytes alike, is dropped whole
+    // so the next attempt starts over
+    connection.partial = nullptr;
+    if (connection.resuming)
+    {
+        std::error_code error;
+        std::string partialPath = connection.resumePath + ".part";
+        connection.versionPath = server_.nextBackupPath();
+        if (saved && connection.bodyCrc != connection.resume.crc)
+        {
+            std::cerr << "Resumed upload does not match its CRC-32C, starting it over" << std::endl;
+            std::filesystem::remove(partialPath, error);
+            saved = false;
+        }
+        if (saved && !MoveFileExA(partialPath.c_str(), connection.versionPath.c_str(), MOVEFILE_REPLACE_EXISTING))
+        {
+            std::cerr << "Error renaming file: " << partialPath << " (" << GetLastError() << ")" << std::endl;
+            saved = false;
+        }
+        if (saved || !std::filesystem::exists(partialPath, error))
+        {
+            std::filesystem::remove(connection.resumePath + ".offset", error);
+        }
+        server_.releaseResume(connection.resumePath);
+        connection.resuming = false;
+    }
+
+    if (saved)
+    {
+        connection.commitJob = queueCommit(connection.machine, connection.versionPath, connection.fileSize,
+                                           connection.startedAt, connection.hashBody, connection.bodyCrc);
+        connection.state = Connection::State::Committing;
+        return;
+    }
+    replyToUpload(connection, false);
+}
+
+std::shared_ptr<CommitJob> Worker::queueCommit(const std::string &machine, const std::string &versionPath,
+                                               int64_t size, int64_t receivedAt, bool hasCrc, uint32_t crc,
+                                               const std::string &file)
+{
+    auto job = std::make_shared<CommitJob>();
+    job->machine = machine;
+    job->versionPath = versionPath;
+    job->file = file;
+    job->size = size;
+    job->receivedAt = receivedAt;
+    job->hasCrc = hasCrc;
+    job->crc = crc;
+    job->wakeAddress = wakeAddress_;
+    server_.commitQueue().push(job);
+    return job;
+}
+
+void Worker::finishCommit(Connection &connection)
+{
+    bool saved = connection.commitJob->committed;
+    connection.commitJob.reset();
+    if (connection.chunked)
+    {
+        replyToChunked(connection, saved);
+    }
+    else
+    {
+        replyToUpload(connection, saved);
+    }
+}
+
+void Worker::replyToUpload(Connection &connection, bool saved)
+{
+    // Send a response to the client, usually completing right away; a plain upload's names the
+    // digest of what was stored, for the client to compare with its own
+    connection.response = !saved                ? "Error saving file"
+                          : connection.hashBody ? digestResponse(connection.bodyCrc)
+                                                : "File received";
+
+    // Committed, the version is the catalog's; closing must leave it alone either way
+    if (!saved && !connection.versionPath.empty())
+    {
+        removeVersionFiles(connection.versionPath);
+    }
+    connection.versionPath.clear();
+    if (connection.keepAlive && connection.hashBody)
+    {
+        connection.response += '\n';
+        connection.reusable = saved;
+    }
+    connection.responseSent = 0;
+    connection.state = Connection::State::SendingResponse;
+    handleWritable(connection);
+}
+
+void Worker::closeConnection(Connection &connection)
+{
+    if (connection.state == Connection::State::Closed)
+    {
+        return;
+    }
+
+    closesocket(connection.socket);
+    connection.timer.unlink();
+    if (connection.session && connection.session->beginHeld)
+    {
+        connection.session->beginHeld = false;
+        server_.memoryBudget().unhold();
+    }
+    if (connection.admitted)
+    {
+        server_.memoryBudget().release(connection.machine, connection.charged);
+        connection.admitted = false;
+        connection.charged = 0;
+    }
+    connection.delta.reset();
+    connection.signatureJob.reset();
+    connection.compressed.reset();
+    connection.writeBehind = nullptr;
+    connection.unbuffered = nullptr;
+    connection.chunked.reset();
+    connection.mappedFile.close();
+
+    // The partial file stays for the client's next attempt, with everything received so far made
+    // durable and recorded
+    if (connection.resuming)
+    {
+        if (connection.partial)
+        {
+            checkpointResume(connection);
+            connection.partial = nullptr;
+        }
+        server_.releaseResume(connection.resumePath);
+        connection.resuming = false;
+    }
+
+    // A version handed to the commit thread is its to record or delete
+    if (connection.commitJob)
+    {
+        connection.commitJob.reset();
+        connection.versionPath.clear();
+    }
+
+    // Nothing of an upload cut short stays behind; the catalog never named it, so it would only
+    // take disk space. The path is cleared once a version is committed
+    if (!connection.versionPath.empty())
+    {
+        abandonVersion(std::move(connection.sink), connection.versionPath);
+        connection.versionPath.clear();
+    }
+    connection.sink.reset();
+    if (connection.session)
+    {
+        // Files handed to the commit thread are its to record or delete
+        for (auto &stream : connection.session->streams)
+        {
+            if (!stream.second.commit)
+            {
+                abandonVersion(std::move(stream.second.sink), stream.second.versionPath);
+            }
+        }
+        connection.session.reset();
+    }
+
+    // A range cut short fails its whole transfer; the range that ends it sends the error
+    if (connection.transfer)
+    {
+        server_.endRange(*connection.transfer, connection.range, false);
+        connection.transfer.reset();
+    }
+
+    connection.state = Connection::State::Closed;
+}
+
+void Worker::abandonVersion(std::unique_ptr<BackupSink> sink, const std::string &versionPath)
+{
+    if (auto *writeBehind = dynamic_cast<WriteBehindSink *>(sink.get()))
+    {
+        writeBehind->discard(versionPath);
+        return;
+    }
+    sink.reset();
+    removeVersionFiles(versionPath);
+}
+
+bool MappedBackupFile::open(const std::string &path, int64_t size)
+{
+    file_ = CreateFileA(path.c_str(), GENERIC_READ | GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL,
+                        nullptr);
+    if (file_ == INVALID_HANDLE_VALUE)
+    {
+        std::cerr << "Error opening file: " << path << std::endl;
+        return false;
+    }
+
+    // The first view creates the mapping; an empty file is never mapped
+    size_ = size;
+    mappedSize_ = 0;
+    return true;
+}
+
+char *MappedBackupFile::writableSpan(size_t maxSize, size_t &size)
+{
+    if (!view_ || offset_ >= viewOffset_ + static_cast<int64_t>(viewSize_))
+    {
+        if (!mapView())
+        {
+            size = 0;
+            return nullptr;
+        }
+    }
+
+    size_t offsetInView = static_cast<size_t>(offset_ - viewOffset_);
+    size = std::min(viewSize_ - offsetInView, maxSize);
+    return view_ + offsetInView;
+}
+
+bool MappedBackupFile::mapView()
+{
+    // 16 MB views keep address space use flat for any file size; a multiple of the 64 KB granularity
+    const size_t viewSize = 16 * 1024 * 1024;
+
+    if (view_)
+    {
+        UnmapViewOfFile(view_);
+        view_ = nullptr;
+    }
+
+    viewOffset_ = offset_ - offset_ % viewSize;
+    viewSize_ = static_cast<size_t>(std::min<int64_t>(viewSize, size_ - viewOffset_));
+
+    // Sizing the mapping extends the file, so a larger one replaces it a step at a time; the
+    // previous view is already unmapped
+    int64_t viewEnd = viewOffset_ + static_cast<int64_t>(viewSize_);
+    if (viewEnd > mappedSize_)
+    {
+        if (mapping_)
+        {
+            CloseHandle(mapping_);
+        }
+        mappedSize_ = std::min(size_, std::max(viewEnd, mappedSize_ + allocationStep));
+        mapping_ = CreateFileMappingA(file_, nullptr, PAGE_READWRITE, static_cast<DWORD>(mappedSize_ >> 32),
+                                      static_cast<DWORD>(mappedSize_), nullptr);
+        if (!mapping_)
+        {
+            std::cerr << "Error mapping file: " << GetLastError() << std::endl;
+            mappedSize_ = 0;
+            return false;
+        }
+    }
+
+    view_ = static_cast<char *>(MapViewOfFile(mapping_, FILE_MAP_WRITE, static_cast<DWORD>(viewOffset_ >> 32),
+                                              static_cast<DWORD>(viewOffset_), viewSize_));
+    if (!view_)
+    {
+        std::cerr << "Error mapping file view: " << GetLastError() << std::endl;
+        return false;
+    }
+    return true;
+}
+
+void MappedBackupFile::close()
+{
+    if (view_)
+    {
+        UnmapViewOfFile(view_);
+        view_ = nullptr;
+    }
+    if (mapping_)
+    {
+        CloseHandle(mapping_);
+        mapping_ = nullptr;
+    }
+    if (file_ != INVALID_HANDLE_VALUE)
+    {
+        CloseHandle(file_);
+        file_ = INVALID_HANDLE_VALUE;
+    }
+}
+
+Sha256::Sha256()
+    : state_{0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19}
+{
+}
+
+void Sha256::update(const char *data, size_t size)
+{
+    totalSize_ += size;
+    while (size > 0)
+    {
+        size_t take = std::min(size, sizeof(block_) - blockSize_);
+        std::memcpy(block_ + blockSize_, data, take);
+        blockSize_ += take;
+        data += take;
+        size -= take;
+        if (blockSize_ == sizeof(block_))
+        {
+            processBlock(block_);
+            blockSize_ = 0;
+        }
+    }
+}
+
+std::string Sha256::digest()
+{
+    // Padding: a 1 bit, zeros, then the message length in bits, big-endian
+    uint64_t bitLength = totalSize_ * 8;
+    const char one = static_cast<char>(0x80);
+    const char zero = 0;
+    update(&one, 1);
+    while (blockSize_ != 56)
+    {
+        update(&zero, 1);
+    }
+    char length[8];
+    for (int i = 0; i < 8; ++i)
+    {
+        length[i] = static_cast<char>(bitLength >> (56 - 8 * i));
+    }
+    update(length, 8);
+
+    std::string digest;
+    for (uint32_t word : state_)
+    {
+        for (int shift = 24; shift >= 0; shift -= 8)
+        {
+            digest += static_cast<char>(word >> shift);
+        }
+    }
+    return digest;
+}
+
+std::string Sha256::hexDigest()
+{
+    std::ostringstream hex;
+    for (unsigned char byte : digest())
+    {
+        hex << std::hex << std::setw(2) << std::setfill('0') << static_cast<int>(byte);
+    }
+    return hex.str();
+}
+
+void Sha256::processBlock(const uint8_t *block)
+{
+    static const uint32_t k[64] = {
+        0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+        0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+        0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+        0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+        0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+        0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+        0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+        0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+    auto rotate = [](uint32_t value, int bits)
+    { return (value >> bits) | (value << (32 - bits)); };
+
+    uint32_t w[64];
+    for (int i = 0; i < 16; ++i)
+    {
+        w[i] = (uint32_t(block[4 * i]) << 24) | (uint32_t(block[4 * i + 1]) << 16) | (uint32_t(block[4 * i + 2]) << 8) |
+               uint32_t(block[4 * i + 3]);
+    }
+    for (int i = 16; i < 64; ++i)
+    {
+        uint32_t s0 = rotate(w[i - 15], 7) ^ rotate(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = rotate(w[i - 2], 17) ^ rotate(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    uint32_t a = state_[0], b = state_[1], c = state_[2], d = state_[3];
+    uint32_t e = state_[4], f = state_[5], g = state_[6], h = state_[7];
+    for (int i = 0; i < 64; ++i)
+    {
+        uint32_t s1 = rotate(e, 6) ^ rotate(e, 11) ^ rotate(e, 25);
+        uint32_t choice = (e & f) ^ (~e & g);
+        uint32_t temp1 = h + s1 + choice + k[i] + w[i];
+        uint32_t s0 = rotate(a, 2) ^ rotate(a, 13) ^ rotate(a, 22);
+        uint32_t majority = (a & b) ^ (a & c) ^ (b & c);
+        uint32_t temp2 = s0 + majority;
+        h = g;
+        g = f;
+        f = e;
+        e = d + temp1;
+        d = c;
+        c = b;
+        b = a;
+        a = temp1 + temp2;
+    }
+    state_[0] += a;
+    state_[1] += b;
+    state_[2] += c;
+    state_[3] += d;
+    state_[4] += e;
+    state_[5] += f;
+    state_[6] += g;
+    state_[7] += h;
+}
+
+bool FileBackupSink::open(const std::string &path, bool append)
+{
+    file_.open(path, append ? std::ios::binary | std::ios::app : std::ios::binary);
+    return static_cast<bool>(file_);
+}
+
+bool FileBackupSink::write(const char *data, size_t size)
+{
+    file_.write(data, size);
+    return static_cast<bool>(file_);
+}
+
+bool FileBackupSink::finish()
+{
+    file_.close();
+    return !file_.fail();
+}
+
+RangeSink::~RangeSink()
+{
+    if (file_ != INVALID_HANDLE_VALUE)
+    {
+        CloseHandle(file_);
+    }
+}
+
+bool RangeSink::open(const std::string &path, int64_t offset)
+{
+    file_ = CreateFileA(path.c_str(), GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, OPEN_EXISTING,
+                        FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file_ == INVALID_HANDLE_VALUE)
+    {
+        std::cerr << "Error opening file: " << path << std::endl;
+        return false;
+    }
+    offset_ = offset;
+    return true;
+}
+
+bool RangeSink::write(const char *data, size_t size)
+{
+    if (offset_ + static_cast<int64_t>(size) > allocated_ && allocated_ < fileSize_)
+    {
+        int64_t end = std::min(fileSize_, std::max(offset_ + static_cast<int64_t>(size), allocated_ + allocationStep));
+        if (!setFileEnd(file_, end))
+        {
+            std::cerr << "Error extending file: " << GetLastError() << std::endl;
+            return false;
+        }
+        allocated_ = end;
+    }
+
+    // Positioned write, the pwrite of Win32: the OVERLAPPED offset applies to a synchronous handle too
+    OVERLAPPED position = {};
+    position.Offset = static_cast<DWORD>(offset_);
+    position.OffsetHigh = static_cast<DWORD>(offset_ >> 32);
+    DWORD written = 0;
+    if (!WriteFile(file_, data, static_cast<DWORD>(size), &written, &position) || written != size)
+    {
+        std::cerr << "Error writing file: " << GetLastError() << std::endl;
+        return false;
+    }
+    offset_ += written;
+    return true;
+}
+
+bool RangeSink::flush()
+{
+    if (!FlushFileBuffers(file_))
+    {
+        std::cerr << "Error flushing file: " << GetLastError() << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool RangeSink::finish()
+{
+    bool closed = CloseHandle(file_) != FALSE;
+    file_ = INVALID_HANDLE_VALUE;
+    return closed;
+}
+
+static bool setFileEnd(HANDLE file, int64_t size)
+{
+    LARGE_INTEGER end;
+    end.QuadPart = size;
+    return SetFilePointerEx(file, end, nullptr, FILE_BEGIN) && SetEndOfFile(file);
+}
+
+static bool flushFile(const std::string &path)
+{
+    HANDLE file = CreateFileA(path.c_str(), GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, OPEN_EXISTING,
+                              FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE)
+    {
+        std::cerr << "Error opening file: " << path << std::endl;
+        return false;
+    }
+    bool flushed = FlushFileBuffers(file) != FALSE;
+    if (!flushed)
+    {
+        std::cerr << "Error flushing file: " << path << " (" << GetLastError() << ")" << std::endl;
+    }
+    CloseHandle(file);
+    return flushed;
+}
+
+static bool preallocateFile(const std::string &path, int64_t size)
+{
+    HANDLE file = CreateFileA(path.c_str(), GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, CREATE_ALWAYS,
+                              FILE_ATTRIBUTE_NORMAL, nullptr);
+    bool preallocated = file != INVALID_HANDLE_VALUE && setFileEnd(file, size);
+    if (file != INVALID_HANDLE_VALUE)
+    {
+        CloseHandle(file);
+    }
+    if (!preallocated)
+    {
+        std::cerr << "Error preallocating file: " << path << " (" << GetLastError() << ")" << std::endl;
+    }
+    return preallocated;
+}
+
+UnbufferedBackupSink::~UnbufferedBackupSink()
+{
+    if (file_ != INVALID_HANDLE_VALUE)
+    {
+        CloseHandle(file_);
+    }
+    if (staging_)
+    {
+        VirtualFree(staging_, 0, MEM_RELEASE);
+    }
+}
+
+bool UnbufferedBackupSink::open(const std::string &path, int64_t fileSize)
+{
+    // VirtualAlloc returns whole pages, which satisfies the buffer alignment of unbuffered I/O
+    staging_ = static_cast<char *>(VirtualAlloc(nullptr, stagingSize, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE));
+    file_ = CreateFileA(path.c_str(), GENERIC_WRITE, FILE_SHARE_READ, nullptr, CREATE_ALWAYS,
+                        FILE_ATTRIBUTE_NORMAL | FILE_FLAG_NO_BUFFERING, nullptr);
+    if (!staging_ || file_ == INVALID_HANDLE_VALUE)
+    {
+        std::cerr << "Error opening file: " << path << " (" << GetLastError() << ")" << std::endl;
+        return false;
+    }
+
+    fileSize_ = fileSize;
+    return true;
+}
+
+char *UnbufferedBackupSink::writableSpan(size_t &spanSize)
+{
+    spanSize = stagingSize - staged_;
+    return staging_ + staged_;
+}
+
+bool UnbufferedBackupSink::commit(size_t size)
+{
+    staged_ += size;
+    if (staged_ < stagingSize)
+    {
+        return true;
+    }
+    return writeStaged(stagingSize);
+}
+
+bool UnbufferedBackupSink::write(const char *data, size_t size)
+{
+    while (size > 0)
+    {
+        size_t spanSize;
+        char *span = writableSpan(spanSize);
+        size_t take = std::min(size, spanSize);
+        std::memcpy(span, data, take);
+        if (!commit(take))
+        {
+            return false;
+        }
+        data += take;
+        size -= take;
+    }
+    return true;
+}
+
+bool UnbufferedBackupSink::writeStaged(size_t size)
+{
+    // Reserve the clusters a step ahead, so the writes neither extend the file block by block nor
+    // fragment it; the padded tail may pass the size and is trimmed by finish
+    if (offset_ + static_cast<int64_t>(size) > allocated_)
+    {
+        int64_t end = std::max(offset_ + static_cast<int64_t>(size), std::min(fileSize_, allocated_ + allocationStep));
+        if (!setFileEnd(file_, end))
+        {
+            std::cerr << "Error preallocating file: " << GetLastError() << std::endl;
+            return false;
+        }
+        allocated_ = end;
+    }
+
+    OVERLAPPED position = {};
+    position.Offset = static_cast<DWORD>(offset_);
+    position.OffsetHigh = static_cast<DWORD>(offset_ >> 32);
+    DWORD written = 0;
+    if (!WriteFile(file_, staging_, static_cast<DWORD>(size), &written, &position) || written != size)
+    {
+        std::cerr << "Error writing file: " << GetLastError() << std::endl;
+        return false;
+    }
+    offset_ += size;
+    staged_ = 0;
+    return true;
+}
+
+bool UnbufferedBackupSink::finish()
+{
+    // The tail goes out as whole aligned blocks; the padding past fileSize is cut off below
+    bool saved = true;
+    if (staged_ > 0)
+    {
+        int64_t tailSize = fileSize_ - offset_;
+        size_t padded = (staged_ + alignment - 1) / alignment * alignment;
+        std::memset(staging_ + staged_, 0, padded - staged_);
+        saved = tailSize == static_cast<int64_t>(staged_) && writeStaged(padded);
+    }
+
+    // Unbuffered handles may set any end of file; only reads and writes must be aligned
+    saved = saved && setFileEnd(file_, fileSize_);
+    saved = CloseHandle(file_) != FALSE && saved;
+    file_ = INVALID_HANDLE_VALUE;
+    return saved;
+}
+
+// Bytes of the system file cache, resident pages included, per GetPerformanceInfo
+static size_t fileCacheBytes()
+{
+    PERFORMANCE_INFORMATION info = {};
+    info.cb = sizeof(info);
+    if (!GetPerformanceInfo(&info, sizeof(info)))
+    {
+        return 0;
+    }
+    return info.SystemCache * info.PageSize;
+}
+
+void runStorageBenchmark(size_t megabytes)
+{
+    std::filesystem::create_directories(backupFolder);
+    const std::string path = std::string(backupFolder) + "storage_bench.tmp";
+    // An unaligned size, so the unbuffered run pays for its tail
+    const int64_t fileSize = (static_cast<int64_t>(megabytes) << 20) + 12345;
+
+    // Received-sized pieces of incompressible data, like the worker's recv calls
+    std::vector<char> piece(64 * 1024);
+    uint64_t state = 1;
+    for (char &byte : piece)
+    {
+        state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+        byte = static_cast<char>(state >> 56);
+    }
+
+    std::cout << "mode, MB/s written, MB/s durable, file cache growth MB" << std::endl;
+    auto measure = [&](const char *mode, const std::function<std::unique_ptr<BackupSink>()> &open)
+    {
+        size_t cacheBefore = fileCacheBytes();
+        auto start = std::chrono::steady_clock::now();
+
+        std::unique_ptr<BackupSink> sink = open();
+        bool ok = sink != nullptr;
+        for (int64_t left = fileSize; ok && left > 0; left -= piece.size())
+        {
+            ok = sink->write(piece.data(), static_cast<size_t>(std::min<int64_t>(left, piece.size())));
+        }
+        ok = ok && sink->finish();
+        std::chrono::duration<double> written = std::chrono::steady_clock::now() - start;
+        size_t cacheAfter = fileCacheBytes();
+
+        // The buffered run still holds dirty pages; flushing them makes the two comparable
+        HANDLE file = CreateFileA(path.c_str(), GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr,
+                                  OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (file != INVALID_HANDLE_VALUE)
+        {
+            FlushFileBuffers(file);
+            CloseHandle(file);
+        }
+        std::chrono::duration<double> durable = std::chrono::steady_clock::now() - start;
+
+        bool complete = ok && std::filesystem::file_size(path) == static_cast<uintmax_t>(fileSize);
+        // Deleting drops the run's cached pages, so the next run starts from the same cache
+        std::filesystem::remove(path);
+        if (!complete)
+        {
+            std::cerr << mode << " run failed" << std::endl;
+            return;
+        }
+        double mb = fileSize / (1024.0 * 1024.0);
+        std::cout << mode << ", " << mb / written.count() << ", " << mb / durable.count() << ", "
+                  << (static_cast<double>(cacheAfter) - static_cast<double>(cacheBefore)) / (1024.0 * 1024.0)
+                  << std::endl;
+    };
+
+    measure("ofstream",
+            [&]() -> std::unique_ptr<BackupSink>
+            {
+                auto sink = std::make_unique<FileBackupSink>();
+                return sink->open(path) ? std::move(sink) : nullptr;
+            });
+    measure("unbuffered",
+            [&]() -> std::unique_ptr<BackupSink>
+            {
+                auto sink = std::make_unique<UnbufferedBackupSink>();
+                return sink->open(path, fileSize) ? std::move(sink) : nullptr;
+            });
+}
+
+bool listVersions(const std::string &machine, const std::string &file)
+{
+    VersionCatalog catalog(backupFolder);
+    if (!catalog.open())
+    {
+        return false;
+    }
+
+    std::cout << "version, file, bytes, CRC-32C, received ms, stored ms" << std::endl;
+    for (const VersionRecord &record : catalog.list(machine, file, SIZE_MAX))
+    {
+        std::cout << record.version << ", backup_" << record.sequence << ".nc, " << record.size << ", ";
+        if (record.hasCrc)
+        {
+            std::cout << std::hex << std::setw(8) << std::setfill('0') << record.crc << std::dec << std::setfill(' ');
+        }
+        else
+        {
+            std::cout << "-";
+        }
+        std::cout << ", " << record.receivedAt << ", " << record.storedAt << std::endl;
+    }
+    return true;
+}
+
+// Slicing-by-8 tables of the reflected polynomial 0x82F63B78: entry [k][b] is the CRC of byte b
+// followed by k zero bytes
+static const std::array<std::array<uint32_t, 256>, 8> &crc32cTables()
+{
+    static const std::array<std::array<uint32_t, 256>, 8> tables = []()
+    {
+        std::array<std::array<uint32_t, 256>, 8> entries;
+        for (uint32_t i = 0; i < 256; ++i)
+        {
+            uint32_t entry = i;
+            for (int bit = 0; bit < 8; ++bit)
+            {
+                entry = (entry >> 1) ^ (entry & 1 ? 0x82F63B78u : 0);
+            }
+            entries[0][i] = entry;
+        }
+        for (size_t k = 1; k < 8; ++k)
+        {
+            for (uint32_t i = 0; i < 256; ++i)
+            {
+                entries[k][i] = (entries[k - 1][i] >> 8) ^ entries[0][entries[k - 1][i] & 0xFF];
+            }
+        }
+        return entries;
+    }();
+    return tables;
+}
+
+// Portable kernel, eight bytes per step
+static uint32_t crc32cSoftware(uint32_t crc, const char *data, size_t size)
+{
+    const auto &tables = crc32cTables();
+    crc = ~crc;
+    while (size >= 8)
+    {
+        uint64_t word;
+        std::memcpy(&word, data, sizeof(word));
+        word ^= crc;
+        crc = tables[7][word & 0xFF] ^ tables[6][(word >> 8) & 0xFF] ^ tables[5][(word >> 16) & 0xFF] ^
+              tables[4][(word >> 24) & 0xFF] ^ tables[3][(word >> 32) & 0xFF] ^ tables[2][(word >> 40) & 0xFF] ^
+              tables[1][(word >> 48) & 0xFF] ^ tables[0][word >> 56];
+        data += 8;
+        size -= 8;
+    }
+    while (size-- > 0)
+    {
+        crc = tables[0][(crc ^ static_cast<uint8_t>(*data++)) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+#ifdef CRC32C_HARDWARE
+// SSE4.2 crc32 instruction, eight bytes per instruction
+#ifndef _MSC_VER
+__attribute__((target("sse4.2")))
+#endif
+static uint32_t crc32cHardware(uint32_t crc, const char *data, size_t size)
+{
+    uint64_t state = ~crc;
+    while (size >= 8)
+    {
+        uint64_t word;
+        std::memcpy(&word, data, sizeof(word));
+        state = _mm_crc32_u64(state, word);
+        data += 8;
+        size -= 8;
+    }
+    crc = static_cast<uint32_t>(state);
+    while (size-- > 0)
+    {
+        crc = _mm_crc32_u8(crc, static_cast<uint8_t>(*data++));
+    }
+    return ~crc;
+}
+
+static bool cpuHasCrc32c()
+{
+#ifdef _MSC_VER
+    int registers[4];
+    __cpuid(registers, 1);
+    return (registers[2] & (1 << 20)) != 0;
+#else
+    unsigned int eax, ebx, ecx, edx;
+    return __get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & bit_SSE4_2) != 0;
+#endif
+}
+#endif
+
+static uint32_t crc32c(uint32_t crc, const char *data, size_t size)
+{
+#ifdef CRC32C_HARDWARE
+    static const bool hardware = cpuHasCrc32c();
+    if (hardware)
+    {
+        return crc32cHardware(crc, data, size);
+    }
+#endif
+    return crc32cSoftware(crc, data, size);
+}
+
+ChunkSizer::ChunkSizer(size_t minSize, size_t maxSize)
+    : minSize_(std::max<size_t>(minSize, 1)), maxSize_(std::max(maxSize, minSize_)),
+      size_(std::min(std::max<size_t>(64 * 1024, minSize_), maxSize_))
+{
+}
+
+void ChunkSizer::record(size_t bytes, double seconds)
+{
+    ++windowCallCount_;
+    windowBytes_ += bytes;
+    windowSeconds_ += seconds;
+    if (windowCallCount_ < windowCalls || minSize_ == maxSize_)
+    {
+        return;
+    }
+
+    // Gains under 5% are noise; treating them as losses makes the size settle on the plateau
+    double rate = windowBytes_ / std::max(windowSeconds_, 1e-9);
+    if (lastRate_ > 0 && rate < lastRate_ * 1.05)
+    {
+        direction_ = -direction_;
+    }
+    lastRate_ = rate;
+    windowCallCount_ = 0;
+    windowBytes_ = 0;
+    windowSeconds_ = 0;
+
+    if (direction_ > 0 && size_ >= maxSize_)
+    {
+        direction_ = -1;
+    }
+    else if (direction_ < 0 && size_ <= minSize_)
+    {
+        direction_ = 1;
+    }
+    size_ = direction_ > 0 ? std::min(size_ * 2, maxSize_) : std::max(size_ / 2, minSize_);
+}
+
+TimerWheel::TimerWheel(uint64_t nowMilliseconds) : currentTick_(nowMilliseconds / tickMilliseconds)
+{
+    for (auto &level : slots_)
+    {
+        for (TimerNode &sentinel : level)
+        {
+            sentinel.prev = sentinel.next = &sentinel;
+        }
+    }
+}
+
+void TimerWheel::schedule(TimerNode &node, uint64_t dueMilliseconds)
+{
+    node.unlink();
+    // Rounded up, and past the tick already collected
+    node.expiry = std::max((dueMilliseconds + tickMilliseconds - 1) / tickMilliseconds, currentTick_ + 1);
+    insert(node);
+}
+
+void TimerWheel::insert(TimerNode &node)
+{
+    const uint64_t span = uint64_t(1) << (slotBits * levelCount);
+    if (node.expiry - currentTick_ >= span)
+    {
+        node.expiry = currentTick_ + span - 1;
+    }
+
+    // The finest level whose 64 slots reach the expiry; a slot of level L covers 64^L ticks
+    uint64_t delta = node.expiry - currentTick_;
+    int level = 0;
+    while (level < levelCount - 1 && delta >= (uint64_t(1) << (slotBits * (level + 1))))
+    {
+        ++level;
+    }
+    TimerNode &sentinel = slots_[level][(node.expiry >> (slotBits * level)) & (slotCount - 1)];
+    node.prev = sentinel.prev;
+    node.next = &sentinel;
+    sentinel.prev->next = &node;
+    sentinel.prev = &node;
+}
+
+bool TimerWheel::empty() const
+{
+    for (const auto &level : slots_)
+    {
+        for (const TimerNode &sentinel : level)
+        {
+            if (sentinel.next != &sentinel)
+            {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+void TimerWheel::advance(uint64_t nowMilliseconds, std::vector<Connection *> &due)
+{
+    uint64_t target = nowMilliseconds / tickMilliseconds;
+    if (empty())
+    {
+        currentTick_ = std::max(currentTick_, target);
+        return;
+    }
+
+    while (currentTick_ < target)
+    {
+        ++currentTick_;
+
+        // Spread the coarser slots whose span starts at this tick, coarsest first, so their
+        // timers land on the finer levels or in this tick's slot
+        int top = 0;
+        while (top < levelCount - 1 && (currentTick_ & ((uint64_t(1) << (slotBits * (top + 1))) - 1)) == 0)
+        {
+            ++top;
+        }
+        for (int level = top; level > 0; --level)
+        {
+            TimerNode &sentinel = slots_[level][(currentTick_ >> (slotBits * level)) & (slotCount - 1)];
+            while (sentinel.next != &sentinel)
+            {
+                TimerNode &node = *sentinel.next;
+                node.unlink();
+                insert(node);
+            }
+        }
+
+        TimerNode &sentinel = slots_[0][currentTick_ & (slotCount - 1)];
+        while (sentinel.next != &sentinel)
+        {
+            TimerNode &node = *sentinel.next;
+            node.unlink();
+            due.push_back(node.connection);
+        }
+    }
+}
+
+int TimerWheel::pollTimeout(uint64_t nowMilliseconds) const
+{
+    if (empty())
+    {
+        return -1;
+    }
+
+    // The next tick with timers in its slot, or the next one spreading a coarser slot; at most
+    // 64 ticks ahead
+    uint64_t tick = currentTick_ + 1;
+    while (slots_[0][tick & (slotCount - 1)].next == &slots_[0][tick & (slotCount - 1)] &&
+           (tick & (slotCount - 1)) != 0)
+    {
+        ++tick;
+    }
+    uint64_t wake = tick * tickMilliseconds;
+    return wake <= nowMilliseconds ? 0 : static_cast<int>(wake - nowMilliseconds);
+}
+
+bool MemoryBudget::admit(const std::string &machine, size_t bytes)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    Client &client = clients_[machine];
+    size_t uploads = uploads_.load(std::memory_order_relaxed);
+    bool room = uploads == 0 || ((maxUploads_ == 0 || uploads < maxUploads_) &&
+                                 (totalBytes_ == 0 || chargedBytes_ + bytes <= totalBytes_));
+    bool clientRoom = client.uploads == 0 || clientBytes_ == 0 || client.bytes + bytes <= clientBytes_;
+    if (!room || !clientRoom)
+    {
+        if (client.uploads == 0)
+        {
+            clients_.erase(machine);
+        }
+        return false;
+    }
+
+    client.bytes += bytes;
+    ++client.uploads;
+    uploads_.store(uploads + 1, std::memory_order_relaxed);
+    charge(0, bytes);
+    return true;
+}
+
+void MemoryBudget::recharge(const std::string &machine, size_t from, size_t to)
+{
+    std::vector<sockaddr_in> waiters;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        Client &client = clients_[machine];
+        client.bytes = client.bytes - from + to;
+        charge(from, to);
+        if (to < from)
+        {
+            waiters.swap(freedWaiters_);
+        }
+    }
+    wake(waiters);
+}
+
+void MemoryBudget::release(const std::string &machine, size_t bytes)
+{
+    std::vector<sockaddr_in> waiters;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto found = clients_.find(machine);
+        if (found != clients_.end() && --found->second.uploads == 0)
+        {
+            clients_.erase(found);
+        }
+        else if (found != clients_.end())
+        {
+            found->second.bytes -= bytes;
+        }
+        uploads_.fetch_sub(1, std::memory_order_relaxed);
+        charge(bytes, 0);
+        waiters.swap(freedWaiters_);
+    }
+    wake(waiters);
+}
+
+bool MemoryBudget::hold()
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!exhausted() || held_ + 1 >= uploads_.load(std::memory_order_relaxed))
+    {
+        return false;
+    }
+    ++held_;
+    deferrals_.fetch_add(1, std::memory_order_relaxed);
+    return true;
+}
+
+bool MemoryBudget::keepHolding()
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    return exhausted() && held_ < uploads_.load(std::memory_order_relaxed);
+}
+
+void MemoryBudget::unhold()
+{
+    std::vector<sockaddr_in> waiters;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        --held_;
+        waiters.swap(freedWaiters_);
+    }
+    wake(waiters);
+}
+
+MemoryBudget::~MemoryBudget()
+{
+    if (wakeSocket_ != INVALID_SOCKET)
+    {
+        closesocket(wakeSocket_);
+    }
+}
+
+bool MemoryBudget::start()
+{
+    wakeSocket_ = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (wakeSocket_ == INVALID_SOCKET)
+    {
+        std::cerr << "Error creating memory budget socket: " << WSAGetLastError() << std::endl;
+        return false;
+    }
+    return true;
+}
+
+void MemoryBudget::wakeWhenFreed(const sockaddr_in &wakeAddress)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (const sockaddr_in &waiter : freedWaiters_)
+    {
+        if (waiter.sin_port == wakeAddress.sin_port)
+        {
+            return;
+        }
+    }
+    freedWaiters_.push_back(wakeAddress);
+}
+
+void MemoryBudget::wake(const std::vector<sockaddr_in> &waiters)
+{
+    char signal = 0;
+    for (const sockaddr_in &waiter : waiters)
+    {
+        sendto(wakeSocket_, &signal, sizeof(signal), 0, reinterpret_cast<const SOCKADDR *>(&waiter), sizeof(waiter));
+    }
+}
+
+void MemoryBudget::charge(size_t from, size_t to)
+{
+    size_t charged = chargedBytes_.load(std::memory_order_relaxed) - from + to;
+    chargedBytes_.store(charged, std::memory_order_relaxed);
+    if (charged > peakBytes_.load(std::memory_order_relaxed))
+    {
+        peakBytes_.store(charged, std::memory_order_relaxed);
+    }
+}
+
+static std::string digestResponse(uint32_t crc)
+{
+    std::ostringstream digest;
+    digest << std::hex << std::setw(8) << std::setfill('0') << crc;
+    return "File received, CRC-32C " + digest.str();
+}
+
+// Record: int64 offset, uint32 CRC-32C of the prefix, uint32 CRC-32C of those 12 bytes
+static bool readResumeCheckpoint(const std::string &transferPath, int64_t &offset, uint32_t &crc)
+{
+    char record[16];
+    std::ifstream file(transferPath + ".offset", std::ios::binary);
+    if (!file.read(record, sizeof(record)) || file.peek() != std::ifstream::traits_type::eof())
+    {
+        return false;
+    }
+    uint32_t check;
+    std::memcpy(&check, record + 12, sizeof(check));
+    if (crc32c(0, record, 12) != check)
+    {
+        return false;
+    }
+    std::memcpy(&offset, record, sizeof(offset));
+    std::memcpy(&crc, record + 8, sizeof(crc));
+    return offset >= 0;
+}
+
+static bool writeResumeCheckpoint(const std::string &transferPath, int64_t offset, uint32_t crc)
+{
+    char record[16];
+    std::memcpy(record, &offset, sizeof(offset));
+    std::memcpy(record + 8, &crc, sizeof(crc));
+    uint32_t check = crc32c(0, record, 12);
+    std::memcpy(record + 12, &check, sizeof(check));
+
+    std::ofstream file(transferPath + ".offset", std::ios::binary | std::ios::trunc);
+    if (!file.write(record, sizeof(record)).flush())
+    {
+        std::cerr << "Error recording resume offset of " << transferPath << std::endl;
+        return false;
+    }
+    return true;
+}
+
+WriteBehindQueue::~WriteBehindQueue()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+    }
+    jobReady_.notify_all();
+    if (thread_.joinable())
+    {
+        thread_.join();
+    }
+    if (wakeSocket_ != INVALID_SOCKET)
+    {
+        closesocket(wakeSocket_);
+    }
+}
+
+bool WriteBehindQueue::start()
+{
+    wakeSocket_ = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (wakeSocket_ == INVALID_SOCKET)
+    {
+        std::cerr << "Error creating disk thread socket: " << WSAGetLastError() << std::endl;
+        return false;
+    }
+    thread_ = std::thread([this]() { run(); });
+    return true;
+}
+
+bool WriteBehindQueue::wakeWhenRoom(const sockaddr_in &wakeAddress)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (queuedBytes_.load(std::memory_order_relaxed) < capacity_)
+    {
+        return false;
+    }
+    for (const sockaddr_in &waiter : roomWaiters_)
+    {
+        if (waiter.sin_port == wakeAddress.sin_port)
+        {
+            return true;
+        }
+    }
+    roomWaiters_.push_back(wakeAddress);
+    return true;
+}
+
+void WriteBehindQueue::wake(const sockaddr_in &wakeAddress)
+{
+    char signal = 0;
+    sendto(wakeSocket_, &signal, sizeof(signal), 0, reinterpret_cast<const SOCKADDR *>(&wakeAddress),
+           sizeof(wakeAddress));
+}
+
+std::vector<char> WriteBehindQueue::takeBuffer()
+{
+    std::vector<char> buffer;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!freeBuffers_.empty())
+        {
+            buffer = std::move(freeBuffers_.back());
+            freeBuffers_.pop_back();
+        }
+    }
+    buffer.reserve(bufferSize);
+    return buffer;
+}
+
+void WriteBehindQueue::push(const std::shared_ptr<WriteBehindTarget> &target, std::vector<char> data, bool finish)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        size_t queued = queuedBytes_.fetch_add(data.size(), std::memory_order_relaxed) + data.size();
+        if (queued > peakBytes_.load(std::memory_order_relaxed))
+        {
+            peakBytes_.store(queued, std::memory_order_relaxed);
+        }
+        if (!full_ && queued >= capacity_)
+        {
+            full_ = true;
+            fullSince_ = std::chrono::steady_clock::now();
+        }
+        jobs_.push_back({target, std::move(data), finish, std::string()});
+    }
+    jobReady_.notify_one();
+}
+
+void WriteBehindQueue::discard(const std::shared_ptr<WriteBehindTarget> &target, const std::string &versionPath)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        jobs_.push_back({target, std::vector<char>(), false, versionPath});
+    }
+    jobReady_.notify_one();
+}
+
+void WriteBehindQueue::waitFinished(const WriteBehindTarget &target)
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    jobDone_.wait(lock, [&target]() { return target.finished.load(std::memory_order_acquire); });
+}
+
+double WriteBehindQueue::stallSeconds() const
+{
+    std::lock_guard<std::mutex> lock(const_cast<std::mutex &>(mutex_));
+    uint64_t stalled = stallNanoseconds_;
+    if (full_)
+    {
+        stalled += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - fullSince_)
+                       .count();
+    }
+    return stalled / 1e9;
+}
+
+static void removeVersionFiles(const std::string &versionPath)
+{
+    std::error_code error;
+    // ".crc32c" digests are no longer written, but older versions may still have one
+    for (const char *suffix : {"", ".crc32c", ".sig", ".gcz", ".recipe"})
+    {
+        std::filesystem::remove(versionPath + suffix, error);
+    }
+}
+
+void WriteBehindQueue::run()
+{
+    while (true)
+    {
+        Job job;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            jobReady_.wait(lock, [this]() { return stopping_ || !jobs_.empty(); });
+            if (jobs_.empty())
+            {
+                return;
+            }
+            job = std::move(jobs_.front());
+            jobs_.pop_front();
+        }
+
+        // One sink's buffers are written in the order they were queued
+        auto start = std::chrono::steady_clock::now();
+        WriteBehindTarget &target = *job.target;
+        if (!job.data.empty() && !target.failed && !target.sink->write(job.data.data(), job.data.size()))
+        {
+            target.failed = true;
+        }
+        if (job.finish)
+        {
+            target.saved = !target.failed && target.sink->finish();
+            target.finished.store(true, std::memory_order_release);
+            wake(target.wakeAddress);
+        }
+        if (!job.discardPath.empty())
+        {
+            target.sink.reset();
+            removeVersionFiles(job.discardPath);
+        }
+        auto end = std::chrono::steady_clock::now();
+        diskNanoseconds_.fetch_add(std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count(),
+                                   std::memory_order_relaxed);
+
+        std::vector<sockaddr_in> waiters;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            size_t queued = queuedBytes_.fetch_sub(job.data.size(), std::memory_order_relaxed) - job.data.size();
+            if (full_ && queued < capacity_)
+            {
+                stallNanoseconds_ += std::chrono::duration_cast<std::chrono::nanoseconds>(end - fullSince_).count();
+                full_ = false;
+            }
+            if (queued < capacity_)
+            {
+                waiters.swap(roomWaiters_);
+            }
+
+            // Keep enough buffers to fill the queue once without allocating
+            if (job.data.capacity() == bufferSize && freeBuffers_.size() < capacity_ / bufferSize)
+            {
+                job.data.clear();
+                freeBuffers_.push_back(std::move(job.data));
+            }
+        }
+        for (const sockaddr_in &waiter : waiters)
+        {
+            wake(waiter);
+        }
+        jobDone_.notify_all();
+    }
+}
+
+WriteBehindSink::WriteBehindSink(WriteBehindQueue &queue, std::unique_ptr<BackupSink> sink,
+                                 const sockaddr_in &wakeAddress)
+    : queue_(queue), target_(std::make_shared<WriteBehindTarget>())
+{
+    target_->sink = std::move(sink);
+    target_->wakeAddress = wakeAddress;
+}
+
+bool WriteBehindSink::write(const char *data, size_t size)
+{
+    // A failure surfaces on the first write after the disk thread hit it
+    if (target_->failed)
+    {
+        return false;
+    }
+
+    while (size > 0)
+    {
+        if (buffer_.capacity() == 0)
+        {
+            buffer_ = queue_.takeBuffer();
+        }
+        size_t take = std::min(size, WriteBehindQueue::bufferSize - buffer_.size());
+        buffer_.insert(buffer_.end(), data, data + take);
+        data += take;
+        size -= take;
+
+        if (buffer_.size() == WriteBehindQueue::bufferSize)
+        {
+            queue_.push(target_, std::move(buffer_), false);
+            buffer_ = std::vector<char>();
+        }
+    }
+    return true;
+}
+
+void WriteBehindSink::close()
+{
+    if (!closed_)
+    {
+        queue_.push(target_, std::move(buffer_), true);
+        buffer_ = std::vector<char>();
+        closed_ = true;
+    }
+}
+
+void WriteBehindSink::discard(const std::string &versionPath)
+{
+    queue_.discard(target_, versionPath);
+    buffer_ = std::vector<char>();
+    closed_ = true;
+}
+
+bool WriteBehindSink::finish()
+{
+    close();
+    queue_.waitFinished(*target_);
+    return saved();
+}
+
+// Write a file under a temporary name and rename it into place, so readers never see a partial file
+static bool writeFileAtomically(const std::string &path, const std::string &tempPath, const char *data, size_t size)
+{
+    {
+        std::ofstream file(tempPath, std::ios::binary);
+        file.write(data, size);
+        file.close();
+        if (file.fail())
+        {
+            std::cerr << "Error writing file: " << tempPath << std::endl;
+            std::remove(tempPath.c_str());
+            return false;
+        }
+    }
+    if (!MoveFileExA(tempPath.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING))
+    {
+        std::cerr << "Error renaming file: " << tempPath << " (" << GetLastError() << ")" << std::endl;
+        std::remove(tempPath.c_str());
+        return false;
+    }
+    return true;
+}
+
+DedupStore::~DedupStore()
+{
+    if (container_ != INVALID_HANDLE_VALUE)
+    {
+        CloseHandle(container_);
+    }
+}
+
+bool DedupStore::init()
+{
+    std::error_code error;
+    std::filesystem::create_directories(chunkFolder_, error);
+    if (error)
+    {
+        std::cerr << "Error creating chunk folder: " << chunkFolder_ << " (" << error.message() << ")" << std::endl;
+        return false;
+    }
+
+    std::vector<uint32_t> containers;
+    for (const auto &entry : std::filesystem::directory_iterator(chunkFolder_, error))
+    {
+        std::string name = entry.path().filename().string();
+        if (name.size() == 64)
+        {
+            chunks_.emplace(name, Location{0, 0, static_cast<uint32_t>(entry.file_size(error))});
+        }
+        else if (name.compare(0, 10, "container_") == 0)
+        {
+            containers.push_back(static_cast<uint32_t>(std::stoul(name.substr(10))));
+        }
+    }
+    std::sort(containers.begin(), containers.end());
+    for (uint32_t id : containers)
+    {
+        indexContainer(id);
+        nextId_ = id + 1;
+    }
+    std::cout << "Chunk store holds " << chunks_.size() << " chunks in " << containers.size() << " containers"
+              << std::endl;
+    return true;
+}
+
+void DedupStore::indexContainer(uint32_t id)
+{
+    std::ifstream file(containerPath(id), std::ios::binary | std::ios::ate);
+    uint64_t end = file.tellg();
+    uint64_t offset = 0;
+    char header[recordHeaderSize];
+    while (offset + recordHeaderSize <= end && file.seekg(offset) && file.read(header, sizeof(header)))
+    {
+        uint32_t size;
+        std::memcpy(&size, header + 64, sizeof(size));
+        if (offset + recordHeaderSize + size > end)
+        {
+            break;
+        }
+        chunks_.emplace(std::string(header, 64), Location{id, offset + recordHeaderSize, size});
+        offset += recordHeaderSize + size;
+    }
+}
+
+bool DedupStore::contains(const std::string &hash)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    return chunks_.count(hash) > 0;
+}
+
+void DedupStore::appendRecord(std::vector<char> &records, const std::string &hash, const char *data, size_t size)
+{
+    uint32_t size32 = static_cast<uint32_t>(size);
+    records.insert(records.end(), hash.begin(), hash.end());
+    records.insert(records.end(), reinterpret_cast<const char *>(&size32),
+                   reinterpret_cast<const char *>(&size32) + sizeof(size32));
+    records.insert(records.end(), data, data + size);
+}
+
+bool DedupStore::putChunks(const std::vector<char> &records)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    // A full container is flushed before it is closed, so sync() only has the active one to flush
+    if (container_ != INVALID_HANDLE_VALUE && containerEnd_ + records.size() > containerSize)
+    {
+        bool flushed = FlushFileBuffers(container_) != FALSE;
+        CloseHandle(container_);
+        container_ = INVALID_HANDLE_VALUE;
+        if (!flushed)
+        {
+            std::cerr << "Error flushing container: " << containerPath(containerId_) << std::endl;
+            return false;
+        }
+    }
+    if (container_ == INVALID_HANDLE_VALUE)
+    {
+        containerId_ = nextId_++;
+        container_ = CreateFileA(containerPath(containerId_).c_str(), GENERIC_WRITE, FILE_SHARE_READ, nullptr,
+                                 CREATE_NEW, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (container_ == INVALID_HANDLE_VALUE)
+        {
+            std::cerr << "Error creating container: " << containerPath(containerId_) << " (" << GetLastError() << ")"
+                      << std::endl;
+            return false;
+        }
+        containerEnd_ = 0;
+    }
+
+    OVERLAPPED position = {};
+    position.Offset = static_cast<DWORD>(containerEnd_);
+    position.OffsetHigh = static_cast<DWORD>(containerEnd_ >> 32);
+    DWORD written = 0;
+    if (!WriteFile(container_, records.data(), static_cast<DWORD>(records.size()), &written, &position) ||
+        written != records.size())
+    {
+        std::cerr << "Error writing container: " << containerPath(containerId_) << " (" << GetLastError() << ")"
+                  << std::endl;
+        return false;
+    }
+
+    for (size_t offset = 0; offset < records.size();)
+    {
+        uint32_t size;
+        std::memcpy(&size, &records[offset + 64], sizeof(size));
+        chunks_.emplace(std::string(&records[offset], 64),
+                        Location{containerId_, containerEnd_ + offset + recordHeaderSize, size});
+        offset += recordHeaderSize + size;
+    }
+    containerEnd_ += records.size();
+    return true;
+}
+
+bool DedupStore::sync()
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (container_ != INVALID_HANDLE_VALUE && !FlushFileBuffers(container_))
+    {
+        std::cerr << "Error flushing container: " << containerPath(containerId_) << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool DedupStore::locate(const std::string &hash, Location &location)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto found = chunks_.find(hash);
+    if (found == chunks_.end())
+    {
+        return false;
+    }
+    location = found->second;
+    return true;
+}
+
+// Index file signature "VCIX" and layout revision
+const uint32_t catalogIndexMagic = 0x58494356;
+const uint32_t catalogIndexFormat = 2;
+// Entries of a new index; it doubles whenever it fills up
+const uint64_t catalogInitialCapacity = 1 << 16;
+// Log record header: <uint32 payload size | record type << 24><uint32 CRC-32C of the payload>
+const size_t catalogRecordHeaderSize = 2 * sizeof(uint32_t);
+// Larger payloads can only be a damaged header
+const uint32_t maxCatalogPayload = 1 << 18;
+
+static uint64_t catalogIndexFileSize(uint64_t entryCapacity)
+{
+    return sizeof(CatalogIndexHeader) + entryCapacity * sizeof(CatalogEntry) +
+           2 * entryCapacity * sizeof(CatalogBucket);
+}
+
+template <typename T>
+static void appendField(std::string &out, const T &value)
+{
+    out.append(reinterpret_cast<const char *>(&value), sizeof(value));
+}
+
+template <typename T>
+static bool readField(const char *&data, const char *end, T &value)
+{
+    if (static_cast<size_t>(end - data) < sizeof(value))
+    {
+        return false;
+    }
+    std::memcpy(&value, data, sizeof(value));
+    data += sizeof(value);
+    return true;
+}
+
+// Payload of a version record: its fields, then <uint16 length><machine><uint16 length><file>, then
+// <uint32 segment><uint64 offset> for a packed version
+static std::string encodeCatalogRecord(const std::string &machine, const std::string &file, const VersionRecord &record)
+{
+    std::string payload;
+    appendField(payload, record.version);
+    appendField(payload, record.sequence);
+    appendField(payload, record.size);
+    appendField(payload, static_cast<uint32_t>(record.hasCrc));
+    appendField(payload, record.crc);
+    appendField(payload, record.receivedAt);
+    appendField(payload, record.storedAt);
+    appendField(payload, static_cast<uint16_t>(machine.size()));
+    payload += machine;
+    appendField(payload, static_cast<uint16_t>(file.size()));
+    payload += file;
+    if (record.packSegment != 0)
+    {
+        appendField(payload, record.packSegment);
+        appendField(payload, record.packOffset);
+    }
+    return payload;
+}
+
+static bool decodeCatalogRecord(const char *data, size_t size, std::string &machine, std::string &file,
+                                VersionRecord &record)
+{
+    const char *end = data + size;
+    uint32_t hasCrc;
+    uint16_t machineSize, fileSize;
+    if (!readField(data, end, record.version) || !readField(data, end, record.sequence) ||
+        !readField(data, end, record.size) || !readField(data, end, hasCrc) || !readField(data, end, record.crc) ||
+        !readField(data, end, record.receivedAt) || !readField(data, end, record.storedAt) ||
+        !readField(data, end, machineSize) || static_cast<size_t>(end - data) < machineSize)
+    {
+        return false;
+    }
+    record.hasCrc = hasCrc != 0;
+    machine.assign(data, machineSize);
+    data += machineSize;
+    if (!readField(data, end, fileSize) || static_cast<size_t>(end - data) < fileSize)
+    {
+        return false;
+    }
+    file.assign(data, fileSize);
+    data += fileSize;
+    return data == end ||
+           (readField(data, end, record.packSegment) && readField(data, end, record.packOffset) && data == end);
+}
+
+bool CatalogIndexFile::open(const std::string &path, uint64_t entryCapacity)
+{
+    bool create = entryCapacity > 0;
+    file_ = CreateFileA(path.c_str(), GENERIC_READ | GENERIC_WRITE, 0, nullptr, create ? CREATE_ALWAYS : OPEN_EXISTING,
+                        FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file_ == INVALID_HANDLE_VALUE)
+    {
+        return false;
+    }
+
+    // Mapping a new file at its full size extends it with zeros
+    LARGE_INTEGER size;
+    size.QuadPart = static_cast<LONGLONG>(catalogIndexFileSize(entryCapacity));
+    if ((!create && !GetFileSizeEx(file_, &size)) || size.QuadPart < static_cast<LONGLONG>(sizeof(CatalogIndexHeader)))
+    {
+        close();
+        return false;
+    }
+    mapping_ = CreateFileMappingA(file_, nullptr, PAGE_READWRITE, static_cast<DWORD>(size.QuadPart >> 32),
+                                  static_cast<DWORD>(size.QuadPart), nullptr);
+    view_ = mapping_ ? static_cast<char *>(MapViewOfFile(mapping_, FILE_MAP_ALL_ACCESS, 0, 0, 0)) : nullptr;
+    if (!view_)
+    {
+        close();
+        return false;
+    }
+
+    header_ = reinterpret_cast<CatalogIndexHeader *>(view_);
+    if (create)
+    {
+        header_->magic = catalogIndexMagic;
+        header_->format = catalogIndexFormat;
+        header_->entryCapacity = entryCapacity;
+        header_->bucketCount = 2 * entryCapacity;
+        header_->entryCount = 0;
+        header_->logOffset = 0;
+        header_->nextSequence = 1;
+    }
+    else if (header_->magic != catalogIndexMagic || header_->format != catalogIndexFormat ||
+             header_->bucketCount != 2 * header_->entryCapacity ||
+             static_cast<uint64_t>(size.QuadPart) != catalogIndexFileSize(header_->entryCapacity))
+    {
+        close();
+        return false;
+    }
+
+    entries_ = reinterpret_cast<CatalogEntry *>(view_ + sizeof(CatalogIndexHeader));
+    buckets_ = reinterpret_cast<CatalogBucket *>(entries_ + header_->entryCapacity);
+    if (create)
+    {
+        // All ones marks every bucket empty
+        std::memset(buckets_, 0xFF, header_->bucketCount * sizeof(CatalogBucket));
+    }
+    return true;
+}
+
+void CatalogIndexFile::close()
+{
+    if (view_)
+    {
+        UnmapViewOfFile(view_);
+        view_ = nullptr;
+    }
+    if (mapping_)
+    {
+        CloseHandle(mapping_);
+        mapping_ = nullptr;
+    }
+    if (file_ != INVALID_HANDLE_VALUE)
+    {
+        CloseHandle(file_);
+        file_ = INVALID_HANDLE_VALUE;
+    }
+    header_ = nullptr;
+    entries_ = nullptr;
+    buckets_ = nullptr;
+}
+
+bool CatalogIndexFile::flush()
+{
+    if (!FlushViewOfFile(view_, 0) || !FlushFileBuffers(file_))
+    {
+        std::cerr << "Error flushing version catalog index: " << GetLastError() << std::endl;
+        return false;
+    }
+    return true;
+}
+
+CatalogBucket &CatalogIndexFile::findBucket(uint64_t keyHash)
+{
+    // Linear probing; the table is at most half full, and the bucket count is a power of two
+    uint64_t mask = header_->bucketCount - 1;
+    for (uint64_t i = keyHash & mask;; i = (i + 1) & mask)
+    {
+        CatalogBucket &bucket = buckets_[i];
+        if (bucket.latest == VersionCatalog::noEntry || bucket.keyHash == keyHash)
+        {
+            return bucket;
+        }
+    }
+}
+
+VersionCatalog::~VersionCatalog()
+{
+    if (index_.header())
+    {
+        checkpoint();
+    }
+    index_.close();
+    if (log_ != INVALID_HANDLE_VALUE)
+    {
+        CloseHandle(log_);
+    }
+}
+
+bool VersionCatalog::open()
+{
+    std::error_code error;
+    std::filesystem::create_directories(folderPath_, error);
+    if (error)
+    {
+        std::cerr << "Error creating backup folder: " << folderPath_ << " (" << error.message() << ")" << std::endl;
+        return false;
+    }
+
+    log_ = CreateFileA(logPath_.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, nullptr, OPEN_ALWAYS,
+                       FILE_ATTRIBUTE_NORMAL, nullptr);
+    LARGE_INTEGER logSize;
+    if (log_ == INVALID_HANDLE_VALUE || !GetFileSizeEx(log_, &logSize))
+    {
+        std::cerr << "Error opening version catalog: " << logPath_ << " (" << GetLastError() << ")" << std::endl;
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!index_.open(indexPath_, 0) || !restoreCheckpoint(logSize.QuadPart))
+    {
+        // Everything the index held is in the log as well
+        index_.close();
+        entryCount_ = 0;
+        keyCount_ = 0;
+        appendOffset_ = 0;
+        nextSequence_ = 1;
+        if (!index_.open(indexPath_, catalogInitialCapacity))
+        {
+            std::cerr << "Error creating version catalog index: " << indexPath_ << " (" << GetLastError() << ")"
+                      << std::endl;
+            return false;
+        }
+        if (logSize.QuadPart > 0)
+        {
+            std::cout << "Rebuilding the version catalog index from its log" << std::endl;
+        }
+    }
+    if (!replayLog(appendOffset_, logSize.QuadPart))
+    {
+        return false;
+    }
+
+    // A catalog started over older versions continues after their numbers instead of overwriting them
+    if (appendOffset_ == 0)
+    {
+        nextSequence_ = std::max<uint64_t>(nextSequence_, scanFolderSequence());
+    }
+    if (!writeCheckpoint(index_))
+    {
+        return false;
+    }
+    std::cout << "Version catalog holds " << entryCount_ << " versions of " << keyCount_ << " files" << std::endl;
+    return true;
+}
+
+bool VersionCatalog::restoreCheckpoint(uint64_t logSize)
+{
+    CatalogIndexHeader &header = *index_.header();
+    if (header.entryCount > header.entryCapacity || header.logOffset > logSize)
+    {
+        return false;
+    }
+    entryCount_ = header.entryCount;
+    keyCount_ = 0;
+
+    // Entries past the checkpoint may be torn, so buckets step back to their last checkpointed
+    // version or become empty again, and the replay indexes the newer versions anew. Every bucket
+    // a checkpointed key probes through was taken before the checkpoint, so none of them empties
+    CatalogEntry *entries = index_.entries();
+    CatalogBucket *buckets = index_.buckets();
+    for (uint64_t i = 0; i < header.bucketCount; ++i)
+    {
+        CatalogBucket &bucket = buckets[i];
+        uint32_t latest = bucket.latest;
+        while (latest != noEntry && latest >= entryCount_)
+        {
+            if (latest >= header.entryCapacity || entries[latest].keyHash != bucket.keyHash ||
+                (entries[latest].previous != noEntry && entries[latest].previous >= latest))
+            {
+                return false;
+            }
+            latest = entries[latest].previous;
+        }
+        if (latest != noEntry && entries[latest].keyHash != bucket.keyHash)
+        {
+            return false;
+        }
+        bucket.latest = latest;
+        keyCount_ += latest != noEntry;
+    }
+
+    appendOffset_ = header.logOffset;
+    nextSequence_ = header.nextSequence;
+    return true;
+}
+
+bool VersionCatalog::replayLog(uint64_t offset, uint64_t logSize)
+{
+    const size_t blockSize = 1 << 20;
+    // Bytes read but not yet indexed, starting at log offset position
+    std::string data;
+    uint64_t position = offset;
+    uint64_t readOffset = offset;
+    bool torn = false;
+
+    while (!torn)
+    {
+        size_t parsed = 0;
+        while (data.size() - parsed >= catalogRecordHeaderSize)
+        {
+            uint32_t sizeWord, checksum;
+            std::memcpy(&sizeWord, data.data() + parsed, sizeof(sizeWord));
+            std::memcpy(&checksum, data.data() + parsed + sizeof(sizeWord), sizeof(checksum));
+            RecordType type = static_cast<RecordType>(sizeWord >> 24);
+            uint32_t payloadSize = sizeWord & 0xFFFFFF;
+            if (payloadSize > maxCatalogPayload)
+            {
+                torn = true;
+                break;
+            }
+            if (data.size() - parsed - catalogRecordHeaderSize < payloadSize)
+            {
+                break;
+            }
+
+            const char *payload = data.data() + parsed + catalogRecordHeaderSize;
+            if (crc32c(0, payload, payloadSize) != checksum)
+            {
+                torn = true;
+                break;
+            }
+
+            if (type == RecordType::Version)
+            {
+                std::string machine, file;
+                VersionRecord record;
+                if (!decodeCatalogRecord(payload, payloadSize, machine, file, record))
+                {
+                    torn = true;
+                    break;
+                }
+
+                // A growth while indexing checkpoints up to this record, which it has not indexed yet
+                appendOffset_ = position + parsed;
+                if (!insertEntry(toEntry(keyHash(machine, file), record)))
+                {
+                    return false;
+                }
+                nextSequence_ = std::max<uint64_t>(nextSequence_, record.sequence + 1);
+            }
+            else if (!applyRecord(type, payload, payloadSize))
+            {
+                torn = true;
+                break;
+            }
+            parsed += catalogRecordHeaderSize + payloadSize;
+        }
+        data.erase(0, parsed);
+        position += parsed;
+        if (torn || readOffset == logSize)
+        {
+            break;
+        }
+
+        size_t take = static_cast<size_t>(std::min<uint64_t>(blockSize, logSize - readOffset));
+        size_t held = data.size();
+        data.resize(held + take);
+        OVERLAPPED at = {};
+        at.Offset = static_cast<DWORD>(readOffset);
+        at.OffsetHigh = static_cast<DWORD>(readOffset >> 32);
+        DWORD read = 0;
+        if (!ReadFile(log_, &data[held], static_cast<DWORD>(take), &read, &at) || read != take)
+        {
+            std::cerr << "Error reading version catalog: " << GetLastError() << std::endl;
+            return false;
+        }
+        readOffset += take;
+    }
+
+    // Whatever follows the last whole record was cut off mid-write and never acknowledged
+    appendOffset_ = position;
+    if (position < logSize)
+    {
+        std::cerr << "Dropping " << logSize - position << " bytes of torn records at the end of the version catalog"
+                  << std::endl;
+        LARGE_INTEGER end;
+        end.QuadPart = static_cast<LONGLONG>(position);
+        if (!SetFilePointerEx(log_, end, nullptr, FILE_BEGIN) || !SetEndOfFile(log_))
+        {
+            std::cerr << "Error truncating version catalog: " << GetLastError() << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+bool VersionCatalog::insertEntry(const CatalogEntry &entry)
+{
+    // Buckets outnumber entries two to one, so a full entry array is the only limit
+    if (entryCount_ == index_.header()->entryCapacity && !growIndex())
+    {
+        return false;
+    }
+
+    CatalogBucket &bucket = index_.findBucket(entry.keyHash);
+    CatalogEntry &slot = index_.entries()[entryCount_];
+    slot = entry;
+    slot.previous = bucket.latest;
+    if (bucket.latest == noEntry)
+    {
+        bucket.keyHash = entry.keyHash;
+        ++keyCount_;
+    }
+    bucket.latest = static_cast<uint32_t>(entryCount_++);
+    return true;
+}
+
+bool VersionCatalog::growIndex()
+{
+    std::string tempPath = indexPath_ + ".tmp";
+    {
+        // Entries keep their positions, so the chains stay valid and only the buckets are rebuilt
+        CatalogIndexFile grown;
+        if (!grown.open(tempPath, index_.header()->entryCapacity * 2))
+        {
+            std::cerr << "Error growing version catalog index: " << GetLastError() << std::endl;
+            return false;
+        }
+        CatalogEntry *entries = grown.entries();
+        std::memcpy(entries, index_.entries(), entryCount_ * sizeof(CatalogEntry));
+        for (uint64_t i = 0; i < entryCount_; ++i)
+        {
+            CatalogBucket &bucket = grown.findBucket(entries[i].keyHash);
+            bucket.keyHash = entries[i].keyHash;
+            bucket.latest = static_cast<uint32_t>(i);
+        }
+        if (!writeCheckpoint(grown))
+        {
+            return false;
+        }
+    }
+
+    // A crash before the rename leaves the old index, which the log brings up to date
+    index_.close();
+    if (!MoveFileExA(tempPath.c_str(), indexPath_.c_str(), MOVEFILE_REPLACE_EXISTING))
+    {
+        std::cerr << "Error renaming file: " << tempPath << " (" << GetLastError() << ")" << std::endl;
+        index_.open(indexPath_, 0);
+        return false;
+    }
+    if (!index_.open(indexPath_, 0))
+    {
+        std::cerr << "Error mapping version catalog index: " << GetLastError() << std::endl;
+        return false;
+    }
+    std::cout << "Version catalog index grown to " << index_.header()->entryCapacity << " versions" << std::endl;
+    return true;
+}
+
+bool VersionCatalog::writeCheckpoint(CatalogIndexFile &index)
+{
+    uint64_t logOffset = appendOffset_;
+    if (!flushLog(logOffset) || !index.flush())
+    {
+        return false;
+    }
+    CatalogIndexHeader &header = *index.header();
+    header.entryCount = entryCount_;
+    header.logOffset = logOffset;
+    header.nextSequence = nextSequence_;
+    return index.flush();
+}
+
+bool VersionCatalog::flushLog(uint64_t offset)
+{
+    std::lock_guard<std::mutex> lock(flushMutex_);
+    if (durableOffset_ >= offset)
+    {
+        return true;
+    }
+
+    // Everything appended before this flush starts is covered by it
+    uint64_t target = std::max(offset, appendOffset_.load());
+    if (!FlushFileBuffers(log_))
+    {
+        std::cerr << "Error flushing version catalog: " << GetLastError() << std::endl;
+        return false;
+    }
+    durableOffset_ = target;
+    return true;
+}
+
+bool VersionCatalog::commit(const std::string &machine, const std::string &file, VersionRecord &record, bool durable)
+{
+    if (machine.size() > 0xFFFF || file.size() > 0xFFFF)
+    {
+        return false;
+    }
+
+    uint64_t end;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        uint64_t hash = keyHash(machine, file);
+        const CatalogBucket &bucket = index_.findBucket(hash);
+        record.version = bucket.latest == noEntry ? 1 : index_.entries()[bucket.latest].version + 1;
+        record.storedAt = unixMilliseconds();
+
+        // The record only counts once indexed, so a growth of the index checkpoints up to it
+        uint64_t offset = appendOffset_;
+        if (!appendRecord(RecordType::Version, encodeCatalogRecord(machine, file, record)))
+        {
+            return false;
+        }
+        end = appendOffset_;
+        appendOffset_ = offset;
+        record.entry = static_cast<uint32_t>(entryCount_);
+        if (!insertEntry(toEntry(hash, record)))
+        {
+            return false;
+        }
+        appendOffset_ = end;
+    }
+
+    // The version is visible to lookups already, but the client only hears of it once it is durable
+    return !durable || flushLog(end);
+}
+
+bool VersionCatalog::latest(const std::string &machine, const std::string &file, VersionRecord &record)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    const CatalogBucket &bucket = index_.findBucket(keyHash(machine, file));
+    if (bucket.latest == noEntry)
+    {
+        return false;
+    }
+    record = toRecord(bucket.latest);
+    return true;
+}
+
+std::vector<VersionRecord> VersionCatalog::list(const std::string &machine, const std::string &file, size_t limit)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::vector<VersionRecord> records;
+    const CatalogEntry *entries = index_.entries();
+    for (uint32_t i = index_.findBucket(keyHash(machine, file)).latest; i != noEntry && records.size() < limit;
+         i = entries[i].previous)
+    {
+        if (!(entries[i].flags & CatalogEntry::deletedFlag))
+        {
+            records.push_back(toRecord(i));
+        }
+    }
+    return records;
+}
+
+std::vector<VersionRecord> VersionCatalog::expire(const std::string &machine, const std::string &file, size_t keep)
+{
+    std::vector<VersionRecord> expired;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        CatalogEntry *entries = index_.entries();
+        size_t kept = 0;
+        // Versions are deleted oldest first, so the walk ends at the first one already deleted
+        for (uint32_t i = index_.findBucket(keyHash(machine, file)).latest;
+             i != noEntry && !(entries[i].flags & CatalogEntry::deletedFlag); i = entries[i].previous)
+        {
+            if (kept < keep)
+            {
+                ++kept;
+                continue;
+            }
+            std::string payload;
+            appendField(payload, i);
+            if (!appendRecord(RecordType::Delete, payload))
+            {
+                break;
+            }
+            entries[i].flags |= CatalogEntry::deletedFlag;
+            expired.push_back(toRecord(i));
+        }
+    }
+    return expired;
+}
+
+bool VersionCatalog::move(uint32_t entry, uint32_t packSegment, uint64_t packOffset)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::string payload;
+    appendField(payload, entry);
+    appendField(payload, packSegment);
+    appendField(payload, packOffset);
+    if (entry >= entryCount_ || !appendRecord(RecordType::Move, payload))
+    {
+        return false;
+    }
+    applyRecord(RecordType::Move, payload.data(), payload.size());
+    return !(index_.entries()[entry].flags & CatalogEntry::deletedFlag);
+}
+
+void VersionCatalog::forEachPacked(const std::function<void(const VersionRecord &)> &visit)
+{
+    // Commits wait for one slice at most
+    const uint64_t sliceSize = 1 << 16;
+    std::vector<VersionRecord> slice;
+    for (uint64_t first = 0;; first += sliceSize)
+    {
+        slice.clear();
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (first >= entryCount_)
+            {
+                return;
+            }
+            const CatalogEntry *entries = index_.entries();
+            for (uint64_t i = first; i < std::min(first + sliceSize, entryCount_); ++i)
+            {
+                if (entries[i].packSegment != 0 && !(entries[i].flags & CatalogEntry::deletedFlag))
+                {
+                    slice.push_back(toRecord(static_cast<uint32_t>(i)));
+                }
+            }
+        }
+        std::for_each(slice.begin(), slice.end(), visit);
+    }
+}
+
+bool VersionCatalog::appendRecord(RecordType type, const std::string &payload)
+{
+    std::string bytes;
+    appendField(bytes, static_cast<uint32_t>(payload.size()) | static_cast<uint32_t>(type) << 24);
+    appendField(bytes, crc32c(0, payload.data(), payload.size()));
+    bytes += payload;
+
+    uint64_t offset = appendOffset_;
+    OVERLAPPED position = {};
+    position.Offset = static_cast<DWORD>(offset);
+    position.OffsetHigh = static_cast<DWORD>(offset >> 32);
+    DWORD written = 0;
+    if (!WriteFile(log_, bytes.data(), static_cast<DWORD>(bytes.size()), &written, &position) ||
+        written != bytes.size())
+    {
+        std::cerr << "Error writing version catalog: " << GetLastError() << std::endl;
+        return false;
+    }
+    appendOffset_ = offset + bytes.size();
+    return true;
+}
+
+bool VersionCatalog::applyRecord(RecordType type, const char *payload, size_t size)
+{
+    const char *end = payload + size;
+    uint32_t entry;
+    if (!readField(payload, end, entry) || entry >= entryCount_)
+    {
+        return false;
+    }
+    CatalogEntry &target = index_.entries()[entry];
+    if (type == RecordType::Delete)
+    {
+        target.flags |= CatalogEntry::deletedFlag;
+        return payload == end;
+    }
+    if (type == RecordType::Move)
+    {
+        return readField(payload, end, target.packSegment) && readField(payload, end, target.packOffset) &&
+               payload == end;
+    }
+    return false;
+}
+
+bool VersionCatalog::checkpoint()
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    const CatalogIndexHeader &header = *index_.header();
+    if (header.entryCount == entryCount_ && header.logOffset == appendOffset_ &&
+        header.nextSequence == nextSequence_)
+    {
+        return true;
+    }
+    return writeCheckpoint(index_);
+}
+
+size_t VersionCatalog::versionCount()
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    return static_cast<size_t>(entryCount_);
+}
+
+uint64_t VersionCatalog::keyHash(const std::string &machine, const std::string &file)
+{
+    // FNV-1a over "machine\0file", then a final mix so the low bits that pick a bucket vary
+    uint64_t hash = 0xCBF29CE484222325ULL;
+    auto add = [&hash](char byte)
+    {
+        hash ^= static_cast<uint8_t>(byte);
+        hash *= 0x100000001B3ULL;
+    };
+    std::for_each(machine.begin(), machine.end(), add);
+    add('\0');
+    std::for_each(file.begin(), file.end(), add);
+
+    hash ^= hash >> 33;
+    hash *= 0xFF51AFD7ED558CCDULL;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+CatalogEntry VersionCatalog::toEntry(uint64_t keyHash, const VersionRecord &record)
+{
+    CatalogEntry entry = {};
+    entry.keyHash = keyHash;
+    entry.sequence = record.sequence;
+    entry.version = record.version;
+    entry.size = record.size;
+    entry.receivedAt = record.receivedAt;
+    entry.storedAt = record.storedAt;
+    entry.packOffset = record.packOffset;
+    entry.packSegment = record.packSegment;
+    entry.previous = noEntry;
+    entry.crc = record.crc;
+    entry.flags = record.hasCrc ? CatalogEntry::hasCrcFlag : 0;
+    return entry;
+}
+
+VersionRecord VersionCatalog::toRecord(uint32_t index) const
+{
+    const CatalogEntry &entry = index_.entries()[index];
+    VersionRecord record;
+    record.version = entry.version;
+    record.sequence = entry.sequence;
+    record.size = entry.size;
+    record.hasCrc = (entry.flags & CatalogEntry::hasCrcFlag) != 0;
+    record.crc = entry.crc;
+    record.receivedAt = entry.receivedAt;
+    record.storedAt = entry.storedAt;
+    record.packSegment = entry.packSegment;
+    record.packOffset = entry.packOffset;
+    record.entry = index;
+    return record;
+}
+
+uint64_t VersionCatalog::scanFolderSequence() const
+{
+    uint64_t next = 1;
+    std::error_code error;
+    for (const auto &entry : std::filesystem::directory_iterator(folderPath_, error))
+    {
+        std::string name = entry.path().filename().string();
+        if (name.compare(0, 7, "backup_") == 0 && name.size() > 7 && std::isdigit(static_cast<unsigned char>(name[7])))
+        {
+            next = std::max<uint64_t>(next, std::stoull(name.substr(7)) + 1);
+        }
+    }
+    return next;
+}
+
+PackStore::~PackStore()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+    }
+    wake_.notify_all();
+    if (compactor_.joinable())
+    {
+        compactor_.join();
+    }
+    for (auto &segment : open_)
+    {
+        CloseHandle(segment->file);
+    }
+}
+
+bool PackStore::init()
+{
+    std::error_code error;
+    std::filesystem::create_directories(packFolder_, error);
+    if (error)
+    {
+        std::cerr << "Error creating pack folder: " << packFolder_ << " (" << error.message() << ")" << std::endl;
+        return false;
+    }
+
+    // Segments are named pack_<id>.seg
+    for (const auto &entry : std::filesystem::directory_iterator(packFolder_, error))
+    {
+        std::string name = entry.path().filename().string();
+        if (name.size() < 10 || name.compare(0, 5, "pack_") != 0 || name.compare(name.size() - 4, 4, ".seg") != 0)
+        {
+            continue;
+        }
+        uint32_t id = static_cast<uint32_t>(std::stoul(name.substr(5)));
+        SegmentUsage &usage = usage_[id];
+        usage.totalBytes = entry.file_size(error);
+        usage.sealed = true;
+        nextId_ = std::max(nextId_, id + 1);
+    }
+
+    uint64_t totalBytes = 0, liveBytes = 0;
+    catalog_.forEachPacked([this](const VersionRecord &record)
+                           { usage_[record.packSegment].liveBytes += recordHeaderSize + record.size; });
+    for (const auto &usage : usage_)
+    {
+        totalBytes += usage.second.totalBytes;
+        liveBytes += usage.second.liveBytes;
+    }
+    std::cout << "Pack store holds " << usage_.size() << " segments, " << liveBytes / (1024.0 * 1024.0)
+              << " MB live of " << totalBytes / (1024.0 * 1024.0) << " MB" << std::endl;
+
+    compactor_ = std::thread(&PackStore::compactLoop, this);
+    return true;
+}
+
+std::string PackStore::segmentPath(uint32_t id) const
+{
+    return packSegmentPath(folderPath_, id);
+}
+
+PackStore::Segment *PackStore::reserve(uint64_t length, uint64_t &offset)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    // A record larger than a segment gets one of its own
+    if (active_ && active_->size > 0 && active_->size + length > segmentSize)
+    {
+        active_->sealed = true;
+        Segment *sealed = active_;
+        active_ = nullptr;
+        closeIfDone(sealed);
+    }
+    if (!active_)
+    {
+        // Shared for writing too, so the commit thread can flush it while writers hold it
+        uint32_t id = nextId_++;
+        HANDLE file = CreateFileA(segmentPath(id).c_str(), GENERIC_READ | GENERIC_WRITE,
+                                  FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, CREATE_NEW, FILE_ATTRIBUTE_NORMAL,
+                                  nullptr);
+        if (file == INVALID_HANDLE_VALUE)
+        {
+            std::cerr << "Error creating segment: " << segmentPath(id) << " (" << GetLastError() << ")" << std::endl;
+            return nullptr;
+        }
+        open_.push_back(std::make_unique<Segment>(Segment{id, file, 0, 0, false}));
+        active_ = open_.back().get();
+    }
+
+    offset = active_->size;
+    active_->size += length;
+    ++active_->writers;
+    usage_[active_->id].totalBytes = active_->size;
+    return active_;
+}
+
+void PackStore::release(Segment *segment)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    --segment->writers;
+    closeIfDone(segment);
+}
+
+void PackStore::closeIfDone(Segment *segment)
+{
+    if (!segment->sealed || segment->writers > 0)
+    {
+        return;
+    }
+    usage_[segment->id].sealed = true;
+    CloseHandle(segment->file);
+    open_.erase(std::find_if(open_.begin(), open_.end(),
+                             [segment](const std::unique_ptr<Segment> &candidate)
+                             { return candidate.get() == segment; }));
+    wake_.notify_all();
+}
+
+void PackStore::storeLocation(uint64_t sequence, uint32_t segment, uint64_t offset, int64_t length)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    locations_[sequence] = {segment, offset, length};
+    ++usage_[segment].pending;
+}
+
+bool PackStore::takeLocation(uint64_t sequence, uint32_t &segment, uint64_t &offset)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto location = locations_.find(sequence);
+    if (location == locations_.end())
+    {
+        return false;
+    }
+    segment = location->second.segment;
+    offset = location->second.offset;
+    return true;
+}
+
+void PackStore::settleLocation(uint64_t sequence, bool committed)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto location = locations_.find(sequence);
+    if (location == locations_.end())
+    {
+        return;
+    }
+    SegmentUsage &usage = usage_[location->second.segment];
+    --usage.pending;
+    if (committed)
+    {
+        usage.liveBytes += recordHeaderSize + location->second.length;
+    }
+    locations_.erase(location);
+}
+
+void PackStore::releaseVersion(const VersionRecord &record)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    SegmentUsage &usage = usage_[record.packSegment];
+    usage.liveBytes -= std::min<uint64_t>(usage.liveBytes, recordHeaderSize + record.size);
+    if (usage.sealed && usage.liveBytes * 2 < usage.totalBytes)
+    {
+        wake_.notify_all();
+    }
+}
+
+void PackStore::compactLoop()
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (!stopping_)
+    {
+        // Sealed segments with no commit outstanding that are more than half garbage
+        std::vector<uint32_t> candidates;
+        for (const auto &usage : usage_)
+        {
+            if (usage.second.sealed && usage.second.pending == 0 &&
+                usage.second.liveBytes * 2 < usage.second.totalBytes)
+            {
+                candidates.push_back(usage.first);
+            }
+        }
+
+        lock.unlock();
+        for (uint32_t id : candidates)
+        {
+            compact(id);
+        }
+        lock.lock();
+
+        // Woken by a sealed segment or a deletion, and now and then to retry segments still in use
+        if (!stopping_)
+        {
+            wake_.wait_for(lock, std::chrono::seconds(30));
+        }
+    }
+}
+
+bool PackStore::compact(uint32_t id)
+{
+    // Live records of the segment, copied in the order they lie in it
+    std::vector<VersionRecord> live;
+    uint64_t liveBytes = 0;
+    catalog_.forEachPacked(
+        [&live, &liveBytes, id](const VersionRecord &record)
+        {
+            if (record.packSegment == id)
+            {
+                live.push_back(record);
+                liveBytes += recordHeaderSize + record.size;
+            }
+        });
+    std::sort(live.begin(), live.end(),
+              [](const VersionRecord &a, const VersionRecord &b) { return a.packOffset < b.packOffset; });
+
+    std::string path = segmentPath(id);
+    if (!live.empty())
+    {
+        HANDLE source = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr,
+                                    OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (source == INVALID_HANDLE_VALUE)
+        {
+            return false;
+        }
+        uint64_t targetOffset;
+        Segment *target = reserve(liveBytes, targetOffset);
+        if (!target)
+        {
+            CloseHandle(source);
+            return false;
+        }
+
+        std::vector<char> buffer(1 << 20);
+        bool copied = true;
+        uint64_t to = targetOffset;
+        for (const VersionRecord &record : live)
+        {
+            uint64_t from = record.packOffset;
+            for (uint64_t left = recordHeaderSize + record.size; copied && left > 0;)
+            {
+                DWORD take = static_cast<DWORD>(std::min<uint64_t>(left, buffer.size()));
+                OVERLAPPED readAt = {}, writeAt = {};
+                readAt.Offset = static_cast<DWORD>(from);
+                readAt.OffsetHigh = static_cast<DWORD>(from >> 32);
+                writeAt.Offset = static_cast<DWORD>(to);
+                writeAt.OffsetHigh = static_cast<DWORD>(to >> 32);
+                DWORD read = 0, written = 0;
+                copied = ReadFile(source, buffer.data(), take, &read, &readAt) && read == take &&
+                         WriteFile(target->file, buffer.data(), take, &written, &writeAt) && written == take;
+                from += take;
+                to += take;
+                left -= take;
+            }
+        }
+        CloseHandle(source);
+
+        // The copies must be on disk before the catalog points at them
+        copied = copied && FlushFileBuffers(target->file);
+        uint32_t targetId = target->id;
+        release(target);
+        if (!copied)
+        {
+            std::cerr << "Error compacting segment: " << path << " (" << GetLastError() << ")" << std::endl;
+            return false;
+        }
+
+        uint64_t movedLiveBytes = 0;
+        for (const VersionRecord &record : live)
+        {
+            if (catalog_.move(record.entry, targetId, targetOffset))
+            {
+                movedLiveBytes += recordHeaderSize + record.size;
+            }
+            targetOffset += recordHeaderSize + record.size;
+        }
+        // The old segment may only go once the moves are durable
+        if (!catalog_.checkpoint())
+        {
+            return false;
+        }
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        usage_[targetId].liveBytes += movedLiveBytes;
+        usage_[id].liveBytes = 0;
+    }
+
+    // A delta upload reading an old version may still hold the segment; a later pass retries
+    std::error_code error;
+    std::filesystem::remove(path, error);
+    if (error)
+    {
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    uint64_t totalBytes = usage_[id].totalBytes;
+    std::cout << "Compacted segment " << id << ": moved " << liveBytes / (1024.0 * 1024.0) << " MB, reclaimed "
+              << (totalBytes - std::min(totalBytes, liveBytes)) / (1024.0 * 1024.0) << " MB" << std::endl;
+    usage_.erase(id);
+    return true;
+}
+
+PackSink::~PackSink()
+{
+    if (segment_)
+    {
+        store_.release(segment_);
+    }
+}
+
+bool PackSink::open(int64_t fileSize)
+{
+    reserved_ = fileSize;
+    segment_ = store_.reserve(PackStore::recordHeaderSize + fileSize, recordOffset_);
+    if (!segment_)
+    {
+        return false;
+    }
+    writeOffset_ = recordOffset_ + PackStore::recordHeaderSize;
+    buffer_.reserve(static_cast<size_t>(std::min<int64_t>(fileSize, bufferSize)));
+    return true;
+}
+
+bool PackSink::write(const char *data, size_t size)
+{
+    // Writing past the reservation would overwrite the next record
+    if (length_ + static_cast<int64_t>(size) > reserved_)
+    {
+        std::cerr << "Version is larger than announced: " << sequence_ << std::endl;
+        return false;
+    }
+    crc_ = crc32c(crc_, data, size);
+    length_ += size;
+    while (size > 0)
+    {
+        size_t take = std::min(size, bufferSize - buffer_.size());
+        buffer_.insert(buffer_.end(), data, data + take);
+        data += take;
+        size -= take;
+        if (buffer_.size() == bufferSize && !flushBuffer())
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool PackSink::flushBuffer()
+{
+    OVERLAPPED position = {};
+    position.Offset = static_cast<DWORD>(writeOffset_);
+    position.OffsetHigh = static_cast<DWORD>(writeOffset_ >> 32);
+    DWORD written = 0;
+    if (!WriteFile(segment_->file, buffer_.data(), static_cast<DWORD>(buffer_.size()), &written, &position) ||
+        written != buffer_.size())
+    {
+        std::cerr << "Error writing segment: " << GetLastError() << std::endl;
+        return false;
+    }
+    writeOffset_ += buffer_.size();
+    buffer_.clear();
+    return true;
+}
+
+bool PackSink::finish()
+{
+    // The header goes last, so a record broken off mid-upload never looks complete
+    char header[PackStore::recordHeaderSize];
+    uint32_t magic = PackStore::recordMagic;
+    std::memcpy(header, &magic, sizeof(magic));
+    std::memcpy(header + 4, &crc_, sizeof(crc_));
+    std::memcpy(header + 8, &sequence_, sizeof(sequence_));
+    std::memcpy(header + 16, &length_, sizeof(length_));
+
+    OVERLAPPED position = {};
+    position.Offset = static_cast<DWORD>(recordOffset_);
+    position.OffsetHigh = static_cast<DWORD>(recordOffset_ >> 32);
+    DWORD written = 0;
+    bool saved = length_ == reserved_ && (buffer_.empty() || flushBuffer()) &&
+                 WriteFile(segment_->file, header, sizeof(header), &written, &position) && written == sizeof(header);
+
+    // The location is pending before the region is released: releasing the last writer of a
+    // sealed segment makes it a compaction candidate, and a segment is only skipped while it has
+    // versions pending
+    if (saved)
+    {
+        store_.storeLocation(sequence_, segment_->id, recordOffset_, length_);
+    }
+    store_.release(segment_);
+    segment_ = nullptr;
+    return saved;
+}
+
+// Random per-byte values of the gear hash, fixed so chunk boundaries are stable across restarts
+static const std::array<uint64_t, 256> &gearTable()
+{
+    static const std::array<uint64_t, 256> table = []()
+    {
+        std::array<uint64_t, 256> values;
+        uint64_t seed = 0x9e3779b97f4a7c15ULL;
+        for (auto &value : values)
+        {
+            // splitmix64
+            uint64_t z = (seed += 0x9e3779b97f4a7c15ULL);
+            z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+            z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+            value = z ^ (z >> 31);
+        }
+        return values;
+    }();
+    return table;
+}
+
+bool DedupSink::write(const char *data, size_t size)
+{
+    // 8 KB average chunks; the high bits of the gear hash cover the last 64 bytes
+    const uint64_t boundaryMask = ((1ULL << 13) - 1) << 51;
+    const auto &gear = gearTable();
+
+    totalBytes_ += size;
+    while (size > 0 && !failed_)
+    {
+        // Scan for the next boundary, then move the whole run into the chunk at once
+        size_t scanned = 0;
+        bool boundary = false;
+        size_t chunkSize = chunk_.size();
+        while (scanned < size)
+        {
+            rollingHash_ = (rollingHash_ << 1) + gear[static_cast<uint8_t>(data[scanned])];
+            ++scanned;
+            ++chunkSize;
+            if ((chunkSize >= minChunkSize && (rollingHash_ & boundaryMask) == 0) || chunkSize >= maxChunkSize)
+            {
+                boundary = true;
+                break;
+            }
+        }
+
+        chunk_.insert(chunk_.end(), data, data + scanned);
+        data += scanned;
+        size -= scanned;
+        if (boundary && !cutChunk())
+        {
+            failed_ = true;
+        }
+    }
+    return !failed_;
+}
+
+bool DedupSink::cutChunk()
+{
+    Sha256 sha;
+    sha.update(chunk_.data(), chunk_.size());
+    std::string hash = sha.hexDigest();
+
+    if (!store_.contains(hash) && batchHashes_.insert(hash).second)
+    {
+        if (batch_.empty())
+        {
+            batch_.reserve(batchSize + DedupStore::recordHeaderSize + maxChunkSize);
+        }
+        DedupStore::appendRecord(batch_, hash, chunk_.data(), chunk_.size());
+        newBytes_ += chunk_.size();
+        if (batch_.size() >= batchSize && !storeBatch())
+        {
+            return false;
+        }
+    }
+
+    recipe_ += hash + " " + std::to_string(chunk_.size()) + "\n";
+    ++chunkCount_;
+    chunk_.clear();
+    rollingHash_ = 0;
+    return true;
+}
+
+bool DedupSink::storeBatch()
+{
+    bool stored = store_.putChunks(batch_);
+    batch_.clear();
+    batchHashes_.clear();
+    return stored;
+}
+
+bool DedupSink::finish()
+{
+    if (!failed_ && !chunk_.empty() && !cutChunk())
+    {
+        failed_ = true;
+    }
+    if (failed_ || (!batch_.empty() && !storeBatch()) || !store_.sync())
+    {
+        return false;
+    }
+
+    if (!writeFileAtomically(recipePath_, recipePath_ + ".tmp", recipe_.data(), recipe_.size()))
+    {
+        return false;
+    }
+
+    std::cout << "Stored " << recipePath_ << ": " << totalBytes_ << " bytes in " << chunkCount_ << " chunks, "
+              << newBytes_ << " bytes new" << std::endl;
+    return true;
+}
+
+bool VersionReader::open(const std::string &versionPath, DedupStore *store)
+{
+    file_.open(versionPath, std::ios::binary | std::ios::ate);
+    if (file_)
+    {
+        size_ = file_.tellg();
+        return true;
+    }
+    file_.clear();
+    if (openCompressed(versionPath + ".gcz"))
+    {
+        return true;
+    }
+    if (!store)
+    {
+        return false;
+    }
+
+    // Recipe lines are "<chunk hash> <chunk size>"
+    std::ifstream recipe(versionPath + ".recipe");
+    if (!recipe)
+    {
+        return false;
+    }
+    isRecipe_ = true;
+    std::string hash;
+    size_t chunkSize;
+    while (recipe >> hash >> chunkSize)
+    {
+        DedupStore::Location location;
+        if (!store->locate(hash, location) || location.size != chunkSize)
+        {
+            std::cerr << "Missing chunk " << hash << " of " << versionPath << std::endl;
+            return false;
+        }
+        std::string path = location.container == 0 ? store->chunkPath(hash) : store->containerPath(location.container);
+        chunks_.push_back({size_, chunkSize, path, location.offset});
+        size_ += chunkSize;
+    }
+    return true;
+}
+
+bool VersionReader::openPacked(const std::string &segmentPath, uint64_t recordOffset)
+{
+    file_.open(segmentPath, std::ios::binary);
+    char header[PackStore::recordHeaderSize];
+    if (!file_.seekg(recordOffset) || !file_.read(header, sizeof(header)))
+    {
+        return false;
+    }
+    uint32_t magic;
+    std::memcpy(&magic, header, sizeof(magic));
+    std::memcpy(&size_, header + 16, sizeof(size_));
+    baseOffset_ = static_cast<int64_t>(recordOffset + PackStore::recordHeaderSize);
+    return magic == PackStore::recordMagic;
+}
+
+bool VersionReader::read(int64_t offset, char *data, size_t size)
+{
+    if (offset < 0 || offset + static_cast<int64_t>(size) > size_)
+    {
+        return false;
+    }
+
+    if (isCompressed_)
+    {
+        return readCompressed(offset, data, size);
+    }
+    if (!isRecipe_)
+    {
+        file_.clear();
+        file_.seekg(baseOffset_ + offset);
+        file_.read(data, size);
+        return static_cast<bool>(file_);
+    }
+
+    // First chunk that ends past the offset
+    auto chunk = std::upper_bound(chunks_.begin(), chunks_.end(), offset,
+                                  [](int64_t value, const Chunk &candidate)
+                                  { return value < candidate.offset + static_cast<int64_t>(candidate.size); });
+    while (size > 0 && chunk != chunks_.end())
+    {
+        if (cachedChunk_ != &*chunk)
+        {
+            // Consecutive chunks mostly share a container, which stays open between them
+            if (chunkFilePath_ != chunk->path)
+            {
+                chunkFile_.close();
+                chunkFile_.open(chunk->path, std::ios::binary);
+                chunkFilePath_ = chunk->path;
+            }
+            chunkFile_.clear();
+            cachedData_.resize(chunk->size);
+            if (!chunkFile_.seekg(chunk->fileOffset) || !chunkFile_.read(cachedData_.data(), chunk->size))
+            {
+                cachedChunk_ = nullptr;
+                return false;
+            }
+            cachedChunk_ = &*chunk;
+        }
+
+        size_t offsetInChunk = static_cast<size_t>(offset - chunk->offset);
+        size_t take = std::min(size, chunk->size - offsetInChunk);
+        std::memcpy(data, cachedData_.data() + offsetInChunk, take);
+        data += take;
+        offset += take;
+        size -= take;
+        ++chunk;
+    }
+    return size == 0;
+}
+
+bool VersionReader::openCompressed(const std::string &path)
+{
+    file_.open(path, std::ios::binary);
+    if (!file_)
+    {
+        return false;
+    }
+
+    // Index the blocks by their headers
+    isCompressed_ = true;
+    int64_t payloadOffset = GcodeCodec::headerSize;
+    uint32_t header[2];
+    while (file_.read(reinterpret_cast<char *>(header), sizeof(header)))
+    {
+        blocks_.push_back({size_, header[0], payloadOffset, header[1]});
+        size_ += header[0];
+        payloadOffset += header[1] + GcodeCodec::headerSize;
+        file_.seekg(header[1], std::ios::cur);
+    }
+    return true;
+}
+
+bool VersionReader::readCompressed(int64_t offset, char *data, size_t size)
+{
+    auto block = std::upper_bound(blocks_.begin(), blocks_.end(), offset,
+                                  [](int64_t value, const CodecBlock &candidate)
+                                  { return value < candidate.offset + static_cast<int64_t>(candidate.size); });
+    while (size > 0 && block != blocks_.end())
+    {
+        if (cachedBlock_ != &*block)
+        {
+            std::vector<char> payload(block->payloadSize);
+            file_.clear();
+            file_.seekg(block->payloadOffset);
+            cachedBlockData_.clear();
+            if (!file_.read(payload.data(), payload.size()) ||
+                !GcodeCodec::decodeBlock(payload.data(), payload.size(), block->size, cachedBlockData_))
+            {
+                cachedBlock_ = nullptr;
+                return false;
+            }
+            cachedBlock_ = &*block;
+        }
+
+        size_t offsetInBlock = static_cast<size_t>(offset - block->offset);
+        size_t take = std::min(size, block->size - offsetInBlock);
+        std::memcpy(data, cachedBlockData_.data() + offsetInBlock, take);
+        data += take;
+        offset += take;
+        size -= take;
+        ++block;
+    }
+    return size == 0;
+}
+
+ChunkedUpload::ChunkedUpload(const ChunkedHeader &header, std::unique_ptr<RangeSink> file)
+    : header_(header),
+      chunkCount_(static_cast<uint32_t>((header.fileSize + header.chunkSize - 1) / header.chunkSize)),
+      file_(std::move(file)), stored_(chunkCount_, false)
+{
+}
+
+bool ChunkedUpload::feed(const char *data, size_t size, std::string &acks)
+{
+    while (size > 0)
+    {
+        if (chunkHeaderReceived_ < chunkHeaderSize)
+        {
+            size_t take = std::min(size, chunkHeaderSize - chunkHeaderReceived_);
+            std::memcpy(chunkHeader_ + chunkHeaderReceived_, data, take);
+            chunkHeaderReceived_ += take;
+            data += take;
+            size -= take;
+            if (chunkHeaderReceived_ < chunkHeaderSize)
+            {
+                return true;
+            }
+
+            uint32_t length;
+            std::memcpy(&index_, chunkHeader_, sizeof(index_));
+            std::memcpy(&length, chunkHeader_ + 4, sizeof(length));
+            std::memcpy(&expectedCrc_, chunkHeader_ + 8, sizeof(expectedCrc_));
+
+            // A chunk must be one the client still owes, at its exact size
+            int64_t offset = static_cast<int64_t>(index_) * header_.chunkSize;
+            if (index_ >= chunkCount_ || stored_[index_] ||
+                length != std::min<int64_t>(header_.chunkSize, header_.fileSize - offset))
+            {
+                std::cerr << "Invalid chunk " << index_ << " of " << chunkCount_ << std::endl;
+                return false;
+            }
+            file_->seek(offset);
+            remaining_ = length;
+            crc_ = 0;
+        }
+
+        // Written as it arrives; a chunk that fails its checksum is overwritten by the retransmission
+        size_t take = std::min<size_t>(size, remaining_);
+        if (take > 0 && !file_->write(data, take))
+        {
+            return false;
+        }
+        crc_ = crc32c(crc_, data, take);
+        remaining_ -= static_cast<uint32_t>(take);
+        data += take;
+        size -= take;
+        if (remaining_ > 0)
+        {
+            continue;
+        }
+
+        chunkHeaderReceived_ = 0;
+        if (crc_ != expectedCrc_)
+        {
+            std::cerr << "Checksum mismatch in chunk " << index_ << ", asking for it again" << std::endl;
+            appendAck(acks, index_, ChunkStatus::Retransmit);
+            continue;
+        }
+        stored_[index_] = true;
+        ++storedCount_;
+        pending_.push_back(index_);
+
+        // Flush once per half window, so the client never waits on a flush per chunk
+        if (pending_.size() >= std::max<uint32_t>(header_.window / 2, 1) || storedCount_ == chunkCount_)
+        {
+            if (!flushAcks(acks))
+            {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+bool ChunkedUpload::flushAcks(std::string &acks)
+{
+    if (!file_->flush())
+    {
+        return false;
+    }
+    for (uint32_t index : pending_)
+    {
+        appendAck(acks, index, ChunkStatus::Stored);
+    }
+    pending_.clear();
+    return true;
+}
+
+void ChunkedUpload::appendAck(std::string &acks, uint32_t index, ChunkStatus status)
+{
+    acks.append(reinterpret_cast<const char *>(&index), sizeof(index));
+    acks.push_back(static_cast<char>(status));
+}
+
+bool CompressedUpload::feed(const char *data, size_t size)
+{
+    while (size > 0)
+    {
+        // Header first, then exactly its payload
+        size_t wanted = GcodeCodec::headerSize;
+        uint32_t header[2] = {0, 0};
+        if (block_.size() >= GcodeCodec::headerSize)
+        {
+            std::memcpy(header, block_.data(), sizeof(header));
+            wanted += header[1];
+        }
+        size_t take = std::min(size, wanted - block_.size());
+        block_.append(data, take);
+        data += take;
+        size -= take;
+
+        if (block_.size() == GcodeCodec::headerSize)
+        {
+            std::memcpy(header, block_.data(), sizeof(header));
+            if (header[0] == 0 || header[0] > GcodeCodec::blockSize || header[1] > 2 * GcodeCodec::blockSize ||
+                rawReceived_ + header[0] > rawSize_)
+            {
+                return false;
+            }
+        }
+        if (block_.size() < GcodeCodec::headerSize || block_.size() < GcodeCodec::headerSize + header[1])
+        {
+            continue;
+        }
+
+        decoded_.clear();
+        if (!GcodeCodec::decodeBlock(block_.data() + GcodeCodec::headerSize, header[1], header[0], decoded_) ||
+            !(storeDecoded_ ? sink_.write(decoded_.data(), decoded_.size()) : sink_.write(block_.data(), block_.size())))
+        {
+            return false;
+        }
+        rawReceived_ += header[0];
+        block_.clear();
+    }
+    return true;
+}
+
+RangeDecoder::RangeDecoder(const char *data, size_t size) : data_(data), size_(size)
+{
+    for (int i = 0; i < 5; ++i)
+    {
+        code_ = (code_ << 8) | nextByte();
+    }
+}
+
+uint8_t RangeDecoder::nextByte()
+{
+    if (position_ >= size_)
+    {
+        overrun_ = true;
+        return 0;
+    }
+    return static_cast<uint8_t>(data_[position_++]);
+}
+
+int RangeDecoder::decodeBit(uint16_t &probability)
+{
+    uint32_t bound = (range_ >> 11) * probability;
+    int bit;
+    if (code_ < bound)
+    {
+        range_ = bound;
+        probability += (2048 - probability) >> 5;
+        bit = 0;
+    }
+    else
+    {
+        code_ -= bound;
+        range_ -= bound;
+        probability -= probability >> 5;
+        bit = 1;
+    }
+    while (range_ < (1u << 24))
+    {
+        range_ <<= 8;
+        code_ = (code_ << 8) | nextByte();
+    }
+    return bit;
+}
+
+uint32_t RangeDecoder::decodeTree(uint16_t *probabilities, int bitCount)
+{
+    uint32_t node = 1;
+    for (int i = 0; i < bitCount; ++i)
+    {
+        node = (node << 1) | decodeBit(probabilities[node]);
+    }
+    return node - (1u << bitCount);
+}
+
+uint64_t RangeDecoder::decodeDirect(int bitCount)
+{
+    uint64_t value = 0;
+    for (int i = 0; i < bitCount; ++i)
+    {
+        range_ >>= 1;
+        int bit = code_ >= range_ ? 1 : 0;
+        if (bit)
+        {
+            code_ -= range_;
+        }
+        value = (value << 1) | bit;
+        while (range_ < (1u << 24))
+        {
+            range_ <<= 8;
+            code_ = (code_ << 8) | nextByte();
+        }
+    }
+    return value;
+}
+
+GcodeModel::GcodeModel() : symbols(static_cast<size_t>(symbolCount) << symbolBits, 1024)
+{
+    std::fill(&decimals[0][0], &decimals[0][0] + sizeof(decimals) / sizeof(uint16_t), 1024);
+    std::fill(&bitLengths[0][0], &bitLengths[0][0] + sizeof(bitLengths) / sizeof(uint16_t), 1024);
+}
+
+static void renderWordNumber(int64_t value, uint32_t decimalsCode, std::string &out)
+{
+    if (value < 0)
+    {
+        out += '-';
+    }
+    std::string digits = std::to_string(value < 0 ? -static_cast<uint64_t>(value) : static_cast<uint64_t>(value));
+    if (decimalsCode == 0)
+    {
+        out += digits;
+        return;
+    }
+
+    size_t fractionDigits = decimalsCode - 1;
+    if (digits.size() <= fractionDigits)
+    {
+        digits.insert(0, fractionDigits + 1 - digits.size(), '0');
+    }
+    out.append(digits, 0, digits.size() - fractionDigits);
+    out += '.';
+    out.append(digits, digits.size() - fractionDigits, fractionDigits);
+}
+
+bool GcodeCodec::decodeBlock(const char *payload, size_t payloadSize, size_t rawSize, std::string &out)
+{
+    auto model = std::make_unique<GcodeModel>();
+    RangeDecoder decoder(payload, payloadSize);
+    size_t end = out.size() + rawSize;
+
+    while (out.size() < end && !decoder.overrun())
+    {
+        uint32_t symbol = decoder.decodeTree(
+            &model->symbols[static_cast<size_t>(model->previousSymbol) << GcodeModel::symbolBits], GcodeModel::symbolBits);
+        model->previousSymbol = symbol;
+        if (symbol < GcodeModel::wordSymbol)
+        {
+            out += static_cast<char>(symbol);
+            continue;
+        }
+        if (symbol >= GcodeModel::symbolCount)
+        {
+            return false;
+        }
+
+        int letter = symbol - GcodeModel::wordSymbol;
+        uint32_t decimalsCode = decoder.decodeTree(model->decimals[letter], 5);
+        int bitLength = static_cast<int>(decoder.decodeTree(model->bitLengths[letter], 7));
+        if (bitLength > 64)
+        {
+            return false;
+        }
+        uint64_t zigzag = bitLength == 0 ? 0 : (1ULL << (bitLength - 1)) | (bitLength > 1 ? decoder.decodeDirect(bitLength - 1) : 0);
+        int64_t delta = static_cast<int64_t>(zigzag >> 1) ^ -static_cast<int64_t>(zigzag & 1);
+        int64_t base = decimalsCode == model->previousDecimals[letter] ? model->previousValue[letter] : 0;
+        int64_t value = base + delta;
+        model->previousValue[letter] = value;
+        model->previousDecimals[letter] = decimalsCode;
+
+        out += static_cast<char>('A' + letter);
+        renderWordNumber(value, decimalsCode, out);
+    }
+    return out.size() == end && !decoder.overrun();
+}
+
+// rsync's weak checksum: sum of the bytes and sum of the running sums, 16 bits each
+static uint32_t weakChecksum(const char *data, size_t size)
+{
+    uint32_t a = 0;
+    uint32_t b = 0;
+    for (size_t i = 0; i < size; ++i)
+    {
+        a += static_cast<uint8_t>(data[i]);
+        b += a;
+    }
+    return (a & 0xffff) | (b << 16);
+}
+
+// First 16 bytes of the block's SHA-256
+static std::string strongChecksum(const char *data, size_t size)
+{
+    Sha256 sha;
+    sha.update(data, size);
+    return sha.digest().substr(0, 16);
+}
+
+// Around sqrt(24 * size), which balances signature bytes against literal bytes per edit
+static uint32_t chooseBlockSize(int64_t fileSize)
+{
+    double blockSize = std::sqrt(24.0 * static_cast<double>(std::max<int64_t>(fileSize, 0)));
+    uint32_t rounded = (static_cast<uint32_t>(std::min(blockSize, 1024.0 * 1024.0)) + 1023) / 1024 * 1024;
+    return std::max<uint32_t>(rounded, 2048);
+}
+
+// Signature stream: uint32 block size, uint32 block count, then per full block a uint32 weak
+// checksum and a 16-byte strong checksum
+static std::string encodeSignatureHeader(uint32_t blockSize, uint32_t blockCount)
+{
+    std::string header(2 * sizeof(uint32_t), '\0');
+    std::memcpy(&header[0], &blockSize, sizeof(blockSize));
+    std::memcpy(&header[sizeof(blockSize)], &blockCount, sizeof(blockCount));
+    return header;
+}
+
+static bool loadSignatures(const std::string &versionPath, VersionReader &base, std::string &signatures)
+{
+    // Computed once per version and kept next to it behind "VSIG", the sequence and the size of
+    // the version; a file left by another version of the same number, or cut short, is redone
+    const uint32_t signatureMagic = 0x47495356;
+    const size_t cacheHeaderSize = sizeof(uint32_t) + sizeof(uint64_t) + sizeof(int64_t);
+    uint64_t sequence = sequenceOfPath(versionPath);
+    int64_t size = base.size();
+    uint32_t blockSize = chooseBlockSize(size);
+    uint32_t blockCount = static_cast<uint32_t>(size / blockSize);
+    const size_t signatureSize = 2 * sizeof(uint32_t) + blockCount * (sizeof(uint32_t) + 16);
+
+    std::string cacheHeader(cacheHeaderSize, '\0');
+    std::memcpy(&cacheHeader[0], &signatureMagic, sizeof(signatureMagic));
+    std::memcpy(&cacheHeader[4], &sequence, sizeof(sequence));
+    std::memcpy(&cacheHeader[12], &size, sizeof(size));
+
+    std::string signaturePath = versionPath + ".sig";
+    std::ifstream cached(signaturePath, std::ios::binary);
+    if (cached)
+    {
+        std::string contents((std::istreambuf_iterator<char>(cached)), std::istreambuf_iterator<char>());
+        if (contents.size() == cacheHeaderSize + signatureSize && contents.compare(0, cacheHeaderSize, cacheHeader) == 0 &&
+            contents.compare(cacheHeaderSize, 2 * sizeof(uint32_t), encodeSignatureHeader(blockSize, blockCount)) == 0)
+        {
+            signatures = contents.substr(cacheHeaderSize);
+            return true;
+        }
+    }
+
+    signatures = encodeSignatureHeader(blockSize, blockCount);
+    signatures.reserve(signatureSize);
+
+    std::vector<char> block(blockSize);
+    for (uint32_t i = 0; i < blockCount; ++i)
+    {
+        if (!base.read(static_cast<int64_t>(i) * blockSize, block.data(), blockSize))
+        {
+            return false;
+        }
+        uint32_t weak = weakChecksum(block.data(), blockSize);
+        signatures.append(reinterpret_cast<const char *>(&weak), sizeof(weak));
+        signatures += strongChecksum(block.data(), blockSize);
+    }
+
+    std::string contents = cacheHeader + signatures;
+    writeFileAtomically(signaturePath, signaturePath + ".tmp", contents.data(), contents.size());
+    return true;
+}
+
+bool DeltaDecoder::feed(const char *data, size_t size)
+{
+    while (size > 0)
+    {
+        if (finished_)
+        {
+            // Nothing may follow the end record
+            return false;
+        }
+
+        if (literalRemaining_ > 0)
+        {
+            size_t take = std::min<size_t>(size, literalRemaining_);
+            if (!output(data, take))
+            {
+                return false;
+            }
+            literalRemaining_ -= static_cast<uint32_t>(take);
+            data += take;
+            size -= take;
+            continue;
+        }
+
+        // Assemble the record header, whose length depends on its type byte
+        header_ += *data++;
+        --size;
+        size_t headerSize = header_[0] == 'L' ? 5 : header_[0] == 'B' ? 9 : header_[0] == 'E' ? 65 : 0;
+        if (headerSize == 0)
+        {
+            return false;
+        }
+        if (header_.size() < headerSize)
+        {
+            continue;
+        }
+
+        if (header_[0] == 'L')
+        {
+            std::memcpy(&literalRemaining_, &header_[1], sizeof(literalRemaining_));
+        }
+        else if (header_[0] == 'B')
+        {
+            uint32_t first, count;
+            std::memcpy(&first, &header_[1], sizeof(first));
+            std::memcpy(&count, &header_[5], sizeof(count));
+            if (!copyBlocks(first, count))
+            {
+                return false;
+            }
+        }
+        else
+        {
+            if (written_ != fileSize_ || sha_.hexDigest() != header_.substr(1))
+            {
+                std::cerr << "Delta upload does not match its digest" << std::endl;
+                return false;
+            }
+            finished_ = true;
+        }
+        header_.clear();
+    }
+    return true;
+}
 
-// TCPServer class that encapsulates the server logic
-class TCPServer
+bool DeltaDecoder::output(const char *data, size_t size)
 {
-public:
-    // Constructor taking IP address and port number as parameters
-    TCPServer(const std::string &ip, int port) : ip_(ip), port_(port) {}
+    if (written_ + static_cast<int64_t>(size) > fileSize_)
+    {
+        return false;
+    }
+    written_ += size;
+    sha_.update(data, size);
+    return sink_.write(data, size);
+}
 
-    // Initialize the server
-    bool init();
+bool DeltaDecoder::copyBlocks(uint32_t first, uint32_t count)
+{
+    if (!base_ || static_cast<uint64_t>(first) + count > blockCount_)
+    {
+        return false;
+    }
 
-    // Start listening for connections and handle incoming data
-    void run();
+    std::vector<char> block(blockSize_);
+    for (uint32_t i = first; i < first + count; ++i)
+    {
+        if (!base_->read(static_cast<int64_t>(i) * blockSize_, block.data(), blockSize_) ||
+            !output(block.data(), blockSize_))
+        {
+            return false;
+        }
+    }
+    return true;
+}
 
-    // receive chunk of file, save it, than return successful status
-    void saveFileAndSendResponse(SOCKET clientSocket);
+IocpWorker::~IocpWorker()
+{
+    if (completionPort_)
+    {
+        CloseHandle(completionPort_);
+    }
+}
 
-private:
-    // IP address of the server
-    std::string ip_;
-    // Port number of the server
-    int port_;
-    // Listening socket for incoming connections
-    SOCKET listenSocket_;
-};
+bool IocpWorker::init()
+{
+    completionPort_ = CreateIoCompletionPort(INVALID_HANDLE_VALUE, nullptr, 0, 1);
+    if (!completionPort_)
+    {
+        std::cerr << "Error creating completion port: " << GetLastError() << std::endl;
+        return false;
+    }
+    return true;
+}
 
-int main()
+bool IocpWorker::adopt(SOCKET clientSocket)
 {
-    // Set IP address and port number
-    std::string ip = "127.0.0.1";
-    int port = 12345;
+    // The connection pointer is the completion key of its socket and file
+    auto *connection = new IocpConnection(clientSocket);
+    if (!CreateIoCompletionPort(reinterpret_cast<HANDLE>(clientSocket), completionPort_,
+                                reinterpret_cast<ULONG_PTR>(connection), 0) ||
+        !PostQueuedCompletionStatus(completionPort_, 0, reinterpret_cast<ULONG_PTR>(connection), nullptr))
+    {
+        std::cerr << "Error handing connection to worker: " << GetLastError() << std::endl;
+        delete connection;
+        return false;
+    }
+    return true;
+}
 
-    // Create a TCPServer instance
-    TCPServer server(ip, port);
+void IocpWorker::wake()
+{
+    // A packet without a connection or an operation
+    PostQueuedCompletionStatus(completionPort_, 0, 0, nullptr);
+}
 
-    // Initialize the server
-    if (server.init())
+void IocpWorker::run()
+{
+    pinToCore(index_);
+
+    const ULONG maxEntries = 64;
+    OVERLAPPED_ENTRY entries[maxEntries];
+
+    while (true)
     {
-        // Run the server
-        server.run();
+        ULONG count = 0;
+        BOOL dequeued = GetQueuedCompletionStatusEx(completionPort_, entries, maxEntries, &count, INFINITE, FALSE);
+        stats.count(1);
+        if (!dequeued)
+        {
+            std::cerr << "Error waiting for completions: " << GetLastError() << std::endl;
+            break;
+        }
+
+        for (ULONG i = 0; i < count; ++i)
+        {
+            auto *connection = reinterpret_cast<IocpConnection *>(entries[i].lpCompletionKey);
+
+            // A packet without an operation is a socket handed over by adopt(), or without a
+            // connection either, a wake()
+            if (!entries[i].lpOverlapped)
+            {
+                if (!connection)
+                {
+                    continue;
+                }
+                startConnection(connection);
+                releaseIfIdle(*connection);
+                continue;
+            }
+
+            auto *operation = reinterpret_cast<IocpOperation *>(entries[i].lpOverlapped);
+            bool succeeded = entries[i].Internal == 0;
+            DWORD bytes = entries[i].dwNumberOfBytesTransferred;
+            --connection->pendingOperations;
+
+            switch (operation->type)
+            {
+            case IocpOperation::Type::Receive:
+                onReceived(*connection, succeeded, bytes);
+                break;
+            case IocpOperation::Type::Write:
+                onWritten(*connection, *operation, succeeded, bytes);
+                break;
+            case IocpOperation::Type::Send:
+                onSent(*connection, succeeded, bytes);
+                break;
+            case IocpOperation::Type::Commit:
+                onCommitted(*connection);
+                break;
+            }
+            releaseIfIdle(*connection);
+        }
+
+        // The wake() of a draining server follows every socket it handed over. A connection idling
+        // in the client's pool is closed; the client retries its next request on the new process
+        if (server_.draining())
+        {
+            // Its receive is cancelled by the close and frees it on completion
+            for (auto &connection : connections_)
+            {
+                if (connection->betweenRequests())
+                {
+                    closeConnection(*connection);
+                }
+            }
+        }
+        if (server_.draining() && connections_.empty())
+        {
+            break;
+        }
+    }
+}
+
+void IocpWorker::startConnection(IocpConnection *connection)
+{
+    connections_.emplace_back(connection);
+    connection->machine = peerAddress(connection->socket);
+
+    const size_t bufferSize = 64 * 1024;
+    connection->buffers[0].resize(bufferSize);
+    connection->buffers[1].resize(bufferSize);
+    connection->receiveOperation.type = IocpOperation::Type::Receive;
+    connection->sendOperation.type = IocpOperation::Type::Send;
+    connection->commitOperation.type = IocpOperation::Type::Commit;
+    for (size_t i = 0; i < 2; ++i)
+    {
+        connection->writeOperations[i].type = IocpOperation::Type::Write;
+        connection->writeOperations[i].bufferIndex = i;
+    }
+    connection->receiveOperation.connection = connection;
+    connection->sendOperation.connection = connection;
+    connection->commitOperation.connection = connection;
+    connection->writeOperations[0].connection = connection;
+    connection->writeOperations[1].connection = connection;
+
+    postReceive(*connection);
+}
+
+void IocpWorker::postReceive(IocpConnection &connection)
+{
+    if (connection.closing || connection.receivePending)
+    {
+        return;
+    }
+
+    WSABUF buffer;
+    if (connection.state == Connection::State::ReadingSize)
+    {
+        buffer.buf = reinterpret_cast<char *>(&connection.fileSize) + connection.sizeBytesReceived;
+        buffer.len = static_cast<ULONG>(sizeof(connection.fileSize) - connection.sizeBytesReceived);
+    }
+    else if (connection.state == Connection::State::ReadingOfferHeader)
+    {
+        buffer.buf = reinterpret_cast<char *>(&connection.offer) + connection.sizeBytesReceived;
+        buffer.len = static_cast<ULONG>(sizeof(connection.offer) - connection.sizeBytesReceived);
+    }
+    else if (connection.state == Connection::State::ReadingBody && connection.bytesReceived < connection.fileSize &&
+             !connection.bufferWriting[connection.receiveBuffer])
+    {
+        std::vector<char> &target = connection.buffers[connection.receiveBuffer];
+        buffer.buf = target.data();
+        buffer.len = static_cast<ULONG>(std::min<int64_t>(target.size(), connection.fileSize - connection.bytesReceived));
     }
     else
     {
-        std::cerr << "Failed to initialize the server." << std::endl;
-        return 1;
+        // Body complete, or both buffers are still being written
+        return;
     }
 
-    return 0;
+    std::memset(&connection.receiveOperation.overlapped, 0, sizeof(OVERLAPPED));
+    DWORD flags = 0;
+    int result = WSARecv(connection.socket, &buffer, 1, nullptr, &flags, &connection.receiveOperation.overlapped, nullptr);
+    stats.count(1);
+    if (result == SOCKET_ERROR && WSAGetLastError() != WSA_IO_PENDING)
+    {
+        std::cerr << "Error receiving file data: " << WSAGetLastError() << std::endl;
+        closeConnection(connection);
+        return;
+    }
+    connection.receivePending = true;
+    ++connection.pendingOperations;
 }
 
-bool TCPServer::init()
+void IocpWorker::onReceived(IocpConnection &connection, bool succeeded, DWORD bytes)
 {
-    WSADATA wsaData;
-    // Initialize Winsock
-    int result = WSAStartup(MAKEWORD(2, 2), &wsaData);
-    if (result != 0)
+    connection.receivePending = false;
+    if (connection.closing)
     {
-        std::cerr << "WSAStartup failed: " << result << std::endl;
-        return false;
+        return;
     }
+    if (!succeeded || bytes == 0)
+    {
+        std::cerr << (succeeded ? "Client disconnected" : "Error receiving file data") << std::endl;
+        closeConnection(connection);
+        return;
+    }
+    stats.count(0, bytes);
 
-    // Create a socket
-    listenSocket_ = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-    if (listenSocket_ == INVALID_SOCKET)
+    if (connection.state == Connection::State::ReadingSize ||
+        connection.state == Connection::State::ReadingOfferHeader)
     {
-        std::cerr << "Error creating socket: " << WSAGetLastError() << std::endl;
-        WSACleanup();
-        return false;
+        connection.sizeBytesReceived += bytes;
+        size_t headerSize = connection.state == Connection::State::ReadingOfferHeader ? sizeof(connection.offer)
+                                                                                      : sizeof(connection.fileSize);
+        if (connection.sizeBytesReceived == headerSize)
+        {
+            onHeader(connection);
+            if (connection.closing)
+            {
+                return;
+            }
+        }
+    }
+    else
+    {
+        // Linked pipeline: the filled buffer goes to disk while the next recv uses the other one.
+        // Receives complete one at a time, so the hash sees the body in order
+        connection.bodyCrc = crc32c(connection.bodyCrc, connection.buffers[connection.receiveBuffer].data(), bytes);
+        connection.bytesReceived += bytes;
+        postWrite(connection, connection.receiveBuffer, bytes);
+        connection.receiveBuffer ^= 1;
     }
 
-    // Set up server address and bind the socket
-    sockaddr_in serverAddress;
-    serverAddress.sin_family = AF_INET;
-    serverAddress.sin_port = htons(port_);
-    inet_pton(AF_INET, ip_.c_str(), &serverAddress.sin_addr.s_addr);
+    postReceive(connection);
+    finishUploadIfDone(connection);
+}
 
-    result = bind(listenSocket_, (SOCKADDR *)&serverAddress, sizeof(serverAddress));
-    if (result == SOCKET_ERROR)
+void IocpWorker::onHeader(IocpConnection &connection)
+{
+    if (connection.state == Connection::State::ReadingSize && connection.fileSize == keepAliveRequest)
     {
-        std::cerr << "Error binding socket: " << WSAGetLastError() << std::endl;
-        closesocket(listenSocket_);
-        WSACleanup();
-        return false;
+        connection.keepAlive = true;
+        connection.sizeBytesReceived = 0;
+        return;
+    }
+    // A kept-alive connection may have idled in the client's pool; time versions from the request
+    if (connection.state == Connection::State::ReadingSize && connection.keepAlive)
+    {
+        connection.startedAt = unixMilliseconds();
+    }
+    if (connection.state == Connection::State::ReadingSize && connection.fileSize == offeredUploadRequest)
+    {
+        connection.state = Connection::State::ReadingOfferHeader;
+        connection.sizeBytesReceived = 0;
+        return;
+    }
+    if (connection.state == Connection::State::ReadingSize)
+    {
+        if (!startBody(connection))
+        {
+            closeConnection(connection);
+        }
+        return;
+    }
+
+    // An unchanged file costs this one round trip; otherwise the body follows as in a plain upload,
+    // received while the answer is still going out
+    const OfferHeader &offer = connection.offer;
+    if (!server_.acceptableFileSize(offer.fileSize))
+    {
+        std::cerr << "Error starting offered upload" << std::endl;
+        closeConnection(connection);
+        return;
+    }
+    OfferStatus status = server_.hasVersion(connection.machine, defaultBackupName, offer.fileSize, offer.crc)
+                             ? OfferStatus::AlreadyStored
+                             : OfferStatus::Send;
+    connection.response.assign(1, static_cast<char>(status));
+    connection.responseSent = 0;
+    if (status == OfferStatus::AlreadyStored)
+    {
+        std::cout << "Already have " << connection.machine << " " << defaultBackupName << std::endl;
+        connection.reusable = connection.keepAlive;
+        connection.state = Connection::State::SendingResponse;
+    }
+    else
+    {
+        connection.fileSize = offer.fileSize;
+        if (!startBody(connection))
+        {
+            closeConnection(connection);
+            return;
+        }
     }
+    postSend(connection);
+}
 
+bool IocpWorker::startBody(IocpConnection &connection)
+{
+    std::string path = server_.nextBackupPath();
+    connection.versionPath = path;
+    if (server_.acceptableFileSize(connection.fileSize))
+    {
+        connection.file = CreateFileA(path.c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS,
+                                      FILE_ATTRIBUTE_NORMAL | FILE_FLAG_OVERLAPPED, nullptr);
+    }
+    if (connection.file == INVALID_HANDLE_VALUE ||
+        !CreateIoCompletionPort(connection.file, completionPort_, reinterpret_cast<ULONG_PTR>(&connection), 0))
+    {
+        std::cerr << "Error opening file: " << path << std::endl;
+        return false;
+    }
+    connection.state = Connection::State::ReadingBody;
     return true;
 }
 
-void TCPServer::run()
+void IocpWorker::postWrite(IocpConnection &connection, size_t bufferIndex, DWORD bytes)
 {
-    // Listen for incoming connections
-    int result = listen(listenSocket_, SOMAXCONN);
-    if (result == SOCKET_ERROR)
+    IocpOperation &operation = connection.writeOperations[bufferIndex];
+    std::memset(&operation.overlapped, 0, sizeof(OVERLAPPED));
+    operation.overlapped.Offset = static_cast<DWORD>(connection.bytesQueued);
+    operation.overlapped.OffsetHigh = static_cast<DWORD>(connection.bytesQueued >> 32);
+    connection.bytesQueued += bytes;
+
+    BOOL written = WriteFile(connection.file, connection.buffers[bufferIndex].data(), bytes, nullptr, &operation.overlapped);
+    stats.count(1);
+    if (!written && GetLastError() != ERROR_IO_PENDING)
     {
-        std::cerr << "Error listening on socket: " << WSAGetLastError() << std::endl;
-        closesocket(listenSocket_);
-        WSACleanup();
+        std::cerr << "Error writing file: " << GetLastError() << std::endl;
+        closeConnection(connection);
+        return;
+    }
+    connection.bufferWriting[bufferIndex] = true;
+    ++connection.pendingOperations;
+}
+
+void IocpWorker::onWritten(IocpConnection &connection, IocpOperation &operation, bool succeeded, DWORD bytes)
+{
+    connection.bufferWriting[operation.bufferIndex] = false;
+    if (connection.closing)
+    {
+        return;
+    }
+    if (!succeeded)
+    {
+        std::cerr << "Error writing file" << std::endl;
+        closeConnection(connection);
         return;
     }
 
-    std::cout << "Server is listening for connections..." << std::endl;
+    connection.bytesWritten += bytes;
+    postReceive(connection);
+    finishUploadIfDone(connection);
+}
 
-    while (true)
+void IocpWorker::finishUploadIfDone(IocpConnection &connection)
+{
+    if (connection.closing || connection.state != Connection::State::ReadingBody ||
+        connection.bytesWritten != connection.fileSize || connection.sendPending)
     {
-        // Accept a client connection
-        sockaddr_in clientAddress;
-        int clientAddressSize = sizeof(clientAddress);
-        SOCKET clientSocket = accept(listenSocket_, (SOCKADDR *)&clientAddress, &clientAddressSize);
+        return;
+    }
 
-        if (clientSocket == INVALID_SOCKET)
-        {
-            std::cerr << "Error accepting connection: " << WSAGetLastError() << std::endl;
-            continue;
-        }
+    bool closed = CloseHandle(connection.file) != FALSE;
+    connection.file = INVALID_HANDLE_VALUE;
+    if (!closed)
+    {
+        removeVersionFiles(connection.versionPath);
+        connection.versionPath.clear();
+        replyToUpload(connection, false);
+        return;
+    }
 
-        std::cout << "Client connected!" << std::endl;
+    // The flushes block, so the commit thread records the version, grouped with the other
+    // workers'; its packet counts as an operation, keeping the connection until it arrives
+    auto job = std::make_shared<CommitJob>();
+    job->machine = connection.machine;
+    job->versionPath = connection.versionPath;
+    job->file = defaultBackupName;
+    job->size = connection.fileSize;
+    job->receivedAt = connection.startedAt;
+    job->hasCrc = true;
+    job->crc = connection.bodyCrc;
+    job->completionPort = completionPort_;
+    job->completionKey = reinterpret_cast<ULONG_PTR>(&connection);
+    std::memset(&connection.commitOperation.overlapped, 0, sizeof(OVERLAPPED));
+    job->completion = &connection.commitOperation.overlapped;
+    connection.commitJob = job;
+    ++connection.pendingOperations;
+    // A version handed to the commit thread is its to record or delete
+    connection.versionPath.clear();
+    connection.state = Connection::State::Committing;
+    server_.commitQueue().push(job);
+}
 
-        // Save the received file and send a response
-        saveFileAndSendResponse(clientSocket);
+void IocpWorker::onCommitted(IocpConnection &connection)
+{
+    bool saved = connection.commitJob->committed;
+    connection.commitJob.reset();
+    if (connection.closing)
+    {
+        return;
+    }
+    replyToUpload(connection, saved);
+}
 
-        // Close the client socket
-        closesocket(clientSocket);
+void IocpWorker::replyToUpload(IocpConnection &connection, bool saved)
+{
+    // Send a response to the client
+    connection.response = saved ? digestResponse(connection.bodyCrc) : "Error saving file";
+    connection.responseSent = 0;
+    if (connection.keepAlive)
+    {
+        connection.response += '\n';
+        connection.reusable = saved;
     }
+    connection.state = Connection::State::SendingResponse;
+    postSend(connection);
+}
 
-    // Close the listening socket and clean up
-    closesocket(listenSocket_);
-    WSACleanup();
+void IocpWorker::postSend(IocpConnection &connection)
+{
+    WSABUF buffer;
+    buffer.buf = &connection.response[connection.responseSent];
+    buffer.len = static_cast<ULONG>(connection.response.size() - connection.responseSent);
+
+    std::memset(&connection.sendOperation.overlapped, 0, sizeof(OVERLAPPED));
+    int result = WSASend(connection.socket, &buffer, 1, nullptr, 0, &connection.sendOperation.overlapped, nullptr);
+    stats.count(1);
+    if (result == SOCKET_ERROR && WSAGetLastError() != WSA_IO_PENDING)
+    {
+        std::cerr << "Error sending response: " << WSAGetLastError() << std::endl;
+        closeConnection(connection);
+        return;
+    }
+    connection.sendPending = true;
+    ++connection.pendingOperations;
 }
 
-void TCPServer::saveFileAndSendResponse(SOCKET clientSocket)
+void IocpWorker::onSent(IocpConnection &connection, bool succeeded, DWORD bytes)
 {
-    static size_t version = 0;
+    connection.sendPending = false;
+    if (connection.closing)
+    {
+        return;
+    }
+    if (!succeeded)
+    {
+        std::cerr << "Error sending response" << std::endl;
+        closeConnection(connection);
+        return;
+    }
 
-    std::string folderPath = "C:/Users/Ian/Desktop/backup/";
-    std::string fileName = "backup_" + std::to_string(++version) + ".nc";
-    std::ofstream outputFile(folderPath + fileName, std::ios::binary);
+    connection.responseSent += bytes;
+    if (connection.responseSent < connection.response.size())
+    {
+        postSend(connection);
+        return;
+    }
 
-    if (!outputFile)
+    // An offer's answer is out while its body arrives; the body may already be on disk
+    if (connection.state == Connection::State::ReadingBody)
     {
-        std::cerr << "Error opening file: " << folderPath + fileName << std::endl;
+        connection.response.clear();
+        connection.responseSent = 0;
+        finishUploadIfDone(connection);
         return;
     }
 
-    const size_t bufferSize = 4096;
-    std::vector<char> buffer(bufferSize);
-    int64_t fileSize;
+    // One file per connection, as before, unless the client keeps it alive
+    if (connection.reusable)
+    {
+        reuseConnection(connection);
+        return;
+    }
+    closeConnection(connection);
+}
 
-    // Read file size
-    int received = recv(clientSocket, reinterpret_cast<char *>(&fileSize), sizeof(fileSize), 0);
-    if (received != sizeof(fileSize))
+void IocpWorker::reuseConnection(IocpConnection &connection)
+{
+    if (server_.draining())
     {
-        std::cerr << "Error receiving file size" << std::endl;
+        closeConnection(connection);
         return;
     }
+    connection.state = Connection::State::ReadingSize;
+    connection.sizeBytesReceived = 0;
+    connection.bytesReceived = connection.bytesQueued = connection.bytesWritten = 0;
+    connection.bodyCrc = 0;
+    connection.receiveBuffer = 0;
+    connection.response.clear();
+    connection.responseSent = 0;
+    connection.reusable = false;
+    postReceive(connection);
+}
 
-    int64_t bytesReceived = 0;
+void IocpWorker::closeConnection(IocpConnection &connection)
+{
+    if (connection.closing)
+    {
+        return;
+    }
 
-    while (bytesReceived < fileSize)
+    // Closing the handles cancels whatever is still in flight; those completions arrive as failures
+    connection.closing = true;
+    closesocket(connection.socket);
+    if (connection.file != INVALID_HANDLE_VALUE)
     {
-        int bytesRead = recv(clientSocket, buffer.data(), bufferSize, 0);
-        if (bytesRead > 0)
-        {
-            outputFile.write(buffer.data(), bytesRead);
-            bytesReceived += bytesRead;
-        }
-        else if (bytesRead == 0)
-        {
-            std::cerr << "Client disconnected" << std::endl;
-            break;
-        }
-        else
-        {
-            std::cerr << "Error receiving file data: " << WSAGetLastError() << std::endl;
-            break;
-        }
+        CloseHandle(connection.file);
+        connection.file = INVALID_HANDLE_VALUE;
+    }
+    connection.state = Connection::State::Closed;
+}
+
+void IocpWorker::releaseIfIdle(IocpConnection &connection)
+{
+    if (!connection.closing || connection.pendingOperations > 0)
+    {
+        return;
     }
 
-    outputFile.close();
+    // With no write in flight any more, an upload that broke off leaves no file behind
+    if (!connection.versionPath.empty())
+    {
+        removeVersionFiles(connection.versionPath);
+    }
 
-    // Send a response to the client
-    std::string response = "File received";
-    send(clientSocket, response.data(), response.size(), 0);
-}
\ No newline at end of file
+    auto found = std::find_if(connections_.begin(), connections_.end(),
+                              [&](const std::unique_ptr<IocpConnection> &candidate)
+                              { return candidate.get() == &connection; });
+    if (found != connections_.end())
+    {
+        std::swap(*found, connections_.back());
+        connections_.pop_back();
+    }
+}